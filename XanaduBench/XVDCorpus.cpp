@@ -0,0 +1,251 @@
+/**********************************************************/
+/*                      XanaduBench                       */
+/*   XVDCorpus.cpp - Deterministic synthetic XVDs to      */
+/*                   benchmark XanaduXVD on               */
+/*                  2024 (c) TorusHyperV                  */
+/**********************************************************/
+
+// Suppress specific warnings from the XVD header struct define
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDCorpus.h"
+#include "XanaduXVD.h"
+#include "XVDWorkers.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+/******************************************************************************************\
+                                CORPUS THEORY OF OPERATION
+
+Benchmarks are only comparable if they run on the same files, and real packages can't be
+shipped around, so the corpus is generated. Everything in a corpus XVD comes from its spec:
+
+- Page contents are SplitMix64 of (seed, page number), with one page in 8 left as zeros
+  (real Drives have plenty of those). Drive pages are numbered in Drive order, so two
+  specs that only differ in fragmentation have the same Drive.
+- Which blocks of a dynamic Drive are allocated is SplitMix64 of (seed, block) against the
+  fill ratio. They get slots in Drive order, then fragmentation * allocated / 2 pairs of
+  slots are swapped (Fisher-Yates style picks, SplitMix64 again). std::shuffle and the
+  std distributions are not used on purpose: their output is up to the standard library.
+
+The HashTree is left as a hole and then built by XanaduXVD::RebuildHashTree(), so the
+corpus is checked by the same code that reads it. Unallocated blocks of dynamic XVDs are
+never written: a 100 GiB sparse XVD only takes the space of its allocated blocks, plus
+the level 0 hash pages that have something in them.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// AUXILIARY                            //
+//////////////////////////////////////////
+static uint64_t SplitMix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x  = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x  = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// 'stream' keeps the Drive, the UserData and the eXVD apart
+static void FillPage(uint8_t* page, uint64_t seed, uint64_t stream, uint64_t page_number)
+{
+    uint64_t key = SplitMix64(seed ^ (stream << 56) ^ page_number);
+    if(key % 8 == 0)
+    {
+        memset(page, 0, XVD_PAGE_SIZE);
+        return;
+    }
+
+    uint64_t* words = (uint64_t*)page;
+    for(size_t i = 0; i < XVD_PAGE_SIZE / sizeof(uint64_t); i++)
+        words[i] = SplitMix64(key + i);
+}
+
+static bool WriteFull(int fd, const void* src, uint64_t length, uint64_t offset)
+{
+    const uint8_t* p = (const uint8_t*)src;
+    while(length > 0)
+    {
+        ssize_t done = pwrite(fd, p, length, (off_t)offset);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done <= 0)
+            return false;
+        p      += done;
+        offset += done;
+        length -= done;
+    }
+    return true;
+}
+
+static uint64_t RoundUpToBlocks(uint64_t bytes)
+{
+    return (bytes + XVD_BLOCK_SIZE - 1) / XVD_BLOCK_SIZE * XVD_BLOCK_SIZE;
+}
+
+//////////////////////////////////////////
+// CORPUS                               //
+//////////////////////////////////////////
+std::vector<XvdCorpusSpec> DefaultCorpus(bool quick)
+{
+    const uint64_t MiB = 1ull << 20;
+    const uint64_t GiB = 1ull << 30;
+
+    std::vector<XvdCorpusSpec> corpus =
+    {
+        //  name                        type              drive               fill    frag   UserData  eXVD
+        { "fixed_1m.xvd",               XvdType::FIXED,   1 * MiB,            1.0,    0.0,   0,        0        },
+        { "fixed_64m_ud_exvd.xvd",      XvdType::FIXED,   64 * MiB,           1.0,    0.0,   2 * MiB,  8 * MiB  },
+        { "dynamic_64m_full.xvd",       XvdType::DYNAMIC, RoundUpToBlocks(64 * MiB), 1.0,    0.0,   0x5000,   0        },
+        { "dynamic_64m_quarter_frag.xvd", XvdType::DYNAMIC, RoundUpToBlocks(64 * MiB), 0.25, 0.5,   0x5000,   0        },
+        { "fixed_1g.xvd",               XvdType::FIXED,   1 * GiB,            1.0,    0.0,   0,        0        },
+        { "dynamic_1g_half.xvd",        XvdType::DYNAMIC, RoundUpToBlocks(1 * GiB),  0.5,    0.0,   0x5000,   0        },
+        { "dynamic_1g_half_frag.xvd",   XvdType::DYNAMIC, RoundUpToBlocks(1 * GiB),  0.5,    1.0,   0x5000,   0        },
+        { "dynamic_100g_sparse_frag.xvd", XvdType::DYNAMIC, RoundUpToBlocks(100 * GiB), 0.0025, 0.3, 0x5000,  0        },
+    };
+
+    if(quick)
+        corpus.erase(std::remove_if(corpus.begin(), corpus.end(),
+                                    [&](const XvdCorpusSpec& spec) { return spec.drive_size > 64 * MiB + XVD_BLOCK_SIZE; }),
+                     corpus.end());
+    return corpus;
+}
+
+bool GenerateCorpusXvd(const XvdCorpusSpec& spec, const char* path, unsigned num_threads)
+{
+    bool     dynamic     = spec.xvd_type == XvdType::DYNAMIC;
+    uint64_t ud_length   = AlignSizeToPageBoundary(spec.user_data);
+    uint64_t exvd_length = AlignSizeToPageBoundary(spec.embedded_xvd);
+    uint64_t num_blocks  = dynamic ? spec.drive_size / XVD_BLOCK_SIZE : 0;
+    uint64_t num_entries = dynamic ? 1 + num_blocks : 0;  // Block 0, then the Drive
+    uint64_t bat_length  = num_entries * BAT_ENTRY_SIZE;
+
+    if(dynamic && (spec.drive_size % XVD_BLOCK_SIZE != 0 || ud_length + bat_length > XVD_BLOCK_SIZE))
+    {
+        fprintf(stderr, "ERR: Corpus spec '%s': the Drive must be whole blocks, and UserData + BAT fit in block 0\n",
+                spec.name.c_str());
+        return false;
+    }
+
+    // 1. Dynamic: which blocks are allocated, and in which slot they end up
+    std::vector<uint32_t> bat(num_entries, (uint32_t)XVD_INVALID_BLOCK);
+    std::vector<uint64_t> slots(1, 0);  // Slot -> Drive block (slot 0 is UserData + BAT)
+    if(dynamic)
+    {
+        bat[0] = 0;
+        for(uint64_t block = 0; block < num_blocks; block++)
+            if((double)(SplitMix64(spec.seed * 31 + block) >> 11) / (double)(1ull << 53) < spec.fill)
+                slots.push_back(block);
+        if(slots.size() == 1)
+            slots.push_back(0);
+
+        uint64_t allocated = slots.size() - 1;
+        uint64_t swaps     = (uint64_t)(spec.fragmentation * (double)allocated / 2);
+        for(uint64_t i = 0; i < swaps; i++)
+        {
+            uint64_t a = 1 + SplitMix64(spec.seed * 77 + 2 * i) % allocated;
+            uint64_t b = 1 + SplitMix64(spec.seed * 77 + 2 * i + 1) % allocated;
+            std::swap(slots[a], slots[b]);
+        }
+        for(uint64_t slot = 1; slot < slots.size(); slot++)
+            bat[1 + slots[slot]] = (uint32_t)slot;
+    }
+
+    // 2. Layout, the way XanaduXVD::ComputeLayout() will find it
+    uint64_t hashed      = dynamic ? num_entries * HASHES_PER_HASH_PAGE : BytesToPages(ud_length + spec.drive_size);
+    auto     shape       = XanaduXVD::HashTreeShapeFromPageNum(hashed);
+    uint64_t tree_pages  = 0;
+    for(uint32_t level = 0; level < shape.num_levels; level++)
+        tree_pages += shape.pages_of_level[level];
+
+    uint64_t exvd_offset = XVD_HEADER_INCL_SIGNATURE;
+    uint64_t data_offset = exvd_offset + exvd_length + PagesToBytes(tree_pages);
+    uint64_t file_size   = data_offset + (dynamic ? slots.size() * XVD_BLOCK_SIZE : ud_length + spec.drive_size);
+
+    auto header = std::make_unique<XvdHeader>();
+    memset(header.get(), 0, sizeof(XvdHeader));
+    memcpy(header->magic, MAGIC, sizeof(header->magic));
+    header->format_version           = 3;
+    header->xvd_type                 = spec.xvd_type;
+    header->content_type             = XvdContentType::Data;
+    header->block_size               = XVD_BLOCK_SIZE;
+    header->drive_size               = spec.drive_size;
+    header->user_data_length         = (uint32_t)spec.user_data;
+    header->embedded_xvd_length      = (uint32_t)spec.embedded_xvd;
+    header->dynamic_header_length    = (uint32_t)bat_length;
+    header->flags.EncryptionDisabled = 1;
+    header->creation_time            = 133000000000000000ull + spec.seed;
+    for(int i = 0; i < 16; i++)
+        header->content_id_guid[i] = (uint8_t)SplitMix64(spec.seed + i);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", path);
+        return false;
+    }
+
+    // 3. Header, eXVD, UserData (and BAT). The HashTree stays a hole for now.
+    std::vector<uint8_t> buffer(std::max<uint64_t>({ XVD_HEADER_INCL_SIGNATURE, exvd_length, ud_length + bat_length }), 0);
+    memcpy(buffer.data(), header.get(), sizeof(XvdHeader));
+    bool ok = WriteFull(fd, buffer.data(), XVD_HEADER_INCL_SIGNATURE, 0);
+
+    for(uint64_t page = 0; page < exvd_length / XVD_PAGE_SIZE; page++)
+        FillPage(buffer.data() + PagesToBytes(page), spec.seed, 2, page);
+    ok = ok && WriteFull(fd, buffer.data(), exvd_length, exvd_offset);
+
+    for(uint64_t page = 0; page < ud_length / XVD_PAGE_SIZE; page++)
+        FillPage(buffer.data() + PagesToBytes(page), spec.seed, 1, page);
+    memcpy(buffer.data() + ud_length, bat.data(), bat_length);
+    ok = ok && WriteFull(fd, buffer.data(), ud_length + bat_length, data_offset);
+
+    // 4. The Drive, one block per work item. Fixed Drives start right after the UserData.
+    uint64_t drive_offset = dynamic ? data_offset : data_offset + ud_length;
+    uint64_t num_items    = dynamic ? slots.size() - 1 : (spec.drive_size + XVD_BLOCK_SIZE - 1) / XVD_BLOCK_SIZE;
+    std::atomic<bool> failed{!ok};
+    ParallelFor(num_items, num_threads, [&](uint64_t item)
+    {
+        thread_local std::vector<uint8_t> block(XVD_BLOCK_SIZE);
+        uint64_t drive_block = dynamic ? slots[item + 1] : item;
+        uint64_t offset      = dynamic ? (item + 1) * XVD_BLOCK_SIZE : item * XVD_BLOCK_SIZE;
+        uint64_t length      = std::min<uint64_t>(XVD_BLOCK_SIZE, spec.drive_size - drive_block * XVD_BLOCK_SIZE);
+        for(uint64_t page = 0; page < length / XVD_PAGE_SIZE; page++)
+            FillPage(block.data() + PagesToBytes(page), spec.seed, 0, drive_block * HASHES_PER_HASH_PAGE + page);
+        if(!failed && !WriteFull(fd, block.data(), length, drive_offset + offset))
+            failed = true;
+    });
+
+    ok = !failed && ftruncate(fd, (off_t)file_size) == 0;
+    if(close(fd) != 0 || !ok)
+    {
+        fprintf(stderr, "ERR: Failed to write '%s'\n", path);
+        remove(path);
+        return false;
+    }
+
+    // 5. The HashTree
+    XanaduXVD xvd(path);
+    if(xvd.Start(false, false) != 0 || xvd.RebuildHashTree(num_threads) != 0)
+    {
+        fprintf(stderr, "ERR: Failed to build the HashTree of '%s'\n", path);
+        remove(path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+/**********************************************************/
+/*                      XanaduBench                       */
+/*   XVDCorpus.h - Deterministic synthetic XVDs to        */
+/*                 benchmark XanaduXVD on                 */
+/*                  2024 (c) TorusHyperV                  */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <string>
+#include <vector>
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+
+// One XVD of the corpus. The same spec always gives the same file, byte for byte.
+struct XvdCorpusSpec
+{
+    std::string name;                          // File name in the corpus directory
+    XvdType     xvd_type      = XvdType::FIXED;
+    uint64_t    drive_size    = 0;             // A multiple of the page size (of the block size for dynamic)
+    double      fill          = 1.0;           // Dynamic: fraction of the Drive blocks that are allocated
+    double      fragmentation = 0.0;           // Dynamic: fraction of the allocated blocks moved out of Drive order
+    uint64_t    user_data     = 0;             // Bytes of UserData
+    uint64_t    embedded_xvd  = 0;             // Bytes of eXVD
+    uint64_t    seed          = 1;
+};
+
+//////////////////////////////////////////
+// CORPUS                               //
+//////////////////////////////////////////
+
+// The corpus the benchmarks run on: fixed XVDs from 1 MiB to 1 GiB (one with UserData and
+// eXVD), dynamic ones with different fill ratios and fragmentation, and a sparse 100 GiB
+// one. 'quick' leaves out everything over 64 MiB.
+std::vector<XvdCorpusSpec> DefaultCorpus(bool quick);
+
+// Writes the XVD described by 'spec' to 'path', with a valid HashTree (built by
+// XanaduXVD::RebuildHashTree()). Unencrypted and unsigned.
+bool GenerateCorpusXvd(const XvdCorpusSpec& spec, const char* path, unsigned num_threads);
@@ -0,0 +1,516 @@
+/**********************************************************/
+/*                      XanaduBench                       */
+/*   Micro-benchmarks for the hot paths of XanaduXVD,     */
+/*   and throughput benchmarks on a synthetic corpus      */
+/*                  2024 (c) TorusHyperV                  */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+#include "XVDSha256.h"
+#include "XVDBat.h"
+#include "XVDAes.h"
+#include "XanaduXVD.h"
+#include "XVDCorpus.h"
+#include "XVDLog.h"
+#include "XVDBufferPool.h"
+#include "XVDWorkers.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////
+// RESULTS                              //
+//////////////////////////////////////////
+
+// Every number printed in a table also ends up here, so that it can be written as CSV
+// (--csv) and compared between runs/machines by a script instead of by eye.
+struct BenchResult
+{
+    std::string suite;
+    std::string benchmark;
+    std::string case_name;
+    double      value;
+    std::string unit;
+};
+
+static std::vector<BenchResult> gResults;
+
+static void Record(const char* suite, const char* benchmark, const std::string& case_name, double value, const char* unit)
+{
+    gResults.push_back({ suite, benchmark, case_name, value, unit });
+}
+
+static bool WriteResultsCsv(const char* filename)
+{
+    FILE* f = fopen(filename, "w");
+    if(!f)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", filename);
+        return false;
+    }
+
+    fprintf(f, "suite,benchmark,case,value,unit\n");
+    for(const BenchResult& result : gResults)
+        fprintf(f, "%s,%s,%s,%.6g,%s\n", result.suite.c_str(), result.benchmark.c_str(), result.case_name.c_str(),
+                result.value, result.unit.c_str());
+    return fclose(f) == 0;
+}
+
+void PrintHelp()
+{
+    char help[] = "XanaduBench Usage:\n"
+                  "Options:\n"
+                  " --seconds [s]:    Minimum time spent on each benchmark (default: 1)\n"
+                  " --corpus [dir]:   Where the synthetic XVDs are kept (default: ./xanadu_corpus)\n"
+                  " --quick:          Only the corpus XVDs up to 64MB\n"
+                  " --regenerate:     Generate the corpus again even if the files are there\n"
+                  " --threads [n]:    Worker threads for hashing/verification (default: one per core)\n"
+                  " --csv [file]:     Also write every result to a CSV file (suite,benchmark,case,value,unit)\n"
+                  " --help:           Show help\n";
+
+    printf("%s", help);
+}
+
+//////////////////////////////////////////
+// SHA256 PAGE KERNELS                  //
+//////////////////////////////////////////
+
+// Hashes the same in-cache batch of pages over and over with one thread, so the number
+// reported is what a single core can do with each kernel (the I/O is not involved).
+int BenchSha256Kernels(double min_seconds)
+{
+    const size_t num_pages = 256; // 1Mb, stays in L2/L3
+    std::vector<uint8_t> pages(num_pages * XVD_PAGE_SIZE);
+    for(size_t i = 0; i < pages.size(); i++)
+        pages[i] = (uint8_t)(i * 2654435761u >> 13);
+    std::vector<uint8_t[SHA256_DIGEST_LENGTH_BYTES]> digests(num_pages);
+
+    printf("SHA256 of 4K pages, single thread (best kernel on this CPU: %s)\n",
+           Sha256KernelName(Sha256BestKernel()));
+    printf("  %-12s %10s\n", "kernel", "GB/s/core");
+
+    for(int k = 0; k < SHA256_KERNEL_COUNT; k++)
+    {
+        Sha256Kernel kernel = (Sha256Kernel)k;
+        if(!Sha256KernelSupported(kernel))
+        {
+            printf("  %-12s %10s\n", Sha256KernelName(kernel), "n/a");
+            continue;
+        }
+
+        // Warm up (and fault in the buffers)
+        Sha256PagesWithKernel(kernel, pages.data(), num_pages, digests.data());
+
+        uint64_t hashed_bytes = 0;
+        auto     start        = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{0};
+        while(elapsed.count() < min_seconds)
+        {
+            Sha256PagesWithKernel(kernel, pages.data(), num_pages, digests.data());
+            hashed_bytes += num_pages * XVD_PAGE_SIZE;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+
+        printf("  %-12s %10.3f\n", Sha256KernelName(kernel), hashed_bytes / elapsed.count() / 1e9);
+        Record("kernels", "sha256_pages", Sha256KernelName(kernel), hashed_bytes / elapsed.count() / 1e9, "GB/s");
+    }
+    return 0;
+}
+
+//////////////////////////////////////////
+// BAT SCANNER                          //
+//////////////////////////////////////////
+
+// Scans a synthetic BAT the size of a ~1.5TB dynamic XVD (2M entries) with runs of allocated
+// and unallocated blocks, like a real fragmented one: what matters is entries per second.
+int BenchBatScanKernels(double min_seconds)
+{
+    const size_t num_entries = 2 * 1024 * 1024;
+    std::vector<uint32_t> bat(num_entries);
+    uint32_t next_entry = 1;
+    for(size_t i = 0; i < num_entries; i++)
+    {
+        // Runs of 1..64 blocks, roughly one third unallocated, some runs jump elsewhere
+        uint32_t run = (uint32_t)((i / 64) * 2654435761u >> 16);
+        if(run % 3 == 0)
+            bat[i] = XVD_INVALID_BLOCK;
+        else
+            bat[i] = (run % 7 == 0) ? (next_entry += 1000) : next_entry++;
+    }
+
+    printf("BAT scan (count + max + bitmap + extents), single thread, %zu entries\n", num_entries);
+    printf("  %-12s %10s %10s\n", "kernel", "GB/s", "Mentries/s");
+
+    XvdBatScan scan;
+    for(int k = 0; k < BAT_SCAN_KERNEL_COUNT; k++)
+    {
+        BatScanKernel kernel = (BatScanKernel)k;
+        if(!BatScanKernelSupported(kernel))
+        {
+            printf("  %-12s %10s\n", BatScanKernelName(kernel), "n/a");
+            continue;
+        }
+
+        ScanBatWithKernel(kernel, (const uint8_t*)bat.data(), num_entries, scan); // Warm up
+
+        uint64_t scanned = 0;
+        auto     start   = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{0};
+        while(elapsed.count() < min_seconds)
+        {
+            ScanBatWithKernel(kernel, (const uint8_t*)bat.data(), num_entries, scan);
+            scanned += num_entries;
+            elapsed  = std::chrono::steady_clock::now() - start;
+        }
+
+        printf("  %-12s %10.3f %10.1f\n", BatScanKernelName(kernel),
+               scanned * BAT_ENTRY_SIZE / elapsed.count() / 1e9, scanned / elapsed.count() / 1e6);
+        Record("kernels", "bat_scan", BatScanKernelName(kernel), scanned / elapsed.count() / 1e6, "Mentries/s");
+    }
+    return 0;
+}
+
+//////////////////////////////////////////
+// AES-XTS                              //
+//////////////////////////////////////////
+
+// Decrypts 256 pages (1Mb, stays in L2/L3) with a different tweak each, so this is the speed
+// of the kernel itself, one core. Decrypting a package scales it by the number of cores.
+int BenchAesXtsKernels(double min_seconds)
+{
+    const size_t num_pages = 256;
+    std::vector<uint8_t> pages(num_pages * XVD_PAGE_SIZE);
+    std::vector<uint8_t> plain(num_pages * XVD_PAGE_SIZE);
+    std::vector<uint8_t> tweaks(num_pages * AES_BLOCK_LENGTH_BYTES);
+    for(size_t i = 0; i < pages.size(); i++)
+        pages[i] = (uint8_t)(i * 2654435761u >> 13);
+    for(size_t i = 0; i < tweaks.size(); i++)
+        tweaks[i] = (uint8_t)(i * 40503u >> 7);
+
+    uint8_t cik[XVD_CIK_LENGTH_BYTES];
+    for(int i = 0; i < XVD_CIK_LENGTH_BYTES; i++)
+        cik[i] = (uint8_t)(i * 37 + 11);
+    AesXtsKey key;
+    AesXtsInit(key, cik);
+    auto page_tweaks = (const uint8_t (*)[AES_BLOCK_LENGTH_BYTES])tweaks.data();
+
+    printf("AES-128-XTS page decryption, single thread, %zu pages per round\n", num_pages);
+    printf("  %-16s %10s %10s\n", "kernel", "GB/s", "pages/s");
+
+    for(int k = 0; k < AES_XTS_KERNEL_COUNT; k++)
+    {
+        AesXtsKernel kernel = (AesXtsKernel)k;
+        if(!AesXtsKernelSupported(kernel))
+        {
+            printf("  %-16s %10s\n", AesXtsKernelName(kernel), "n/a");
+            continue;
+        }
+
+        AesXtsDecryptPagesWithKernel(kernel, key, pages.data(), plain.data(), num_pages, page_tweaks); // Warm up
+
+        uint64_t decrypted = 0;
+        auto     start     = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{0};
+        while(elapsed.count() < min_seconds)
+        {
+            AesXtsDecryptPagesWithKernel(kernel, key, pages.data(), plain.data(), num_pages, page_tweaks);
+            decrypted += num_pages;
+            elapsed    = std::chrono::steady_clock::now() - start;
+        }
+
+        printf("  %-16s %10.3f %10.0f\n", AesXtsKernelName(kernel),
+               PagesToBytes(decrypted) / elapsed.count() / 1e9, decrypted / elapsed.count());
+        Record("kernels", "aes_xts_pages", AesXtsKernelName(kernel), PagesToBytes(decrypted) / elapsed.count() / 1e9, "GB/s");
+    }
+    return 0;
+}
+
+//////////////////////////////////////////
+// BUFFER POOL                          //
+//////////////////////////////////////////
+
+// What a worker pays for the buffer of one group of 170 pages: borrowing a chunk from the
+// pool, against allocating it every time like a std::vector would (zero filled). Every page
+// of the buffer is written once either way, as a reader would.
+int BenchBufferPool(double min_seconds, unsigned num_threads)
+{
+    unsigned threads = num_threads ? num_threads : DefaultWorkerCount();
+    auto use = [](uint8_t* buffer)
+    {
+        for(size_t offset = 0; offset < XVD_POOL_CHUNK_SIZE; offset += XVD_PAGE_SIZE)
+            buffer[offset] = (uint8_t)offset;
+    };
+    auto from_pool = [&]()
+    {
+        XvdPoolChunk chunk = XvdBorrowChunk();
+        use(chunk.data());
+    };
+    auto from_system = [&]()
+    {
+        std::vector<uint8_t> buffer(XVD_POOL_CHUNK_SIZE);
+        use(buffer.data());
+    };
+
+    printf("Group buffer (%u Kb), borrow + touch every page + give back\n", XVD_POOL_CHUNK_SIZE / 1024);
+    printf("  %-16s %8s %12s\n", "source", "threads", "ns/buffer");
+
+    struct Case { const char* name; std::function<void()> fn; };
+    for(const Case& c : { Case{ "pool", from_pool }, Case{ "std::vector", from_system } })
+        for(unsigned t : { 1u, threads })
+        {
+            c.fn(); // Warm up (the pool gets its first chunk here)
+
+            std::atomic<uint64_t> buffers{0};
+            auto start = std::chrono::steady_clock::now();
+            ParallelFor(t, t, [&](uint64_t)
+            {
+                uint64_t done = 0;
+                while(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < min_seconds)
+                {
+                    for(int i = 0; i < 64; i++)
+                        c.fn();
+                    done += 64;
+                }
+                buffers += done;
+            });
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            // Per thread: each thread gets its own buffers, in parallel
+            double ns = elapsed.count() * 1e9 * t / (double)buffers;
+            printf("  %-16s %8u %12.1f\n", c.name, t, ns);
+            Record("kernels", "group_buffer", std::string(c.name) + "_x" + std::to_string(t), ns, "ns");
+            if(t == threads)
+                break;
+        }
+
+    XvdBufferPoolStats stats = XvdBufferPoolGetStats();
+    printf("  pool: %llu chunks allocated, %llu freed\n", (unsigned long long)stats.system_allocs,
+           (unsigned long long)stats.system_frees);
+    return 0;
+}
+
+//////////////////////////////////////////
+// CORPUS                               //
+//////////////////////////////////////////
+
+// ComputeLayout() is protected, this is the only way to time it on its own
+class LayoutBenchXVD : public XanaduXVD
+{
+public:
+    using XanaduXVD::XanaduXVD;
+    void RecomputeLayout() { ComputeLayout(); }
+};
+
+// Runs 'fn' once to warm up, then until both 'min_seconds' and 'min_iterations' are reached.
+// Returns the average seconds per call, or a negative number if any call failed.
+template<typename Fn>
+static double TimePerCall(double min_seconds, uint64_t min_iterations, Fn fn)
+{
+    if(!fn())
+        return -1;
+
+    uint64_t iterations = 0;
+    auto     start      = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{0};
+    while(elapsed.count() < min_seconds || iterations < min_iterations)
+    {
+        if(!fn())
+            return -1;
+        iterations++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return elapsed.count() / iterations;
+}
+
+// Opens, scans, extracts and verifies every XVD of the corpus (generating the missing ones
+// first). The corpus is read over and over, so these are warm page cache numbers: they show
+// what the code costs, not what the disk can do.
+int BenchCorpus(double min_seconds, const char* corpus_dir, bool quick, bool regenerate, unsigned num_threads)
+{
+    // What XanaduXVD tells the user while extracting/verifying would end up in the middle of the table
+    XvdLogLevel log_level = gXvdLogLevel;
+    gXvdLogLevel = XVD_LOG_ERR;
+
+    mkdir(corpus_dir, 0755);
+
+    printf("Corpus '%s', %u worker threads (0 = one per core), warm page cache\n", corpus_dir, num_threads);
+    printf("  %-30s %8s %10s %11s %10s %12s %11s\n", "case", "gen (s)", "Start (us)", "Layout (us)",
+           "BAT Ment/s", "Extract MB/s", "Verify GB/s");
+
+    int ret = 0;
+    for(const XvdCorpusSpec& spec : DefaultCorpus(quick))
+    {
+        std::string path = std::string(corpus_dir) + "/" + spec.name;
+        const char* name = spec.name.c_str();
+
+        // 1. Generation, only if the file isn't there yet (the same spec gives the same file)
+        double     gen_seconds = 0;
+        struct stat st;
+        if(regenerate || stat(path.c_str(), &st) != 0)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if(!GenerateCorpusXvd(spec, path.c_str(), num_threads))
+            {
+                ret = 1;
+                continue;
+            }
+            gen_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            Record("corpus", "generate", name, gen_seconds, "s");
+        }
+
+        // 2. Start(): open, map, header checks, layout (with the BAT read and scanned)
+        double start_seconds = TimePerCall(min_seconds, 5, [&]()
+        {
+            XanaduXVD xvd(path.c_str());
+            return xvd.Start(false, false) == 0;
+        });
+
+        LayoutBenchXVD xvd(path.c_str());
+        if(start_seconds < 0 || xvd.Start(false, false) != 0)
+        {
+            fprintf(stderr, "ERR: Failed to open corpus XVD '%s'\n", path.c_str());
+            ret = 1;
+            continue;
+        }
+
+        // 3. Layout computation alone, on an already opened XVD
+        double layout_seconds = TimePerCall(min_seconds, 5, [&]() { xvd.RecomputeLayout(); return true; });
+
+        // 4. BAT scan on the real BAT (dynamic only)
+        const std::vector<uint32_t>& bat = xvd.Layout().BAT();
+        double bat_rate = 0;
+        if(!bat.empty())
+        {
+            XvdBatScan scan;
+            double scan_seconds = TimePerCall(min_seconds, 5, [&]()
+            {
+                ScanBat((const uint8_t*)bat.data(), bat.size(), scan);
+                return true;
+            });
+            bat_rate = bat.size() / scan_seconds / 1e6;
+        }
+
+        // 5. Drive extraction. Only the allocated blocks of dynamic XVDs are actually copied.
+        std::string tmp_path      = path + ".drive.tmp";
+        uint64_t    drive_bytes   = bat.empty() ? xvd.Layout().Length(XVD_REGION_DRIVE)
+                                                : xvd.Layout().AllocatedBlocks() * XVD_BLOCK_SIZE;
+        double      extract_seconds = TimePerCall(min_seconds, 1, [&]() { return xvd.ExtractDrive(tmp_path.c_str()) == 0; });
+        remove(tmp_path.c_str());
+
+        // 6. HashTree verification: every hashed page that is in the file
+        const XvdHashTreeShape& shape = xvd.Layout().HashTreeShape();
+        uint64_t data_bytes   = xvd.Layout().ComputedFileSize() - xvd.Layout().Offset(XVD_REGION_USERDATA);
+        uint64_t hashed_bytes = std::min<uint64_t>(PagesToBytes(shape.hashed_pages), data_bytes);
+        double   verify_seconds = TimePerCall(min_seconds, 1, [&]() { return xvd.VerifyHashTree(num_threads) == 0; });
+
+        if(extract_seconds < 0 || verify_seconds < 0)
+        {
+            fprintf(stderr, "ERR: Extraction or verification of corpus XVD '%s' failed\n", path.c_str());
+            ret = 1;
+            continue;
+        }
+
+        double extract_rate = drive_bytes / extract_seconds / 1e6;
+        double verify_rate  = hashed_bytes / verify_seconds / 1e9;
+        char gen_str[16] = "-";   // Already there from a previous run
+        if(gen_seconds > 0)
+            snprintf(gen_str, sizeof(gen_str), "%.2f", gen_seconds);
+        printf("  %-30s %8s %10.1f %11.1f %10.1f %12.1f %11.3f\n", name, gen_str, start_seconds * 1e6,
+               layout_seconds * 1e6, bat_rate, extract_rate, verify_rate);
+
+        Record("corpus", "start",   name, start_seconds * 1e6,  "us");
+        Record("corpus", "layout",  name, layout_seconds * 1e6, "us");
+        if(!bat.empty())
+            Record("corpus", "bat_scan", name, bat_rate, "Mentries/s");
+        Record("corpus", "extract", name, extract_rate, "MB/s");
+        Record("corpus", "verify",  name, verify_rate,  "GB/s");
+    }
+
+    gXvdLogLevel = log_level;
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    const option long_opts[] =
+    {
+        {"seconds",    required_argument, nullptr, 's'},
+        {"corpus",     required_argument, nullptr, 'c'},
+        {"quick",      no_argument,       nullptr, 'q'},
+        {"regenerate", no_argument,       nullptr, 'r'},
+        {"threads",    required_argument, nullptr, 't'},
+        {"csv",        required_argument, nullptr, 'o'},
+        {"help",       no_argument,       nullptr, 'h'},
+        {nullptr,   no_argument,       nullptr, 0}
+    };
+    int long_index = 0;
+    int opt = 0;
+
+    double      seconds     = 1.0;
+    const char* corpus_dir  = "./xanadu_corpus";
+    bool        quick       = false;
+    bool        regenerate  = false;
+    unsigned    num_threads = 0;
+    const char* csv_file    = nullptr;
+    while( (opt = getopt_long(argc, argv, "s:c:qrt:o:h", long_opts, &long_index)) != -1 )
+    {
+        switch(opt)
+        {
+            case 's':
+                seconds = atof(optarg);
+                break;
+            case 'c':
+                corpus_dir = optarg;
+                break;
+            case 'q':
+                quick = true;
+                break;
+            case 'r':
+                regenerate = true;
+                break;
+            case 't':
+                num_threads = (unsigned)atoi(optarg);
+                break;
+            case 'o':
+                csv_file = optarg;
+                break;
+            case 'h':
+            default:
+                PrintHelp();
+                exit(0);
+        }
+    }
+
+    int ret = BenchSha256Kernels(seconds);
+    printf("\n");
+    ret |= BenchBatScanKernels(seconds);
+    printf("\n");
+    ret |= BenchAesXtsKernels(seconds);
+    printf("\n");
+    ret |= BenchBufferPool(seconds, num_threads);
+    printf("\n");
+    ret |= BenchCorpus(seconds, corpus_dir, quick, regenerate, num_threads);
+
+    if(csv_file && !WriteResultsCsv(csv_file))
+        ret = 1;
+    return ret;
+}
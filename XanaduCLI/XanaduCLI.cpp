@@ -8,8 +8,18 @@
 // Project includes
 ///////////////////////////////////////
 #include "XanaduXVD.h"
+#include "XVDScan.h"
+#include "XVDIndex.h"
+#include "XVDBuilder.h"
+#include "XVDLog.h"
+#include "XVDTrace.h"
+#include "XVDProgress.h"
 //#include "..\src\XanaduXVD.h"
 #include <getopt.h>
+#include <signal.h>
+#include <chrono>
+#include <strings.h>
+#include <thread>
 
 void PrintHelp()
 {
@@ -18,16 +28,186 @@ void PrintHelp()
                   "Options:\n"\
                   " --file:                           Specifies the input XVD file\n"\
                   " --info:                           Displays information about the XVD\n"\
+                  " --scan [path]:                    Scan every XVD under a directory, one CSV line per XVD\n"\
+                  " --deep:                           With --scan, fully open every XVD (layout and size checks)\n"\
+                  " --index [index_filename]:         With --scan, update that index instead of printing (only new\n"\
+                  "                                   and changed files are scanned). Alone, the index to --query\n"\
+                  " --query [query]:                  Query the --index: 'id:<GUID>' (content id, ProductId or PDUID)\n"\
+                  "                                   or 'type:<ContentType>[:<YYYY-MM-DD>]' (created after that day)\n"\
                   " --unsafe:                         Parses XVD even if header is not valid (might crash)\n"\
                   " --extract_exvd [output_filename]: Extract Embedded XVD\n"\
                   " --extract_udat [output_filename]: Extract UserData\n"\
+                  " --extract_drive [output_filename]:Extract the Drive as a raw image (sparse for dynamic XVDs)\n"\
+                  " --extract_verified [output_filename]: Extract the Drive in one pass, verifying the HashTree\n"\
+                  "                                   and decrypting (needs --cik) on the fly\n"\
+                  " --decrypt [output_filename]:      Write a decrypted copy of the XVD (needs --cik)\n"\
+                  " --cik [cik_filename]:             CIK to decrypt with (32 byte key, or GUID + key)\n"\
                   " --verify_htree:                   Verify HashTree\n"\
+                  " --diff [base_xvd]:                List the pages that changed from an older version of the XVD\n"\
+                  " --delta [delta_filename]:         With --diff, write a delta patch from the base instead\n"\
+                  " --apply_delta [delta_filename]:   Rebuild the new XVD from this one (the base) and a delta\n"\
+                  "                                   ('-' reads it from stdin). Needs --output\n"\
+                  " --output [output_filename]:       Where --apply_delta and --build write the new XVD\n"\
+                  " --build [drive_image]:            Create an XVD (unencrypted, unsigned) from a raw Drive image.\n"\
+                  "                                   Needs --output\n"\
+                  " --dynamic:                        With --build, a dynamic XVD (all-zero blocks are left out)\n"\
+                  " --with_udat [filename]:           With --build, the UserData to put in the XVD\n"\
+                  " --with_exvd [filename]:           With --build, the embedded XVD to put in the XVD\n"\
+                  " --content_type [type]:            With --build, the content type (e.g. Title, default: Data)\n"\
+                  " --threads [num]:                  Worker threads for heavy operations (default: one per core)\n"\
                   " --rebuild_htree:                  Rebuild HashTree\n"\
+                  " --trim [exvd|userdata|blocks]:    Trim the XVD in place: remove the embedded XVD or the UserData,\n"\
+                  "                                   or unmap the all-zero blocks of a dynamic XVD\n"\
+                  " --defrag:                         Put the blocks of a dynamic XVD in Drive order, in place\n"\
+                  " --no_mmap:                        Read the XVD with pread() instead of memory mapping it\n"\
+                  " --io_depth [num]:                 Reads in flight when not memory mapped (default: 32)\n"\
+                  " --direct_io:                      Read the XVD with O_DIRECT, bypassing the page cache, and don't\n"\
+                  "                                   keep extracted files in it either (for XVDs bigger than RAM)\n"\
+                  " --log_level [err|info|dbg]:       How much to print (default: info, dbg also dumps what the\n"\
+                  "                                   parser finds in the header and layout)\n"\
+                  " --stats:                          Print time spent per phase and I/O counters at the end (stderr)\n"\
+                  " --trace [trace_filename]:         Write a Chrome trace of every phase (chrome://tracing, Perfetto)\n"\
+                  " --progress:                       Show progress and ETA of long operations (stderr). Ctrl-C\n"\
+                  "                                   cancels them cleanly either way\n"\
                   " --help:  Show help\n";
 
     printf("%s", help);
 }
 
+// Looks a content type up by the name ContentTypeStr() gives it, any case
+static bool ContentTypeFromString(const char* name, uint32_t& type)
+{
+    for(uint32_t i = 0; i < 64; i++)
+        if(strcasecmp(ContentTypeStr((XvdContentType)i), name) == 0)
+        {
+            type = i;
+            return true;
+        }
+    return false;
+}
+
+// --query: 'id:<GUID>' or 'type:<ContentType>[:<YYYY-MM-DD>]'
+static int QueryIndex(const char* index_file, const char* query)
+{
+    XvdIndex index;
+    if(!index.Open(index_file))
+    {
+        fprintf(stderr, "ERR: Failed to open index '%s'\n", index_file);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint32_t> found;
+    if(strncmp(query, "id:", 3) == 0)
+    {
+        MS_GUID guid;
+        if(!MsGUIDFromString(query + 3, guid))
+        {
+            fprintf(stderr, "ERR: Invalid GUID '%s'\n", query + 3);
+            return 1;
+        }
+
+        // Any of the three ids. An XVD with the same GUID in two of them is only listed once.
+        const uint8_t*    id = (const uint8_t*)&guid;
+        std::vector<bool> listed(index.Records().size());
+        for(auto& matches : { index.FindByContentId(id), index.FindByProductId(id), index.FindByPduid(id) })
+            for(uint32_t number : matches)
+                if(!listed[number])
+                {
+                    listed[number] = true;
+                    found.push_back(number);
+                }
+    }
+    else if(strncmp(query, "type:", 5) == 0)
+    {
+        std::string type_name = query + 5;
+        uint64_t    min_time  = 0;
+        if(size_t colon = type_name.find(':'); colon != std::string::npos)
+        {
+            if(!FiletimeFromString(type_name.c_str() + colon + 1, min_time))
+            {
+                fprintf(stderr, "ERR: Invalid date '%s'\n", type_name.c_str() + colon + 1);
+                return 1;
+            }
+            type_name.resize(colon);
+        }
+
+        uint32_t type;
+        if(!ContentTypeFromString(type_name.c_str(), type))
+        {
+            fprintf(stderr, "ERR: Unknown content type '%s'\n", type_name.c_str());
+            return 1;
+        }
+        found = index.FindByContentType(type, min_time, UINT64_MAX);
+    }
+    else
+    {
+        fprintf(stderr, "ERR: Invalid query '%s'\n", query);
+        return 1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::vector<XvdScanRecord> records;
+    for(uint32_t number : found)
+        records.push_back(index.ToScanRecord(index.Records()[number]));
+    WriteScanRecordsCsv(stdout, records);
+    fprintf(stderr, "INFO: %zu of %zu records match, in %.3f ms\n", records.size(), index.Records().size(),
+            elapsed.count() * 1000.0);
+    return 0;
+}
+
+// Every long operation reports here. The first Ctrl-C cancels it (a lock-free store, fine in
+// a signal handler) and the operation cleans up after itself, a second one kills us as usual.
+static XvdProgress sProgress;
+
+static void OnInterrupt(int)
+{
+    sProgress.Cancel();
+}
+
+// --progress: one line on stderr, redrawn every 200 ms while an operation runs
+struct ProgressPrinter
+{
+    std::atomic<bool> stop{false};
+    std::thread       thread;
+
+    void Start()
+    {
+        thread = std::thread([this]()
+        {
+            bool drawn = false;
+            while(!stop)
+            {
+                XvdProgressSnapshot snapshot = sProgress.Snapshot();
+                if(snapshot.phase != XVD_PROGRESS_IDLE && snapshot.phase != XVD_PROGRESS_DONE)
+                {
+                    double eta = snapshot.Eta();
+                    fprintf(stderr, "\r%s: %5.1f%% (%.2f / %.2f GB, %.0f MB/s, ETA %s%.0f s)%s   ",
+                            ProgressPhaseStr(snapshot.phase), snapshot.Fraction() * 100.0,
+                            snapshot.bytes_done / 1e9, snapshot.bytes_total / 1e9, snapshot.BytesPerSecond() / 1e6,
+                            eta < 0 ? "~" : "", eta < 0 ? 0.0 : eta, snapshot.cancelled ? " CANCELLING" : "");
+                    drawn = true;
+                }
+                else if(drawn)
+                {
+                    fprintf(stderr, "\n");
+                    drawn = false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            }
+            if(drawn)
+                fprintf(stderr, "\n");
+        });
+    }
+
+    ~ProgressPrinter()
+    {
+        stop = true;
+        if(thread.joinable())
+            thread.join();
+    }
+};
+
 // soon to be: XanaduXVDCli
 int main(int argc, char *argv[])
 {
@@ -38,11 +218,38 @@ int main(int argc, char *argv[])
     {
         {"file",          required_argument,    nullptr, 'f'},
         {"info",          no_argument,          nullptr, 'i'},
+        {"scan",          required_argument,    nullptr, 'b'},
+        {"deep",          no_argument,          nullptr, 'D'},
+        {"index",         required_argument,    nullptr, 'n'},
+        {"query",         required_argument,    nullptr, 'Q'},
         {"unsafe",        no_argument,          nullptr, 's'},
         {"extract_exvd",  required_argument,    nullptr, 'e'},
         {"extract_udat",  required_argument,    nullptr, 'u'},
+        {"extract_drive", required_argument,    nullptr, 'd'},
+        {"extract_verified", required_argument, nullptr, 'p'},
+        {"decrypt",       required_argument,    nullptr, 'x'},
+        {"cik",           required_argument,    nullptr, 'k'},
         {"verify_htree",  no_argument,          nullptr, 'v'},
+        {"diff",          required_argument,    nullptr, 'c'},
+        {"delta",         required_argument,    nullptr, 'g'},
+        {"apply_delta",   required_argument,    nullptr, 'a'},
+        {"output",        required_argument,    nullptr, 'o'},
+        {"build",         required_argument,    nullptr, 'B'},
+        {"dynamic",       no_argument,          nullptr, 'y'},
+        {"with_udat",     required_argument,    nullptr, 'U'},
+        {"with_exvd",     required_argument,    nullptr, 'E'},
+        {"content_type",  required_argument,    nullptr, 'C'},
         {"rebuild_htree", no_argument,          nullptr, 'r'},
+        {"trim",          required_argument,    nullptr, 'T'},
+        {"defrag",        no_argument,          nullptr, 'F'},
+        {"threads",       required_argument,    nullptr, 't'},
+        {"no_mmap",       no_argument,          nullptr, 'm'},
+        {"io_depth",      required_argument,    nullptr, 'q'},
+        {"direct_io",     no_argument,          nullptr, 'O'},
+        {"log_level",     required_argument,    nullptr, 'L'},
+        {"stats",         no_argument,          nullptr, 'S'},
+        {"trace",         required_argument,    nullptr, 'j'},
+        {"progress",      no_argument,          nullptr, 'P'},
         {"help",          no_argument,          nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -55,10 +262,32 @@ int main(int argc, char *argv[])
     bool extract_udat = false;
     bool verify_hasht = false;
     bool rebuild_hash = false;
+    bool defrag       = false;
     bool unsafe       = false;
+    bool use_mmap     = true;
+    bool direct_io    = false;
     char* filename    = nullptr;
+    char* scan_root   = nullptr;
+    bool  scan_deep   = false;
+    char* index_file  = nullptr;
+    char* query       = nullptr;
+    char* drive_out   = nullptr;
+    char* decrypt_out = nullptr;
+    char* verified_out = nullptr;
+    char* cik_file    = nullptr;
+    char* diff_base   = nullptr;
+    char* delta_out   = nullptr;
+    char* delta_in    = nullptr;
+    char* output      = nullptr;
+    char* trim        = nullptr;
+    XvdBuildParams build;
+    unsigned threads  = 0;
+    unsigned io_depth = 0;
+    bool  stats       = false;
+    char* trace_out   = nullptr;
+    bool  progress    = false;
 
-    const char* const short_opts = "f:iseuvrh";
+    const char* const short_opts = "f:ib:Dn:Q:seud:p:x:k:vc:g:a:o:B:yU:E:C:rT:Ft:mq:OL:Sj:Ph";
     while( (opt = getopt_long(argc, argv, short_opts, long_opts, &long_index)) != -1 )
     {
         switch(opt)
@@ -66,6 +295,18 @@ int main(int argc, char *argv[])
             case 'i':
                 infodump = true;
                 break;
+            case 'b':
+                scan_root    = optarg;
+                break;
+            case 'D':
+                scan_deep    = true;
+                break;
+            case 'n':
+                index_file   = optarg;
+                break;
+            case 'Q':
+                query        = optarg;
+                break;
             case 'e':
                 extract_exvd = true;
                 break;
@@ -75,12 +316,93 @@ int main(int argc, char *argv[])
             case 'u':
                 extract_udat = true;
                 break;
+            case 'd':
+                drive_out    = optarg;
+                break;
+            case 'p':
+                verified_out = optarg;
+                break;
+            case 'x':
+                decrypt_out  = optarg;
+                break;
+            case 'k':
+                cik_file     = optarg;
+                break;
             case 'v':
                 verify_hasht = true;
                 break;
+            case 'c':
+                diff_base    = optarg;
+                break;
+            case 'g':
+                delta_out    = optarg;
+                break;
+            case 'a':
+                delta_in     = optarg;
+                break;
+            case 'o':
+                output       = optarg;
+                break;
+            case 'B':
+                build.drive_image  = optarg;
+                break;
+            case 'y':
+                build.xvd_type     = XvdType::DYNAMIC;
+                break;
+            case 'U':
+                build.user_data    = optarg;
+                break;
+            case 'E':
+                build.embedded_xvd = optarg;
+                break;
+            case 'C':
+            {
+                uint32_t type;
+                if(!ContentTypeFromString(optarg, type))
+                {
+                    fprintf(stderr, "Unknown content type '%s'\n", optarg);
+                    return 1;
+                }
+                build.content_type = (XvdContentType)type;
+                break;
+            }
             case 'r':
                 rebuild_hash = true;
                 break;
+            case 'T':
+                trim         = optarg;
+                break;
+            case 'F':
+                defrag       = true;
+                break;
+            case 't':
+                threads = (unsigned)strtoul(optarg, nullptr, 0);
+                break;
+            case 'm':
+                use_mmap = false;
+                break;
+            case 'q':
+                io_depth = (unsigned)strtoul(optarg, nullptr, 0);
+                break;
+            case 'O':
+                direct_io    = true;
+                break;
+            case 'L':
+                if(!XvdLogLevelFromString(optarg, gXvdLogLevel))
+                {
+                    fprintf(stderr, "Unknown --log_level '%s'. Please use err, info or dbg\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                stats        = true;
+                break;
+            case 'j':
+                trace_out    = optarg;
+                break;
+            case 'P':
+                progress     = true;
+                break;
             case 'h':
                 PrintHelp();
                 exit(0);
@@ -94,6 +416,88 @@ int main(int argc, char *argv[])
         }
     }
 
+    // Instrumentation: recorded from here on, dumped when main() returns, whatever the mode
+    struct TraceDump
+    {
+        bool  stats;
+        char* trace_out;
+        ~TraceDump()
+        {
+            fflush(stdout);
+            if(stats)
+                XvdTracePrintSummary(stderr);
+            if(trace_out && XvdTraceWriteChrome(trace_out))
+                fprintf(stderr, "INFO: Trace written to '%s'\n", trace_out);
+        }
+    } trace_dump{ stats, trace_out };
+    if(stats || trace_out)
+        XvdTraceEnable((stats ? (uint32_t)XVD_TRACE_SUMMARY : 0) | (trace_out ? (uint32_t)XVD_TRACE_EVENTS : 0));
+
+    struct sigaction on_interrupt = {};
+    on_interrupt.sa_handler = OnInterrupt;
+    on_interrupt.sa_flags   = SA_RESETHAND;
+    sigaction(SIGINT, &on_interrupt, nullptr);
+
+    // Declared after trace_dump, so the last progress line is out before the stats
+    ProgressPrinter progress_printer;
+    if(progress)
+        progress_printer.Start();
+
+    // Index mode: bring the index up to date with the tree
+    if(scan_root && index_file)
+    {
+        XvdIndex::UpdateStats stats;
+        auto start = std::chrono::steady_clock::now();
+        if(!XvdIndex::Update(index_file, scan_root, scan_deep ? XVD_SCAN_LEVEL_LAYOUT : XVD_SCAN_LEVEL_HEADER,
+                             threads, stats))
+            return 1;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        fprintf(stderr, "INFO: %llu files, %llu unchanged, %llu scanned, %llu removed in %.2f s\n",
+                (unsigned long long)stats.files, (unsigned long long)stats.unchanged,
+                (unsigned long long)stats.scanned, (unsigned long long)stats.removed, elapsed.count());
+        return 0;
+    }
+
+    // Query mode: matching records go to stdout as CSV, like a scan
+    if(query)
+    {
+        if(!index_file)
+        {
+            fprintf(stderr, "ERR: --query needs an --index\n");
+            return 1;
+        }
+        return QueryIndex(index_file, query);
+    }
+
+    // Batch mode: no single XVD, records go to stdout, everything else to stderr
+    if(scan_root)
+    {
+        std::vector<XvdScanRecord> records;
+        auto start = std::chrono::steady_clock::now();
+        uint64_t num_files = ScanXvdTree(scan_root, scan_deep ? XVD_SCAN_LEVEL_LAYOUT : XVD_SCAN_LEVEL_HEADER,
+                                         threads, records);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        WriteScanRecordsCsv(stdout, records);
+        fprintf(stderr, "INFO: %zu XVDs found in %llu files in %.2f s\n", records.size(),
+                (unsigned long long)num_files, elapsed.count());
+        return 0;
+    }
+
+    // Build mode: a new XVD from a raw image
+    if(build.drive_image)
+    {
+        if(output == nullptr)
+        {
+            fprintf(stderr, "Building an XVD needs an output file. Please use --output\n");
+            return 1;
+        }
+        build.num_threads = threads;
+        build.progress    = &sProgress;
+        return BuildXvd(build, output) ? 0 : 1;
+    }
+
     if(filename == nullptr)
     {
         printf("No XVD file passed. Please use --file or -f\n");
@@ -103,9 +507,13 @@ int main(int argc, char *argv[])
 
     // Create XanaduXVD object
     XanaduXVD xvd(filename);
+    xvd.SetProgress(&sProgress);
+    if(io_depth)
+        xvd.SetIoQueueDepth(io_depth);
+    xvd.SetDirectIo(direct_io);
 
     // Start XanaduXVD
-    if(auto ret = xvd.Start(unsafe, true); ret)
+    if(auto ret = xvd.Start(unsafe, gXvdLogLevel >= XVD_LOG_DBG, use_mmap); ret)
     {
         fprintf(stderr, "Failed to manipulate XVD: %s - reason: %d\n", argv[0], ret);
         return 1;
@@ -120,6 +528,78 @@ int main(int argc, char *argv[])
     if(extract_udat)
         xvd.ExtractUserData("extracted.vbi"); // TODO: pass argument
 
+    if(drive_out)
+        ret = xvd.ExtractDrive(drive_out);
+
+    if(verified_out)
+        ret = xvd.ExtractDriveVerified(verified_out, cik_file, threads);
+
+    if(decrypt_out)
+    {
+        if(cik_file == nullptr)
+        {
+            fprintf(stderr, "Decryption needs a CIK. Please use --cik\n");
+            return 1;
+        }
+        ret = xvd.Decrypt(cik_file, decrypt_out, threads);
+    }
+
+    if(trim)
+    {
+        if(strcmp(trim, "exvd") == 0)
+            ret = xvd.RemoveEmbeddedXVD();
+        else if(strcmp(trim, "userdata") == 0)
+            ret = xvd.RemoveUserData(threads);
+        else if(strcmp(trim, "blocks") == 0)
+            ret = xvd.TrimUnusedBlocks(threads);
+        else
+        {
+            fprintf(stderr, "Unknown --trim '%s'. Please use exvd, userdata or blocks\n", trim);
+            return 1;
+        }
+    }
+
+    if(defrag)
+        ret = xvd.Defragment(threads);
+
+    if(rebuild_hash)
+        ret = xvd.RebuildHashTree(threads);
+
+    if(verify_hasht)
+        ret = xvd.VerifyHashTree(threads);
+
+    if(diff_base)
+    {
+        XanaduXVD base(diff_base);
+        if(io_depth)
+            base.SetIoQueueDepth(io_depth);
+        base.SetDirectIo(direct_io);
+        if(ret = base.Start(unsafe, false, use_mmap); ret)
+        {
+            fprintf(stderr, "Failed to open base XVD: %s - reason: %d\n", diff_base, ret);
+            return 1;
+        }
+
+        XvdDiff diff;
+        if(delta_out)
+            ret = xvd.CreateDelta(base, delta_out, threads);
+        else if(ret = xvd.Diff(base, diff, threads); ret == 0)
+            for(const XvdDiffRange& range : diff.ranges)
+                printf("OUT: %-9s 0x%012llx - 0x%012llx (%llu pages)\n", RegionIdStr(range.region),
+                       (unsigned long long)range.offset, (unsigned long long)(range.offset + range.length),
+                       (unsigned long long)((range.length + XVD_PAGE_SIZE - 1) / XVD_PAGE_SIZE));
+    }
+
+    if(delta_in)
+    {
+        if(output == nullptr)
+        {
+            fprintf(stderr, "Applying a delta needs an output file. Please use --output\n");
+            return 1;
+        }
+        ret = ApplyXvdDelta(filename, delta_in, output) ? 0 : 1;
+    }
+
     // TODO Create enum of errors in XanaduXVD.h
-    return 0;
+    return ret;
 }
\ No newline at end of file
@@ -1,11 +1,17 @@
 // Copyright 2020 Arthur Sonzogni. All rights reserved.
 // Use of this source code is governed by the MIT license that can be found in
 // the LICENSE file.
+#include <atomic>    // for atomic
 #include <functional>  // for function
 #include <iostream>  // for basic_ostream::operator<<, operator<<, endl, basic_ostream, basic_ostream<>::__ostream_type, cout, ostream
 #include <string>    // for string, basic_string, allocator
 #include <chrono>
+#include <thread>    // for thread, sleep_for
 #include <vector>    // for vector
+
+#include "XanaduXVD.h"
+#include "XVDLog.h"
+#include "XVDProgress.h"
  
 #include "ftxui/component/captured_mouse.hpp"      // for ftxui
 #include "ftxui/component/component.hpp"           // for Menu
@@ -59,26 +65,104 @@ void ClearScreen(ScreenInteractive& screen)
 ///////////////////////////////////////////////////////////////
 // MENU METHODS
 ///////////////////////////////////////////////////////////////
-void VerifyHashTree(ScreenInteractive& screen)
+// Shows 'message' until a key is pressed, so it isn't wiped by the next ClearScreen()
+void ShowResult(ScreenInteractive& screen, const std::string& message)
 {
-      std::string reset_position;
-        for (float percentage = 0.0f; percentage <= 1.0f; percentage += 0.002f) {
-            std::string data_downloaded =
-                std::to_string(int(percentage * 5000)) + "/5000";
-            auto document = hbox({
-                text("Verifying hash tree:"),
-                gauge(percentage) | flex,
-                text(" " + data_downloaded),
-            });
-    auto screen = Screen(100, 1);
-    Render(screen, document);
-    std::cout << reset_position;
-    screen.Print();
-    reset_position = screen.ResetPosition();
- 
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
-  std::cout << std::endl;
+    auto renderer = Renderer([&] {
+        return vbox({
+                   text(message) | bold | center,
+                   separator(),
+                   text("Press any key to continue") | dim | center,
+               }) |
+               border;
+    });
+    auto component = CatchEvent(renderer, [&](Event event) {
+        if(event.is_mouse())
+            return false;
+        screen.ExitLoopClosure()();
+        return true;
+    });
+
+    screen.Loop(component);
+}
+
+// Runs a long XanaduXVD operation on a worker thread and draws its real progress (see
+// XVDProgress.h) until it's done. The gauge only reads atomics, it never slows the workers.
+// Esc or q cancels it: the operation stops at its next chunk, and 'cancelled' says so.
+int RunWithProgress(ScreenInteractive& screen, XanaduXVD& xvd, const std::string& label,
+                    std::function<int(XanaduXVD&)> operation, bool& cancelled)
+{
+    XvdProgress progress;
+    xvd.SetProgress(&progress);
+
+    std::atomic<bool> finished{false};
+    int ret = 0;
+    std::thread worker([&]() {
+        ret = operation(xvd);
+        finished = true;
+    });
+
+    // Redraws the gauge every 100 ms, and leaves the loop once the operation is done
+    std::thread ticker([&]() {
+        while(!finished)
+        {
+            screen.PostEvent(Event::Custom);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        screen.Post(screen.ExitLoopClosure());
+    });
+
+    auto renderer = Renderer([&] {
+        XvdProgressSnapshot snapshot = progress.Snapshot();
+        double eta = snapshot.Eta();
+        std::string status = " " + std::to_string(snapshot.bytes_done >> 20) + "/" +
+                             std::to_string(snapshot.bytes_total >> 20) + " MB" +
+                             (eta < 0 ? std::string("") : ", ETA " + std::to_string((int)eta) + " s");
+        return vbox({
+                   hbox({
+                       text(label + ":"),
+                       gauge((float)snapshot.Fraction()) | flex,
+                       text(status),
+                   }),
+                   text(snapshot.cancelled ? "Cancelling..." : "Press Esc or q to cancel") | dim,
+               }) |
+               size(WIDTH, EQUAL, 100) | border;
+    });
+    auto component = CatchEvent(renderer, [&](Event event) {
+        if(event == Event::Escape || event == Event::Character('q'))
+        {
+            progress.Cancel();
+            return true;
+        }
+        return false;
+    });
+
+    screen.Loop(component);
+    worker.join();
+    ticker.join();
+    ClearScreen(screen);
+
+    xvd.SetProgress(nullptr);
+    cancelled = (ret != 0) && progress.CancelRequested();
+    return ret;
+}
+
+void VerifyHashTree(ScreenInteractive& screen, XanaduXVD& xvd)
+{
+    bool cancelled = false;
+    int  ret = RunWithProgress(screen, xvd, "Verifying hash tree", [](XanaduXVD& x) { return x.VerifyHashTree(); }, cancelled);
+    ShowResult(screen, ret == 0  ? "HashTree is VALID" :
+                       cancelled ? "HashTree verification CANCELLED" :
+                                   "HashTree is INVALID (" + std::to_string(ret) + ")");
+}
+
+void RebuildHashTree(ScreenInteractive& screen, XanaduXVD& xvd)
+{
+    bool cancelled = false;
+    int  ret = RunWithProgress(screen, xvd, "Rebuilding hash tree", [](XanaduXVD& x) { return x.RebuildHashTree(); }, cancelled);
+    ShowResult(screen, ret == 0  ? "HashTree rebuilt" :
+                       cancelled ? "HashTree rebuild CANCELLED (the HashTree is incomplete, rebuild it again)" :
+                                   "Failed to rebuild the HashTree (" + std::to_string(ret) + ")");
 }
 
 int InitMenu(ScreenInteractive& screen)
@@ -254,6 +338,9 @@ int ConfigureSettings(ScreenInteractive& screen)
 ///////////////////////////////////////////////////////////////
 int main()
 {
+    // XanaduXVD's INFO lines would scroll the menus and the gauges away
+    gXvdLogLevel = XVD_LOG_ERR;
+
     // Init the basic FTXUI ScreenInteractive object
     auto screen = ScreenInteractive::TerminalOutput();
     //std::cout << help;
@@ -279,11 +366,17 @@ init_menu:
         return 0;
 
     // OpenXVD
-    VerifyHashTree(screen);
     auto res = OpenXVDMenu(screen);
     if(res.empty())
         goto init_menu;
 
+    XanaduXVD xvd(res.c_str());
+    if(xvd.Start(false, false) != 0)
+    {
+        std::cout << "Failed to open '" << res << "' as an XVD\n";
+        goto init_menu;
+    }
+
     // XVD Loaded, proceed to main menu
     option = MainMenu(screen);
 
@@ -297,6 +390,10 @@ init_menu:
             std::cout << "Dump UserData\n"; break;
         case 3:
             std::cout << "Exit\n"; break;
+        case 6:
+            VerifyHashTree(screen, xvd); break;
+        case 7:
+            RebuildHashTree(screen, xvd); break;
         default: break;
     }
 
@@ -1,2 +1,5 @@
 REM Builds the XanaduCLI app. -I./src specifies that headers are in the /src folder (that's where XanaduXVD lives)
-g++ -std=c++20 -I./src .\XanaduCLI\XanaduCLI.cpp .\src\XanaduXVD.cpp .\src\XVDTypes.cpp
\ No newline at end of file
+g++ -std=c++20 -O2 -pthread -I./src .\XanaduCLI\XanaduCLI.cpp .\src\XanaduXVD.cpp .\src\XVDTypes.cpp .\src\XVDFile.cpp .\src\XVDBat.cpp .\src\XVDAsyncReader.cpp .\src\XVDSha256.cpp .\src\XVDWorkers.cpp .\src\XVDAes.cpp .\src\XVDScan.cpp .\src\XVDIndex.cpp .\src\XVDDelta.cpp .\src\XVDBuilder.cpp .\src\XVDLog.cpp .\src\XVDTrace.cpp .\src\XVDBufferPool.cpp -o xanaducli
+
+REM Builds the XanaduBench micro-benchmarks
+g++ -std=c++20 -O2 -pthread -I./src .\XanaduBench\XanaduBench.cpp .\XanaduBench\XVDCorpus.cpp .\src\XanaduXVD.cpp .\src\XVDTypes.cpp .\src\XVDFile.cpp .\src\XVDBat.cpp .\src\XVDAsyncReader.cpp .\src\XVDSha256.cpp .\src\XVDWorkers.cpp .\src\XVDAes.cpp .\src\XVDScan.cpp .\src\XVDIndex.cpp .\src\XVDDelta.cpp .\src\XVDLog.cpp .\src\XVDTrace.cpp .\src\XVDBufferPool.cpp -o xanadubench
\ No newline at end of file
@@ -0,0 +1,441 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDAes.cpp - AES-128-XTS page decryption kernels      */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDAes.h"
+#include "XVDTypes.h"
+#include "XVDTrace.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <string.h>
+
+///////////////////////////////////////
+// x86 includes
+///////////////////////////////////////
+#if defined(__x86_64__) || defined(__i386__)
+#define XVD_AES_X86 1
+#include <immintrin.h>
+#endif
+
+/******************************************************************************************\
+                            AES-XTS KERNELS THEORY OF OPERATION
+
+Encrypted XVDs use AES-128 in XTS mode (the same mode BitLocker & co use for disks), with
+one 4K page per "data unit". The key is the 32 byte CIK: 16 bytes of tweak key followed by
+16 bytes of data key. For every page:
+
+    T0       = AES-Encrypt(tweak_key, page_tweak)       (page_tweak: see XanaduXVD::Decrypt())
+    T(j+1)   = T(j) * alpha                              (multiplication in GF(2^128))
+    plain(j) = AES-Decrypt(data_key, cipher(j) ^ T(j)) ^ T(j)     for the 256 blocks j of the page
+
+The 256 tweaks of a page only depend on T0, so they are computed first with plain 64 bit
+shifts, and then all the blocks of the page are independent: perfect for SIMD. AES-NI does
+one AES round of one block per instruction, but with a latency of several cycles, so the
+kernel keeps 8 blocks in flight. VAES does the same on 2 (AVX2) or 4 (AVX-512) blocks per
+instruction. Every page is independent from the others too, so the caller spreads pages
+across all the cores.
+
+The plain C++ kernel is a textbook byte oriented AES. It is there for correctness on
+non x86 machines and for cross-checking, not for speed.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// SCALAR AES-128                       //
+//////////////////////////////////////////
+static uint8_t gSbox[256];
+static uint8_t gInvSbox[256];
+
+static inline uint8_t Rotl8(uint8_t x, int n) { return (uint8_t)((x << n) | (x >> (8 - n))); }
+
+static bool InitSboxes()
+{
+    // Walks the whole multiplicative group of GF(2^8) with generator 3: p goes through every
+    // non zero element and q is always its inverse. The S-box is the affine transform of the
+    // inverse. Avoids typing (and mistyping) 512 magic numbers.
+    uint8_t p = 1, q = 1;
+    do
+    {
+        p = p ^ (uint8_t)(p << 1) ^ ((p & 0x80) ? 0x1B : 0);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if(q & 0x80)
+            q ^= 0x09;
+        gSbox[p] = q ^ Rotl8(q, 1) ^ Rotl8(q, 2) ^ Rotl8(q, 3) ^ Rotl8(q, 4) ^ 0x63;
+    } while(p != 1);
+    gSbox[0] = 0x63;
+
+    for(int i = 0; i < 256; i++)
+        gInvSbox[gSbox[i]] = (uint8_t)i;
+    return true;
+}
+[[maybe_unused]] static bool gSboxesReady = InitSboxes();
+
+static inline uint8_t Xtime(uint8_t x) { return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1B : 0)); }
+
+static void ExpandKey128(const uint8_t key[AES128_KEY_LENGTH_BYTES], uint8_t rk[AES128_ROUNDS + 1][AES_BLOCK_LENGTH_BYTES])
+{
+    uint8_t* w = &rk[0][0];
+    memcpy(w, key, AES128_KEY_LENGTH_BYTES);
+
+    uint8_t rcon = 1;
+    for(int i = 4; i < 4 * (AES128_ROUNDS + 1); i++)
+    {
+        uint8_t t[4] = { w[4 * (i - 1)], w[4 * (i - 1) + 1], w[4 * (i - 1) + 2], w[4 * (i - 1) + 3] };
+        if(i % 4 == 0)
+        {
+            // RotWord + SubWord + Rcon
+            uint8_t t0 = t[0];
+            t[0] = gSbox[t[1]] ^ rcon;
+            t[1] = gSbox[t[2]];
+            t[2] = gSbox[t[3]];
+            t[3] = gSbox[t0];
+            rcon = Xtime(rcon);
+        }
+        for(int b = 0; b < 4; b++)
+            w[4 * i + b] = w[4 * (i - 4) + b] ^ t[b];
+    }
+}
+
+static void MixColumn(uint8_t* c)
+{
+    uint8_t a0 = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+    uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+    c[0] ^= all ^ Xtime(a0 ^ a1);
+    c[1] ^= all ^ Xtime(a1 ^ a2);
+    c[2] ^= all ^ Xtime(a2 ^ a3);
+    c[3] ^= all ^ Xtime(a3 ^ a0);
+}
+
+static void InvMixColumn(uint8_t* c)
+{
+    // InvMixColumns = MixColumns after a cheap "pre-mix" (AES proposal, section 4.1.3),
+    // way faster than four generic GF(2^8) multiplications per byte
+    uint8_t u = Xtime(Xtime(c[0] ^ c[2]));
+    uint8_t v = Xtime(Xtime(c[1] ^ c[3]));
+    c[0] ^= u;
+    c[1] ^= v;
+    c[2] ^= u;
+    c[3] ^= v;
+    MixColumn(c);
+}
+
+static void AddRoundKey(uint8_t s[16], const uint8_t rk[16])
+{
+    for(int i = 0; i < 16; i++)
+        s[i] ^= rk[i];
+}
+
+// The state is column major: byte i is row i%4, column i/4
+static void EncryptBlockScalar(const uint8_t rk[AES128_ROUNDS + 1][AES_BLOCK_LENGTH_BYTES], uint8_t s[16])
+{
+    AddRoundKey(s, rk[0]);
+    for(int round = 1; round <= AES128_ROUNDS; round++)
+    {
+        // SubBytes + ShiftRows (row r rotates left by r)
+        uint8_t t[16];
+        for(int i = 0; i < 16; i++)
+            t[i] = gSbox[s[(i + 4 * (i % 4)) % 16]];
+        memcpy(s, t, 16);
+
+        if(round != AES128_ROUNDS)
+            for(int c = 0; c < 4; c++)
+                MixColumn(s + 4 * c);
+        AddRoundKey(s, rk[round]);
+    }
+}
+
+static void DecryptBlockScalar(const uint8_t rk[AES128_ROUNDS + 1][AES_BLOCK_LENGTH_BYTES], uint8_t s[16])
+{
+    AddRoundKey(s, rk[AES128_ROUNDS]);
+    for(int round = AES128_ROUNDS - 1; round >= 0; round--)
+    {
+        // InvShiftRows (row r rotates right by r) + InvSubBytes
+        uint8_t t[16];
+        for(int i = 0; i < 16; i++)
+            t[i] = gInvSbox[s[(i + 16 - 4 * (i % 4)) % 16]];
+        memcpy(s, t, 16);
+
+        AddRoundKey(s, rk[round]);
+        if(round != 0)
+            for(int c = 0; c < 4; c++)
+                InvMixColumn(s + 4 * c);
+    }
+}
+
+//////////////////////////////////////////
+// XTS TWEAKS                           //
+//////////////////////////////////////////
+
+// From the encrypted tweak of a page (T0), all the tweaks of its 256 blocks. The 128 bit
+// value is little endian: multiplying by alpha is a 1 bit shift left, and if a bit falls
+// off the top, xor with the reduction polynomial (x^128 + x^7 + x^2 + x + 1 -> 0x87).
+static void ComputePageTweaks(const uint8_t t0[AES_BLOCK_LENGTH_BYTES], uint64_t tweaks[][2])
+{
+    uint64_t lo, hi;
+    memcpy(&lo, t0, 8);
+    memcpy(&hi, t0 + 8, 8);
+    for(uint32_t j = 0; j < XVD_PAGE_SIZE / AES_BLOCK_LENGTH_BYTES; j++)
+    {
+        tweaks[j][0] = lo;
+        tweaks[j][1] = hi;
+        uint64_t carry = hi >> 63;
+        hi = (hi << 1) | (lo >> 63);
+        lo = (lo << 1) ^ (carry * 0x87);
+    }
+}
+
+#define BLOCKS_PER_PAGE (XVD_PAGE_SIZE / AES_BLOCK_LENGTH_BYTES)
+
+static void DecryptPageScalar(const AesXtsKey& key, const uint8_t* src, uint8_t* dst, const uint8_t tweak[AES_BLOCK_LENGTH_BYTES])
+{
+    uint8_t t0[AES_BLOCK_LENGTH_BYTES];
+    memcpy(t0, tweak, AES_BLOCK_LENGTH_BYTES);
+    EncryptBlockScalar(key.tweak_enc, t0);
+
+    uint64_t tweaks[BLOCKS_PER_PAGE][2];
+    ComputePageTweaks(t0, tweaks);
+
+    for(uint32_t j = 0; j < BLOCKS_PER_PAGE; j++)
+    {
+        uint8_t block[AES_BLOCK_LENGTH_BYTES];
+        const uint8_t* t = (const uint8_t*)tweaks[j];
+        for(int i = 0; i < AES_BLOCK_LENGTH_BYTES; i++)
+            block[i] = src[j * AES_BLOCK_LENGTH_BYTES + i] ^ t[i];
+        DecryptBlockScalar(key.data_enc, block);
+        for(int i = 0; i < AES_BLOCK_LENGTH_BYTES; i++)
+            dst[j * AES_BLOCK_LENGTH_BYTES + i] = block[i] ^ t[i];
+    }
+}
+
+//////////////////////////////////////////
+// AES-NI KERNEL (8 blocks in flight)   //
+//////////////////////////////////////////
+#ifdef XVD_AES_X86
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+
+static inline __m128i EncryptTweakAesni(const AesXtsKey& key, const uint8_t tweak[AES_BLOCK_LENGTH_BYTES])
+{
+    __m128i t = _mm_xor_si128(_mm_loadu_si128((const __m128i*)tweak), _mm_load_si128((const __m128i*)key.tweak_enc[0]));
+    for(int r = 1; r < AES128_ROUNDS; r++)
+        t = _mm_aesenc_si128(t, _mm_load_si128((const __m128i*)key.tweak_enc[r]));
+    return _mm_aesenclast_si128(t, _mm_load_si128((const __m128i*)key.tweak_enc[AES128_ROUNDS]));
+}
+
+static void DecryptPageAesni(const AesXtsKey& key, const uint8_t* src, uint8_t* dst, const uint8_t tweak[AES_BLOCK_LENGTH_BYTES])
+{
+    alignas(16) uint8_t t0[AES_BLOCK_LENGTH_BYTES];
+    _mm_store_si128((__m128i*)t0, EncryptTweakAesni(key, tweak));
+
+    alignas(16) uint64_t tweaks[BLOCKS_PER_PAGE][2];
+    ComputePageTweaks(t0, tweaks);
+
+    __m128i rk[AES128_ROUNDS + 1];
+    for(int r = 0; r <= AES128_ROUNDS; r++)
+        rk[r] = _mm_load_si128((const __m128i*)key.data_dec[r]);
+
+    for(uint32_t j = 0; j < BLOCKS_PER_PAGE; j += 8)
+    {
+        __m128i t[8], x[8];
+        for(int b = 0; b < 8; b++)
+        {
+            t[b] = _mm_load_si128((const __m128i*)tweaks[j + b]);
+            x[b] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + (j + b) * AES_BLOCK_LENGTH_BYTES)), t[b]), rk[0]);
+        }
+        for(int r = 1; r < AES128_ROUNDS; r++)
+            for(int b = 0; b < 8; b++)
+                x[b] = _mm_aesdec_si128(x[b], rk[r]);
+        for(int b = 0; b < 8; b++)
+        {
+            x[b] = _mm_xor_si128(_mm_aesdeclast_si128(x[b], rk[AES128_ROUNDS]), t[b]);
+            _mm_storeu_si128((__m128i*)(dst + (j + b) * AES_BLOCK_LENGTH_BYTES), x[b]);
+        }
+    }
+}
+
+#pragma GCC pop_options
+
+//////////////////////////////////////////
+// VAES AVX2 KERNEL (2 blocks/register) //
+//////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("aes,vaes,avx2")
+
+static void DecryptPageVaesAvx2(const AesXtsKey& key, const uint8_t* src, uint8_t* dst, const uint8_t tweak[AES_BLOCK_LENGTH_BYTES])
+{
+    alignas(32) uint8_t t0[AES_BLOCK_LENGTH_BYTES];
+    _mm_store_si128((__m128i*)t0, EncryptTweakAesni(key, tweak));
+
+    alignas(32) uint64_t tweaks[BLOCKS_PER_PAGE][2];
+    ComputePageTweaks(t0, tweaks);
+
+    __m256i rk[AES128_ROUNDS + 1];
+    for(int r = 0; r <= AES128_ROUNDS; r++)
+        rk[r] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)key.data_dec[r]));
+
+    // 4 registers of 2 blocks: 8 blocks in flight
+    for(uint32_t j = 0; j < BLOCKS_PER_PAGE; j += 8)
+    {
+        __m256i t[4], x[4];
+        for(int b = 0; b < 4; b++)
+        {
+            t[b] = _mm256_load_si256((const __m256i*)tweaks[j + 2 * b]);
+            x[b] = _mm256_xor_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(src + (j + 2 * b) * AES_BLOCK_LENGTH_BYTES)), t[b]), rk[0]);
+        }
+        for(int r = 1; r < AES128_ROUNDS; r++)
+            for(int b = 0; b < 4; b++)
+                x[b] = _mm256_aesdec_epi128(x[b], rk[r]);
+        for(int b = 0; b < 4; b++)
+        {
+            x[b] = _mm256_xor_si256(_mm256_aesdeclast_epi128(x[b], rk[AES128_ROUNDS]), t[b]);
+            _mm256_storeu_si256((__m256i*)(dst + (j + 2 * b) * AES_BLOCK_LENGTH_BYTES), x[b]);
+        }
+    }
+}
+
+#pragma GCC pop_options
+
+//////////////////////////////////////////
+// VAES AVX-512 KERNEL (4 blocks/reg)   //
+//////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("aes,vaes,avx512f")
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"        // GCC's own AVX-512 headers trigger these
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+static void DecryptPageVaesAvx512(const AesXtsKey& key, const uint8_t* src, uint8_t* dst, const uint8_t tweak[AES_BLOCK_LENGTH_BYTES])
+{
+    alignas(64) uint8_t t0[AES_BLOCK_LENGTH_BYTES];
+    _mm_store_si128((__m128i*)t0, EncryptTweakAesni(key, tweak));
+
+    alignas(64) uint64_t tweaks[BLOCKS_PER_PAGE][2];
+    ComputePageTweaks(t0, tweaks);
+
+    __m512i rk[AES128_ROUNDS + 1];
+    for(int r = 0; r <= AES128_ROUNDS; r++)
+        rk[r] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)key.data_dec[r]));
+
+    // 4 registers of 4 blocks: 16 blocks in flight
+    for(uint32_t j = 0; j < BLOCKS_PER_PAGE; j += 16)
+    {
+        __m512i t[4], x[4];
+        for(int b = 0; b < 4; b++)
+        {
+            t[b] = _mm512_load_si512((const void*)tweaks[j + 4 * b]);
+            x[b] = _mm512_xor_si512(_mm512_xor_si512(_mm512_loadu_si512((const void*)(src + (j + 4 * b) * AES_BLOCK_LENGTH_BYTES)), t[b]), rk[0]);
+        }
+        for(int r = 1; r < AES128_ROUNDS; r++)
+            for(int b = 0; b < 4; b++)
+                x[b] = _mm512_aesdec_epi128(x[b], rk[r]);
+        for(int b = 0; b < 4; b++)
+        {
+            x[b] = _mm512_xor_si512(_mm512_aesdeclast_epi128(x[b], rk[AES128_ROUNDS]), t[b]);
+            _mm512_storeu_si512((void*)(dst + (j + 4 * b) * AES_BLOCK_LENGTH_BYTES), x[b]);
+        }
+    }
+}
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif // XVD_AES_X86
+
+//////////////////////////////////////////
+// DISPATCH                             //
+//////////////////////////////////////////
+bool AesXtsKernelSupported(AesXtsKernel kernel)
+{
+    switch(kernel)
+    {
+        case AES_XTS_KERNEL_SCALAR:      return true;
+#ifdef XVD_AES_X86
+        // GCC's builtins already take care of checking the OS saves the AVX registers
+        case AES_XTS_KERNEL_AESNI:       return __builtin_cpu_supports("aes");
+        case AES_XTS_KERNEL_VAES_AVX2:   return __builtin_cpu_supports("aes") && __builtin_cpu_supports("vaes")
+                                             && __builtin_cpu_supports("avx2");
+        case AES_XTS_KERNEL_VAES_AVX512: return __builtin_cpu_supports("aes") && __builtin_cpu_supports("vaes")
+                                             && __builtin_cpu_supports("avx512f");
+#endif
+        default:                         return false;
+    }
+}
+
+AesXtsKernel AesXtsBestKernel()
+{
+    static AesXtsKernel best = []()
+    {
+        const AesXtsKernel by_preference[] = { AES_XTS_KERNEL_VAES_AVX512, AES_XTS_KERNEL_VAES_AVX2, AES_XTS_KERNEL_AESNI };
+        for(auto kernel : by_preference)
+            if(AesXtsKernelSupported(kernel))
+                return kernel;
+        return AES_XTS_KERNEL_SCALAR;
+    }();
+    return best;
+}
+
+const char* AesXtsKernelName(AesXtsKernel kernel)
+{
+    switch(kernel)
+    {
+        case AES_XTS_KERNEL_SCALAR:      return "Scalar";
+        case AES_XTS_KERNEL_AESNI:       return "AES-NI";
+        case AES_XTS_KERNEL_VAES_AVX2:   return "VAES (AVX2)";
+        case AES_XTS_KERNEL_VAES_AVX512: return "VAES (AVX-512)";
+        default:                         return "UNKNOWN";
+    }
+}
+
+void AesXtsInit(AesXtsKey& key, const uint8_t cik[XVD_CIK_LENGTH_BYTES])
+{
+    ExpandKey128(cik,                           key.tweak_enc);
+    ExpandKey128(cik + AES128_KEY_LENGTH_BYTES, key.data_enc);
+
+    // Only the SIMD kernels use it, but it doesn't need any special instruction to compute
+    memcpy(key.data_dec[0], key.data_enc[AES128_ROUNDS], AES_BLOCK_LENGTH_BYTES);
+    for(int r = 1; r < AES128_ROUNDS; r++)
+    {
+        memcpy(key.data_dec[r], key.data_enc[AES128_ROUNDS - r], AES_BLOCK_LENGTH_BYTES);
+        for(int c = 0; c < 4; c++)
+            InvMixColumn(key.data_dec[r] + 4 * c);
+    }
+    memcpy(key.data_dec[AES128_ROUNDS], key.data_enc[0], AES_BLOCK_LENGTH_BYTES);
+}
+
+void AesXtsDecryptPagesWithKernel(AesXtsKernel kernel, const AesXtsKey& key, const uint8_t* src, uint8_t* dst,
+                                  size_t num_pages, const uint8_t (*tweaks)[AES_BLOCK_LENGTH_BYTES])
+{
+    if(!AesXtsKernelSupported(kernel))
+        kernel = AES_XTS_KERNEL_SCALAR;
+
+    auto decrypt_page = DecryptPageScalar;
+#ifdef XVD_AES_X86
+    switch(kernel)
+    {
+        case AES_XTS_KERNEL_AESNI:       decrypt_page = DecryptPageAesni;      break;
+        case AES_XTS_KERNEL_VAES_AVX2:   decrypt_page = DecryptPageVaesAvx2;   break;
+        case AES_XTS_KERNEL_VAES_AVX512: decrypt_page = DecryptPageVaesAvx512; break;
+        default:                                                               break;
+    }
+#endif
+
+    for(size_t page = 0; page < num_pages; page++)
+        decrypt_page(key, src + page * XVD_PAGE_SIZE, dst + page * XVD_PAGE_SIZE, tweaks[page]);
+}
+
+void AesXtsDecryptPages(const AesXtsKey& key, const uint8_t* src, uint8_t* dst, size_t num_pages,
+                        const uint8_t (*tweaks)[AES_BLOCK_LENGTH_BYTES])
+{
+    XVD_TRACE_SCOPE(XVD_PHASE_DECRYPT, PagesToBytes(num_pages));
+    AesXtsDecryptPagesWithKernel(AesXtsBestKernel(), key, src, dst, num_pages, tweaks);
+}
@@ -0,0 +1,63 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDAes.h - AES-128-XTS used by encrypted XVDs.        */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////
+// Constants
+///////////////////////////////////////
+#define AES_BLOCK_LENGTH_BYTES  16
+#define AES128_KEY_LENGTH_BYTES 16
+#define AES128_ROUNDS           10
+#define XVD_CIK_LENGTH_BYTES    32   // Tweak key (16) + data key (16)
+
+// Implementations available to decrypt 4K pages. See XVDAes.cpp for the details.
+enum AesXtsKernel
+{
+    AES_XTS_KERNEL_SCALAR      = 0,   // Plain C++, works everywhere (slow)
+    AES_XTS_KERNEL_AESNI       = 1,   // AES-NI, 8 blocks interleaved
+    AES_XTS_KERNEL_VAES_AVX2   = 2,   // VAES on 256 bit registers, 2 blocks per register
+    AES_XTS_KERNEL_VAES_AVX512 = 3,   // VAES on 512 bit registers, 4 blocks per register
+    AES_XTS_KERNEL_COUNT
+};
+
+// Expanded keys of one XTS key pair (the CIK)
+struct AesXtsKey
+{
+    alignas(16) uint8_t data_enc[AES128_ROUNDS + 1][AES_BLOCK_LENGTH_BYTES];  // Data key, encryption schedule
+    alignas(16) uint8_t data_dec[AES128_ROUNDS + 1][AES_BLOCK_LENGTH_BYTES];  // Data key, "equivalent inverse cipher" schedule
+    alignas(16) uint8_t tweak_enc[AES128_ROUNDS + 1][AES_BLOCK_LENGTH_BYTES]; // Tweak key, encryption schedule
+};
+
+//////////////////////////////////////////
+// AES-XTS METHODS                      //
+//////////////////////////////////////////
+
+// Expands a CIK: the first 16 bytes are the tweak key, the last 16 bytes the data key
+void AesXtsInit(AesXtsKey& key, const uint8_t cik[XVD_CIK_LENGTH_BYTES]);
+
+// Decrypts 'num_pages' XVD_PAGE_SIZE pages from 'src' into 'dst' (they can be the same buffer).
+// Every page is one XTS data unit, with its own 16 byte tweak (before encryption with the
+// tweak key) in 'tweaks'. The fastest kernel the CPU supports is used.
+void AesXtsDecryptPages(const AesXtsKey& key, const uint8_t* src, uint8_t* dst, size_t num_pages,
+                        const uint8_t (*tweaks)[AES_BLOCK_LENGTH_BYTES]);
+
+// Same, forcing a kernel (falls back to scalar if the CPU can't run it)
+void AesXtsDecryptPagesWithKernel(AesXtsKernel kernel, const AesXtsKey& key, const uint8_t* src, uint8_t* dst,
+                                  size_t num_pages, const uint8_t (*tweaks)[AES_BLOCK_LENGTH_BYTES]);
+
+// Runtime CPU dispatch helpers
+bool         AesXtsKernelSupported(AesXtsKernel kernel);
+AesXtsKernel AesXtsBestKernel();
+const char*  AesXtsKernelName(AesXtsKernel kernel);
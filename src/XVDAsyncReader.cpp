@@ -0,0 +1,556 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDAsyncReader.cpp - io_uring / pread() read engine   */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDAsyncReader.h"
+#include "XVDTypes.h"
+#include "XVDTrace.h"
+#include "XVDBufferPool.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/******************************************************************************************\
+                                ASYNC READER THEORY OF OPERATION
+
+There's a fixed set of 'queue_depth' buffers, all page aligned and big enough for the
+biggest request (chunks of the buffer pool when requests fit in one, which is always the
+case for groups of 170 pages, so back to back runs don't allocate anything). A buffer is in one of three states: free, owned by a read in flight, or
+owned by a consumer. The I/O side grabs free buffers and fires reads into them, completed
+reads are pushed to a queue, and consumer threads pop them, call the callback and give the
+buffer back. So there's never more than queue_depth buffers of memory in use, and when the
+consumers are slower than the disk (hashing, decrypting...) the reads just wait for a free
+buffer: back-pressure for free.
+
+io_uring: the calling thread owns the ring. It fills submission entries (one READV per
+buffer), submits them all with a single io_uring_enter() that also waits for at least one
+completion, and reaps whatever completed. Short reads (they can happen) are resubmitted for
+the remaining bytes. liburing isn't used on purpose: no dependencies, and the part of the
+API we need is small. The ring is just three mmap'd areas: the submission ring (indices),
+the submission entries, and the completion ring. The kernel and us talk through the head
+and tail of each ring, which need acquire/release ordering.
+
+pread(): 'queue_depth' threads, each one grabs the next request, a free buffer, and reads.
+Same queue of completions, same consumers.
+
+\******************************************************************************************/
+
+///////////////////////////////////////
+// Auxiliary methods
+///////////////////////////////////////
+static int IoUringSetup(uint32_t entries, io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int IoUringEnter(int ring_fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static uint32_t LoadAcquire(const uint32_t* p)    { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static void     StoreRelease(uint32_t* p, uint32_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+//////////////////////////////////////////
+// SHARED STATE OF A RUN                //
+//////////////////////////////////////////
+struct XvdAsyncReader::Shared
+{
+    struct Completion
+    {
+        uint64_t index;   // Which request
+        unsigned buffer;  // Where its data is
+    };
+
+    const std::vector<XvdReadRequest>& requests;
+    const XvdReadConsumer&             consumer;
+    const std::vector<uint8_t*>&       buffers;
+
+    std::atomic<bool>       failed{false};
+
+    std::mutex              free_mutex;
+    std::condition_variable free_cv;
+    std::vector<unsigned>   free_buffers;
+
+    std::mutex              done_mutex;
+    std::condition_variable done_cv;
+    std::deque<Completion>  done;
+    bool                    finished = false;
+
+    Shared(const std::vector<XvdReadRequest>& r, const XvdReadConsumer& c, const std::vector<uint8_t*>& b)
+        : requests(r), consumer(c), buffers(b)
+    {
+        for(unsigned i = 0; i < buffers.size(); i++)
+            free_buffers.push_back(i);
+    }
+
+    // Get a free buffer. If 'wait' is false and there is none, returns false right away.
+    bool PopFree(unsigned& buffer, bool wait)
+    {
+        std::unique_lock lock(free_mutex);
+        if(wait)
+            free_cv.wait(lock, [&]{ return !free_buffers.empty(); });
+        if(free_buffers.empty())
+            return false;
+        buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return true;
+    }
+
+    void Release(unsigned buffer)
+    {
+        {
+            std::lock_guard lock(free_mutex);
+            free_buffers.push_back(buffer);
+        }
+        free_cv.notify_one();
+    }
+
+    // Calls the consumer on a completed buffer and gives the buffer back
+    void Consume(const Completion& c)
+    {
+        if(!failed)
+        {
+            std::span<const uint8_t> data(buffers[c.buffer], requests[c.index].length);
+            if(!consumer(c.index, data))
+                failed = true;
+        }
+        Release(c.buffer);
+    }
+
+    void Deliver(const Completion& c)
+    {
+        {
+            std::lock_guard lock(done_mutex);
+            done.push_back(c);
+        }
+        done_cv.notify_one();
+    }
+
+    void Finish()
+    {
+        {
+            std::lock_guard lock(done_mutex);
+            finished = true;
+        }
+        done_cv.notify_all();
+    }
+
+    // Consumer loop: runs until Finish() was called and the queue is empty
+    void ConsumerLoop()
+    {
+        for(;;)
+        {
+            Completion c;
+            {
+                std::unique_lock lock(done_mutex);
+                done_cv.wait(lock, [&]{ return finished || !done.empty(); });
+                if(done.empty())
+                    return;
+                c = done.front();
+                done.pop_front();
+            }
+            Consume(c);
+        }
+    }
+};
+
+//////////////////////////////////////////
+// ASYNC READER METHODS                 //
+//////////////////////////////////////////
+XvdAsyncReader::XvdAsyncReader(int fd, uint64_t max_request_size, unsigned queue_depth, bool use_io_uring)
+    : mFd(fd),
+      mMaxRequestSize(AlignSizeToPageBoundary(max_request_size)),
+      mQueueDepth(queue_depth == 0 ? 1 : queue_depth),
+      mEngine(XVD_IO_ENGINE_PREAD)
+{
+    // Page aligned buffers: faster copies out of the page cache, and required for O_DIRECT
+    bool pooled = mMaxRequestSize <= XVD_POOL_CHUNK_SIZE;
+    for(unsigned i = 0; i < mQueueDepth; i++)
+        mBuffers.push_back(pooled ? XvdPoolAcquire() : (uint8_t*)aligned_alloc(XVD_PAGE_SIZE, mMaxRequestSize));
+
+    if(use_io_uring && SetupIoUring())
+        mEngine = XVD_IO_ENGINE_IO_URING;
+}
+
+XvdAsyncReader::~XvdAsyncReader()
+{
+    TeardownIoUring();
+    bool pooled = mMaxRequestSize <= XVD_POOL_CHUNK_SIZE;
+    for(auto buffer : mBuffers)
+        pooled ? XvdPoolRelease(buffer) : free(buffer);
+}
+
+const char* XvdAsyncReader::EngineName() const
+{
+    return mEngine == XVD_IO_ENGINE_IO_URING ? "io_uring" : "pread";
+}
+
+bool XvdAsyncReader::SetupIoUring()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // Every read in flight owns one buffer, so the rings never need more than queue_depth entries
+    mRingFd = IoUringSetup(mQueueDepth, &params);
+    if(mRingFd < 0)
+    {
+        mRingFd = -1;
+        return false; // ENOSYS, EPERM (seccomp / sysctl)... just use pread()
+    }
+
+    mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    mCqRingSize = params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe);
+    mSqesSize   = params.sq_entries * sizeof(io_uring_sqe);
+
+    // Since 5.4 both rings live in a single mapping
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap)
+        mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+
+    mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+    if(mSqRing == MAP_FAILED)
+    {
+        mSqRing = nullptr;
+        TeardownIoUring();
+        return false;
+    }
+
+    if(single_mmap)
+        mCqRing = mSqRing;
+    else
+    {
+        mCqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+        if(mCqRing == MAP_FAILED)
+        {
+            mCqRing = nullptr;
+            TeardownIoUring();
+            return false;
+        }
+    }
+
+    mSqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+    if(mSqes == MAP_FAILED)
+    {
+        mSqes = nullptr;
+        TeardownIoUring();
+        return false;
+    }
+
+    uint8_t* sq = (uint8_t*)mSqRing;
+    uint8_t* cq = (uint8_t*)mCqRing;
+    mSqHead  = (uint32_t*)(sq + params.sq_off.head);
+    mSqTail  = (uint32_t*)(sq + params.sq_off.tail);
+    mSqMask  = (uint32_t*)(sq + params.sq_off.ring_mask);
+    mSqArray = (uint32_t*)(sq + params.sq_off.array);
+    mCqHead  = (uint32_t*)(cq + params.cq_off.head);
+    mCqTail  = (uint32_t*)(cq + params.cq_off.tail);
+    mCqMask  = (uint32_t*)(cq + params.cq_off.ring_mask);
+    mCqes    = cq + params.cq_off.cqes;
+    return true;
+}
+
+void XvdAsyncReader::TeardownIoUring()
+{
+    if(mSqes)
+        munmap(mSqes, mSqesSize);
+    if(mCqRing && mCqRing != mSqRing)
+        munmap(mCqRing, mCqRingSize);
+    if(mSqRing)
+        munmap(mSqRing, mSqRingSize);
+    if(mRingFd >= 0)
+        close(mRingFd);
+
+    mSqes = mCqRing = mSqRing = nullptr;
+    mRingFd = -1;
+}
+
+bool XvdAsyncReader::Run(const std::vector<XvdReadRequest>& requests, unsigned num_consumers, const XvdReadConsumer& consumer)
+{
+    for(auto& request : requests)
+        if(request.length > mMaxRequestSize)
+            return false;
+
+    for(auto buffer : mBuffers)
+        if(buffer == nullptr)
+            return false; // Out of memory when constructing
+
+    Shared shared(requests, consumer, mBuffers);
+
+    std::vector<std::thread> consumers;
+    for(unsigned i = 0; i < num_consumers; i++)
+        consumers.emplace_back([&]{ shared.ConsumerLoop(); });
+
+    bool ok = true;
+    if(mEngine == XVD_IO_ENGINE_IO_URING)
+    {
+        // The ring is driven by this thread. Without consumer threads, it also consumes.
+        ok = RunIoUring(requests, shared, num_consumers == 0);
+        shared.Finish();
+    }
+    else if(num_consumers > 0)
+    {
+        ok = RunPread(requests, shared);
+        shared.Finish();
+    }
+    else
+    {
+        // The pread() threads can't be the ones consuming (the consumer must run on this
+        // thread), so the reads are driven from a helper thread and this one consumes.
+        std::thread io([&]{ ok = RunPread(requests, shared); shared.Finish(); });
+        shared.ConsumerLoop();
+        io.join();
+    }
+
+    for(auto& t : consumers)
+        t.join();
+
+    return ok && !shared.failed;
+}
+
+bool XvdAsyncReader::RunIoUring(const std::vector<XvdReadRequest>& requests, Shared& shared, bool consume_inline)
+{
+    // Per buffer: the request it's reading, how much is read already, its iovec, and whether
+    // the kernel owns it (a read into it was queued and its completion not reaped yet)
+    std::vector<uint64_t> buffer_request(mQueueDepth);
+    std::vector<uint64_t> buffer_done(mQueueDepth);
+    std::vector<iovec>    buffer_iov(mQueueDepth);
+    std::vector<bool>     buffer_busy(mQueueDepth, false);
+
+    // user_data of the cancel requests, so their completions aren't taken for reads
+    const uint64_t CANCEL_TAG = UINT64_MAX;
+
+    io_uring_sqe* sqes = (io_uring_sqe*)mSqes;
+    io_uring_cqe* cqes = (io_uring_cqe*)mCqes;
+
+    auto queue_read = [&](unsigned buffer)
+    {
+        const XvdReadRequest& request = requests[buffer_request[buffer]];
+        uint64_t done = buffer_done[buffer];
+        buffer_iov[buffer].iov_base = mBuffers[buffer] + done;
+        buffer_iov[buffer].iov_len  = request.length - done;
+
+        // We are the only ones writing the submission tail
+        uint32_t tail  = *mSqTail;
+        uint32_t index = tail & *mSqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = IORING_OP_READV; // READV rather than READ: works on any io_uring kernel (5.1+)
+        sqe->fd        = mFd;
+        sqe->addr      = (uint64_t)&buffer_iov[buffer];
+        sqe->len       = 1;
+        sqe->off       = request.offset + done;
+        sqe->user_data = buffer;
+        mSqArray[index] = index;
+        StoreRelease(mSqTail, tail + 1);
+    };
+
+    // The ring is broken (io_uring_enter() fails for good) but reads are still in flight into
+    // our buffers. Those are pool chunks, and other threads get them as soon as they go back,
+    // so the kernel must be done with them first: cancel what's in flight and reap every
+    // completion. If even that can't be done, the buffers are leaked instead of released
+    // (and the reader can't Run() again). Better a few MB lost than memory written behind
+    // someone else's back.
+    auto drain_in_flight = [&](unsigned in_flight)
+    {
+        for(unsigned buffer = 0; buffer < mQueueDepth; buffer++)
+        {
+            uint32_t tail = *mSqTail;
+            if(!buffer_busy[buffer] || tail - LoadAcquire(mSqHead) > *mSqMask)
+                continue; // Submission ring full, that read will just have to finish on its own
+
+            uint32_t index = tail & *mSqMask;
+            io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode    = IORING_OP_ASYNC_CANCEL; // Matches the read by its user_data
+            sqe->fd        = -1;
+            sqe->addr      = buffer;
+            sqe->user_data = CANCEL_TAG;
+            mSqArray[index] = index;
+            StoreRelease(mSqTail, tail + 1);
+        }
+
+        while(in_flight > 0)
+        {
+            uint32_t to_submit = *mSqTail - LoadAcquire(mSqHead);
+            XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+            if(IoUringEnter(mRingFd, to_submit, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                break;
+
+            uint32_t head = *mCqHead;
+            uint32_t tail = LoadAcquire(mCqTail);
+            for(; head != tail; head++)
+            {
+                uint64_t tag = cqes[head & *mCqMask].user_data;
+                if(tag == CANCEL_TAG || !buffer_busy[tag])
+                    continue;
+                buffer_busy[tag] = false;
+                in_flight--;
+                shared.Release((unsigned)tag);
+            }
+            StoreRelease(mCqHead, head);
+        }
+
+        for(unsigned buffer = 0; buffer < mQueueDepth; buffer++)
+            if(buffer_busy[buffer])
+                mBuffers[buffer] = nullptr; // Leaked on purpose, see above
+    };
+
+    uint64_t next_request = 0;
+    unsigned in_flight    = 0;
+    bool     io_error     = false;
+    while(true)
+    {
+        // 1. Fill the queue with as many reads as we have free buffers for. Only block waiting
+        //    for a buffer if there's nothing in flight (all buffers are with the consumers).
+        while(!shared.failed && !io_error && next_request < requests.size())
+        {
+            unsigned buffer;
+            if(!shared.PopFree(buffer, in_flight == 0))
+                break;
+            buffer_request[buffer] = next_request++;
+            buffer_done[buffer]    = 0;
+            buffer_busy[buffer]    = true;
+            queue_read(buffer);
+            in_flight++;
+        }
+
+        if(in_flight == 0)
+            break;
+
+        // 2. Submit whatever is pending and wait for at least one read to complete
+        uint32_t to_submit = *mSqTail - LoadAcquire(mSqHead);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(IoUringEnter(mRingFd, to_submit, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            drain_in_flight(in_flight); // The ring itself is broken. Bail, once the kernel let go of our buffers.
+            return false;
+        }
+
+        // 3. Reap the completions
+        uint32_t head = *mCqHead;
+        uint32_t tail = LoadAcquire(mCqTail);
+        for(; head != tail; head++)
+        {
+            io_uring_cqe* cqe = &cqes[head & *mCqMask];
+            unsigned buffer = (unsigned)cqe->user_data;
+            int      result = cqe->res;
+            const XvdReadRequest& request = requests[buffer_request[buffer]];
+
+            if(result == -EINTR || result == -EAGAIN)
+            {
+                queue_read(buffer); // Try again
+                continue;
+            }
+
+            if(result <= 0)
+            {
+                io_error = true; // Read error or unexpected end of file
+                in_flight--;
+                buffer_busy[buffer] = false;
+                shared.Release(buffer);
+                continue;
+            }
+
+            buffer_done[buffer] += result;
+            XVD_TRACE_COUNT(XVD_COUNTER_BYTES_READ, result);
+            if(buffer_done[buffer] < request.length)
+            {
+                queue_read(buffer); // Short read, go for the rest
+                continue;
+            }
+
+            in_flight--;
+            buffer_busy[buffer] = false;
+            Shared::Completion completion{ buffer_request[buffer], buffer };
+            if(consume_inline)
+                shared.Consume(completion);
+            else
+                shared.Deliver(completion);
+        }
+        StoreRelease(mCqHead, head);
+    }
+
+    return !io_error;
+}
+
+bool XvdAsyncReader::RunPread(const std::vector<XvdReadRequest>& requests, Shared& shared)
+{
+    std::atomic<uint64_t> next_request{0};
+    std::atomic<bool>     io_error{false};
+
+    auto reader = [&]()
+    {
+        while(!shared.failed && !io_error)
+        {
+            uint64_t index = next_request++;
+            if(index >= requests.size())
+                break;
+
+            unsigned buffer;
+            shared.PopFree(buffer, true);
+
+            const XvdReadRequest& request = requests[index];
+            uint8_t* out    = mBuffers[buffer];
+            uint64_t left   = request.length;
+            uint64_t offset = request.offset;
+            while(left > 0)
+            {
+                ssize_t done = pread(mFd, out, left, offset);
+                XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+                if(done < 0 && errno == EINTR)
+                    continue;
+                if(done <= 0)
+                    break;
+                XVD_TRACE_COUNT(XVD_COUNTER_BYTES_READ, done);
+                out    += done;
+                offset += done;
+                left   -= done;
+            }
+
+            if(left != 0)
+            {
+                io_error = true;
+                shared.Release(buffer);
+                break;
+            }
+
+            shared.Deliver({ index, buffer });
+        }
+    };
+
+    std::vector<std::thread> readers;
+    unsigned num_readers = (unsigned)std::min<uint64_t>(mQueueDepth, requests.size());
+    for(unsigned i = 0; i < num_readers; i++)
+        readers.emplace_back(reader);
+    for(auto& t : readers)
+        t.join();
+
+    return !io_error;
+}
@@ -0,0 +1,113 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDAsyncReader.h - Keeps many reads in flight and     */
+/*                     hands the finished buffers to      */
+/*                     consumer threads.                  */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <functional>
+#include <span>
+#include <vector>
+
+///////////////////////////////////////
+// Constants
+///////////////////////////////////////
+#define XVD_ASYNC_DEFAULT_QUEUE_DEPTH   32
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+enum XvdIoEngine
+{
+    XVD_IO_ENGINE_IO_URING = 0,  // Linux io_uring (raw syscalls, no liburing needed)
+    XVD_IO_ENGINE_PREAD    = 1   // Pool of threads doing plain pread()
+};
+
+// One read: 'length' bytes at 'offset' of the file. 'length' can't be bigger than the
+// max_request_size the reader was created with.
+struct XvdReadRequest
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Called once per request when its data is in memory. 'index' is the position of the request
+// in the vector passed to Run(). The data is only valid during the call, the buffer goes
+// back to the reader right after. Return false to stop everything (e.g. on a fatal error).
+using XvdReadConsumer = std::function<bool(uint64_t index, std::span<const uint8_t> data)>;
+
+//////////////////////////////////////////
+// ASYNC READER                         //
+//////////////////////////////////////////
+
+// Reads a list of (offset, length) requests keeping up to 'queue_depth' of them in flight,
+// and delivers every completed buffer to a consumer callback, in whatever order they finish.
+// It's the "read big ranges at known offsets, then do something with the pages" part of
+// verification, extraction and decryption. One synchronous reader can't keep an NVMe drive
+// busy, it needs a deep queue of outstanding reads, which is what this does.
+//
+// io_uring is used when the kernel has it. Otherwise (old kernel, seccomp'd container...)
+// a pool of threads doing pread() is used instead, which is slower but gets the same job done.
+class XvdAsyncReader
+{
+public:
+    XvdAsyncReader(int fd, uint64_t max_request_size,
+                   unsigned queue_depth = XVD_ASYNC_DEFAULT_QUEUE_DEPTH, bool use_io_uring = true);
+    ~XvdAsyncReader();
+
+    XvdAsyncReader(const XvdAsyncReader&)            = delete;
+    XvdAsyncReader& operator=(const XvdAsyncReader&) = delete;
+
+    // Reads every request. The consumer is called from 'num_consumers' threads at the same
+    // time (so it must be thread-safe), or from the calling thread if num_consumers is 0.
+    // Returns false if any read failed or the consumer asked to stop.
+    bool Run(const std::vector<XvdReadRequest>& requests, unsigned num_consumers, const XvdReadConsumer& consumer);
+
+    XvdIoEngine Engine()     const { return mEngine; }
+    const char* EngineName() const;
+
+private:
+    struct Shared;
+    bool RunIoUring(const std::vector<XvdReadRequest>& requests, Shared& shared, bool consume_inline);
+    bool RunPread(const std::vector<XvdReadRequest>& requests, Shared& shared);
+
+    bool SetupIoUring();
+    void TeardownIoUring();
+
+    int                   mFd;
+    uint64_t              mMaxRequestSize;
+    unsigned              mQueueDepth;
+    XvdIoEngine           mEngine;
+    std::vector<uint8_t*> mBuffers;  // queue_depth page-aligned buffers of max_request_size (pooled if they fit a chunk)
+
+    // io_uring state (only when mEngine == XVD_IO_ENGINE_IO_URING)
+    int       mRingFd      = -1;
+    void*     mSqRing      = nullptr;
+    void*     mCqRing      = nullptr;
+    void*     mSqes        = nullptr;
+    size_t    mSqRingSize  = 0;
+    size_t    mCqRingSize  = 0;
+    size_t    mSqesSize    = 0;
+    uint32_t* mSqHead      = nullptr;
+    uint32_t* mSqTail      = nullptr;
+    uint32_t* mSqMask      = nullptr;
+    uint32_t* mSqArray     = nullptr;
+    uint32_t* mCqHead      = nullptr;
+    uint32_t* mCqTail      = nullptr;
+    uint32_t* mCqMask      = nullptr;
+    void*     mCqes        = nullptr;
+};
@@ -0,0 +1,324 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDBat.cpp - Scalar / SSE4.1 / AVX2 BAT scanners      */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDBat.h"
+#include "XVDTypes.h"
+#include "XVDTrace.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <string.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+
+///////////////////////////////////////
+// x86 includes
+///////////////////////////////////////
+#if defined(__x86_64__) || defined(__i386__)
+#define XVD_BAT_X86 1
+#include <immintrin.h>
+#endif
+
+/******************************************************************************************\
+                              BAT SCANNER THEORY OF OPERATION
+
+A BAT is just an array of uint32_t: XVD_INVALID_BLOCK (0xFFFFFFFF) for unallocated blocks,
+or where the block is in the file otherwise. In one pass over it we want the allocated count,
+the highest entry, a bitmap of allocated blocks and the list of extents (runs of blocks that
+are consecutive both in the virtual Drive and in the file).
+
+All of that can be derived from two bit masks per chunk of entries:
+  - alloc: bit i set if entry i != 0xFFFFFFFF
+  - cont:  bit i set if entry i continues the run of entry i-1 (both allocated and
+           entry[i] == entry[i-1] + 1)
+alloc is a compare + movemask, cont is a compare of the chunk against itself shifted by
+one entry (an unaligned load at i-1) plus one. Count is a popcount of alloc, the max is a
+lane-wise unsigned max with the unallocated lanes zeroed, and the bitmap is alloc itself.
+
+Extents are built from the masks. The common cases are handled in one step per chunk:
+a chunk fully inside a run just makes the current extent longer, a chunk with nothing
+allocated does nothing. Only chunks where runs start or end go bit by bit.
+
+\*******************************************************************************************/
+
+///////////////////////////////////////
+// Auxiliary methods
+///////////////////////////////////////
+static inline uint32_t LoadEntry(const uint8_t* bat, uint64_t index)
+{
+    uint32_t entry;
+    memcpy(&entry, bat + index * BAT_ENTRY_SIZE, sizeof(entry));
+    return entry;
+}
+
+static void ResetScan(XvdBatScan& scan, size_t num_entries)
+{
+    scan.num_entries      = num_entries;
+    scan.allocated_blocks = 0;
+    scan.max_entry        = 0;
+    scan.bitmap.assign((num_entries + 63) / 64, 0);
+    scan.extents.clear();
+}
+
+// Consumes the masks of 'n' entries starting at 'base' (base is a multiple of n, n <= 32 and a
+// divisor of 64, so the chunk never straddles two bitmap words)
+static inline void EmitChunk(XvdBatScan& scan, const uint8_t* bat, uint64_t base, unsigned n,
+                             uint32_t alloc, uint32_t cont)
+{
+    if(alloc == 0)
+        return; // Nothing here. An open extent just ends (next allocated block won't be 'cont')
+
+    uint32_t full = (n == 32) ? 0xFFFFFFFFu : ((1u << n) - 1);
+    scan.allocated_blocks += __builtin_popcount(alloc);
+    scan.bitmap[base / 64] |= (uint64_t)alloc << (base % 64);
+
+    // Whole chunk continues the current run
+    if(alloc == full && cont == full)
+    {
+        scan.extents.back().num_blocks += n;
+        return;
+    }
+
+    uint32_t starts = alloc & ~cont;
+    for(uint32_t bits = alloc; bits != 0; bits &= bits - 1)
+    {
+        unsigned i = __builtin_ctz(bits);
+        if((starts >> i) & 1)
+            scan.extents.push_back({ base + i, 1, LoadEntry(bat, base + i) });
+        else
+            scan.extents.back().num_blocks++;
+    }
+}
+
+// Plain C++ masks for entries [begin, end). Also used for the tails of the SIMD kernels.
+static void ScanRangeScalar(XvdBatScan& scan, const uint8_t* bat, uint64_t begin, uint64_t end)
+{
+    const unsigned chunk = 8;
+    for(uint64_t base = begin; base < end; base += chunk)
+    {
+        unsigned n     = (unsigned)std::min<uint64_t>(chunk, end - base);
+        uint32_t alloc = 0, cont = 0;
+        for(unsigned i = 0; i < n; i++)
+        {
+            uint64_t index = base + i;
+            uint32_t entry = LoadEntry(bat, index);
+            if(entry == (uint32_t)XVD_INVALID_BLOCK)
+                continue;
+
+            alloc |= 1u << i;
+            if(scan.max_entry < entry)
+                scan.max_entry = entry;
+
+            if(index > 0)
+            {
+                uint32_t prev = LoadEntry(bat, index - 1);
+                if(prev != (uint32_t)XVD_INVALID_BLOCK && entry == prev + 1)
+                    cont |= 1u << i;
+            }
+        }
+
+        // The chunk size only needs to divide 64 for EmitChunk(), which the tails don't
+        // guarantee, so go entry by entry when this isn't a full aligned chunk
+        if(n == chunk && base % chunk == 0)
+            EmitChunk(scan, bat, base, n, alloc, cont);
+        else
+            for(unsigned i = 0; i < n; i++)
+                EmitChunk(scan, bat, base + i, 1, (alloc >> i) & 1, (cont >> i) & 1);
+    }
+}
+
+//////////////////////////////////////////
+// SSE4.1 KERNEL (4 entries at once)    //
+//////////////////////////////////////////
+#ifdef XVD_BAT_X86
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+static void ScanBatSse41(XvdBatScan& scan, const uint8_t* bat, uint64_t num_entries)
+{
+    const __m128i invalid = _mm_set1_epi32(-1);
+    const __m128i one     = _mm_set1_epi32(1);
+    __m128i max_v = _mm_setzero_si128();
+
+    // The first entry has no previous one, so chunk 0 goes through the scalar path
+    uint64_t simd_end = num_entries & ~3ull;
+    uint64_t start    = std::min<uint64_t>(4, simd_end);
+    ScanRangeScalar(scan, bat, 0, start);
+
+    uint32_t prev_alloc = start ? ((scan.bitmap[0] >> (start - 1)) & 1) : 0;
+    for(uint64_t base = start; base < simd_end; base += 4)
+    {
+        __m128i v    = _mm_loadu_si128((const __m128i*)(bat + base * BAT_ENTRY_SIZE));
+        __m128i prev = _mm_loadu_si128((const __m128i*)(bat + (base - 1) * BAT_ENTRY_SIZE));
+        __m128i inv  = _mm_cmpeq_epi32(v, invalid);
+        __m128i seq  = _mm_cmpeq_epi32(v, _mm_add_epi32(prev, one));
+
+        uint32_t alloc = ~(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(inv)) & 0xF;
+        uint32_t cont  = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(seq)) & alloc & ((alloc << 1) | prev_alloc);
+        max_v = _mm_max_epu32(max_v, _mm_andnot_si128(inv, v));
+
+        EmitChunk(scan, bat, base, 4, alloc, cont);
+        prev_alloc = alloc >> 3;
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, max_v);
+    for(auto lane : lanes)
+        scan.max_entry = std::max(scan.max_entry, lane);
+
+    ScanRangeScalar(scan, bat, std::max(start, simd_end), num_entries);
+}
+
+#pragma GCC pop_options
+
+//////////////////////////////////////////
+// AVX2 KERNEL (8 entries at once)      //
+//////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static void ScanBatAvx2(XvdBatScan& scan, const uint8_t* bat, uint64_t num_entries)
+{
+    const __m256i invalid = _mm256_set1_epi32(-1);
+    const __m256i one     = _mm256_set1_epi32(1);
+    __m256i max_v = _mm256_setzero_si256();
+
+    uint64_t simd_end = num_entries & ~7ull;
+    uint64_t start    = std::min<uint64_t>(8, simd_end);
+    ScanRangeScalar(scan, bat, 0, start);
+
+    uint32_t prev_alloc = start ? ((scan.bitmap[0] >> (start - 1)) & 1) : 0;
+    for(uint64_t base = start; base < simd_end; base += 8)
+    {
+        __m256i v    = _mm256_loadu_si256((const __m256i*)(bat + base * BAT_ENTRY_SIZE));
+        __m256i prev = _mm256_loadu_si256((const __m256i*)(bat + (base - 1) * BAT_ENTRY_SIZE));
+        __m256i inv  = _mm256_cmpeq_epi32(v, invalid);
+        __m256i seq  = _mm256_cmpeq_epi32(v, _mm256_add_epi32(prev, one));
+
+        uint32_t alloc = ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(inv)) & 0xFF;
+        uint32_t cont  = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(seq)) & alloc & ((alloc << 1) | prev_alloc);
+        max_v = _mm256_max_epu32(max_v, _mm256_andnot_si256(inv, v));
+
+        EmitChunk(scan, bat, base, 8, alloc, cont);
+        prev_alloc = alloc >> 7;
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, max_v);
+    for(auto lane : lanes)
+        scan.max_entry = std::max(scan.max_entry, lane);
+
+    ScanRangeScalar(scan, bat, std::max(start, simd_end), num_entries);
+}
+
+#pragma GCC pop_options
+#endif // XVD_BAT_X86
+
+//////////////////////////////////////////
+// DISPATCH                             //
+//////////////////////////////////////////
+bool BatScanKernelSupported(BatScanKernel kernel)
+{
+    switch(kernel)
+    {
+        case BAT_SCAN_KERNEL_SCALAR: return true;
+#ifdef XVD_BAT_X86
+        // GCC's builtins already take care of checking the OS saves the AVX registers
+        case BAT_SCAN_KERNEL_SSE41:  return __builtin_cpu_supports("sse4.1");
+        case BAT_SCAN_KERNEL_AVX2:   return __builtin_cpu_supports("avx2");
+#endif
+        default:                     return false;
+    }
+}
+
+const char* BatScanKernelName(BatScanKernel kernel)
+{
+    switch(kernel)
+    {
+        case BAT_SCAN_KERNEL_SCALAR: return "Scalar";
+        case BAT_SCAN_KERNEL_SSE41:  return "SSE4.1 (x4)";
+        case BAT_SCAN_KERNEL_AVX2:   return "AVX2 (x8)";
+        default:                     return "UNKNOWN";
+    }
+}
+
+void ScanBatWithKernel(BatScanKernel kernel, const uint8_t* bat, size_t num_entries, XvdBatScan& scan)
+{
+    ResetScan(scan, num_entries);
+    if(!BatScanKernelSupported(kernel))
+        kernel = BAT_SCAN_KERNEL_SCALAR;
+
+    switch(kernel)
+    {
+#ifdef XVD_BAT_X86
+        case BAT_SCAN_KERNEL_SSE41: ScanBatSse41(scan, bat, num_entries); break;
+        case BAT_SCAN_KERNEL_AVX2:  ScanBatAvx2(scan, bat, num_entries);  break;
+#endif
+        default:                    ScanRangeScalar(scan, bat, 0, num_entries); break;
+    }
+}
+
+void ScanBat(const uint8_t* bat, size_t num_entries, XvdBatScan& scan)
+{
+    static BatScanKernel best = BatScanKernelSupported(BAT_SCAN_KERNEL_AVX2)  ? BAT_SCAN_KERNEL_AVX2
+                              : BatScanKernelSupported(BAT_SCAN_KERNEL_SSE41) ? BAT_SCAN_KERNEL_SSE41
+                                                                              : BAT_SCAN_KERNEL_SCALAR;
+    XVD_TRACE_SCOPE(XVD_PHASE_BAT_SCAN, num_entries * BAT_ENTRY_SIZE);
+    ScanBatWithKernel(best, bat, num_entries, scan);
+}
+
+uint64_t XvdBatScan::AllocatedInRange(uint64_t first_block, uint64_t num_blocks) const
+{
+    if(first_block >= num_entries)
+        return 0;
+    uint64_t end = std::min<uint64_t>(num_entries, first_block + num_blocks);
+
+    uint64_t count = 0;
+    for(uint64_t block = first_block; block < end; )
+    {
+        // Whole words at once when possible
+        uint64_t bit   = block % 64;
+        uint64_t take  = std::min<uint64_t>(64 - bit, end - block);
+        uint64_t word  = bitmap[block / 64] >> bit;
+        if(take < 64)
+            word &= (1ull << take) - 1;
+        count += __builtin_popcountll(word);
+        block += take;
+    }
+    return count;
+}
+
+XvdBatFragmentation XvdBatScan::Fragmentation() const
+{
+    // Consecutive extents only differ by a hole in the Drive when the second one starts in the
+    // file right where the first one ended. Otherwise reading them in order is a seek.
+    XvdBatFragmentation frag;
+    const XvdBatExtent* previous = nullptr;
+    for(const XvdBatExtent& extent : extents)
+    {
+        uint64_t previous_end = previous ? previous->first_entry + previous->num_blocks : 0;
+        if(!previous || extent.first_entry != previous_end)
+        {
+            frag.physical_runs++;
+            if(previous && extent.first_entry < previous_end)
+                frag.backward_seeks++;
+        }
+        previous = &extent;
+    }
+
+    if(allocated_blocks > 1)
+        frag.percent = 100.0 * (double)(frag.physical_runs - 1) / (double)(allocated_blocks - 1);
+    return frag;
+}
@@ -0,0 +1,88 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDBat.h - Block Allocation Table scanner             */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <vector>
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+
+// Implementations of the BAT scan. See XVDBat.cpp.
+enum BatScanKernel
+{
+    BAT_SCAN_KERNEL_SCALAR = 0,  // Plain C++, works everywhere
+    BAT_SCAN_KERNEL_SSE41  = 1,  // 4 entries at once
+    BAT_SCAN_KERNEL_AVX2   = 2,  // 8 entries at once
+    BAT_SCAN_KERNEL_COUNT
+};
+
+// A run of allocated virtual blocks that are also one after the other in the XVD file:
+// blocks [first_block, first_block + num_blocks) are BAT entries first_entry, first_entry+1...
+// This is the unit a sparse export or a sequential read can do with a single I/O.
+struct XvdBatExtent
+{
+    uint64_t first_block;
+    uint64_t num_blocks;
+    uint32_t first_entry;
+};
+
+// How far a sequential read of the virtual Drive is from a sequential read of the file.
+// Holes in the Drive don't count: reading blocks 0 and 5 when 1-4 are unallocated is still
+// sequential if they are one after the other in the file.
+struct XvdBatFragmentation
+{
+    uint64_t physical_runs  = 0;  // Runs of allocated blocks (in Drive order) that are consecutive in the file
+    uint64_t backward_seeks = 0;  // Runs that start before the end of the previous one
+    double   percent        = 0;  // (runs - 1) / (allocated - 1): 0 = sequential, 100 = a seek per block
+};
+
+// Everything the rest of the code wants to know about a BAT, computed in one pass
+struct XvdBatScan
+{
+    uint64_t                  num_entries      = 0;
+    uint64_t                  allocated_blocks = 0;
+    uint32_t                  max_entry        = 0;  // Highest mapped entry (0 if none)
+    std::vector<uint64_t>     bitmap;                // Bit N set = block N allocated
+    std::vector<XvdBatExtent> extents;               // Sorted by first_block
+
+    bool IsAllocated(uint64_t block) const
+    {
+        return block < num_entries && ((bitmap[block / 64] >> (block % 64)) & 1);
+    }
+
+    // Allocated blocks in [first_block, first_block + num_blocks), straight from the bitmap
+    uint64_t AllocatedInRange(uint64_t first_block, uint64_t num_blocks) const;
+
+    // From the extents, no need to look at the BAT again
+    XvdBatFragmentation Fragmentation() const;
+};
+
+//////////////////////////////////////////
+// BAT METHODS                          //
+//////////////////////////////////////////
+
+// Scans 'num_entries' little endian uint32_t BAT entries (no alignment required, so it can run
+// straight on a view of the mapped file). The fastest kernel the CPU supports is used.
+void ScanBat(const uint8_t* bat, size_t num_entries, XvdBatScan& scan);
+
+// Same, forcing a kernel (falls back to scalar if the CPU can't run it). For benchmarks/tests.
+void ScanBatWithKernel(BatScanKernel kernel, const uint8_t* bat, size_t num_entries, XvdBatScan& scan);
+
+bool        BatScanKernelSupported(BatScanKernel kernel);
+const char* BatScanKernelName(BatScanKernel kernel);
@@ -0,0 +1,122 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDBufferPool.cpp - Implementation of the I/O buffer  */
+/*                      pool                              */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDBufferPool.h"
+#include "XVDQueue.h"
+#include "XVDTrace.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdlib.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <atomic>
+
+/******************************************************************************************\
+                              BUFFER POOL THEORY OF OPERATION
+
+Readers, hashers, decryptors and writers all need the same thing over and over: a page
+aligned buffer for a group of 170 pages, for a very short time. Allocating one each time
+means a trip to the allocator (mmap() for something this big) plus the kernel zero filling
+fresh pages, for a buffer that is about to be overwritten anyway. So buffers come from here:
+
+- Each thread keeps up to XVD_POOL_THREAD_CACHE chunks of its own. A worker that borrows and
+  returns a chunk per group never leaves its cache: no atomics, no locks, no allocation.
+- Chunks that a thread can't keep (its cache is full, or it's a thread that only returns
+  chunks, like the writer of a pipeline) go to a shared lock-free queue (see XVDQueue.h),
+  where any thread with an empty cache picks them up.
+- Only when both are empty is a chunk allocated, and only when both are full is one freed.
+  So what's retained is bounded (XVD_POOL_MAX_SHARED plus the thread caches), and what's in
+  use is bounded by the callers, which all work in chunks, never in whole regions.
+
+When a thread exits, its cache goes to the shared queue (or is freed). The shared queue
+itself is never destroyed, so threads that exit after main() returns can still do that.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// STATE                                //
+//////////////////////////////////////////
+static std::atomic<uint64_t> sSystemAllocs{0};
+static std::atomic<uint64_t> sSystemFrees{0};
+
+static XvdBoundedQueue<uint8_t*>& SharedChunks()
+{
+    static auto* shared = new XvdBoundedQueue<uint8_t*>(XVD_POOL_MAX_SHARED);
+    return *shared;
+}
+
+static void FreeChunk(uint8_t* chunk)
+{
+    free(chunk);
+    sSystemFrees.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct XvdPoolThreadCache
+{
+    uint8_t* chunks[XVD_POOL_THREAD_CACHE];
+    unsigned count = 0;
+
+    ~XvdPoolThreadCache()
+    {
+        while(count > 0)
+        {
+            uint8_t* chunk = chunks[--count];
+            if(!SharedChunks().TryPush(chunk))
+                FreeChunk(chunk);
+        }
+    }
+};
+
+static thread_local XvdPoolThreadCache sThreadCache;
+
+//////////////////////////////////////////
+// BUFFER POOL METHODS                  //
+//////////////////////////////////////////
+uint8_t* XvdPoolAcquire()
+{
+    uint8_t* chunk = nullptr;
+    if(sThreadCache.count > 0)
+        chunk = sThreadCache.chunks[--sThreadCache.count];
+    else if(!SharedChunks().TryPop(chunk))
+    {
+        chunk = (uint8_t*)aligned_alloc(XVD_POOL_ALIGNMENT, XVD_POOL_CHUNK_SIZE);
+        if(chunk == nullptr)
+            return nullptr;
+        sSystemAllocs.fetch_add(1, std::memory_order_relaxed);
+        XVD_TRACE_COUNT(XVD_COUNTER_BUFFER_ALLOCS, 1);
+    }
+
+    return chunk;
+}
+
+void XvdPoolRelease(uint8_t* chunk)
+{
+    if(chunk == nullptr)
+        return;
+
+    if(sThreadCache.count < XVD_POOL_THREAD_CACHE)
+        sThreadCache.chunks[sThreadCache.count++] = chunk;
+    else if(!SharedChunks().TryPush(chunk))
+        FreeChunk(chunk);
+}
+
+XvdBufferPoolStats XvdBufferPoolGetStats()
+{
+    XvdBufferPoolStats stats;
+    stats.system_allocs = sSystemAllocs.load(std::memory_order_relaxed);
+    stats.system_frees  = sSystemFrees.load(std::memory_order_relaxed);
+    return stats;
+}
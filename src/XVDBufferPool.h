@@ -0,0 +1,112 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDBufferPool.h - Pool of page aligned, fixed size    */
+/*                    I/O buffers with per-thread caches  */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <span>
+
+///////////////////////////////////////
+// Constants
+///////////////////////////////////////
+
+// One chunk is a group of 170 pages: a level 0 hash page worth of data, and a block of a
+// dynamic XVD. Every bulk path works in pieces of that size (or smaller), so one chunk size
+// is enough. Page aligned, so the chunks can be used for O_DIRECT.
+#define XVD_POOL_CHUNK_SIZE      XVD_BLOCK_SIZE
+#define XVD_POOL_ALIGNMENT       XVD_PAGE_SIZE
+#define XVD_POOL_THREAD_CACHE    8      // Chunks a thread keeps for itself, no atomics at all
+#define XVD_POOL_MAX_SHARED      128    // Chunks kept for whoever needs them (~90Mb), the rest is freed
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+struct XvdBufferPoolStats
+{
+    uint64_t system_allocs;  // Chunks that had to be allocated (not served from a cache)
+    uint64_t system_frees;   // Chunks given back to the system (caches full)
+};
+
+//////////////////////////////////////////
+// BUFFER POOL                          //
+//////////////////////////////////////////
+
+// Borrows a chunk of XVD_POOL_CHUNK_SIZE bytes, XVD_POOL_ALIGNMENT aligned. It is NOT zero
+// filled (it usually holds whatever the last user left). nullptr if out of memory.
+uint8_t* XvdPoolAcquire();
+
+// Gives a chunk from XvdPoolAcquire() back. Can be called from any thread, nullptr is fine.
+void XvdPoolRelease(uint8_t* chunk);
+
+XvdBufferPoolStats XvdBufferPoolGetStats();
+
+// Owns one borrowed chunk, gives it back when it goes out of scope. Move-only.
+class XvdPoolChunk
+{
+public:
+    XvdPoolChunk() = default;
+    ~XvdPoolChunk() { Release(); }
+
+    XvdPoolChunk(const XvdPoolChunk&)            = delete;
+    XvdPoolChunk& operator=(const XvdPoolChunk&) = delete;
+    XvdPoolChunk(XvdPoolChunk&& other) noexcept : mData(other.mData) { other.mData = nullptr; }
+    XvdPoolChunk& operator=(XvdPoolChunk&& other) noexcept
+    {
+        if(this != &other)
+        {
+            Release();
+            mData       = other.mData;
+            other.mData = nullptr;
+        }
+        return *this;
+    }
+
+    // Borrows a chunk if there is none yet. False if out of memory.
+    bool Acquire()
+    {
+        if(mData == nullptr)
+            mData = XvdPoolAcquire();
+        return mData != nullptr;
+    }
+
+    void Release()
+    {
+        XvdPoolRelease(mData);
+        mData = nullptr;
+    }
+
+    uint8_t*           data()  const { return mData; }
+    static constexpr size_t size()   { return XVD_POOL_CHUNK_SIZE; }
+    std::span<uint8_t> span()  const { return { mData, mData ? size() : 0 }; }
+    explicit operator bool()   const { return mData != nullptr; }
+
+private:
+    uint8_t* mData = nullptr;
+};
+
+// Borrowed chunk, empty (false) if out of memory
+static inline XvdPoolChunk XvdBorrowChunk()
+{
+    XvdPoolChunk chunk;
+    chunk.Acquire();
+    return chunk;
+}
@@ -0,0 +1,447 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDBuilder.cpp - Creation of fixed and dynamic XVDs   */
+/*                   from a raw Drive image               */
+/*                                                        */
+/**********************************************************/
+
+// Suppress specific warnings from the XVD header struct define
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDBuilder.h"
+#include "XanaduXVD.h"
+#include "XVDFile.h"
+#include "XVDLog.h"
+#include "XVDProgress.h"
+#include "XVDTrace.h"
+#include "XVDSha256.h"
+#include "XVDWorkers.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+/******************************************************************************************\
+                                BUILDER THEORY OF OPERATION
+
+The layout of a new XVD is fully determined by a handful of header fields, so everything is
+computed up front, the same way XanaduXVD::ComputeLayout() will compute it when opening it:
+
+    Header (0x3000) | eXVD | HashTree | UserData | Drive                  (fixed)
+    Header (0x3000) | eXVD | HashTree | block 0: UserData, BAT | blocks    (dynamic)
+
+There is no MDU (mutable_page_num = 0) and no XVC. Level 0 of the HashTree covers every page
+from the UserData on: UserData + Drive for fixed XVDs, and as many blocks as the BAT has
+entries for dynamic ones. The first entry maps block 0 (UserData + BAT), then there's one per
+Drive block, so the tree always covers block 0 and every allocated block, in file order.
+
+A dynamic XVD only stores the blocks of the Drive that have something in them: a block of
+the image that is all zeros is left unmapped in the BAT (it reads as zeros anyway). Blocks
+that do get stored are given slots in Drive order, so the new XVD is not fragmented. Finding
+the zero blocks is cheap: a block with data usually has it in its first bytes, so only the
+zero blocks themselves are read to the end.
+
+Then it's two passes over the data:
+
+1. The HashTree, bottom up, in memory. Level 0 is one hash page per 170 data pages, which is
+   exactly a block: every worker takes a block, hashes its pages (multi-buffer SHA256 straight
+   from the mapped image) and fills its hash page. Each upper level is the same thing over the
+   level below, much smaller. The tree is ~1/170 of the data, so it fits in memory for any
+   reasonable Drive.
+2. The file, front to back in a single sequential pass: the header (with the root hash), the
+   eXVD, the HashTree, the UserData and the Drive. The eXVD, UserData and Drive are handed to
+   the kernel (XvdFile::CopyTo()), so they never go through user space, and filesystems with
+   reflinks can even share the extents with the image. Zero padding is never written, the
+   final ftruncate() leaves holes.
+
+Progress (params.progress) covers both passes: the bytes hashed plus the bytes copied. The
+zero block scan is quick next to them and only checks for a cancel.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// AUXILIARY                            //
+//////////////////////////////////////////
+static bool WriteFull(int fd, const void* src, uint64_t length, uint64_t offset)
+{
+    XVD_TRACE_SCOPE(XVD_PHASE_WRITE, length);
+    const uint8_t* p = (const uint8_t*)src;
+    while(length > 0)
+    {
+        ssize_t done = pwrite(fd, p, length, (off_t)offset);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done <= 0)
+            return false;
+        XVD_TRACE_COUNT(XVD_COUNTER_BYTES_WRITTEN, done);
+        p      += done;
+        offset += done;
+        length -= done;
+    }
+    return true;
+}
+
+// XvdFile::CopyTo() in pieces, reporting progress and checking for a cancel between them
+static bool CopyWithProgress(const XvdFile& from, int fd, uint64_t offset, uint64_t length, uint64_t out_offset,
+                             XvdProgress* progress)
+{
+    for(uint64_t done = 0; done < length; )
+    {
+        if(XvdCancelled(progress))
+            return false;
+        uint64_t chunk = std::min<uint64_t>(XVD_PROGRESS_COPY_CHUNK, length - done);
+        if(!from.CopyTo(fd, offset + done, chunk, out_offset + done))
+            return false;
+        XvdProgressAdvance(progress, chunk);
+        done += chunk;
+    }
+    return true;
+}
+
+static bool IsZeroBlock(std::span<const uint8_t> data)
+{
+    // The first non-zero byte ends it, so only blocks that really are zero are read to the end
+    const uint64_t* words = (const uint64_t*)data.data();
+    for(size_t i = 0; i < data.size() / sizeof(uint64_t); i++)
+        if(words[i] != 0)
+            return false;
+    for(size_t i = data.size() & ~(sizeof(uint64_t) - 1); i < data.size(); i++)
+        if(data[i] != 0)
+            return false;
+    return true;
+}
+
+// [offset, offset + length) of a file, zero padded past its end
+static std::span<const uint8_t> ReadPadded(const XvdFile& file, uint64_t offset, uint64_t length,
+                                           std::vector<uint8_t>& scratch)
+{
+    if(offset + length <= file.Size())
+        return file.ViewOrRead(offset, length, scratch);
+
+    scratch.assign(length, 0);
+    uint64_t available = (offset < file.Size()) ? file.Size() - offset : 0;
+    if(available > 0 && !file.Read(scratch.data(), available, offset))
+        return {};
+    return { scratch.data(), length };
+}
+
+static bool OpenOptional(XvdFile& file, const char* filename, const char* what)
+{
+    if(filename == nullptr)
+        return true;
+    if(file.Open(filename, true))
+        return true;
+    fprintf(stderr, "ERR: Failed to open %s '%s'!\n", what, filename);
+    return false;
+}
+
+//////////////////////////////////////////
+// BUILDER                              //
+//////////////////////////////////////////
+bool BuildXvd(const XvdBuildParams& params, const char* output_filename)
+{
+    XvdFile image, user_data, exvd;
+    if(params.drive_image == nullptr || !image.Open(params.drive_image, true))
+    {
+        fprintf(stderr, "ERR: Failed to open Drive image '%s'!\n", params.drive_image ? params.drive_image : "");
+        return false;
+    }
+    if(!OpenOptional(user_data, params.user_data, "UserData") || !OpenOptional(exvd, params.embedded_xvd, "embedded XVD"))
+        return false;
+
+    bool     dynamic     = params.xvd_type == XvdType::DYNAMIC;
+    uint64_t drive_size  = dynamic ? (image.Size() + XVD_BLOCK_SIZE - 1) / XVD_BLOCK_SIZE * XVD_BLOCK_SIZE
+                                   : AlignSizeToPageBoundary(image.Size());
+    uint64_t ud_length   = AlignSizeToPageBoundary(user_data.Size());
+    uint64_t exvd_length = AlignSizeToPageBoundary(exvd.Size());
+    uint64_t num_blocks  = dynamic ? drive_size / XVD_BLOCK_SIZE : 0;
+    uint64_t num_entries = dynamic ? 1 + num_blocks : 0;  // Block 0, then the Drive
+    uint64_t bat_length  = num_entries * BAT_ENTRY_SIZE;
+
+    if(drive_size == 0 || user_data.Size() > UINT32_MAX || exvd.Size() > UINT32_MAX)
+    {
+        fprintf(stderr, "ERR: The Drive image can't be empty, and UserData and eXVD must be under 4 GB\n");
+        return false;
+    }
+    if(dynamic && ud_length + bat_length > XVD_BLOCK_SIZE)
+    {
+        fprintf(stderr, "ERR: UserData (0x%llx) and BAT (0x%llx) don't fit in block 0 of a dynamic XVD\n",
+                (unsigned long long)ud_length, (unsigned long long)bat_length);
+        return false;
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // 1. Dynamic: which blocks of the Drive go in the file. slots[N] = the Drive block in slot N.
+    //    Block 0 is always there, and so is its BAT entry.
+    std::vector<uint32_t> bat(num_entries, (uint32_t)XVD_INVALID_BLOCK);
+    std::vector<uint64_t> slots(1, 0);
+    if(dynamic)
+    {
+        bat[0] = 0;
+
+        std::vector<uint8_t> has_data(num_blocks, 0);
+        std::atomic<bool>    io_error{false};
+        ParallelFor(num_blocks, params.num_threads, [&](uint64_t block)
+        {
+            if(XvdCancelled(params.progress))
+                return;
+            thread_local std::vector<uint8_t> scratch;
+            uint64_t offset = block * XVD_BLOCK_SIZE;
+            auto     data   = image.ViewOrRead(offset, std::min<uint64_t>(XVD_BLOCK_SIZE, image.Size() - offset), scratch);
+            if(data.empty())
+                io_error = true;
+            else
+                has_data[block] = !IsZeroBlock(data);
+        });
+        if(XvdCancelled(params.progress))
+            return false;
+        if(io_error)
+        {
+            fprintf(stderr, "ERR: Failed to read Drive image '%s'\n", params.drive_image);
+            return false;
+        }
+
+        for(uint64_t block = 0; block < num_blocks; block++)
+            if(has_data[block])
+            {
+                bat[1 + block] = (uint32_t)slots.size();
+                slots.push_back(block);
+            }
+    }
+
+    // Block 0 of a dynamic XVD is built in memory: UserData, then the BAT
+    std::vector<uint8_t> block0;
+    if(dynamic)
+    {
+        block0.assign(XVD_BLOCK_SIZE, 0);
+        if(user_data.Size() > 0 && !user_data.Read(block0.data(), user_data.Size(), 0))
+        {
+            fprintf(stderr, "ERR: Failed to read UserData '%s'\n", params.user_data);
+            return false;
+        }
+        memcpy(block0.data() + ud_length, bat.data(), bat_length);
+    }
+
+    // 2. The HashTree, bottom up
+    uint64_t         data_length = dynamic ? slots.size() * XVD_BLOCK_SIZE : ud_length + drive_size;
+    uint64_t         hashed      = dynamic ? num_entries * HASHES_PER_HASH_PAGE : BytesToPages(ud_length + drive_size);
+    XvdHashTreeShape shape       = XanaduXVD::HashTreeShapeFromPageNum(hashed);
+    uint64_t         tree_pages  = 0;
+    if(params.data_integrity)
+        for(uint32_t level = 0; level < shape.num_levels; level++)
+            tree_pages += shape.pages_of_level[level];
+
+    // What gets hashed and what gets copied, for the progress
+    uint64_t copy_bytes = user_data.Size() + exvd.Size() + image.Size();
+    if(dynamic)
+    {
+        copy_bytes = exvd.Size();
+        for(uint64_t slot = 1; slot < slots.size(); slot++)
+            copy_bytes += std::min<uint64_t>(XVD_BLOCK_SIZE, image.Size() - slots[slot] * XVD_BLOCK_SIZE);
+    }
+    XvdProgressOperation progress(params.progress, XVD_PROGRESS_BUILD,
+                                  (params.data_integrity ? PagesToBytes(tree_pages) + data_length : 0) + copy_bytes);
+
+    std::vector<uint8_t> tree(PagesToBytes(tree_pages), 0);
+    uint8_t              root_hash[SHA256_DIGEST_LENGTH_BYTES] = {};
+    if(params.data_integrity)
+    {
+        // Level 0: hash page N covers data pages [N * 170, N * 170 + 170), which is the Nth
+        // block of the data. Pages past the end of the file (dynamic) have no entry.
+        uint64_t          data_pages = std::min<uint64_t>(hashed, data_length / XVD_PAGE_SIZE);
+        std::atomic<bool> io_error{false};
+        ParallelFor((data_pages + HASHES_PER_HASH_PAGE - 1) / HASHES_PER_HASH_PAGE, params.num_threads, [&](uint64_t group)
+        {
+            if(XvdCancelled(params.progress))
+                return;
+            thread_local std::vector<uint8_t> scratch;
+            uint64_t num_pages = std::min<uint64_t>(HASHES_PER_HASH_PAGE, data_pages - group * HASHES_PER_HASH_PAGE);
+            uint64_t length    = PagesToBytes(num_pages);
+            uint64_t offset    = group * XVD_BLOCK_SIZE;  // In the data (from the UserData on)
+
+            std::span<const uint8_t> data;
+            if(dynamic)
+                data = (group == 0) ? std::span<const uint8_t>(block0.data(), length)
+                                    : ReadPadded(image, slots[group] * XVD_BLOCK_SIZE, length, scratch);
+            else if(offset >= ud_length)
+                data = ReadPadded(image, offset - ud_length, length, scratch);
+            else
+            {
+                // Straddles the UserData and the Drive
+                std::vector<uint8_t> piece;
+                uint64_t in_ud = std::min<uint64_t>(length, ud_length - offset);
+                auto     ud    = ReadPadded(user_data, offset, in_ud, piece);
+                auto     rest  = ReadPadded(image, 0, length - in_ud, scratch);
+                if(ud.empty() || (length > in_ud && rest.empty()))
+                {
+                    io_error = true;
+                    return;
+                }
+                std::vector<uint8_t> both(length);
+                memcpy(both.data(), ud.data(), in_ud);
+                memcpy(both.data() + in_ud, rest.data(), length - in_ud);
+                scratch.swap(both);
+                data = { scratch.data(), length };
+            }
+            if(data.size() != length)
+            {
+                io_error = true;
+                return;
+            }
+
+            uint8_t  digests[HASHES_PER_HASH_PAGE][SHA256_DIGEST_LENGTH_BYTES];
+            uint8_t* page = tree.data() + PagesToBytes(shape.level_start_page[0] + group);
+            Sha256Pages(data.data(), num_pages, digests);
+            for(uint64_t i = 0; i < num_pages; i++)
+                memcpy(page + i * HASH_LENGTH, digests[i], HASH_LENGTH);
+            XvdProgressAdvance(params.progress, length);
+        });
+        if(XvdCancelled(params.progress))
+            return false;
+        if(io_error)
+        {
+            fprintf(stderr, "ERR: Failed to read the data to hash\n");
+            return false;
+        }
+
+        // Levels 1 and up: the level below is already in memory, one parent page per worker item
+        for(uint32_t level = 1; level < shape.num_levels; level++)
+        {
+            uint64_t children = shape.pages_of_level[level - 1];
+            ParallelFor(shape.pages_of_level[level], params.num_threads, [&](uint64_t parent)
+            {
+                uint64_t num_children = std::min<uint64_t>(HASHES_PER_HASH_PAGE, children - parent * HASHES_PER_HASH_PAGE);
+                uint8_t  digests[HASHES_PER_HASH_PAGE][SHA256_DIGEST_LENGTH_BYTES];
+                Sha256Pages(tree.data() + PagesToBytes(shape.level_start_page[level - 1] + parent * HASHES_PER_HASH_PAGE),
+                            num_children, digests);
+                uint8_t* page = tree.data() + PagesToBytes(shape.level_start_page[level] + parent);
+                for(uint64_t i = 0; i < num_children; i++)
+                    memcpy(page + i * HASH_LENGTH, digests[i], HASH_LENGTH);
+                XvdProgressAdvance(params.progress, PagesToBytes(num_children));
+            });
+        }
+
+        Sha256(tree.data() + PagesToBytes(shape.level_start_page[shape.num_levels - 1]), XVD_PAGE_SIZE, root_hash);
+    }
+
+    std::chrono::duration<double> hash_time = std::chrono::steady_clock::now() - start_time;
+
+    // 3. The header
+    auto header = std::make_unique<XvdHeader>();
+    memset(header.get(), 0, sizeof(XvdHeader));
+    memcpy(header->magic, MAGIC, sizeof(header->magic));
+    header->format_version              = 3;
+    header->xvd_type                    = params.xvd_type;
+    header->content_type                = params.content_type;
+    header->block_size                  = XVD_BLOCK_SIZE;
+    header->drive_size                  = drive_size;
+    header->user_data_length            = (uint32_t)user_data.Size();
+    header->embedded_xvd_length         = (uint32_t)exvd.Size();
+    header->dynamic_header_length       = (uint32_t)bat_length;
+    header->flags.EncryptionDisabled    = 1;
+    header->flags.DataIntegrityDisabled = !params.data_integrity;
+    header->PackageVersionNumber        = params.package_version;
+    header->creation_time               = params.creation_time ? params.creation_time
+                                        : ((uint64_t)time(nullptr) + 11644473600ull) * 10000000ull;
+    memcpy(header->root_hash,       root_hash,         ROOT_HASH_LENGTH);
+    memcpy(header->content_id_guid, params.content_id, sizeof(header->content_id_guid));
+    memcpy(header->ProductId,       params.product_id, sizeof(header->ProductId));
+    memcpy(header->PDUID,           params.pduid,      sizeof(header->PDUID));
+
+    static const uint8_t no_id[16] = {};
+    if(memcmp(header->content_id_guid, no_id, sizeof(no_id)) == 0)
+    {
+        std::random_device random;
+        for(uint8_t& byte : header->content_id_guid)
+            byte = (uint8_t)random();
+    }
+
+    // 4. The file, front to back
+    uint64_t exvd_offset = XVD_HEADER_INCL_SIGNATURE;
+    uint64_t tree_offset = exvd_offset + exvd_length;
+    uint64_t data_offset = tree_offset + tree.size();
+    uint64_t file_size   = data_offset + (dynamic ? slots.size() * XVD_BLOCK_SIZE : ud_length + drive_size);
+
+    int fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", output_filename);
+        return false;
+    }
+
+    std::vector<uint8_t> header_page(XVD_HEADER_INCL_SIGNATURE, 0);
+    memcpy(header_page.data(), header.get(), sizeof(XvdHeader));
+    bool ok = WriteFull(fd, header_page.data(), header_page.size(), 0) &&
+              CopyWithProgress(exvd, fd, 0, exvd.Size(), exvd_offset, params.progress) &&
+              WriteFull(fd, tree.data(), tree.size(), tree_offset);
+
+    if(dynamic)
+    {
+        // Block 0, then the allocated blocks in runs that are consecutive in the image too
+        ok = ok && WriteFull(fd, block0.data(), block0.size(), data_offset);
+        for(uint64_t slot = 1; ok && slot < slots.size(); )
+        {
+            uint64_t run = 1;
+            while(slot + run < slots.size() && slots[slot + run] == slots[slot] + run)
+                run++;
+            uint64_t from   = slots[slot] * XVD_BLOCK_SIZE;
+            uint64_t length = std::min<uint64_t>(run * XVD_BLOCK_SIZE, image.Size() - from);
+            ok   = CopyWithProgress(image, fd, from, length, data_offset + slot * XVD_BLOCK_SIZE, params.progress);
+            slot += run;
+        }
+    }
+    else
+        ok = ok && CopyWithProgress(user_data, fd, 0, user_data.Size(), data_offset, params.progress) &&
+             CopyWithProgress(image, fd, 0, image.Size(), data_offset + ud_length, params.progress);
+
+    // The padding at the end
+    ok = ok && ftruncate(fd, (off_t)file_size) == 0;
+    if(close(fd) != 0)
+        ok = false;
+    if(!ok)
+    {
+        if(!XvdCancelled(params.progress))
+            fprintf(stderr, "ERR: Failed to write '%s'\n", output_filename);
+        remove(output_filename);
+        return false;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    double gbytes = (double)image.Size() / 1e9;
+    XVD_LOG(XVD_LOG_INFO, "INFO: Built %s XVD '%s': %.2f GB Drive", dynamic ? "dynamic" : "fixed", output_filename, gbytes);
+    if(dynamic)
+        XVD_LOG(XVD_LOG_INFO, " (%llu of %llu blocks stored)", (unsigned long long)(slots.size() - 1), (unsigned long long)num_blocks);
+    XVD_LOG(XVD_LOG_INFO, ", hashed in %.2f s, %.2f s total (%.2f GB/s)\n", hash_time.count(), elapsed.count(),
+           elapsed.count() > 0 ? gbytes / elapsed.count() : 0.0);
+
+    // Whatever was built must open like any other XVD
+    XanaduXVD check(output_filename);
+    if(check.Start(false, false) != 0)
+    {
+        fprintf(stderr, "ERR: '%s' doesn't pass the XVD checks, this is a bug\n", output_filename);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDBuilder.h - Creation of fixed and dynamic XVDs     */
+/*                 from a raw Drive image                 */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+
+class XvdProgress;
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+
+// What goes into the new XVD. Everything but the Drive image is optional.
+struct XvdBuildParams
+{
+    const char*    drive_image    = nullptr;              // Raw image of the Drive (padded with zeros to a page, or a block for dynamic XVDs)
+    const char*    user_data      = nullptr;              // UserData blob (e.g. a VBI)
+    const char*    embedded_xvd   = nullptr;              // Embedded XVD blob
+    XvdType        xvd_type       = XvdType::FIXED;       // Dynamic XVDs leave the all-zero blocks of the Drive out
+    XvdContentType content_type   = XvdContentType::Data;
+    bool           data_integrity = true;                 // Build a HashTree
+    uint8_t        content_id[16] = {};                   // All zeros = a random one
+    uint8_t        product_id[16] = {};
+    uint8_t        pduid[16]      = {};
+    uint64_t       package_version = 0;
+    uint64_t       creation_time  = 0;                    // FILETIME, 0 = now
+    unsigned       num_threads    = 0;                    // 0 = one per core
+    XvdProgress*   progress       = nullptr;              // Optional, to watch or cancel the build (see XVDProgress.h)
+};
+
+//////////////////////////////////////////
+// BUILDER                              //
+//////////////////////////////////////////
+
+// Creates 'output_filename' from 'params'. The XVD is unencrypted and unsigned, and laid out
+// exactly the way XanaduXVD::Start() expects it (which is checked at the end). The HashTree is
+// computed first, in parallel, then the file is written in a single pass front to back, with
+// the Drive copied from the image by the kernel (see XvdFile::CopyTo()). A cancelled build
+// returns false and leaves no output behind.
+bool BuildXvd(const XvdBuildParams& params, const char* output_filename);
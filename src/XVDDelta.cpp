@@ -0,0 +1,356 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDDelta.cpp - Binary delta patches between two       */
+/*                 versions of an XVD                     */
+/*                                                        */
+/**********************************************************/
+
+// Suppress specific warnings from the XVD header struct define
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDDelta.h"
+#include "XVDFile.h"
+#include "XVDLog.h"
+#include "XVDTrace.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h> // offsetof
+#include <string.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+/******************************************************************************************\
+                                DELTA THEORY OF OPERATION
+
+An update of a package usually changes a few files of its Drive, which means a few pages
+of the XVD, the hash pages above them and a few header fields. A delta is the new XVD
+described in terms of the old one (the base): a list of ops that, one after the other,
+produce the new file front to back:
+
+    COPY  dst_offset src_offset length   -> take those bytes from the base
+    DATA  dst_offset length <bytes>      -> take the bytes that follow in the delta
+
+XanaduXVD::CreateDelta() gets the changed pages from the HashTree guided diff (see
+XanaduXVD::Diff()), everything else is a COPY. The header, eXVD and MDU are compared byte
+by byte, so header field changes (root hash, version, ...) end up as tiny DATA ops.
+
+Applying it is a single sequential pass over the delta and over the output:
+
+- The delta is only ever read forward, so it can be piped in (e.g. straight from the
+  network) without landing on disk first.
+- COPY ops are handed to the kernel (copy_file_range(), see XvdFile::CopyTo()): the bytes
+  don't go through user space, and filesystems with reflinks just share the extents.
+- DATA ops go through a single buffer of XVD_DELTA_BUFFER_SIZE, whatever their size.
+
+The base must be exactly the one the delta was made from: its size and root hash are in the
+delta header and are checked before anything is written.
+
+The delta itself can't be trusted either (a bad download, a truncated pipe...): the header
+carries the SHA256 of the whole delta (header included, with the digest field zeroed). The
+applier hashes everything it reads as it goes, and at the end a mismatch throws the output
+away. Checking the root hash of the output against the delta header wouldn't do: both come
+from the delta, and the HashTree of the output is never recomputed here.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// AUXILIARY                            //
+//////////////////////////////////////////
+static bool ReadFull(int fd, void* dst, uint64_t length, Sha256Context* digest = nullptr)
+{
+    // Pipes hand out whatever they have, keep reading until it's all there
+    uint8_t* p = (uint8_t*)dst;
+    while(length > 0)
+    {
+        ssize_t done = read(fd, p, length);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done <= 0)
+            return false;
+        XVD_TRACE_COUNT(XVD_COUNTER_BYTES_READ, done);
+        if(digest)
+            Sha256Update(*digest, p, done);
+        p      += done;
+        length -= done;
+    }
+    return true;
+}
+
+static bool WriteFull(int fd, const void* src, uint64_t length, uint64_t offset)
+{
+    XVD_TRACE_SCOPE(XVD_PHASE_WRITE, length);
+    const uint8_t* p = (const uint8_t*)src;
+    while(length > 0)
+    {
+        ssize_t done = pwrite(fd, p, length, (off_t)offset);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done <= 0)
+            return false;
+        XVD_TRACE_COUNT(XVD_COUNTER_BYTES_WRITTEN, done);
+        p      += done;
+        offset += done;
+        length -= done;
+    }
+    return true;
+}
+
+//////////////////////////////////////////
+// DELTA WRITER                         //
+//////////////////////////////////////////
+XvdDeltaWriter::~XvdDeltaWriter()
+{
+    if(mFile)
+        fclose(mFile);
+}
+
+bool XvdDeltaWriter::Open(const char* filename, uint64_t base_size, const uint8_t base_root_hash[ROOT_HASH_LENGTH],
+                          uint64_t target_size, const uint8_t target_root_hash[ROOT_HASH_LENGTH])
+{
+    // Read back by Finish() to compute the digest
+    mFile = fopen(filename, "w+b");
+    if(!mFile)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", filename);
+        return false;
+    }
+
+    mHeader = XvdDeltaHeader{};
+    memcpy(mHeader.magic, XVD_DELTA_MAGIC, sizeof(mHeader.magic));
+    mHeader.version     = XVD_DELTA_VERSION;
+    mHeader.base_size   = base_size;
+    mHeader.target_size = target_size;
+    memcpy(mHeader.base_root_hash,   base_root_hash,   ROOT_HASH_LENGTH);
+    memcpy(mHeader.target_root_hash, target_root_hash, ROOT_HASH_LENGTH);
+
+    // The real header is written by Finish(), once the op count is known
+    mOp         = XvdDeltaOp{};
+    mOpPosition = sizeof(XvdDeltaHeader);
+    return fwrite(&mHeader, sizeof(mHeader), 1, mFile) == 1;
+}
+
+bool XvdDeltaWriter::FlushOp()
+{
+    if(mOp.length == 0)
+        return true;
+
+    // DATA ops already have their data in the file, after the space left for the op
+    bool ok;
+    if(mOp.type == XVD_DELTA_OP_DATA)
+    {
+        int64_t end = ftello(mFile);
+        ok = fseeko(mFile, mOpPosition, SEEK_SET) == 0 && fwrite(&mOp, sizeof(mOp), 1, mFile) == 1 &&
+             fseeko(mFile, end, SEEK_SET) == 0;
+        mHeader.data_length += mOp.length;
+    }
+    else
+        ok = fwrite(&mOp, sizeof(mOp), 1, mFile) == 1;
+
+    mHeader.num_ops++;
+    mOp         = XvdDeltaOp{};
+    mOpPosition = ftello(mFile);
+    return ok;
+}
+
+bool XvdDeltaWriter::Copy(uint64_t dst_offset, uint64_t src_offset, uint64_t length)
+{
+    if(length == 0)
+        return true;
+
+    if(mOp.length != 0 && mOp.type == XVD_DELTA_OP_COPY && mOp.dst_offset + mOp.length == dst_offset &&
+       mOp.src_offset + mOp.length == src_offset)
+    {
+        mOp.length += length;
+        return true;
+    }
+
+    if(!FlushOp())
+        return false;
+    mOp = { XVD_DELTA_OP_COPY, 0, dst_offset, src_offset, length };
+    return true;
+}
+
+bool XvdDeltaWriter::Data(uint64_t dst_offset, std::span<const uint8_t> data)
+{
+    if(data.empty())
+        return true;
+
+    if(mOp.length == 0 || mOp.type != XVD_DELTA_OP_DATA || mOp.dst_offset + mOp.length != dst_offset)
+    {
+        if(!FlushOp())
+            return false;
+
+        // Leave room for the op, its length is only known once the data stops coming
+        mOp = { XVD_DELTA_OP_DATA, 0, dst_offset, 0, 0 };
+        if(fwrite(&mOp, sizeof(mOp), 1, mFile) != 1)
+            return false;
+    }
+
+    mOp.length += data.size();
+    return fwrite(data.data(), 1, data.size(), mFile) == data.size();
+}
+
+bool XvdDeltaWriter::Finish()
+{
+    bool ok = FlushOp() && fflush(mFile) == 0 && fseeko(mFile, sizeof(XvdDeltaHeader), SEEK_SET) == 0;
+
+    // The digest covers the final header (digest zeroed) and everything after it. DATA ops
+    // are patched in place once their length is known, so the ops can only be hashed now,
+    // reading the delta back.
+    Sha256Context digest;
+    Sha256Init(digest);
+    memset(mHeader.digest, 0, sizeof(mHeader.digest));
+    Sha256Update(digest, (const uint8_t*)&mHeader, sizeof(mHeader));
+
+    std::vector<uint8_t> buffer(XVD_DELTA_BUFFER_SIZE);
+    for(size_t done; ok && (done = fread(buffer.data(), 1, buffer.size(), mFile)) > 0; )
+        Sha256Update(digest, buffer.data(), done);
+    ok = ok && !ferror(mFile);
+    Sha256Final(digest, mHeader.digest);
+
+    ok = ok && fseeko(mFile, 0, SEEK_SET) == 0 && fwrite(&mHeader, sizeof(mHeader), 1, mFile) == 1;
+    if(fclose(mFile) != 0)
+        ok = false;
+    mFile = nullptr;
+    return ok;
+}
+
+//////////////////////////////////////////
+// DELTA APPLIER                        //
+//////////////////////////////////////////
+bool ApplyXvdDelta(const char* base_filename, const char* delta_filename, const char* output_filename)
+{
+    bool from_stdin = strcmp(delta_filename, "-") == 0;
+    int  delta_fd   = from_stdin ? STDIN_FILENO : open(delta_filename, O_RDONLY | O_CLOEXEC);
+    if(delta_fd < 0)
+    {
+        fprintf(stderr, "ERR: Failed to open delta '%s'\n", delta_filename);
+        return false;
+    }
+
+    // Closes what was opened, and doesn't leave half an output behind
+    int  out_fd = -1;
+    auto fail   = [&](const char* reason)
+    {
+        fprintf(stderr, "ERR: Failed to apply delta '%s': %s\n", delta_filename, reason);
+        if(!from_stdin)
+            close(delta_fd);
+        if(out_fd >= 0)
+        {
+            close(out_fd);
+            remove(output_filename);
+        }
+        return false;
+    };
+
+    XvdDeltaHeader header;
+    if(!ReadFull(delta_fd, &header, sizeof(header)))
+        return fail("truncated header");
+    if(memcmp(header.magic, XVD_DELTA_MAGIC, sizeof(header.magic)) != 0)
+        return fail("not an XVD delta");
+    if(header.version != XVD_DELTA_VERSION)
+        return fail("unsupported delta version");
+
+    // Everything read from here on is hashed, to be checked against the digest at the end
+    Sha256Context digest;
+    Sha256Init(digest);
+    {
+        XvdDeltaHeader hashed = header;
+        memset(hashed.digest, 0, sizeof(hashed.digest));
+        Sha256Update(digest, (const uint8_t*)&hashed, sizeof(hashed));
+    }
+
+    // The delta only makes sense on top of the exact base it was made from
+    XvdFile base;
+    uint8_t base_root_hash[ROOT_HASH_LENGTH];
+    if(!base.Open(base_filename, false) || !base.Read(base_root_hash, ROOT_HASH_LENGTH, offsetof(XvdHeader, root_hash)))
+        return fail("can't read the base XVD");
+    if(base.Size() != header.base_size || memcmp(base_root_hash, header.base_root_hash, ROOT_HASH_LENGTH) != 0)
+        return fail("it was made for a different base XVD");
+
+    out_fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out_fd < 0)
+        return fail("can't open the output file");
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Applying delta (%llu ops, %.2f MB of new data)...\n", (unsigned long long)header.num_ops,
+           (double)header.data_length / 1e6);
+    auto start_time = std::chrono::steady_clock::now();
+
+    std::vector<uint8_t> buffer(XVD_DELTA_BUFFER_SIZE);
+    uint64_t             position = 0;
+    uint64_t             copied   = 0;
+    for(uint64_t i = 0; i < header.num_ops; i++)
+    {
+        XvdDeltaOp op;
+        if(!ReadFull(delta_fd, &op, sizeof(op), &digest))
+            return fail("truncated ops");
+
+        // Front to back, no holes, no overlaps: the output is written sequentially
+        if(op.dst_offset != position || op.length > header.target_size - position)
+            return fail("ops out of order");
+
+        if(op.type == XVD_DELTA_OP_COPY)
+        {
+            if(!base.CopyTo(out_fd, op.src_offset, op.length, op.dst_offset))
+                return fail("copy from the base failed");
+            copied += op.length;
+        }
+        else if(op.type == XVD_DELTA_OP_DATA)
+        {
+            for(uint64_t done = 0; done < op.length; )
+            {
+                uint64_t length = std::min<uint64_t>(buffer.size(), op.length - done);
+                if(!ReadFull(delta_fd, buffer.data(), length, &digest))
+                    return fail("truncated data");
+                if(!WriteFull(out_fd, buffer.data(), length, op.dst_offset + done))
+                    return fail("write failed");
+                done += length;
+            }
+        }
+        else
+            return fail("unknown op");
+
+        position += op.length;
+    }
+
+    if(position != header.target_size)
+        return fail("ops don't cover the whole XVD");
+
+    // Every byte of the delta made it intact (only now it's known: the delta is a stream)
+    uint8_t computed[SHA256_DIGEST_LENGTH_BYTES];
+    Sha256Final(digest, computed);
+    if(memcmp(computed, header.digest, sizeof(computed)) != 0)
+        return fail("the delta is corrupted (digest mismatch)");
+
+    if(close(out_fd) != 0)
+    {
+        out_fd = -1;
+        remove(output_filename);
+        return fail("write failed");
+    }
+    out_fd = -1;
+    if(!from_stdin)
+        close(delta_fd);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    XVD_LOG(XVD_LOG_INFO, "INFO: Wrote '%s': %.2f MB copied from the base, %.2f MB from the delta in %.2f s\n", output_filename,
+           (double)copied / 1e6, (double)header.data_length / 1e6, elapsed.count());
+    return true;
+}
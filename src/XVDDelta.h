@@ -0,0 +1,111 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDDelta.h - Binary delta patches between two         */
+/*               versions of an XVD                       */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+#include "XVDSha256.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stdio.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <span>
+
+///////////////////////////////////////
+// Constants
+///////////////////////////////////////
+#define XVD_DELTA_MAGIC        "XVDDELTA"
+#define XVD_DELTA_VERSION      2
+#define XVD_DELTA_BUFFER_SIZE  (1 << 20)  // Biggest piece of new data held in memory when applying
+
+///////////////////////////////////////
+// On-disk types (little endian)
+///////////////////////////////////////
+enum XvdDeltaOpType : uint32_t
+{
+    XVD_DELTA_OP_COPY = 1,  // 'length' bytes of the base at 'src_offset'
+    XVD_DELTA_OP_DATA = 2   // 'length' bytes that follow the op in the delta
+};
+
+// Start of the delta. The ops come right after it.
+struct XvdDeltaHeader
+{
+    char     magic[8];                        // XVD_DELTA_MAGIC
+    uint32_t version;                         // XVD_DELTA_VERSION
+    uint32_t reserved;
+    uint64_t base_size;                       // The base XVD the delta applies to...
+    uint8_t  base_root_hash[ROOT_HASH_LENGTH];
+    uint64_t target_size;                     // ...and the XVD it turns it into
+    uint8_t  target_root_hash[ROOT_HASH_LENGTH];
+    uint64_t num_ops;
+    uint64_t data_length;                     // Sum of the lengths of all the DATA ops
+    uint8_t  digest[SHA256_DIGEST_LENGTH_BYTES]; // SHA256 of the whole delta, with this field zeroed
+};
+
+// Ops are sorted by 'dst_offset' and cover the target exactly once, front to back
+struct XvdDeltaOp
+{
+    uint32_t type;                            // XvdDeltaOpType
+    uint32_t reserved;
+    uint64_t dst_offset;
+    uint64_t src_offset;                      // COPY only
+    uint64_t length;
+};
+
+//////////////////////////////////////////
+// DELTA WRITER                         //
+//////////////////////////////////////////
+
+// Writes a delta one piece of the target at a time, in order. Consecutive pieces of the same
+// kind are merged into a single op (copies only when the base side is contiguous too).
+class XvdDeltaWriter
+{
+public:
+    XvdDeltaWriter() = default;
+    ~XvdDeltaWriter();
+
+    XvdDeltaWriter(const XvdDeltaWriter&)            = delete;
+    XvdDeltaWriter& operator=(const XvdDeltaWriter&) = delete;
+
+    bool Open(const char* filename, uint64_t base_size, const uint8_t base_root_hash[ROOT_HASH_LENGTH],
+              uint64_t target_size, const uint8_t target_root_hash[ROOT_HASH_LENGTH]);
+    bool Copy(uint64_t dst_offset, uint64_t src_offset, uint64_t length);
+    bool Data(uint64_t dst_offset, std::span<const uint8_t> data);
+    bool Finish();  // Writes the final header and digest. The delta is unusable until this is called.
+
+    const XvdDeltaHeader& Header() const { return mHeader; }
+
+private:
+    bool FlushOp();
+
+    FILE*          mFile = nullptr;
+    XvdDeltaHeader mHeader{};
+    XvdDeltaOp     mOp{};             // The op being built (length 0 = none)
+    int64_t        mOpPosition = 0;   // Where it goes in the file (DATA ops have their data after it)
+};
+
+//////////////////////////////////////////
+// DELTA APPLIER                        //
+//////////////////////////////////////////
+
+// Rebuilds the target XVD into 'output_filename' from its base and a delta ("-" reads the delta
+// from stdin). The output is written front to back, with the copies from the base done by the
+// kernel (copy_file_range()) and never more than XVD_DELTA_BUFFER_SIZE of new data in memory.
+// Everything read from the delta is hashed on the way, and if it doesn't match the digest
+// in its header (a corrupted delta) the output is removed and false returned.
+bool ApplyXvdDelta(const char* base_filename, const char* delta_filename, const char* output_filename);
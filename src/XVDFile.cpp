@@ -0,0 +1,449 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDFile.cpp - mmap / pread / O_DIRECT backed XVD file */
+/*                reader                                  */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDFile.h"
+#include "XVDBufferPool.h"
+#include "XVDTrace.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <future>
+
+/******************************************************************************************\
+                              DIRECT I/O THEORY OF OPERATION
+
+Verifying, extracting or decrypting a big XVD reads it once from start to end. Through the
+page cache, that means the kernel keeps every page it read "just in case", evicting whatever
+else was cached (other XVDs, the build tree, the desktop...) for data nobody reads again.
+Direct mode reads with O_DIRECT instead: straight from the device into our buffers.
+
+O_DIRECT wants the buffer, the offset and the length aligned (to the logical block size of
+the device, which is never bigger than a page on anything we care about). So:
+- The bulk paths already read whole pages at page offsets into page aligned pool chunks, so
+  their reads go straight through the direct descriptor (BulkFd(), ReadDirect()).
+- Anything else (header, BAT, a few bytes of a hash page into a std::vector...) is read into
+  a pooled bounce chunk covering the whole pages around it, and the part asked for copied
+  out. Callers never see the difference.
+- If the direct read is refused anyway (EINVAL), the normal descriptor is used. Open() also
+  tries one read before committing to direct mode, so this is just a safety net.
+
+The output side stays buffered (extents and the Drive tail aren't aligned, and the output can
+be anything), but XvdWriteBehind starts the writeback of what was written right away and
+drops it from the cache once it's on disk. So the page cache usage of an extraction stays
+around XVD_WRITE_BEHIND_BYTES, whatever the size of the XVD.
+
+\*******************************************************************************************/
+
+///////////////////////////////////////
+// Auxiliary methods
+///////////////////////////////////////
+static uint64_t PageDown(uint64_t value)
+{
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    return value & ~(page - 1);
+}
+
+static bool IsDirectAligned(uint64_t value)
+{
+    return (value % XVD_POOL_ALIGNMENT) == 0;
+}
+
+// pread() until 'length' bytes are read or the end of the file. 'got' says how many were
+// read. False on error. With O_DIRECT a short read that isn't a multiple of the alignment
+// can only be the end of the file, and reading on from there would be unaligned.
+static bool PreadAll(int fd, uint8_t* out, uint64_t length, uint64_t offset, uint64_t& got, bool direct)
+{
+    got = 0;
+    while(got < length)
+    {
+        ssize_t done = pread(fd, out + got, length - got, offset + got);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done < 0)
+            return false;
+        if(done == 0)
+            break; // End of file
+        XVD_TRACE_COUNT(XVD_COUNTER_BYTES_READ, done);
+        got += done;
+        if(direct && !IsDirectAligned(done))
+            break;
+    }
+    return true;
+}
+
+// Opening with O_DIRECT works on filesystems that then refuse every read (the alignment is
+// only checked on read), so make sure one aligned read goes through before using it
+static bool DirectReadWorks(int fd)
+{
+    XvdPoolChunk probe = XvdBorrowChunk();
+    uint64_t     got   = 0;
+    return probe && PreadAll(fd, probe.data(), XVD_PAGE_SIZE, 0, got, true);
+}
+
+static bool WriteAllAt(int fd, const uint8_t* src, uint64_t length, uint64_t offset)
+{
+    while(length > 0)
+    {
+        ssize_t done = pwrite(fd, src, length, offset);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done <= 0)
+        {
+            if(done < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        XVD_TRACE_COUNT(XVD_COUNTER_BYTES_WRITTEN, done);
+        src    += done;
+        offset += done;
+        length -= done;
+    }
+    return true;
+}
+
+//////////////////////////////////////////
+// XVD FILE METHODS                     //
+//////////////////////////////////////////
+bool XvdFile::Open(const char* filename, bool use_mmap, bool direct_io)
+{
+    Close();
+
+    mFd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(mFd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(mFd, &st) != 0)
+    {
+        Close();
+        return false;
+    }
+    mSize = (uint64_t)st.st_size;
+
+    // Direct mode: every read goes through an O_DIRECT descriptor, and nothing is mapped
+    // (a mapping reads through the page cache, which is the thing being avoided). If the
+    // filesystem doesn't do O_DIRECT, carry on in the normal mode.
+    if(direct_io)
+    {
+        mDirectFd = open(filename, O_RDONLY | O_CLOEXEC | O_DIRECT);
+        if(mDirectFd >= 0 && !DirectReadWorks(mDirectFd))
+        {
+            close(mDirectFd);
+            mDirectFd = -1;
+        }
+        if(IsDirect())
+            return true;
+    }
+
+    // Map the whole container read-only. It's only address space: pages are brought in from
+    // the page cache when they are touched. If it fails (or the file size doesn't fit in
+    // size_t) we just stay in pread() mode, that's not an error.
+    // Heads-up: if someone truncates the file while it's mapped, touching the lost pages
+    // raises SIGBUS. Don't modify an XVD with another tool while XanaduXVD has it open.
+    if(use_mmap && mSize > 0 && mSize <= (uint64_t)SIZE_MAX)
+    {
+        void* mapping = mmap(nullptr, (size_t)mSize, PROT_READ, MAP_SHARED, mFd, 0);
+        if(mapping != MAP_FAILED)
+            mMapping = (const uint8_t*)mapping;
+    }
+
+    return true;
+}
+
+void XvdFile::Close()
+{
+    if(mMapping)
+        munmap((void*)mMapping, (size_t)mSize);
+    if(mFd >= 0)
+        close(mFd);
+    if(mDirectFd >= 0)
+        close(mDirectFd);
+
+    mMapping  = nullptr;
+    mFd       = -1;
+    mDirectFd = -1;
+    mSize     = 0;
+}
+
+std::span<const uint8_t> XvdFile::View(uint64_t offset, uint64_t length) const
+{
+    // Written this way so offset+length can't overflow
+    if(!mMapping || offset > mSize || length > mSize - offset)
+        return {};
+    XVD_TRACE_COUNT(XVD_COUNTER_CACHE_HITS, 1);
+    return { mMapping + offset, (size_t)length };
+}
+
+std::span<const uint8_t> XvdFile::ViewOrRead(uint64_t offset, uint64_t length, std::vector<uint8_t>& scratch) const
+{
+    if(mMapping)
+        return View(offset, length);
+
+    if(scratch.size() < length)
+        scratch.resize(length);
+    if(!Read(scratch.data(), length, offset))
+        return {};
+    return { scratch.data(), (size_t)length };
+}
+
+std::span<const uint8_t> XvdFile::ViewOrRead(uint64_t offset, uint64_t length, XvdPoolChunk& chunk) const
+{
+    if(mMapping)
+        return View(offset, length);
+
+    if(length > chunk.size() || !chunk.Acquire() || !Read(chunk.data(), length, offset))
+        return {};
+    return { chunk.data(), (size_t)length };
+}
+
+bool XvdFile::Read(void* dst, uint64_t length, uint64_t offset) const
+{
+    if(mMapping)
+    {
+        auto view = View(offset, length);
+        if(view.size() != length)
+            return false;
+        memcpy(dst, view.data(), length);
+        return true;
+    }
+
+    // Whatever goes wrong in direct mode (EINVAL from a device that wants a bigger alignment
+    // after all, or a real I/O error), the buffered descriptor gets a go. A real error fails
+    // there too, so nothing is lost.
+    if(IsDirect() && ReadDirect((uint8_t*)dst, length, offset))
+        return true;
+
+    // pread() doesn't have a cursor, so several worker threads can read
+    // different parts of the XVD at the same time without stepping on each other.
+    uint64_t got = 0;
+    return PreadAll(mFd, (uint8_t*)dst, length, offset, got, false) && got == length; // Error or unexpected end of file
+}
+
+bool XvdFile::ReadDirect(uint8_t* dst, uint64_t length, uint64_t offset) const
+{
+    uint64_t got = 0;
+
+    // Everything aligned (the bulk paths, reading pages into pool chunks): straight in
+    if(IsDirectAligned((uint64_t)dst) && IsDirectAligned(offset) && IsDirectAligned(length))
+        return PreadAll(mDirectFd, dst, length, offset, got, true) && got == length;
+
+    // Otherwise through a bounce chunk, one chunk worth of whole pages at a time. 'skip' is
+    // the unaligned head of the first page, the unaligned tail is just not copied out.
+    XvdPoolChunk bounce = XvdBorrowChunk();
+    if(!bounce)
+        return false;
+
+    while(length > 0)
+    {
+        uint64_t start  = offset - (offset % XVD_POOL_ALIGNMENT);
+        uint64_t skip   = offset - start;
+        uint64_t wanted = std::min<uint64_t>(length, bounce.size() - skip);
+        uint64_t pages  = AlignSizeToPageBoundary(skip + wanted);
+        if(!PreadAll(mDirectFd, bounce.data(), pages, start, got, true) || got < skip + wanted)
+            return false;
+
+        memcpy(dst, bounce.data() + skip, wanted);
+        dst    += wanted;
+        offset += wanted;
+        length -= wanted;
+    }
+    return true;
+}
+
+void XvdFile::AdviseSequential(uint64_t offset, uint64_t length) const
+{
+    auto view = View(offset, length);
+    if(view.empty())
+        return;
+
+    // madvise() wants a page aligned start
+    uint64_t start = PageDown((uint64_t)view.data());
+    madvise((void*)start, (uint64_t)view.data() + view.size() - start, MADV_SEQUENTIAL);
+}
+
+void XvdFile::AdviseWillNeed(uint64_t offset, uint64_t length) const
+{
+    auto view = View(offset, length);
+    if(view.empty())
+        return;
+
+    uint64_t start = PageDown((uint64_t)view.data());
+    madvise((void*)start, (uint64_t)view.data() + view.size() - start, MADV_WILLNEED);
+}
+
+bool XvdFile::CopyTo(int out_fd, uint64_t offset, uint64_t length, uint64_t out_offset) const
+{
+    if(offset > mSize || length > mSize - offset)
+        return false;
+    XVD_TRACE_SCOPE(XVD_PHASE_WRITE, length);
+
+    // Nothing below makes a single call bigger than this, so no call blocks for too long
+    const uint64_t max_chunk = 1ull << 30;
+
+    // 1. copy_file_range(): the kernel copies page cache to page cache (or the filesystem
+    //    just shares the extents). Fails with EXDEV/EINVAL/ENOSYS/EOPNOTSUPP depending on the
+    //    kernel version and filesystems involved, in which case the next method is tried.
+    //    Explicit offsets are used so none of the file positions is touched.
+    //    Not in direct mode: the kernel would read the XVD through the page cache.
+    bool fallback = IsDirect();
+    while(length > 0 && !fallback)
+    {
+        loff_t  in_off  = (loff_t)offset;
+        loff_t  out_off = (loff_t)out_offset;
+        ssize_t done    = copy_file_range(mFd, &in_off, out_fd, &out_off, std::min(length, max_chunk), 0);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+            fallback = true;
+        else if(done <= 0)
+            return false; // Real I/O error, or the file shrank under our feet
+        else
+        {
+            XVD_TRACE_COUNT(XVD_COUNTER_BYTES_WRITTEN, done);
+            offset     += done;
+            out_offset += done;
+            length     -= done;
+        }
+    }
+    if(length == 0)
+        return true;
+
+    // 2. sendfile(): still no copy through user space. It writes at the current position of
+    //    'out_fd' (input offset is explicit), so put it where we want it first. Only files
+    //    that can seek can get here, which is always the case for our output files.
+    fallback = IsDirect() || (lseek(out_fd, (off_t)out_offset, SEEK_SET) < 0);
+    while(length > 0 && !fallback)
+    {
+        off_t   in_off = (off_t)offset;
+        ssize_t done   = sendfile(out_fd, mFd, &in_off, std::min(length, max_chunk));
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done < 0 && errno == EINTR)
+            continue;
+        if(done < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            fallback = true;
+        else if(done <= 0)
+            return false;
+        else
+        {
+            XVD_TRACE_COUNT(XVD_COUNTER_BYTES_WRITTEN, done);
+            offset     += done;
+            out_offset += done;
+            length     -= done;
+        }
+    }
+    if(length == 0)
+        return true;
+
+    // 3. Good old read/write loop. If the file is mapped the mapping is the buffer. If not,
+    //    two chunks of the buffer pool are used: the next piece is read in the background
+    //    while the current one is being written, so reading and writing overlap.
+    //    In direct mode the reads are O_DIRECT and the written pages are dropped behind.
+    const uint64_t chunk_size = XVD_POOL_CHUNK_SIZE;
+    if(mMapping)
+    {
+        while(length > 0)
+        {
+            uint64_t chunk = std::min(length, chunk_size);
+            if(!WriteAllAt(out_fd, mMapping + offset, chunk, out_offset))
+                return false;
+            offset     += chunk;
+            out_offset += chunk;
+            length     -= chunk;
+        }
+        return true;
+    }
+
+    XvdPoolChunk buffers[2] = { XvdBorrowChunk(), XvdBorrowChunk() };
+    if(!buffers[0] || !buffers[1])
+        return false;
+    XvdWriteBehind write_behind(IsDirect() ? out_fd : -1);
+    uint64_t chunk = std::min(length, chunk_size);
+    if(!Read(buffers[0].data(), chunk, offset))
+        return false;
+
+    for(int current = 0; length > 0; current ^= 1)
+    {
+        uint64_t next_offset = offset + chunk;
+        uint64_t next_chunk  = std::min(length - chunk, chunk_size);
+
+        // Prefetch the next chunk into the other buffer while this one is written out
+        std::future<bool> prefetch;
+        if(next_chunk > 0)
+            prefetch = std::async(std::launch::async, [&, next_offset, next_chunk, current]()
+            {
+                return Read(buffers[current ^ 1].data(), next_chunk, next_offset);
+            });
+
+        bool written = WriteAllAt(out_fd, buffers[current].data(), chunk, out_offset);
+        write_behind.Written(out_offset, chunk);
+        bool read_ok = (next_chunk == 0) || prefetch.get();
+        if(!written || !read_ok)
+            return false;
+
+        offset     += chunk;
+        out_offset += chunk;
+        length     -= chunk;
+        chunk       = next_chunk;
+    }
+    return true;
+}
+
+//////////////////////////////////////////
+// WRITE BEHIND METHODS                 //
+//////////////////////////////////////////
+void XvdWriteBehind::Written(uint64_t offset, uint64_t length)
+{
+    if(mFd < 0 || length == 0)
+        return;
+
+    // Get these pages on their way to the disk now, without waiting for them
+    sync_file_range(mFd, (off_t)offset, (off_t)length, SYNC_FILE_RANGE_WRITE);
+    XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+    mPending.push_back({ offset, length });
+    mPendingBytes += length;
+
+    while(mPendingBytes > XVD_WRITE_BEHIND_BYTES)
+        Drop();
+}
+
+void XvdWriteBehind::Flush()
+{
+    while(!mPending.empty())
+        Drop();
+}
+
+void XvdWriteBehind::Drop()
+{
+    auto [offset, length] = mPending.front();
+    mPending.pop_front();
+    mPendingBytes -= length;
+
+    // Dirty pages can't be dropped, so wait until they're written (by now they usually are)
+    sync_file_range(mFd, (off_t)offset, (off_t)length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(mFd, (off_t)offset, (off_t)length, POSIX_FADV_DONTNEED);
+    XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 2);
+}
@@ -0,0 +1,152 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDFile.h - Read-only access to an XVD file, memory   */
+/*              mapped when possible, pread() otherwise   */
+/*              (or O_DIRECT, bypassing the page cache).  */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <deque>
+#include <span>
+#include <utility>
+#include <vector>
+
+class XvdPoolChunk;
+
+//////////////////////////////////////////
+// XVD FILE                             //
+//////////////////////////////////////////
+
+// Read-only handle to an XVD file. When the file can be mmap'd, View() hands out spans
+// pointing straight into the page cache, so parsing the header, scanning the BAT or
+// hashing pages never copies anything. When it can't (mmap disabled, unsupported
+// filesystem, 32 bit address space too small...) everything still works through pread().
+//
+// In direct mode (see Open()) the file is never mapped, and reads bypass the page cache:
+// scanning a 100 GB XVD once doesn't evict everything else from memory on the way.
+//
+// All the const methods are safe to call from several threads at the same time.
+class XvdFile
+{
+public:
+    XvdFile() = default;
+    ~XvdFile() { Close(); }
+
+    // One handle, one owner. Moving hands the descriptor and the mapping over.
+    XvdFile(const XvdFile&)            = delete;
+    XvdFile& operator=(const XvdFile&) = delete;
+    XvdFile(XvdFile&& other) noexcept { *this = std::move(other); }
+    XvdFile& operator=(XvdFile&& other) noexcept
+    {
+        if(this != &other)
+        {
+            Close();
+            std::swap(mFd, other.mFd);
+            std::swap(mDirectFd, other.mDirectFd);
+            std::swap(mSize, other.mSize);
+            std::swap(mMapping, other.mMapping);
+        }
+        return *this;
+    }
+
+    // 'direct_io' opens a second descriptor with O_DIRECT, which every read goes through
+    // (and implies no mmap). If the filesystem doesn't support it (tmpfs, some FUSE, a
+    // device with sectors bigger than a page...) the file is opened in the normal mode
+    // anyway: check IsDirect() to know which one you got.
+    bool Open(const char* filename, bool use_mmap = true, bool direct_io = false);
+    void Close();
+
+    bool     IsOpen()   const { return mFd >= 0; }
+    bool     IsMapped() const { return mMapping != nullptr; }
+    bool     IsDirect() const { return mDirectFd >= 0; }
+    int      Fd()       const { return mFd; }
+    uint64_t Size()     const { return mSize; }
+
+    // Descriptor for bulk reads of whole pages (the async reader): the O_DIRECT one in
+    // direct mode. Reads through it must use XVD_PAGE_SIZE aligned buffers, offsets and lengths.
+    int      BulkFd()   const { return IsDirect() ? mDirectFd : mFd; }
+
+    // Zero-copy view of [offset, offset+length). Empty span if the file isn't
+    // mapped or the range isn't fully inside the file.
+    std::span<const uint8_t> View(uint64_t offset, uint64_t length) const;
+
+    // Same as View(), but if the file isn't mapped the range is pread() into 'scratch'
+    // and a span of that is returned instead. Empty span on I/O error / out of range.
+    // This is what the parsing and hashing code uses: no copies when mapped, and
+    // a reused buffer when not.
+    std::span<const uint8_t> ViewOrRead(uint64_t offset, uint64_t length, std::vector<uint8_t>& scratch) const;
+
+    // Same, but reads into a chunk of the buffer pool (borrowed only if it's needed and the
+    // chunk has none yet). For the hot paths: page aligned, and no allocation in steady state.
+    // 'length' can't be bigger than XVD_POOL_CHUNK_SIZE.
+    std::span<const uint8_t> ViewOrRead(uint64_t offset, uint64_t length, XvdPoolChunk& chunk) const;
+
+    // Copies [offset, offset+length) into 'dst'. False on I/O error or short read.
+    // In direct mode any buffer/offset/length works: whatever isn't page aligned is read
+    // through a pooled bounce buffer covering the whole pages around it.
+    bool Read(void* dst, uint64_t length, uint64_t offset) const;
+
+    // Copies [offset, offset+length) of the XVD into 'out_fd' at 'out_offset' without bouncing
+    // it through user space: copy_file_range() first (which can even share extents on
+    // filesystems with reflinks), then sendfile(), and only if the kernel refuses both, a
+    // bounded double-buffered read/write loop. Memory usage is constant whatever the size.
+    // In direct mode it's always that loop (the kernel side copies go through the page
+    // cache), with O_DIRECT reads and the written pages dropped behind (see XvdWriteBehind).
+    bool CopyTo(int out_fd, uint64_t offset, uint64_t length, uint64_t out_offset) const;
+
+    // Hints for the kernel about how a range is going to be read (no-op without a mapping)
+    void AdviseSequential(uint64_t offset, uint64_t length) const;
+    void AdviseWillNeed(uint64_t offset, uint64_t length) const;
+
+private:
+    bool ReadDirect(uint8_t* dst, uint64_t length, uint64_t offset) const;
+
+    int            mFd       = -1;
+    int            mDirectFd = -1;  // O_DIRECT descriptor, only in direct mode
+    uint64_t       mSize     = 0;
+    const uint8_t* mMapping  = nullptr;
+};
+
+//////////////////////////////////////////
+// WRITE BEHIND                         //
+//////////////////////////////////////////
+
+// Keeps the pages written to an output file from piling up in the page cache, the write side
+// of direct mode. Every Written() range gets its writeback started right away, and once more
+// than XVD_WRITE_BEHIND_BYTES are in flight the oldest ranges are waited for and dropped from
+// the cache. Writes themselves stay buffered: the output doesn't need to be aligned.
+// Does nothing if constructed with fd = -1, so callers can always have one.
+#define XVD_WRITE_BEHIND_BYTES   (8ull << 20)
+
+class XvdWriteBehind
+{
+public:
+    explicit XvdWriteBehind(int fd) : mFd(fd) {}
+    ~XvdWriteBehind() { Flush(); }
+
+    XvdWriteBehind(const XvdWriteBehind&)            = delete;
+    XvdWriteBehind& operator=(const XvdWriteBehind&) = delete;
+
+    void Written(uint64_t offset, uint64_t length);
+    void Flush(); // Waits for everything pending and drops it
+
+private:
+    void Drop();  // Oldest range
+
+    int                                        mFd;
+    std::deque<std::pair<uint64_t, uint64_t>> mPending;  // (offset, length) being written back
+    uint64_t                                   mPendingBytes = 0;
+};
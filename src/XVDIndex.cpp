@@ -0,0 +1,422 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDIndex.cpp - Persistent catalog of a library of     */
+/*                 scanned XVDs                           */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDIndex.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdio.h>
+#include <string.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <numeric>
+#include <string>
+
+/******************************************************************************************\
+                                INDEX THEORY OF OPERATION
+
+The index is what a batch scan (see XVDScan.cpp) found, saved so that the next question
+about the library doesn't have to open tens of thousands of files again. The file is laid
+out to be used straight from a read-only mapping, without parsing or loading anything:
+
+    +------------------+
+    | XvdIndexHeader   |  offsets of everything below
+    +------------------+
+    | XvdIndexRecord[] |  fixed size, sorted by (content id, ProductId, PDUID, version, path)
+    +------------------+
+    | uint32_t[]       |  record numbers sorted by (ProductId, version)
+    | uint32_t[]       |  record numbers sorted by (PDUID, version)
+    | uint32_t[]       |  record numbers sorted by (content type, creation time)
+    | uint32_t[]       |  record numbers sorted by path
+    +------------------+
+    | paths            |
+    +------------------+
+
+Every lookup is then a binary search (std::lower_bound/upper_bound) on one of those arrays:
+a handful of page faults on the mapping, microseconds even for a huge library. E.g. "every
+EraOS XVD created after X" is the range of the by-type array between (EraOS, X) and
+(EraOS, max), already sorted by date.
+
+Records of files that turned out not to be XVDs are kept too (with status NOT_XVD): they
+are what lets an update skip them next time. Lookups never return them.
+
+Updating is done by walking the tree again (cheap: readdir + stat) and comparing the size
+and mtime of every file with its record, found by path. Only the files that changed, or
+are new, are opened and scanned. The new index is written next to the old one and then
+renamed over it, which is atomic: anybody who has the old one mapped keeps using it.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// ORDERINGS                            //
+//////////////////////////////////////////
+static bool KeyLess(const XvdIndexRecord& a, std::string_view path_a, const XvdIndexRecord& b, std::string_view path_b)
+{
+    if(int c = memcmp(a.content_id, b.content_id, sizeof(a.content_id)); c != 0) return c < 0;
+    if(int c = memcmp(a.product_id, b.product_id, sizeof(a.product_id)); c != 0) return c < 0;
+    if(int c = memcmp(a.pduid,      b.pduid,      sizeof(a.pduid));      c != 0) return c < 0;
+    if(a.package_version != b.package_version) return a.package_version < b.package_version;
+    return path_a < path_b;
+}
+
+static bool IdThenVersionLess(const uint8_t* id_a, uint64_t version_a, const uint8_t* id_b, uint64_t version_b)
+{
+    if(int c = memcmp(id_a, id_b, 16); c != 0)
+        return c < 0;
+    return version_a < version_b;
+}
+
+static bool TypeThenTimeLess(const XvdIndexRecord& a, const XvdIndexRecord& b)
+{
+    if(a.content_type != b.content_type)
+        return a.content_type < b.content_type;
+    return a.creation_time < b.creation_time;
+}
+
+//////////////////////////////////////////
+// READING                              //
+//////////////////////////////////////////
+bool XvdIndex::Open(const char* filename)
+{
+    Close();
+    if(!mFile.Open(filename))
+        return false;
+
+    mData = mFile.ViewOrRead(0, mFile.Size(), mScratch);
+    if(mData.size() < sizeof(XvdIndexHeader))
+    {
+        Close();
+        return false;
+    }
+
+    auto header = (const XvdIndexHeader*)mData.data();
+    uint64_t n  = header->num_records;
+    auto fits   = [&](uint64_t offset, uint64_t length)
+    {
+        return offset % 8 == 0 && offset <= mData.size() && length <= mData.size() - offset;
+    };
+
+    if(memcmp(header->magic, XVD_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != XVD_INDEX_VERSION || header->record_size != sizeof(XvdIndexRecord) ||
+       n > UINT32_MAX ||
+       !fits(header->records_offset,    n * sizeof(XvdIndexRecord)) ||
+       !fits(header->by_product_offset, n * sizeof(uint32_t))       ||
+       !fits(header->by_pduid_offset,   n * sizeof(uint32_t))       ||
+       !fits(header->by_type_offset,    n * sizeof(uint32_t))       ||
+       !fits(header->by_path_offset,    n * sizeof(uint32_t))       ||
+       !(header->strings_offset <= mData.size() && header->strings_length <= mData.size() - header->strings_offset))
+    {
+        fprintf(stderr, "ERR: '%s' is not a valid XVD index\n", filename);
+        Close();
+        return false;
+    }
+
+    mHeader    = header;
+    mRecords   = { (const XvdIndexRecord*)(mData.data() + header->records_offset), n };
+    mByProduct = Permutation(header->by_product_offset);
+    mByPduid   = Permutation(header->by_pduid_offset);
+    mByType    = Permutation(header->by_type_offset);
+    mByPath    = Permutation(header->by_path_offset);
+
+    // A record number out of range would read out of the mapping
+    for(auto permutation : { mByProduct, mByPduid, mByType, mByPath })
+        for(uint32_t number : permutation)
+            if(number >= n)
+            {
+                fprintf(stderr, "ERR: '%s' is not a valid XVD index\n", filename);
+                Close();
+                return false;
+            }
+
+    return true;
+}
+
+void XvdIndex::Close()
+{
+    mFile.Close();
+    mScratch.clear();
+    mData    = {};
+    mHeader  = nullptr;
+    mRecords = {};
+    mByProduct = mByPduid = mByType = mByPath = {};
+}
+
+std::span<const uint32_t> XvdIndex::Permutation(uint64_t offset) const
+{
+    return { (const uint32_t*)(mData.data() + offset), mRecords.size() };
+}
+
+std::string_view XvdIndex::Path(const XvdIndexRecord& record) const
+{
+    if(record.path_offset > mHeader->strings_length || record.path_length > mHeader->strings_length - record.path_offset)
+        return {};
+    return { (const char*)mData.data() + mHeader->strings_offset + record.path_offset, record.path_length };
+}
+
+std::vector<uint32_t> XvdIndex::FindByContentId(const uint8_t id[16]) const
+{
+    // The records themselves are sorted by content id first
+    auto first = std::lower_bound(mRecords.begin(), mRecords.end(), id,
+                                  [](const XvdIndexRecord& r, const uint8_t* v) { return memcmp(r.content_id, v, 16) < 0; });
+    auto last  = std::upper_bound(first, mRecords.end(), id,
+                                  [](const uint8_t* v, const XvdIndexRecord& r) { return memcmp(v, r.content_id, 16) < 0; });
+
+    std::vector<uint32_t> found;
+    for(auto it = first; it != last; ++it)
+        if(it->status != XVD_SCAN_NOT_XVD)
+            found.push_back((uint32_t)(it - mRecords.begin()));
+
+    // Same content id but different ProductId/PDUID would break the version order
+    std::stable_sort(found.begin(), found.end(), [&](uint32_t a, uint32_t b)
+    {
+        return mRecords[a].package_version < mRecords[b].package_version;
+    });
+    return found;
+}
+
+std::vector<uint32_t> XvdIndex::FindByProductId(const uint8_t id[16]) const
+{
+    auto first = std::lower_bound(mByProduct.begin(), mByProduct.end(), id,
+                                  [&](uint32_t r, const uint8_t* v) { return memcmp(mRecords[r].product_id, v, 16) < 0; });
+    auto last  = std::upper_bound(first, mByProduct.end(), id,
+                                  [&](const uint8_t* v, uint32_t r) { return memcmp(v, mRecords[r].product_id, 16) < 0; });
+
+    std::vector<uint32_t> found;
+    for(auto it = first; it != last; ++it)
+        if(mRecords[*it].status != XVD_SCAN_NOT_XVD)
+            found.push_back(*it);
+    return found;
+}
+
+std::vector<uint32_t> XvdIndex::FindByPduid(const uint8_t id[16]) const
+{
+    auto first = std::lower_bound(mByPduid.begin(), mByPduid.end(), id,
+                                  [&](uint32_t r, const uint8_t* v) { return memcmp(mRecords[r].pduid, v, 16) < 0; });
+    auto last  = std::upper_bound(first, mByPduid.end(), id,
+                                  [&](const uint8_t* v, uint32_t r) { return memcmp(v, mRecords[r].pduid, 16) < 0; });
+
+    std::vector<uint32_t> found;
+    for(auto it = first; it != last; ++it)
+        if(mRecords[*it].status != XVD_SCAN_NOT_XVD)
+            found.push_back(*it);
+    return found;
+}
+
+std::vector<uint32_t> XvdIndex::FindByContentType(uint32_t content_type, uint64_t min_time, uint64_t max_time) const
+{
+    XvdIndexRecord low{}, high{};
+    low.content_type  = high.content_type = content_type;
+    low.creation_time = min_time;
+    high.creation_time = max_time;
+
+    auto first = std::lower_bound(mByType.begin(), mByType.end(), low,
+                                  [&](uint32_t r, const XvdIndexRecord& v) { return TypeThenTimeLess(mRecords[r], v); });
+    auto last  = std::upper_bound(first, mByType.end(), high,
+                                  [&](const XvdIndexRecord& v, uint32_t r) { return TypeThenTimeLess(v, mRecords[r]); });
+
+    std::vector<uint32_t> found;
+    for(auto it = first; it != last; ++it)
+        if(mRecords[*it].status != XVD_SCAN_NOT_XVD)
+            found.push_back(*it);
+    return found;
+}
+
+const XvdIndexRecord* XvdIndex::FindByPath(std::string_view path) const
+{
+    auto it = std::lower_bound(mByPath.begin(), mByPath.end(), path,
+                               [&](uint32_t r, std::string_view v) { return Path(mRecords[r]) < v; });
+    if(it == mByPath.end() || Path(mRecords[*it]) != path)
+        return nullptr;
+    return &mRecords[*it];
+}
+
+XvdScanRecord XvdIndex::ToScanRecord(const XvdIndexRecord& record) const
+{
+    XvdScanRecord scan;
+    scan.path             = std::string(Path(record));
+    scan.status           = (XvdScanStatus)record.status;
+    scan.file_size        = record.file_size;
+    scan.file_mtime_ns    = record.file_mtime_ns;
+    scan.format_version   = record.format_version;
+    scan.xvd_type         = record.xvd_type;
+    scan.content_type     = record.content_type;
+    scan.drive_size       = record.drive_size;
+    scan.creation_time    = record.creation_time;
+    scan.package_version  = record.package_version;
+    scan.is_signed        = record.is_signed != 0;
+    scan.allocated_blocks = record.allocated_blocks;
+    memcpy(&scan.flags,     &record.flags,     sizeof(scan.flags));
+    memcpy(scan.content_id, record.content_id, sizeof(scan.content_id));
+    memcpy(scan.product_id, record.product_id, sizeof(scan.product_id));
+    memcpy(scan.pduid,      record.pduid,      sizeof(scan.pduid));
+    return scan;
+}
+
+//////////////////////////////////////////
+// WRITING                              //
+//////////////////////////////////////////
+bool XvdIndex::Write(const char* filename, const std::vector<XvdScanRecord>& records, XvdScanLevel level)
+{
+    if(records.size() > UINT32_MAX)
+        return false;
+
+    // 1. Records and the paths
+    std::string                 strings;
+    std::vector<XvdIndexRecord> unsorted(records.size());
+    for(size_t i = 0; i < records.size(); i++)
+    {
+        const XvdScanRecord& scan = records[i];
+        XvdIndexRecord&      r    = unsorted[i];
+        memcpy(r.content_id, scan.content_id, sizeof(r.content_id));
+        memcpy(r.product_id, scan.product_id, sizeof(r.product_id));
+        memcpy(r.pduid,      scan.pduid,      sizeof(r.pduid));
+        memcpy(&r.flags,     &scan.flags,     sizeof(r.flags));
+        r.package_version  = scan.package_version;
+        r.creation_time    = scan.creation_time;
+        r.drive_size       = scan.drive_size;
+        r.file_size        = scan.file_size;
+        r.file_mtime_ns    = scan.file_mtime_ns;
+        r.allocated_blocks = scan.allocated_blocks;
+        r.content_type     = scan.content_type;
+        r.xvd_type         = scan.xvd_type;
+        r.format_version   = scan.format_version;
+        r.status           = scan.status;
+        r.is_signed        = scan.is_signed;
+        r.path_offset      = strings.size();
+        r.path_length      = scan.path.size();
+        strings.append(scan.path);
+        strings.push_back('\0');
+    }
+
+    // 2. Sort them by key
+    auto path_of = [&](const XvdIndexRecord& r) { return std::string_view(strings).substr(r.path_offset, r.path_length); };
+    std::vector<uint32_t> order(records.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+        return KeyLess(unsorted[a], path_of(unsorted[a]), unsorted[b], path_of(unsorted[b]));
+    });
+
+    std::vector<XvdIndexRecord> sorted(records.size());
+    for(size_t i = 0; i < order.size(); i++)
+        sorted[i] = unsorted[order[i]];
+
+    // 3. And the other orders, as record numbers into the sorted records
+    auto permutation = [&](auto less)
+    {
+        std::vector<uint32_t> numbers(sorted.size());
+        std::iota(numbers.begin(), numbers.end(), 0);
+        std::sort(numbers.begin(), numbers.end(), [&](uint32_t a, uint32_t b) { return less(sorted[a], sorted[b]); });
+        return numbers;
+    };
+    auto by_product = permutation([](const XvdIndexRecord& a, const XvdIndexRecord& b)
+                                  { return IdThenVersionLess(a.product_id, a.package_version, b.product_id, b.package_version); });
+    auto by_pduid   = permutation([](const XvdIndexRecord& a, const XvdIndexRecord& b)
+                                  { return IdThenVersionLess(a.pduid, a.package_version, b.pduid, b.package_version); });
+    auto by_type    = permutation(TypeThenTimeLess);
+    auto by_path    = permutation([&](const XvdIndexRecord& a, const XvdIndexRecord& b) { return path_of(a) < path_of(b); });
+
+    // 4. Lay it out (every array 8 byte aligned) and write it
+    auto align8 = [](uint64_t v) { return (v + 7) & ~7ull; };
+    uint64_t perm_length = align8(sorted.size() * sizeof(uint32_t));
+
+    XvdIndexHeader header{};
+    memcpy(header.magic, XVD_INDEX_MAGIC, sizeof(header.magic));
+    header.version           = XVD_INDEX_VERSION;
+    header.record_size       = sizeof(XvdIndexRecord);
+    header.scan_level        = level;
+    header.num_records       = sorted.size();
+    header.records_offset    = align8(sizeof(XvdIndexHeader));
+    header.by_product_offset = header.records_offset + sorted.size() * sizeof(XvdIndexRecord);
+    header.by_pduid_offset   = header.by_product_offset + perm_length;
+    header.by_type_offset    = header.by_pduid_offset + perm_length;
+    header.by_path_offset    = header.by_type_offset + perm_length;
+    header.strings_offset    = header.by_path_offset + perm_length;
+    header.strings_length    = strings.size();
+
+    std::string temp_filename = std::string(filename) + ".tmp";
+    FILE* f = fopen(temp_filename.c_str(), "wb");
+    if(!f)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", temp_filename.c_str());
+        return false;
+    }
+
+    const uint8_t padding[8] = {};
+    auto write_array = [&](const void* data, uint64_t length, uint64_t padded_length)
+    {
+        return fwrite(data, 1, length, f) == length && fwrite(padding, 1, padded_length - length, f) == padded_length - length;
+    };
+
+    bool ok = write_array(&header, sizeof(header), header.records_offset) &&
+              write_array(sorted.data(),     sorted.size() * sizeof(XvdIndexRecord), sorted.size() * sizeof(XvdIndexRecord)) &&
+              write_array(by_product.data(), by_product.size() * sizeof(uint32_t), perm_length) &&
+              write_array(by_pduid.data(),   by_pduid.size() * sizeof(uint32_t),   perm_length) &&
+              write_array(by_type.data(),    by_type.size() * sizeof(uint32_t),    perm_length) &&
+              write_array(by_path.data(),    by_path.size() * sizeof(uint32_t),    perm_length) &&
+              write_array(strings.data(),    strings.size(),                       strings.size());
+    if(fclose(f) != 0)
+        ok = false;
+
+    if(!ok || rename(temp_filename.c_str(), filename) != 0)
+    {
+        fprintf(stderr, "ERR: Failed to write index '%s'!\n", filename);
+        remove(temp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool XvdIndex::Update(const char* filename, const char* root, XvdScanLevel level, unsigned num_threads,
+                      UpdateStats& stats)
+{
+    stats = UpdateStats{};
+
+    // No index yet (or a broken one, or a shallower one) is the same as an empty one
+    XvdIndex old_index;
+    if(old_index.Open(filename) && old_index.Level() < level)
+        old_index.Close();
+
+    std::vector<XvdScanCandidate> files = ListScanCandidates(root);
+    stats.files = files.size();
+
+    std::vector<XvdScanRecord> records;
+    std::vector<std::string>   to_scan;
+    uint64_t                   still_there = 0;
+    for(XvdScanCandidate& file : files)
+    {
+        const XvdIndexRecord* old = old_index.IsOpen() ? old_index.FindByPath(file.path) : nullptr;
+        if(old)
+            still_there++;
+
+        // I/O errors are always retried, they may be gone by now
+        if(old && old->file_size == file.size && old->file_mtime_ns == file.mtime_ns && old->status != XVD_SCAN_IO_ERROR)
+            records.push_back(old_index.ToScanRecord(*old));
+        else
+            to_scan.push_back(std::move(file.path));
+    }
+    stats.unchanged = records.size();
+    stats.scanned   = to_scan.size();
+    stats.removed   = old_index.Records().size() - still_there;
+
+    std::vector<XvdScanRecord> scanned;
+    ScanXvdFiles(to_scan, level, num_threads, scanned);
+    for(XvdScanRecord& record : scanned)
+        records.push_back(std::move(record));
+
+    old_index.Close();
+    return Write(filename, records, level);
+}
@@ -0,0 +1,147 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDIndex.h - Persistent, memory mapped catalog of a   */
+/*               scanned library of XVDs                  */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDFile.h"
+#include "XVDScan.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <span>
+#include <string_view>
+#include <vector>
+
+///////////////////////////////////////
+// Constants
+///////////////////////////////////////
+#define XVD_INDEX_MAGIC   "XVDINDEX"
+#define XVD_INDEX_VERSION 1
+
+///////////////////////////////////////
+// On-disk types (little endian)
+///////////////////////////////////////
+
+// Start of the file. Every *_offset is from the start of the file.
+struct XvdIndexHeader
+{
+    char     magic[8];            // XVD_INDEX_MAGIC
+    uint32_t version;             // XVD_INDEX_VERSION
+    uint32_t record_size;         // sizeof(XvdIndexRecord)
+    uint32_t scan_level;          // XvdScanLevel the records were scanned with
+    uint32_t reserved;
+    uint64_t num_records;
+    uint64_t records_offset;      // XvdIndexRecord[num_records], sorted by key (see XVDIndex.cpp)
+    uint64_t by_product_offset;   // uint32_t[num_records], record numbers sorted by ProductId, version
+    uint64_t by_pduid_offset;     // uint32_t[num_records], record numbers sorted by PDUID, version
+    uint64_t by_type_offset;      // uint32_t[num_records], record numbers sorted by content type, creation time
+    uint64_t by_path_offset;      // uint32_t[num_records], record numbers sorted by path
+    uint64_t strings_offset;      // Paths, one after the other (NUL terminated)
+    uint64_t strings_length;
+};
+
+// One file of the library (XVD or not, see 'status')
+struct XvdIndexRecord
+{
+    uint8_t  content_id[16];      // XvdHeader::content_id_guid
+    uint8_t  product_id[16];      // XvdHeader::ProductId
+    uint8_t  pduid[16];           // XvdHeader::PDUID
+    uint64_t package_version;     // XvdHeader::PackageVersionNumber
+    uint64_t creation_time;       // FILETIME
+    uint64_t drive_size;
+    uint64_t file_size;           // These two are what tells if the file changed since it was scanned
+    int64_t  file_mtime_ns;
+    uint64_t allocated_blocks;    // Deep scans of dynamic XVDs only
+    uint32_t content_type;
+    uint32_t flags;               // XvdFlags, as stored in the header
+    uint32_t xvd_type;
+    uint32_t format_version;
+    uint32_t status;              // XvdScanStatus
+    uint32_t is_signed;
+    uint64_t path_offset;         // In the strings
+    uint64_t path_length;
+};
+
+//////////////////////////////////////////
+// INDEX                                //
+//////////////////////////////////////////
+
+// Read-only view of an index file. Lookups are binary searches straight on the mapping,
+// nothing is parsed or loaded when opening it. The record numbers returned by the lookups
+// are positions in Records().
+class XvdIndex
+{
+public:
+    XvdIndex() = default;
+
+    XvdIndex(const XvdIndex&)            = delete;
+    XvdIndex& operator=(const XvdIndex&) = delete;
+
+    bool Open(const char* filename);  // Maps the index and checks its structure
+    void Close();
+    bool IsOpen() const { return mHeader != nullptr; }
+
+    std::span<const XvdIndexRecord> Records() const { return mRecords; }
+    XvdScanLevel                    Level()   const { return (XvdScanLevel)mHeader->scan_level; }
+    std::string_view                Path(const XvdIndexRecord& record) const;
+
+    // Every record with that content id / ProductId / PDUID, sorted by package version
+    std::vector<uint32_t> FindByContentId(const uint8_t id[16]) const;
+    std::vector<uint32_t> FindByProductId(const uint8_t id[16]) const;
+    std::vector<uint32_t> FindByPduid(const uint8_t id[16]) const;
+
+    // Every record of a content type created in [min_time, max_time] (FILETIMEs), oldest first
+    std::vector<uint32_t> FindByContentType(uint32_t content_type, uint64_t min_time, uint64_t max_time) const;
+
+    // The record of a file, if it is in the index
+    const XvdIndexRecord* FindByPath(std::string_view path) const;
+
+    // Scan record <-> index record
+    XvdScanRecord ToScanRecord(const XvdIndexRecord& record) const;
+
+    // Writes an index of 'records' (any order) to 'filename'. It's written to a temporary file
+    // first and then renamed over, so readers of the old index never see a half written one.
+    static bool Write(const char* filename, const std::vector<XvdScanRecord>& records, XvdScanLevel level);
+
+    // Brings the index up to date with the files under 'root': files whose size and mtime are
+    // the same as in the index keep their record, everything else is scanned again, and files
+    // that are gone are dropped. Creates the index if it doesn't exist. Asking for a deeper
+    // level than the index was built with rescans everything.
+    struct UpdateStats
+    {
+        uint64_t files     = 0;  // Under 'root' right now
+        uint64_t unchanged = 0;  // Taken from the old index
+        uint64_t scanned   = 0;  // New or changed
+        uint64_t removed   = 0;  // In the old index but not under 'root' anymore
+    };
+    static bool Update(const char* filename, const char* root, XvdScanLevel level, unsigned num_threads,
+                       UpdateStats& stats);
+
+private:
+    std::span<const uint32_t> Permutation(uint64_t offset) const;
+
+    XvdFile                         mFile;
+    std::vector<uint8_t>            mScratch;  // The whole index, if it could not be mapped
+    std::span<const uint8_t>        mData;
+    const XvdIndexHeader*           mHeader = nullptr;
+    std::span<const XvdIndexRecord> mRecords;
+    std::span<const uint32_t>       mByProduct;
+    std::span<const uint32_t>       mByPduid;
+    std::span<const uint32_t>       mByType;
+    std::span<const uint32_t>       mByPath;
+};
@@ -0,0 +1,126 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDLayout.h - Where every region of an opened XVD     */
+/*                lives, computed once when opening it.   */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// XanaduXVD includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+#include "XVDBat.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <vector>
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+
+// Regions of an XVD, in the order they appear in the file
+enum XvdRegionId : uint32_t
+{
+    XVD_REGION_HEADER    = 0,
+    XVD_REGION_EXVD      = 1,
+    XVD_REGION_MDU       = 2,
+    XVD_REGION_HASHTREE  = 3,
+    XVD_REGION_USERDATA  = 4,
+    XVD_REGION_XVC       = 5,
+    XVD_REGION_DYNHEADER = 6,
+    XVD_REGION_DRIVE     = 7,
+    XVD_REGION_COUNT
+};
+
+static inline const char* RegionIdStr(XvdRegionId region)
+{
+    switch(region)
+    {
+        case XVD_REGION_HEADER:    return "Header";
+        case XVD_REGION_EXVD:      return "eXVD";
+        case XVD_REGION_MDU:       return "MDU";
+        case XVD_REGION_HASHTREE:  return "HashTree";
+        case XVD_REGION_USERDATA:  return "UserData";
+        case XVD_REGION_XVC:       return "XVC";
+        case XVD_REGION_DYNHEADER: return "DynHeader";
+        case XVD_REGION_DRIVE:     return "Drive";
+        default:                   return "UNKNOWN";
+    }
+}
+
+struct XvdRegion
+{
+    uint64_t offset    = 0;             // Absolute offset in the XVD file
+    uint64_t length    = 0;             // Size in the XVD file (0 = region not present)
+    uint64_t alignment = XVD_PAGE_SIZE; // Granularity of the length (DynHeader is not page aligned)
+
+    uint64_t End() const { return offset + length; }
+};
+
+//////////////////////////////////////////
+// XVD LAYOUT                           //
+//////////////////////////////////////////
+
+// Immutable snapshot of the layout of an opened XVD. XanaduXVD::ComputeLayout() fills it
+// once (reading the BAT only once for dynamic XVDs), after that everything is O(1).
+class XvdLayout
+{
+public:
+    const XvdRegion&        Region(XvdRegionId region) const { return mRegions[region]; }
+    uint64_t                Offset(XvdRegionId region) const { return mRegions[region].offset; }
+    uint64_t                Length(XvdRegionId region) const { return mRegions[region].length; }
+
+    // Size the XVD file should have according to the header (and BAT)
+    uint64_t                ComputedFileSize()         const { return mComputedFileSize; }
+
+    // HashTree
+    const XvdHashTreeShape& HashTreeShape()            const { return mHashTreeShape; }
+
+    // Dynamic XVDs only: the Drive part of the Block Allocation Table as read from disk, and
+    // what the BAT scanner found in it (allocation bitmap and extents, see XVDBat.h). The BAT
+    // on disk starts with MetadataBlocks() entries for the blocks that hold UserData, XVC and
+    // the BAT itself, the Drive entries come after them.
+    const std::vector<uint32_t>& BAT()                 const { return mBat; }
+    uint64_t                MetadataBlocks()           const { return mMetadataBlocks; }
+    uint64_t                BatDriveOffset()           const { return mRegions[XVD_REGION_DYNHEADER].offset +
+                                                                      mMetadataBlocks * BAT_ENTRY_SIZE; }
+    const XvdBatScan&       BatScan()                  const { return mBatScan; }
+    uint64_t                AllocatedBlocks()          const { return mBatScan.allocated_blocks; }
+    uint32_t                MaxBatEntry()              const { return mBatScan.max_entry; }
+    uint64_t                DynamicOccupancy()         const { return mDynamicOccupancy; }
+
+    // Dynamic XVDs only: where block 'block' of the virtual Drive lives in the file. False if
+    // the block is unallocated (reads as zeros). The BAT index of a Drive block comes after the
+    // metadata blocks (index = (metadata + virtual offset) / block size), and entries count
+    // blocks from the start of the UserData region, so an entry N means the data is N blocks
+    // after UserData (block 0 holds UserData + XVC + BAT).
+    bool DriveBlockOffset(uint64_t block, uint64_t& file_offset) const
+    {
+        if(block >= mBat.size() || mBat[block] == (uint32_t)XVD_INVALID_BLOCK)
+            return false;
+        file_offset = mRegions[XVD_REGION_USERDATA].offset + (uint64_t)mBat[block] * XVD_BLOCK_SIZE;
+        return true;
+    }
+
+private:
+    friend class XanaduXVD;
+
+    XvdRegion             mRegions[XVD_REGION_COUNT] = {};
+    uint64_t              mComputedFileSize = 0;
+    XvdHashTreeShape      mHashTreeShape{};
+    std::vector<uint32_t> mBat;
+    uint64_t              mMetadataBlocks = 0;
+    XvdBatScan            mBatScan;
+    uint64_t              mDynamicOccupancy = 0;
+};
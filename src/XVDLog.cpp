@@ -0,0 +1,44 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDLog.cpp - Implementation of the leveled logging    */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDLog.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdarg.h>
+#include <strings.h>
+
+//////////////////////////////////////////
+// LOG METHODS                          //
+//////////////////////////////////////////
+XvdLogLevel gXvdLogLevel = XVD_LOG_INFO;
+
+bool XvdLogLevelFromString(const char* name, XvdLogLevel& level)
+{
+    if(strcasecmp(name, "err") == 0)
+        level = XVD_LOG_ERR;
+    else if(strcasecmp(name, "info") == 0)
+        level = XVD_LOG_INFO;
+    else if(strcasecmp(name, "dbg") == 0)
+        level = XVD_LOG_DBG;
+    else
+        return false;
+    return true;
+}
+
+void XvdLogPrint(XvdLogLevel level, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(level == XVD_LOG_ERR ? stderr : stdout, format, args);
+    va_end(args);
+}
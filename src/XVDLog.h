@@ -0,0 +1,51 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDLog.h - Leveled logging for the INFO/DBG output    */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdio.h>
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+enum XvdLogLevel : int
+{
+    XVD_LOG_ERR  = 0,   // Errors only (stderr)
+    XVD_LOG_INFO = 1,   // + what is being done and how it went (default)
+    XVD_LOG_DBG  = 2,   // + everything XanaduXVD finds while parsing (needs debug_mode in Start() too)
+};
+
+// Messages above this level are compiled out, e.g. -DXVD_LOG_MAX_LEVEL=1 for no DBG at all
+#ifndef XVD_LOG_MAX_LEVEL
+#define XVD_LOG_MAX_LEVEL XVD_LOG_DBG
+#endif
+
+// Set once at startup (before any worker thread exists), read everywhere
+extern XvdLogLevel gXvdLogLevel;
+
+//////////////////////////////////////////
+// LOG METHODS                          //
+//////////////////////////////////////////
+
+// "err", "info" or "dbg"
+bool XvdLogLevelFromString(const char* name, XvdLogLevel& level);
+
+// Prints as is (messages carry their own "INFO: "/"DBG: " prefix), ERR to stderr, the rest to stdout
+void XvdLogPrint(XvdLogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// The arguments are not even evaluated unless the level is on, so a batch of XVDs opened
+// at the default level doesn't pay for formatting DBG lines nobody reads.
+#define XVD_LOG(level, ...)                                                \
+    do                                                                     \
+    {                                                                      \
+        if((level) <= XVD_LOG_MAX_LEVEL && (level) <= gXvdLogLevel)        \
+            XvdLogPrint((level), __VA_ARGS__);                             \
+    } while(0)
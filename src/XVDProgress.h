@@ -0,0 +1,210 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDProgress.h - Lock-free progress reporting and      */
+/*                  cancellation of long operations       */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+/******************************************************************************************\
+                                PROGRESS THEORY OF OPERATION
+
+Verifying, rebuilding, extracting, decrypting or building a 100GB package takes minutes.
+The caller (CLI, GUI) creates an XvdProgress, hands it to the operation (see
+XanaduXVD::SetProgress() and XvdBuildParams::progress), runs the operation on some thread
+and polls Snapshot() from another one as often as it likes:
+
+- The operation calls Begin() once with the phase and the bytes it's going to process,
+  and then its workers call Advance() for every chunk they finish. That's one relaxed
+  fetch_add per chunk (a group of 170 pages, a block...), nothing else.
+- Snapshot() only loads atomics, so the watcher never blocks the workers or the other way
+  around. The fields are loaded one by one, so a snapshot can be a chunk behind on one of
+  them, which doesn't matter for a progress bar.
+- Cancel() sets a flag that the operation checks at chunk boundaries. Once it sees it, the
+  workers stop picking up new chunks, the operation cleans up what it has to (e.g. removes
+  a half written output) and returns XanaduXVD's CANCELLED error (9), or false for the
+  free functions. The flag stays set until Reset(), so an operation started after a
+  Cancel() returns right away.
+
+\*******************************************************************************************/
+
+// Kernel-side copies (copy_file_range()...) are split in pieces of this size, so progress
+// moves and a cancel is seen at least every 64Mb
+#define XVD_PROGRESS_COPY_CHUNK  (64ull * 1024 * 1024)
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+enum XvdProgressPhase : uint32_t
+{
+    XVD_PROGRESS_IDLE    = 0,
+    XVD_PROGRESS_VERIFY  = 1,   // HashTree verification
+    XVD_PROGRESS_REBUILD = 2,   // HashTree rebuild
+    XVD_PROGRESS_EXTRACT = 3,   // Drive extraction (plain or verified)
+    XVD_PROGRESS_DECRYPT = 4,   // Decrypted copy
+    XVD_PROGRESS_BUILD   = 5,   // New XVD from a Drive image
+    XVD_PROGRESS_DONE    = 6,   // Last operation finished (or gave up)
+};
+
+static inline const char* ProgressPhaseStr(XvdProgressPhase phase)
+{
+    switch(phase)
+    {
+        case XVD_PROGRESS_IDLE:    return "Idle";
+        case XVD_PROGRESS_VERIFY:  return "Verifying";
+        case XVD_PROGRESS_REBUILD: return "Rebuilding HashTree";
+        case XVD_PROGRESS_EXTRACT: return "Extracting";
+        case XVD_PROGRESS_DECRYPT: return "Decrypting";
+        case XVD_PROGRESS_BUILD:   return "Building";
+        case XVD_PROGRESS_DONE:    return "Done";
+        default:                   return "UNKNOWN";
+    }
+}
+
+struct XvdProgressSnapshot
+{
+    XvdProgressPhase phase       = XVD_PROGRESS_IDLE;
+    uint64_t         bytes_done  = 0;
+    uint64_t         bytes_total = 0;
+    double           elapsed     = 0;     // Seconds since Begin()
+    bool             cancelled   = false;
+
+    uint64_t PagesDone()  const { return bytes_done / XVD_PAGE_SIZE; }
+    double   Fraction()   const { return bytes_total ? (double)bytes_done / (double)bytes_total : 0.0; }
+    double   BytesPerSecond() const { return elapsed > 0 ? bytes_done / elapsed : 0.0; }
+
+    // Seconds left at the speed so far, negative if there's no way to tell yet
+    double   Eta() const
+    {
+        if(bytes_done == 0 || elapsed <= 0)
+            return -1;
+        return elapsed * (double)(bytes_total - bytes_done) / (double)bytes_done;
+    }
+};
+
+//////////////////////////////////////////
+// PROGRESS                             //
+//////////////////////////////////////////
+class XvdProgress
+{
+public:
+    XvdProgress() = default;
+
+    // Shared by the operation and its watchers, it has to stay where it is
+    XvdProgress(const XvdProgress&)            = delete;
+    XvdProgress& operator=(const XvdProgress&) = delete;
+
+    // -- Operation side ------------------------------------------------------------------
+    void Begin(XvdProgressPhase phase, uint64_t bytes_total)
+    {
+        mBytesDone.store(0, std::memory_order_relaxed);
+        mBytesTotal.store(bytes_total, std::memory_order_relaxed);
+        mStartNs.store(NowNs(), std::memory_order_relaxed);
+        mPhase.store(phase, std::memory_order_release);
+    }
+
+    void Advance(uint64_t bytes)
+    {
+        mBytesDone.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void End()
+    {
+        mPhase.store(XVD_PROGRESS_DONE, std::memory_order_release);
+    }
+
+    bool CancelRequested() const
+    {
+        return mCancel.load(std::memory_order_relaxed);
+    }
+
+    // -- Watcher side --------------------------------------------------------------------
+    void Cancel() { mCancel.store(true, std::memory_order_relaxed); }
+    void Reset()  { mCancel.store(false, std::memory_order_relaxed); mPhase.store(XVD_PROGRESS_IDLE); }
+
+    XvdProgressSnapshot Snapshot() const
+    {
+        XvdProgressSnapshot snapshot;
+        snapshot.phase       = mPhase.load(std::memory_order_acquire);
+        snapshot.bytes_total = mBytesTotal.load(std::memory_order_relaxed);
+        snapshot.bytes_done  = std::min(mBytesDone.load(std::memory_order_relaxed), snapshot.bytes_total);
+        snapshot.cancelled   = CancelRequested();
+        if(snapshot.phase != XVD_PROGRESS_IDLE)
+            snapshot.elapsed = (NowNs() - mStartNs.load(std::memory_order_relaxed)) / 1e9;
+        return snapshot;
+    }
+
+private:
+    static uint64_t NowNs()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::atomic<XvdProgressPhase> mPhase{XVD_PROGRESS_IDLE};
+    std::atomic<uint64_t>         mBytesDone{0};
+    std::atomic<uint64_t>         mBytesTotal{0};
+    std::atomic<uint64_t>         mStartNs{0};
+    std::atomic<bool>             mCancel{false};
+};
+
+// For code that may or may not have been given an XvdProgress
+static inline void XvdProgressBegin(XvdProgress* progress, XvdProgressPhase phase, uint64_t bytes_total)
+{
+    if(progress)
+        progress->Begin(phase, bytes_total);
+}
+
+static inline void XvdProgressAdvance(XvdProgress* progress, uint64_t bytes)
+{
+    if(progress)
+        progress->Advance(bytes);
+}
+
+static inline void XvdProgressEnd(XvdProgress* progress)
+{
+    if(progress)
+        progress->End();
+}
+
+static inline bool XvdCancelled(const XvdProgress* progress)
+{
+    return progress && progress->CancelRequested();
+}
+
+// Begin() when constructed, End() when going out of scope, whichever way the operation returns
+class XvdProgressOperation
+{
+public:
+    XvdProgressOperation(XvdProgress* progress, XvdProgressPhase phase, uint64_t bytes_total) : mProgress(progress)
+    {
+        XvdProgressBegin(mProgress, phase, bytes_total);
+    }
+    ~XvdProgressOperation() { XvdProgressEnd(mProgress); }
+
+    XvdProgressOperation(const XvdProgressOperation&)            = delete;
+    XvdProgressOperation& operator=(const XvdProgressOperation&) = delete;
+
+private:
+    XvdProgress* mProgress;
+};
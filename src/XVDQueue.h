@@ -0,0 +1,172 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDQueue.h - Bounded lock-free queue connecting the   */
+/*               stages of the bulk pipelines.            */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+///////////////////////////////////////
+// x86 includes
+///////////////////////////////////////
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/******************************************************************************************\
+                              BOUNDED QUEUE THEORY OF OPERATION
+
+Dmitry Vyukov's bounded MPMC queue: a ring of cells, each one with a sequence number that
+says whose turn it is. A producer claims the cell at the enqueue position when its sequence
+equals the position, writes the value, and bumps the sequence to position + 1, which is
+what a consumer at that position is waiting for. Claiming is a single compare-and-swap on
+the position, so any number of threads can push and pop at the same time without a lock,
+and a thread that gets preempted in the middle never blocks the others.
+
+The queue has a fixed capacity, which is the whole point: a fast stage (e.g. reading from
+the page cache) can't run ahead of a slow one (e.g. writing to a slow disk) and fill the
+memory with buffers. When a queue is full/empty the blocking Push()/Pop() back off: a few
+pause instructions first (the other side is usually just about to finish), then yield the
+core, and finally short sleeps, so an idle stage doesn't burn a CPU a busy one needs.
+
+\*******************************************************************************************/
+
+// Spin -> yield -> sleep, for threads waiting on a queue
+class XvdBackoff
+{
+public:
+    void Wait()
+    {
+        if(mSpins < 64)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        }
+        else if(mSpins < 256)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        mSpins++;
+    }
+
+private:
+    unsigned mSpins = 0;
+};
+
+// Bounded multi-producer multi-consumer queue of trivially copyable values
+template <typename T>
+class XvdBoundedQueue
+{
+public:
+    // The capacity is rounded up to a power of two
+    explicit XvdBoundedQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while(size < capacity)
+            size *= 2;
+
+        mCells = std::make_unique<Cell[]>(size);
+        mMask  = size - 1;
+        for(size_t i = 0; i < size; i++)
+            mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    XvdBoundedQueue(const XvdBoundedQueue&)            = delete;
+    XvdBoundedQueue& operator=(const XvdBoundedQueue&) = delete;
+
+    bool TryPush(const T& value)
+    {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Cell&    cell = mCells[pos & mMask];
+            size_t   seq  = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0)
+            {
+                if(mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+                return false;  // Full
+            else
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool TryPop(T& value)
+    {
+        size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Cell&    cell = mCells[pos & mMask];
+            size_t   seq  = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0)
+            {
+                if(mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = cell.value;
+                    cell.sequence.store(pos + mMask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+                return false;  // Empty
+            else
+                pos = mDequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    void Push(const T& value)
+    {
+        XvdBackoff backoff;
+        while(!TryPush(value))
+            backoff.Wait();
+    }
+
+    T Pop()
+    {
+        T value;
+        XvdBackoff backoff;
+        while(!TryPop(value))
+            backoff.Wait();
+        return value;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T                   value;
+    };
+
+    std::unique_ptr<Cell[]> mCells;
+    size_t                  mMask = 0;
+
+    // On their own cache lines: producers and consumers hammer different ones
+    alignas(64) std::atomic<size_t> mEnqueuePos{0};
+    alignas(64) std::atomic<size_t> mDequeuePos{0};
+};
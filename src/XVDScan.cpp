@@ -0,0 +1,270 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDScan.cpp - Batch scanning of directory trees       */
+/*                                                        */
+/**********************************************************/
+
+// Suppress specific warnings from the XVD header struct define
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDScan.h"
+#include "XanaduXVD.h"
+#include "XVDWorkers.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+
+/******************************************************************************************\
+                                BATCH SCAN THEORY OF OPERATION
+
+An inventory of a content library (tens of thousands of packages, many of them tens of GB)
+only needs what's in the headers: ids, versions, types, sizes. So by default, for every
+file, exactly one open() + one pread() of 0x3000 bytes + one close() is done. Nothing is
+mapped, the BAT is not read, nothing else is touched. Those are small random reads, so
+what limits the speed is the latency of the disk (or the network share), not its
+bandwidth: the files are spread across more threads than cores to keep many reads in
+flight at once.
+
+The deep level (XVD_SCAN_LEVEL_LAYOUT) does a full XanaduXVD::Start() on every file that
+has the msft-xvd magic: layout computation, BAT scan of dynamic XVDs and the file size
+check. That's what the CLI does when opening a single XVD, and it costs a few more reads
+per file, so it's opt-in.
+
+Walking the tree itself is a single thread (readdir() + stat() are cheap next to the
+reads) and happens first, so the workers only have to pick the next file from a list.
+Walking and scanning are separate steps so the index (see XVDIndex.cpp) can skip the
+files that didn't change since the last scan.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// SINGLE FILE                          //
+//////////////////////////////////////////
+static bool IsSaneHeader(const XvdHeader& header)
+{
+    // Same checks IsValidHeaderFormat() does before looking at the layout
+    return (header.format_version == 2 || header.format_version == 3) &&
+           (header.xvd_type == XvdType::FIXED || header.xvd_type == XvdType::DYNAMIC) &&
+            header.block_size == XVD_BLOCK_SIZE;
+}
+
+static int64_t MtimeNs(const struct stat& st)
+{
+    return (int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+}
+
+bool ScanXvdHeader(const char* path, XvdScanRecord& record)
+{
+    record.path = path;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        record.status = XVD_SCAN_IO_ERROR;
+        return false;
+    }
+
+    // Heap, 0x3000 bytes is a lot of stack for a worker thread
+    auto    buffer = std::make_unique<uint8_t[]>(XVD_HEADER_INCL_SIGNATURE);
+    ssize_t length = pread(fd, buffer.get(), XVD_HEADER_INCL_SIGNATURE, 0);
+    struct stat st{};
+    bool stat_ok = fstat(fd, &st) == 0;
+    close(fd);
+
+    if(length < 0 || !stat_ok)
+    {
+        record.status = XVD_SCAN_IO_ERROR;
+        return false;
+    }
+
+    record.file_size     = (uint64_t)st.st_size;
+    record.file_mtime_ns = MtimeNs(st);
+    if(length < (ssize_t)(sizeof(MAGIC) + offsetof(XvdHeader, magic)) ||
+       memcmp(buffer.get() + offsetof(XvdHeader, magic), MAGIC, 8) != 0)
+    {
+        record.status = XVD_SCAN_NOT_XVD;
+        return false;
+    }
+
+    if(length != XVD_HEADER_INCL_SIGNATURE)
+    {
+        record.status = XVD_SCAN_INVALID_HEADER;
+        return true;
+    }
+
+    // NOTE: Like XanaduXVD::Start(), this assumes a little endian machine
+    auto header = std::make_unique<XvdHeader>();
+    memcpy(header.get(), buffer.get(), sizeof(XvdHeader));
+
+    uint8_t zeros[RSA_SINGATURE_SIZE] = {};
+    record.format_version  = header->format_version;
+    record.xvd_type        = header->xvd_type;
+    record.content_type    = header->content_type;
+    record.flags           = header->flags;
+    record.drive_size      = header->drive_size;
+    record.creation_time   = header->creation_time;
+    record.package_version = header->PackageVersionNumber;
+    record.is_signed       = memcmp(header->rsa_signature, zeros, RSA_SINGATURE_SIZE) != 0;
+    memcpy(record.content_id, header->content_id_guid, sizeof(record.content_id));
+    memcpy(record.product_id, header->ProductId,       sizeof(record.product_id));
+    memcpy(record.pduid,      header->PDUID,           sizeof(record.pduid));
+
+    record.status = IsSaneHeader(*header) ? XVD_SCAN_OK : XVD_SCAN_INVALID_HEADER;
+    return true;
+}
+
+static void ScanXvdLayout(XvdScanRecord& record)
+{
+    // The full thing. Not in debug mode, so it only complains on stderr.
+    XanaduXVD xvd(record.path.c_str());
+    int ret = xvd.Start(false, false);
+    if(ret == 0)
+        record.allocated_blocks = xvd.Layout().AllocatedBlocks();
+    else
+        record.status = (ret == 2) ? XVD_SCAN_IO_ERROR : XVD_SCAN_INVALID_LAYOUT;
+}
+
+//////////////////////////////////////////
+// DIRECTORY TREES                      //
+//////////////////////////////////////////
+std::vector<XvdScanCandidate> ListScanCandidates(const char* root)
+{
+    namespace fs = std::filesystem;
+
+    // Symlinked directories are not followed (loops), unreadable ones are skipped
+    std::vector<XvdScanCandidate> files;
+    auto add = [&](const std::string& path)
+    {
+        // Smaller than a header can't be an XVD, no need to open it
+        struct stat st{};
+        if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= XVD_HEADER_INCL_SIGNATURE)
+            files.push_back({ path, (uint64_t)st.st_size, MtimeNs(st) });
+    };
+
+    std::error_code ec;
+    if(fs::is_regular_file(root, ec))
+        add(root);
+    else
+    {
+        fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec), end;
+        if(ec)
+            fprintf(stderr, "ERR: Failed to open directory '%s': %s\n", root, ec.message().c_str());
+        for(; !ec && it != end; it.increment(ec))
+            if(it->is_regular_file(ec))
+                add(it->path().string());
+    }
+    return files;
+}
+
+void ScanXvdFiles(const std::vector<std::string>& paths, XvdScanLevel level, unsigned num_threads,
+                  std::vector<XvdScanRecord>& records)
+{
+    // Every file into its own slot, so no locking is needed
+    records.clear();
+    records.resize(paths.size());
+    if(num_threads == 0)
+        num_threads = std::max(DefaultWorkerCount(), (unsigned)XVD_SCAN_MIN_WORKERS);
+
+    ParallelFor(paths.size(), num_threads, [&](uint64_t i)
+    {
+        XvdScanRecord& record = records[i];
+        if(ScanXvdHeader(paths[i].c_str(), record) && level == XVD_SCAN_LEVEL_LAYOUT && record.status == XVD_SCAN_OK)
+            ScanXvdLayout(record);
+    });
+}
+
+uint64_t ScanXvdTree(const char* root, XvdScanLevel level, unsigned num_threads, std::vector<XvdScanRecord>& records)
+{
+    std::vector<std::string> paths;
+    for(auto& file : ListScanCandidates(root))
+        paths.push_back(std::move(file.path));
+
+    std::vector<XvdScanRecord> scanned;
+    ScanXvdFiles(paths, level, num_threads, scanned);
+
+    records.clear();
+    for(auto& record : scanned)
+        if(record.status != XVD_SCAN_NOT_XVD)
+            records.push_back(std::move(record));
+
+    std::sort(records.begin(), records.end(),
+              [](const XvdScanRecord& a, const XvdScanRecord& b) { return a.path < b.path; });
+    return paths.size();
+}
+
+//////////////////////////////////////////
+// OUTPUT                               //
+//////////////////////////////////////////
+const char* ScanStatusStr(XvdScanStatus status)
+{
+    switch(status)
+    {
+        case XVD_SCAN_OK:             return "OK";
+        case XVD_SCAN_IO_ERROR:       return "IO_ERROR";
+        case XVD_SCAN_INVALID_HEADER: return "INVALID_HEADER";
+        case XVD_SCAN_INVALID_LAYOUT: return "INVALID_LAYOUT";
+        case XVD_SCAN_NOT_XVD:        return "NOT_XVD";
+        default:                      return "UNKNOWN";
+    }
+}
+
+static void WriteCsvString(FILE* out, const std::string& value)
+{
+    // Paths can have commas and quotes: always quoted, quotes doubled
+    fputc('"', out);
+    for(char c : value)
+    {
+        if(c == '"')
+            fputc('"', out);
+        fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void WriteScanRecordsCsv(FILE* out, const std::vector<XvdScanRecord>& records)
+{
+    fprintf(out, "path,status,file_size,format_version,xvd_type,content_type,content_id,product_id,pduid,"
+                 "package_version,drive_size,encrypted,signed,creation_time,allocated_blocks\n");
+
+    for(const XvdScanRecord& record : records)
+    {
+        WriteCsvString(out, record.path);
+        fprintf(out, ",%s,%llu", ScanStatusStr(record.status), (unsigned long long)record.file_size);
+        if(record.status == XVD_SCAN_IO_ERROR)
+        {
+            fprintf(out, ",,,,,,,,,,,,\n");
+            continue;
+        }
+
+        fprintf(out, ",%u,%s,%s,%s,%s,%s,%s,%llu,%s,%s,%s,%llu\n",
+                record.format_version,
+                record.xvd_type == XvdType::FIXED ? "Fixed" : record.xvd_type == XvdType::DYNAMIC ? "Dynamic" : "Unknown",
+                ContentTypeStr((XvdContentType)record.content_type),
+                MsGUIDToString(*(const MS_GUID*)record.content_id).c_str(),
+                MsGUIDToString(*(const MS_GUID*)record.product_id).c_str(),
+                MsGUIDToString(*(const MS_GUID*)record.pduid).c_str(),
+                MsVersionToString(record.package_version, false).c_str(),
+                (unsigned long long)record.drive_size,
+                record.flags.EncryptionDisabled ? "No" : "Yes",
+                record.is_signed ? "Yes" : "No",
+                FiletimeToString(record.creation_time).c_str(),
+                (unsigned long long)record.allocated_blocks);
+    }
+}
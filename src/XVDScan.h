@@ -0,0 +1,105 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDScan.h - Batch scanning of whole directory trees   */
+/*              of XVDs (content library inventory)       */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTypes.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stdio.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <string>
+#include <vector>
+
+///////////////////////////////////////
+// Constants
+///////////////////////////////////////
+#define XVD_SCAN_MIN_WORKERS 16  // Header reads are latency bound, more threads than cores help
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+enum XvdScanLevel
+{
+    XVD_SCAN_LEVEL_HEADER = 0,  // Only the 0x3000 bytes of the header are read
+    XVD_SCAN_LEVEL_LAYOUT = 1   // Full XanaduXVD::Start(): layout, BAT, file size check
+};
+
+enum XvdScanStatus
+{
+    XVD_SCAN_OK             = 0,
+    XVD_SCAN_IO_ERROR       = 1,  // Could not open/read the file
+    XVD_SCAN_INVALID_HEADER = 2,  // msft-xvd magic, but nonsense in the header
+    XVD_SCAN_INVALID_LAYOUT = 3,  // Header OK, but the layout doesn't match the file (deep level only)
+    XVD_SCAN_NOT_XVD        = 4   // No msft-xvd magic. Only kept by the index, so it's not read again
+};
+
+// A file found while walking a tree, before opening it
+struct XvdScanCandidate
+{
+    std::string path;
+    uint64_t    size;
+    int64_t     mtime_ns;  // Last modification, nanoseconds since the UNIX epoch
+};
+
+// One scanned XVD
+struct XvdScanRecord
+{
+    std::string   path;
+    XvdScanStatus status              = XVD_SCAN_OK;
+    uint64_t      file_size           = 0;
+    int64_t       file_mtime_ns       = 0;
+    uint32_t      format_version      = 0;
+    uint32_t      xvd_type            = 0;
+    uint32_t      content_type        = 0;
+    XvdFlags      flags{};
+    uint64_t      drive_size          = 0;
+    uint64_t      creation_time       = 0;
+    uint8_t       content_id[16]      = {};
+    uint8_t       product_id[16]      = {};
+    uint8_t       pduid[16]           = {};
+    uint64_t      package_version     = 0;
+    bool          is_signed           = false;
+    uint64_t      allocated_blocks    = 0;  // Dynamic XVDs, deep level only
+};
+
+//////////////////////////////////////////
+// SCAN METHODS                         //
+//////////////////////////////////////////
+
+// Reads the header of a single file and fills 'record' from it. Returns false if the file is
+// not an XVD (status XVD_SCAN_NOT_XVD), or can't be read (status XVD_SCAN_IO_ERROR).
+bool ScanXvdHeader(const char* path, XvdScanRecord& record);
+
+// Walks 'root' recursively (or just takes it, if it's a file). Only regular files big enough
+// to be an XVD are returned.
+std::vector<XvdScanCandidate> ListScanCandidates(const char* root);
+
+// Scans 'paths' on 'num_threads' threads (0 = max(cores, XVD_SCAN_MIN_WORKERS)). Every path
+// gets a record, in the same order, including the ones that are not XVDs.
+void ScanXvdFiles(const std::vector<std::string>& paths, XvdScanLevel level, unsigned num_threads,
+                  std::vector<XvdScanRecord>& records);
+
+// Both of the above: every XVD under 'root', sorted by path. Files that are not XVDs don't
+// get a record. Returns the number of files looked at.
+uint64_t ScanXvdTree(const char* root, XvdScanLevel level, unsigned num_threads, std::vector<XvdScanRecord>& records);
+
+// One CSV line per record, with a header line first
+void WriteScanRecordsCsv(FILE* out, const std::vector<XvdScanRecord>& records);
+
+const char* ScanStatusStr(XvdScanStatus status);
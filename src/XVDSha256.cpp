@@ -0,0 +1,818 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDSha256.cpp - SHA256 (FIPS 180-4) with SHA-NI and   */
+/*                  SIMD multi-buffer kernels for pages.  */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDSha256.h"
+#include "XVDTypes.h"
+#include "XVDTrace.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <string.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+///////////////////////////////////////
+// x86 includes
+///////////////////////////////////////
+#if defined(__x86_64__) || defined(__i386__)
+#define XVD_SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/******************************************************************************************\
+                            SHA256 KERNELS THEORY OF OPERATION
+
+Everything in the HashTree is the SHA256 of exactly one 4K page. That's very convenient:
+a 4K page is always 64 message blocks plus one padding block, and that padding block is
+identical for every page. There are two ways to go fast:
+
+- SHA-NI: Intel/AMD CPUs since ~2017 (Goldmont, Zen, Ice Lake...) have instructions that
+  do 2 SHA256 rounds at once. One page at a time, but each page is very fast.
+
+- Multi-buffer: without SHA-NI, a single SHA256 stream can't be vectorized (each round
+  depends on the previous one). But we have lots of independent pages, so we can hash
+  4 (SSE), 8 (AVX2) or 16 (AVX-512) pages at once, one page per 32 bit SIMD lane.
+  The generic kernel is in XVDSha256Lanes.inl and is included once per flavour below.
+
+Sha256Pages() picks the best kernel for the running CPU once (see Sha256BestKernel()),
+and the plain C++ one is always there as a fallback for non x86 machines. Use XanaduBench
+to see how fast every kernel is on a given machine.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// SHA256 CONSTANTS                     //
+//////////////////////////////////////////
+static const uint32_t SHA256_K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t SHA256_H0[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+//////////////////////////////////////////
+// INTERNAL HELPERS                     //
+//////////////////////////////////////////
+static inline uint32_t Ror32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static inline uint32_t LoadBE32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void StoreBE32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+// The padding block that follows the 64 data blocks of every 4K page: 0x80, zeros,
+// and the message length (0x8000 bits) at the end.
+static const uint8_t* PagePaddingBlock()
+{
+    static uint8_t block[SHA256_BLOCK_LENGTH_BYTES] = {0};
+    block[0]  = 0x80;
+    block[62] = (uint8_t)((XVD_PAGE_SIZE * 8) >> 8);
+    block[63] = (uint8_t)((XVD_PAGE_SIZE * 8) & 0xFF);
+    return block;
+}
+
+// Message schedule of the padding block (W[t] + K[t]). Same for every page so it's
+// computed once, and the multi-buffer kernels just broadcast it.
+static uint32_t gPagePaddingWK[64];
+static bool InitPagePaddingWK()
+{
+    uint32_t w[64];
+    const uint8_t* block = PagePaddingBlock();
+    for(int i = 0; i < 16; i++)
+        w[i] = LoadBE32(block + 4 * i);
+    for(int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = Ror32(w[i-15], 7) ^ Ror32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = Ror32(w[i-2], 17) ^ Ror32(w[i-2], 19)  ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    for(int i = 0; i < 64; i++)
+        gPagePaddingWK[i] = w[i] + SHA256_K[i];
+    return true;
+}
+static bool gPagePaddingWKReady = InitPagePaddingWK();
+
+//////////////////////////////////////////
+// SCALAR KERNEL                        //
+//////////////////////////////////////////
+
+// Runs the SHA256 compression function over 'num_blocks' 64 byte blocks
+static void Sha256CompressScalar(uint32_t state[8], const uint8_t* data, size_t num_blocks)
+{
+    uint32_t w[64];
+    while(num_blocks--)
+    {
+        for(int i = 0; i < 16; i++)
+            w[i] = LoadBE32(data + 4 * i);
+        for(int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = Ror32(w[i-15], 7) ^ Ror32(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = Ror32(w[i-2], 17) ^ Ror32(w[i-2], 19)  ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i = 0; i < 64; i++)
+        {
+            uint32_t S1  = Ror32(e, 6) ^ Ror32(e, 11) ^ Ror32(e, 25);
+            uint32_t ch  = (e & f) ^ (~e & g);
+            uint32_t t1  = h + S1 + ch + SHA256_K[i] + w[i];
+            uint32_t S0  = Ror32(a, 2) ^ Ror32(a, 13) ^ Ror32(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2  = S0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += SHA256_BLOCK_LENGTH_BYTES;
+    }
+}
+
+#ifdef XVD_SHA256_X86
+//////////////////////////////////////////
+// SHA-NI KERNEL                        //
+//////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("sha,sse4.1,ssse3")
+
+// Same contract as Sha256CompressScalar(). This is the usual SHA-NI dance: the state is
+// kept as ABEF/CDGH, every _mm_sha256rnds2_epu32 does 2 rounds, and msg1/msg2 compute the
+// message schedule 4 words at a time (W[t] for the next quad-round is ready just in time).
+static void Sha256CompressShaNI(uint32_t state[8], const uint8_t* data, size_t num_blocks)
+{
+    const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp    = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp    = _mm_shuffle_epi32(tmp, 0xB1);           // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);        // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);     // CDGH
+
+    while(num_blocks--)
+    {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+        __m128i msg[4];
+
+        #pragma GCC unroll 16
+        for(int i = 0; i < 16; i++)
+        {
+            if(i < 4)
+                msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), BSWAP);
+
+            __m128i wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i*)&SHA256_K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+
+            // W[4(i+1)..] = msg2(msg1(W[4(i-3)..]) + W[4(i-2)+1..], W[4i..])
+            if(i >= 3 && i <= 14)
+            {
+                __m128i next = _mm_add_epi32(msg[(i + 1) & 3], _mm_alignr_epi8(msg[i & 3], msg[(i + 3) & 3], 4));
+                msg[(i + 1) & 3] = _mm_sha256msg2_epu32(next, msg[i & 3]);
+            }
+
+            wk     = _mm_shuffle_epi32(wk, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+
+            if(i >= 1 && i <= 12)
+                msg[(i + 3) & 3] = _mm_sha256msg1_epu32(msg[(i + 3) & 3], msg[i & 3]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += SHA256_BLOCK_LENGTH_BYTES;
+    }
+
+    tmp    = _mm_shuffle_epi32(state0, 0x1B);        // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);        // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);     // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);        // HGFE
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+// Two independent streams interleaved. sha256rnds2 has a few cycles of latency but can
+// start every cycle, so a single page leaves the SHA unit idle most of the time. Working
+// on two pages at once fills those bubbles; page hashing always has pages to spare.
+static void Sha256CompressShaNIx2(uint32_t state_a[8], uint32_t state_b[8],
+                                  const uint8_t* data_a, const uint8_t* data_b, size_t num_blocks)
+{
+    const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    uint32_t*      states[2] = { state_a, state_b };
+    const uint8_t* datas[2]  = { data_a, data_b };
+
+    __m128i state0[2], state1[2];
+    for(int s = 0; s < 2; s++)
+    {
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&states[s][0]), 0xB1);
+        state1[s]   = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&states[s][4]), 0x1B);
+        state0[s]   = _mm_alignr_epi8(tmp, state1[s], 8);
+        state1[s]   = _mm_blend_epi16(state1[s], tmp, 0xF0);
+    }
+
+    for(size_t block = 0; block < num_blocks; block++)
+    {
+        __m128i abef_save[2] = { state0[0], state0[1] };
+        __m128i cdgh_save[2] = { state1[0], state1[1] };
+        __m128i msg[2][4];
+
+        #pragma GCC unroll 16
+        for(int i = 0; i < 16; i++)
+        {
+            __m128i k = _mm_loadu_si128((const __m128i*)&SHA256_K[4 * i]);
+            __m128i wk[2];
+
+            #pragma GCC unroll 2
+            for(int s = 0; s < 2; s++)
+            {
+                if(i < 4)
+                    msg[s][i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(datas[s] + 64 * block + 16 * i)), BSWAP);
+                wk[s]     = _mm_add_epi32(msg[s][i & 3], k);
+                state1[s] = _mm_sha256rnds2_epu32(state1[s], state0[s], wk[s]);
+            }
+
+            #pragma GCC unroll 2
+            for(int s = 0; s < 2; s++)
+            {
+                if(i >= 3 && i <= 14)
+                {
+                    __m128i next = _mm_add_epi32(msg[s][(i + 1) & 3], _mm_alignr_epi8(msg[s][i & 3], msg[s][(i + 3) & 3], 4));
+                    msg[s][(i + 1) & 3] = _mm_sha256msg2_epu32(next, msg[s][i & 3]);
+                }
+                wk[s]     = _mm_shuffle_epi32(wk[s], 0x0E);
+                state0[s] = _mm_sha256rnds2_epu32(state0[s], state1[s], wk[s]);
+                if(i >= 1 && i <= 12)
+                    msg[s][(i + 3) & 3] = _mm_sha256msg1_epu32(msg[s][(i + 3) & 3], msg[s][i & 3]);
+            }
+        }
+
+        for(int s = 0; s < 2; s++)
+        {
+            state0[s] = _mm_add_epi32(state0[s], abef_save[s]);
+            state1[s] = _mm_add_epi32(state1[s], cdgh_save[s]);
+        }
+    }
+
+    for(int s = 0; s < 2; s++)
+    {
+        __m128i tmp = _mm_shuffle_epi32(state0[s], 0x1B);
+        state1[s]   = _mm_shuffle_epi32(state1[s], 0xB1);
+        state0[s]   = _mm_blend_epi16(tmp, state1[s], 0xF0);
+        state1[s]   = _mm_alignr_epi8(state1[s], tmp, 8);
+        _mm_storeu_si128((__m128i*)&states[s][0], state0[s]);
+        _mm_storeu_si128((__m128i*)&states[s][4], state1[s]);
+    }
+}
+
+#pragma GCC pop_options
+
+//////////////////////////////////////////
+// SSE 4-LANE KERNEL                    //
+//////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("ssse3")
+
+// Loads 4 words of 4 lanes and transposes them, so vector i holds word i of every lane
+static inline void Transpose4x4(__m128i r[4])
+{
+    __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+    __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+    __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+    __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm_unpacklo_epi64(t0, t1);
+    r[1] = _mm_unpackhi_epi64(t0, t1);
+    r[2] = _mm_unpacklo_epi64(t2, t3);
+    r[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+static inline void LoadBlockX4(__m128i w[16], const uint8_t* const pages[4], uint32_t offset)
+{
+    const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    for(int quad = 0; quad < 4; quad++)
+    {
+        __m128i r[4];
+        for(int lane = 0; lane < 4; lane++)
+            r[lane] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pages[lane] + offset + 16 * quad)), BSWAP);
+        Transpose4x4(r);
+        for(int i = 0; i < 4; i++)
+            w[4 * quad + i] = r[i];
+    }
+}
+
+#define SHA256_LANES            4
+#define SHA256_LANES_FN         Sha256PagesSSEx4
+#define VEC                     __m128i
+#define V_SET1(x)               _mm_set1_epi32((int)(x))
+#define V_ADD(a, b)             _mm_add_epi32(a, b)
+#define V_XOR(a, b)             _mm_xor_si128(a, b)
+#define V_ROR(x, n)             _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+#define V_SHR(x, n)             _mm_srli_epi32(x, n)
+#define V_CH(e, f, g)           _mm_xor_si128(_mm_and_si128(e, f), _mm_andnot_si128(e, g))
+#define V_MAJ(a, b, c)          _mm_or_si128(_mm_and_si128(a, b), _mm_and_si128(c, _mm_or_si128(a, b)))
+#define V_STORE(ptr, v)         _mm_store_si128((__m128i*)(ptr), v)
+#define V_LOAD_BLOCK(w, p, off) LoadBlockX4(w, p, off)
+#include "XVDSha256Lanes.inl"
+#undef SHA256_LANES
+#undef SHA256_LANES_FN
+#undef VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_ROR
+#undef V_SHR
+#undef V_CH
+#undef V_MAJ
+#undef V_STORE
+#undef V_LOAD_BLOCK
+
+#pragma GCC pop_options
+
+//////////////////////////////////////////
+// AVX2 8-LANE KERNEL                   //
+//////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+// 8x8 transpose of 32 bit words: in-lane unpacks, then swap the 128 bit halves around
+static inline void Transpose8x8(__m256i r[8])
+{
+    __m256i t[8], u[8];
+    for(int i = 0; i < 4; i++)
+    {
+        t[2 * i]     = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+        t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        u[4 * i + 0] = _mm256_unpacklo_epi64(t[4 * i],     t[4 * i + 2]);
+        u[4 * i + 1] = _mm256_unpackhi_epi64(t[4 * i],     t[4 * i + 2]);
+        u[4 * i + 2] = _mm256_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+        u[4 * i + 3] = _mm256_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+    }
+    for(int i = 0; i < 4; i++)
+    {
+        r[i]     = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+static inline void LoadBlockX8(__m256i w[16], const uint8_t* const pages[8], uint32_t offset)
+{
+    const __m256i BSWAP = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                            0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    for(int half = 0; half < 2; half++)
+    {
+        __m256i r[8];
+        for(int lane = 0; lane < 8; lane++)
+            r[lane] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(pages[lane] + offset + 32 * half)), BSWAP);
+        Transpose8x8(r);
+        for(int i = 0; i < 8; i++)
+            w[8 * half + i] = r[i];
+    }
+}
+
+#define SHA256_LANES            8
+#define SHA256_LANES_FN         Sha256PagesAVX2x8
+#define VEC                     __m256i
+#define V_SET1(x)               _mm256_set1_epi32((int)(x))
+#define V_ADD(a, b)             _mm256_add_epi32(a, b)
+#define V_XOR(a, b)             _mm256_xor_si256(a, b)
+#define V_ROR(x, n)             _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define V_SHR(x, n)             _mm256_srli_epi32(x, n)
+#define V_CH(e, f, g)           _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g))
+#define V_MAJ(a, b, c)          _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)))
+#define V_STORE(ptr, v)         _mm256_store_si256((__m256i*)(ptr), v)
+#define V_LOAD_BLOCK(w, p, off) LoadBlockX8(w, p, off)
+#include "XVDSha256Lanes.inl"
+#undef SHA256_LANES
+#undef SHA256_LANES_FN
+#undef VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_ROR
+#undef V_SHR
+#undef V_CH
+#undef V_MAJ
+#undef V_STORE
+#undef V_LOAD_BLOCK
+
+#pragma GCC pop_options
+
+//////////////////////////////////////////
+// AVX-512 16-LANE KERNEL               //
+//////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"        // GCC's own AVX-512 headers trigger these
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// 16x16 transpose: 4x4 transposes inside every 128 bit chunk (unpacks), and then a
+// 4x4 transpose of the 128 bit chunks themselves (shuffle_i32x4)
+static inline void Transpose16x16(__m512i r[16])
+{
+    __m512i t[16], u[16];
+    for(int i = 0; i < 8; i++)
+    {
+        t[2 * i]     = _mm512_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+        t[2 * i + 1] = _mm512_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+    }
+    for(int i = 0; i < 4; i++)
+    {
+        u[4 * i + 0] = _mm512_unpacklo_epi64(t[4 * i],     t[4 * i + 2]);
+        u[4 * i + 1] = _mm512_unpackhi_epi64(t[4 * i],     t[4 * i + 2]);
+        u[4 * i + 2] = _mm512_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+        u[4 * i + 3] = _mm512_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+    }
+    // u[4k + m], chunk j = word (4j + m) of lanes 4k..4k+3
+    for(int m = 0; m < 4; m++)
+    {
+        __m512i v0 = _mm512_shuffle_i32x4(u[m],     u[4 + m],  0x44);
+        __m512i v1 = _mm512_shuffle_i32x4(u[m],     u[4 + m],  0xEE);
+        __m512i v2 = _mm512_shuffle_i32x4(u[8 + m], u[12 + m], 0x44);
+        __m512i v3 = _mm512_shuffle_i32x4(u[8 + m], u[12 + m], 0xEE);
+        r[0  + m] = _mm512_shuffle_i32x4(v0, v2, 0x88);
+        r[4  + m] = _mm512_shuffle_i32x4(v0, v2, 0xDD);
+        r[8  + m] = _mm512_shuffle_i32x4(v1, v3, 0x88);
+        r[12 + m] = _mm512_shuffle_i32x4(v1, v3, 0xDD);
+    }
+}
+
+static inline void LoadBlockX16(__m512i w[16], const uint8_t* const pages[16], uint32_t offset)
+{
+    const __m512i BSWAP = _mm512_set_epi64(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                           0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                           0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                           0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    for(int lane = 0; lane < 16; lane++)
+        w[lane] = _mm512_shuffle_epi8(_mm512_loadu_si512((const void*)(pages[lane] + offset)), BSWAP);
+    Transpose16x16(w);
+}
+
+// AVX-512 has real rotates, and ternary logic does Ch/Maj in one instruction each
+#define SHA256_LANES            16
+#define SHA256_LANES_FN         Sha256PagesAVX512x16
+#define VEC                     __m512i
+#define V_SET1(x)               _mm512_set1_epi32((int)(x))
+#define V_ADD(a, b)             _mm512_add_epi32(a, b)
+#define V_XOR(a, b)             _mm512_xor_si512(a, b)
+#define V_ROR(x, n)             _mm512_ror_epi32(x, n)
+#define V_SHR(x, n)             _mm512_srli_epi32(x, n)
+#define V_CH(e, f, g)           _mm512_ternarylogic_epi32(e, f, g, 0xCA)
+#define V_MAJ(a, b, c)          _mm512_ternarylogic_epi32(a, b, c, 0xE8)
+#define V_STORE(ptr, v)         _mm512_store_si512((void*)(ptr), v)
+#define V_LOAD_BLOCK(w, p, off) LoadBlockX16(w, p, off)
+#include "XVDSha256Lanes.inl"
+#undef SHA256_LANES
+#undef SHA256_LANES_FN
+#undef VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_ROR
+#undef V_SHR
+#undef V_CH
+#undef V_MAJ
+#undef V_STORE
+#undef V_LOAD_BLOCK
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+//////////////////////////////////////////
+// CPU FEATURE DETECTION                //
+//////////////////////////////////////////
+struct CpuFeatures
+{
+    bool ssse3   = false;
+    bool sse41   = false;
+    bool avx2    = false;
+    bool avx512  = false; // F + BW
+    bool sha     = false;
+};
+
+static CpuFeatures DetectCpuFeatures()
+{
+    CpuFeatures cpu;
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return cpu;
+
+    cpu.ssse3 = (ecx >> 9)  & 1;
+    cpu.sse41 = (ecx >> 19) & 1;
+
+    // AVX registers are only usable if the OS saves them on context switches (XCR0)
+    bool os_avx = false, os_avx512 = false;
+    if(((ecx >> 27) & 1) && ((ecx >> 28) & 1)) // OSXSAVE + AVX
+    {
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        os_avx    = (xcr0_lo & 0x06) == 0x06; // XMM + YMM
+        os_avx512 = (xcr0_lo & 0xE6) == 0xE6; // + opmask + ZMM
+    }
+
+    if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        cpu.avx2   = os_avx && ((ebx >> 5) & 1);
+        cpu.avx512 = os_avx512 && ((ebx >> 16) & 1) && ((ebx >> 30) & 1);
+        cpu.sha    = ((ebx >> 29) & 1) && cpu.sse41 && cpu.ssse3;
+    }
+    return cpu;
+}
+
+static const CpuFeatures& GetCpuFeatures()
+{
+    static CpuFeatures cpu = DetectCpuFeatures();
+    return cpu;
+}
+#endif // XVD_SHA256_X86
+
+//////////////////////////////////////////
+// DISPATCH                             //
+//////////////////////////////////////////
+bool Sha256KernelSupported(Sha256Kernel kernel)
+{
+    switch(kernel)
+    {
+        case SHA256_KERNEL_SCALAR:     return true;
+#ifdef XVD_SHA256_X86
+        case SHA256_KERNEL_SSE_X4:     return GetCpuFeatures().ssse3;
+        case SHA256_KERNEL_AVX2_X8:    return GetCpuFeatures().avx2;
+        case SHA256_KERNEL_AVX512_X16: return GetCpuFeatures().avx512;
+        case SHA256_KERNEL_SHANI:      return GetCpuFeatures().sha;
+#endif
+        default:                       return false;
+    }
+}
+
+Sha256Kernel Sha256BestKernel()
+{
+    // Which one wins between SHA-NI and the widest multi-buffer kernel depends a lot on the
+    // microarchitecture (SHA-NI throughput varies a lot between CPUs, and AVX-512 may lower
+    // the clocks on some Intel ones). So instead of guessing, the first call races both on a
+    // small batch of pages (~1ms) and keeps the fastest one for the rest of the process.
+    static Sha256Kernel best = []()
+    {
+        Sha256Kernel widest = SHA256_KERNEL_SCALAR;
+        const Sha256Kernel by_width[] = { SHA256_KERNEL_AVX512_X16, SHA256_KERNEL_AVX2_X8, SHA256_KERNEL_SSE_X4 };
+        for(auto kernel : by_width)
+        {
+            if(Sha256KernelSupported(kernel))
+            {
+                widest = kernel;
+                break;
+            }
+        }
+
+        if(!Sha256KernelSupported(SHA256_KERNEL_SHANI))
+            return widest;
+        if(widest == SHA256_KERNEL_SCALAR)
+            return SHA256_KERNEL_SHANI;
+
+        const size_t num_pages = 32;
+        std::vector<uint8_t> pages(num_pages * XVD_PAGE_SIZE, 0x5A);
+        uint8_t digests[num_pages][SHA256_DIGEST_LENGTH_BYTES];
+
+        auto time_kernel = [&](Sha256Kernel kernel)
+        {
+            Sha256PagesWithKernel(kernel, pages.data(), num_pages, digests); // warm up
+            auto best_time = std::chrono::steady_clock::duration::max();
+            for(int round = 0; round < 3; round++)
+            {
+                auto start = std::chrono::steady_clock::now();
+                Sha256PagesWithKernel(kernel, pages.data(), num_pages, digests);
+                best_time = std::min(best_time, std::chrono::steady_clock::now() - start);
+            }
+            return best_time;
+        };
+
+        return (time_kernel(widest) < time_kernel(SHA256_KERNEL_SHANI)) ? widest : SHA256_KERNEL_SHANI;
+    }();
+    return best;
+}
+
+const char* Sha256KernelName(Sha256Kernel kernel)
+{
+    switch(kernel)
+    {
+        case SHA256_KERNEL_SCALAR:     return "scalar";
+        case SHA256_KERNEL_SSE_X4:     return "sse-x4";
+        case SHA256_KERNEL_AVX2_X8:    return "avx2-x8";
+        case SHA256_KERNEL_AVX512_X16: return "avx512-x16";
+        case SHA256_KERNEL_SHANI:      return "sha-ni";
+        default:                       return "UNKNOWN";
+    }
+}
+
+// Single-stream compression, SHA-NI if available
+static void Sha256Compress(uint32_t state[8], const uint8_t* data, size_t num_blocks)
+{
+#ifdef XVD_SHA256_X86
+    if(Sha256KernelSupported(SHA256_KERNEL_SHANI))
+        return Sha256CompressShaNI(state, data, num_blocks);
+#endif
+    Sha256CompressScalar(state, data, num_blocks);
+}
+
+//////////////////////////////////////////
+// SHA256 METHODS                       //
+//////////////////////////////////////////
+void Sha256(const uint8_t* data, size_t length, uint8_t digest[SHA256_DIGEST_LENGTH_BYTES])
+{
+    uint32_t state[8];
+    memcpy(state, SHA256_H0, sizeof(state));
+
+    // Full blocks go straight from the caller's buffer
+    size_t full_blocks = length / SHA256_BLOCK_LENGTH_BYTES;
+    Sha256Compress(state, data, full_blocks);
+
+    // Tail + padding: 0x80, zeros, and the message length in bits (big endian).
+    // This can spill into a second block if the tail is longer than 55 bytes.
+    uint8_t tail[2 * SHA256_BLOCK_LENGTH_BYTES] = {0};
+    size_t  rem = length % SHA256_BLOCK_LENGTH_BYTES;
+    memcpy(tail, data + full_blocks * SHA256_BLOCK_LENGTH_BYTES, rem);
+    tail[rem] = 0x80;
+
+    size_t   tail_blocks = (rem < 56) ? 1 : 2;
+    uint64_t bit_length  = (uint64_t)length * 8;
+    for(int i = 0; i < 8; i++)
+        tail[tail_blocks * SHA256_BLOCK_LENGTH_BYTES - 1 - i] = (uint8_t)(bit_length >> (8 * i));
+    Sha256Compress(state, tail, tail_blocks);
+
+    for(int i = 0; i < 8; i++)
+        StoreBE32(digest + 4 * i, state[i]);
+}
+
+void Sha256Init(Sha256Context& ctx)
+{
+    memcpy(ctx.state, SHA256_H0, sizeof(ctx.state));
+    ctx.block_used = 0;
+    ctx.length     = 0;
+}
+
+void Sha256Update(Sha256Context& ctx, const uint8_t* data, size_t length)
+{
+    ctx.length += length;
+
+    // Top up the pending block first
+    if(ctx.block_used > 0)
+    {
+        size_t take = std::min(length, SHA256_BLOCK_LENGTH_BYTES - ctx.block_used);
+        memcpy(ctx.block + ctx.block_used, data, take);
+        ctx.block_used += take;
+        data           += take;
+        length         -= take;
+        if(ctx.block_used < SHA256_BLOCK_LENGTH_BYTES)
+            return;
+        Sha256Compress(ctx.state, ctx.block, 1);
+        ctx.block_used = 0;
+    }
+
+    // Full blocks straight from the caller's buffer, the rest waits for more data
+    size_t full_blocks = length / SHA256_BLOCK_LENGTH_BYTES;
+    Sha256Compress(ctx.state, data, full_blocks);
+    ctx.block_used = length % SHA256_BLOCK_LENGTH_BYTES;
+    memcpy(ctx.block, data + full_blocks * SHA256_BLOCK_LENGTH_BYTES, ctx.block_used);
+}
+
+void Sha256Final(Sha256Context& ctx, uint8_t digest[SHA256_DIGEST_LENGTH_BYTES])
+{
+    // Same padding as Sha256()
+    uint8_t tail[2 * SHA256_BLOCK_LENGTH_BYTES] = {0};
+    memcpy(tail, ctx.block, ctx.block_used);
+    tail[ctx.block_used] = 0x80;
+
+    size_t   tail_blocks = (ctx.block_used < 56) ? 1 : 2;
+    uint64_t bit_length  = ctx.length * 8;
+    for(int i = 0; i < 8; i++)
+        tail[tail_blocks * SHA256_BLOCK_LENGTH_BYTES - 1 - i] = (uint8_t)(bit_length >> (8 * i));
+    Sha256Compress(ctx.state, tail, tail_blocks);
+
+    for(int i = 0; i < 8; i++)
+        StoreBE32(digest + 4 * i, ctx.state[i]);
+}
+
+// Hashes one page with a single-stream compression function
+template<void (*COMPRESS)(uint32_t*, const uint8_t*, size_t)>
+static void Sha256OnePage(const uint8_t* page, uint8_t digest[SHA256_DIGEST_LENGTH_BYTES])
+{
+    uint32_t state[8];
+    memcpy(state, SHA256_H0, sizeof(state));
+    COMPRESS(state, page, XVD_PAGE_SIZE / SHA256_BLOCK_LENGTH_BYTES);
+    COMPRESS(state, PagePaddingBlock(), 1);
+    for(int i = 0; i < 8; i++)
+        StoreBE32(digest + 4 * i, state[i]);
+}
+
+// Feeds 'num_pages' pages to a LANES wide kernel. The last batch may be incomplete:
+// the spare lanes just hash the last page again and their digests are thrown away.
+template<int LANES, void (*KERNEL)(const uint8_t* const*, uint8_t (*)[SHA256_DIGEST_LENGTH_BYTES])>
+static void Sha256PagesInLanes(const uint8_t* pages, size_t num_pages, uint8_t (*digests)[SHA256_DIGEST_LENGTH_BYTES])
+{
+    const uint8_t* lane_pages[LANES];
+    uint8_t        lane_digests[LANES][SHA256_DIGEST_LENGTH_BYTES];
+    for(size_t first = 0; first < num_pages; first += LANES)
+    {
+        size_t count = (num_pages - first < LANES) ? num_pages - first : LANES;
+        for(int lane = 0; lane < LANES; lane++)
+            lane_pages[lane] = pages + (first + (lane < (int)count ? lane : count - 1)) * XVD_PAGE_SIZE;
+
+        if(count == LANES)
+            KERNEL(lane_pages, digests + first);
+        else
+        {
+            KERNEL(lane_pages, lane_digests);
+            memcpy(digests + first, lane_digests, count * SHA256_DIGEST_LENGTH_BYTES);
+        }
+    }
+}
+
+void Sha256PagesWithKernel(Sha256Kernel kernel, const uint8_t* pages, size_t num_pages,
+                           uint8_t (*digests)[SHA256_DIGEST_LENGTH_BYTES])
+{
+    if(!Sha256KernelSupported(kernel))
+        kernel = SHA256_KERNEL_SCALAR;
+
+    switch(kernel)
+    {
+#ifdef XVD_SHA256_X86
+        case SHA256_KERNEL_SHANI:
+        {
+            // Pages go in pairs through the interleaved kernel, an odd last one goes alone
+            size_t i = 0;
+            for(; i + 1 < num_pages; i += 2)
+            {
+                uint32_t state[2][8];
+                memcpy(state[0], SHA256_H0, sizeof(SHA256_H0));
+                memcpy(state[1], SHA256_H0, sizeof(SHA256_H0));
+                const uint8_t* page_a = pages + i * XVD_PAGE_SIZE;
+                const uint8_t* page_b = page_a + XVD_PAGE_SIZE;
+                Sha256CompressShaNIx2(state[0], state[1], page_a, page_b, XVD_PAGE_SIZE / SHA256_BLOCK_LENGTH_BYTES);
+                Sha256CompressShaNIx2(state[0], state[1], PagePaddingBlock(), PagePaddingBlock(), 1);
+                for(int w = 0; w < 8; w++)
+                {
+                    StoreBE32(digests[i] + 4 * w, state[0][w]);
+                    StoreBE32(digests[i + 1] + 4 * w, state[1][w]);
+                }
+            }
+            if(i < num_pages)
+                Sha256OnePage<Sha256CompressShaNI>(pages + i * XVD_PAGE_SIZE, digests[i]);
+            break;
+        }
+        case SHA256_KERNEL_AVX512_X16:
+            Sha256PagesInLanes<16, Sha256PagesAVX512x16>(pages, num_pages, digests);
+            break;
+        case SHA256_KERNEL_AVX2_X8:
+            Sha256PagesInLanes<8, Sha256PagesAVX2x8>(pages, num_pages, digests);
+            break;
+        case SHA256_KERNEL_SSE_X4:
+            Sha256PagesInLanes<4, Sha256PagesSSEx4>(pages, num_pages, digests);
+            break;
+#endif
+        default:
+            for(size_t i = 0; i < num_pages; i++)
+                Sha256OnePage<Sha256CompressScalar>(pages + i * XVD_PAGE_SIZE, digests[i]);
+            break;
+    }
+}
+
+void Sha256Pages(const uint8_t* pages, size_t num_pages, uint8_t (*digests)[SHA256_DIGEST_LENGTH_BYTES])
+{
+    XVD_TRACE_SCOPE(XVD_PHASE_HASH, PagesToBytes(num_pages));
+    Sha256PagesWithKernel(Sha256BestKernel(), pages, num_pages, digests);
+}
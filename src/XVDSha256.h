@@ -0,0 +1,70 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDSha256.h - SHA256 used by the XVD HashTree.        */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////
+// Constants
+///////////////////////////////////////
+#define SHA256_DIGEST_LENGTH_BYTES  32
+#define SHA256_BLOCK_LENGTH_BYTES   64
+
+// Implementations available to hash 4K pages. See XVDSha256.cpp for the details.
+enum Sha256Kernel
+{
+    SHA256_KERNEL_SCALAR     = 0,   // Plain C++, works everywhere
+    SHA256_KERNEL_SSE_X4     = 1,   // 4 pages at once (SSSE3)
+    SHA256_KERNEL_AVX2_X8    = 2,   // 8 pages at once (AVX2)
+    SHA256_KERNEL_AVX512_X16 = 3,   // 16 pages at once (AVX-512 F+BW)
+    SHA256_KERNEL_SHANI      = 4,   // One page at a time with the SHA extensions
+    SHA256_KERNEL_COUNT
+};
+
+// State of a SHA256 fed in pieces (see Sha256Init())
+struct Sha256Context
+{
+    uint32_t state[8];
+    uint8_t  block[SHA256_BLOCK_LENGTH_BYTES];  // Bytes that don't fill a block yet
+    size_t   block_used;
+    uint64_t length;                            // Total bytes fed so far
+};
+
+//////////////////////////////////////////
+// SHA256 METHODS                       //
+//////////////////////////////////////////
+
+// Hashes an arbitrary buffer. Used for one-off hashes (e.g. the root hash).
+void Sha256(const uint8_t* data, size_t length, uint8_t digest[SHA256_DIGEST_LENGTH_BYTES]);
+
+// Same hash, for data that arrives in pieces (e.g. a stream read in chunks): Init, Update
+// as many times as needed, Final. Gives exactly what Sha256() gives on the concatenation.
+void Sha256Init(Sha256Context& ctx);
+void Sha256Update(Sha256Context& ctx, const uint8_t* data, size_t length);
+void Sha256Final(Sha256Context& ctx, uint8_t digest[SHA256_DIGEST_LENGTH_BYTES]);
+
+// Hashes 'num_pages' consecutive XVD_PAGE_SIZE pages starting at 'pages', writing
+// one full 32 byte digest per page into 'digests'. This is what the HashTree code
+// calls: every node of the tree is the (truncated) SHA256 of exactly one 4K page.
+// The fastest kernel the running CPU supports is picked the first time it's called.
+void Sha256Pages(const uint8_t* pages, size_t num_pages, uint8_t (*digests)[SHA256_DIGEST_LENGTH_BYTES]);
+
+// Same as Sha256Pages() but forcing a kernel (falls back to scalar if the CPU can't run it).
+// Mostly useful for benchmarking and cross-checking the kernels against each other.
+void Sha256PagesWithKernel(Sha256Kernel kernel, const uint8_t* pages, size_t num_pages,
+                           uint8_t (*digests)[SHA256_DIGEST_LENGTH_BYTES]);
+
+// Runtime CPU dispatch helpers
+bool         Sha256KernelSupported(Sha256Kernel kernel);
+Sha256Kernel Sha256BestKernel();
+const char*  Sha256KernelName(Sha256Kernel kernel);
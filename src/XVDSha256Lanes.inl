@@ -0,0 +1,86 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDSha256Lanes.inl - Multi-buffer SHA256 of 4K pages. */
+/*                                                        */
+/**********************************************************/
+
+// This file is NOT a regular header. XVDSha256.cpp includes it once per SIMD flavour
+// (SSE, AVX2, AVX-512) inside a "#pragma GCC target" region, after defining:
+//
+//   SHA256_LANES             Number of pages hashed at once (4, 8, 16)
+//   SHA256_LANES_FN          Name of the function to generate
+//   VEC                      Vector type holding one 32 bit word of every lane
+//   V_SET1(x)                Broadcast a 32 bit constant to every lane
+//   V_ADD/V_XOR(a, b)        Lane-wise add / xor
+//   V_ROR(x, n), V_SHR(x, n) Lane-wise rotate right / shift right
+//   V_CH(e, f, g)            SHA256 Ch()  = (e & f) ^ (~e & g)
+//   V_MAJ(a, b, c)           SHA256 Maj() = (a & b) ^ (a & c) ^ (b & c)
+//   V_STORE(ptr, v)          Store one vector to memory
+//   V_LOAD_BLOCK(w, pages, offset)
+//                            Load 16 big-endian message words of the 64 byte block at
+//                            'offset' of every lane into w[0..15], transposed so that
+//                            w[i] holds word i of every lane
+//
+// Since every page has the exact same length (XVD_PAGE_SIZE), all the lanes go
+// through the exact same number of blocks, which is what makes this SIMD friendly:
+// there's no per-lane masking, no lane finishes earlier than the others.
+
+static void SHA256_LANES_FN(const uint8_t* const pages[SHA256_LANES], uint8_t (*digests)[SHA256_DIGEST_LENGTH_BYTES])
+{
+    VEC state[8];
+    for(int i = 0; i < 8; i++)
+        state[i] = V_SET1(SHA256_H0[i]);
+
+    VEC w[16];
+    for(uint32_t block = 0; block <= XVD_PAGE_SIZE / SHA256_BLOCK_LENGTH_BYTES; block++)
+    {
+        // The last block is the padding block, which is the same for every 4K page,
+        // and so is its message schedule: it was precomputed together with K[]
+        bool padding_block = (block == XVD_PAGE_SIZE / SHA256_BLOCK_LENGTH_BYTES);
+        if(!padding_block)
+            V_LOAD_BLOCK(w, pages, block * SHA256_BLOCK_LENGTH_BYTES);
+
+        VEC a = state[0], b = state[1], c = state[2], d = state[3];
+        VEC e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int t = 0; t < 64; t++)
+        {
+            VEC wk;
+            if(padding_block)
+                wk = V_SET1(gPagePaddingWK[t]);
+            else
+            {
+                if(t >= 16)
+                {
+                    VEC w15 = w[(t + 1) & 15];
+                    VEC w2  = w[(t + 14) & 15];
+                    VEC s0  = V_XOR(V_XOR(V_ROR(w15, 7), V_ROR(w15, 18)), V_SHR(w15, 3));
+                    VEC s1  = V_XOR(V_XOR(V_ROR(w2, 17), V_ROR(w2, 19)),  V_SHR(w2, 10));
+                    w[t & 15] = V_ADD(V_ADD(w[t & 15], s0), V_ADD(w[(t + 9) & 15], s1));
+                }
+                wk = V_ADD(w[t & 15], V_SET1(SHA256_K[t]));
+            }
+
+            VEC S1 = V_XOR(V_XOR(V_ROR(e, 6), V_ROR(e, 11)), V_ROR(e, 25));
+            VEC t1 = V_ADD(V_ADD(h, S1), V_ADD(V_CH(e, f, g), wk));
+            VEC S0 = V_XOR(V_XOR(V_ROR(a, 2), V_ROR(a, 13)), V_ROR(a, 22));
+            VEC t2 = V_ADD(S0, V_MAJ(a, b, c));
+            h = g; g = f; f = e; e = V_ADD(d, t1);
+            d = c; c = b; b = a; a = V_ADD(t1, t2);
+        }
+
+        state[0] = V_ADD(state[0], a); state[1] = V_ADD(state[1], b);
+        state[2] = V_ADD(state[2], c); state[3] = V_ADD(state[3], d);
+        state[4] = V_ADD(state[4], e); state[5] = V_ADD(state[5], f);
+        state[6] = V_ADD(state[6], g); state[7] = V_ADD(state[7], h);
+    }
+
+    // Un-transpose: state[i] holds word i of every lane's digest
+    alignas(64) uint32_t words[8][SHA256_LANES];
+    for(int i = 0; i < 8; i++)
+        V_STORE(words[i], state[i]);
+    for(int lane = 0; lane < SHA256_LANES; lane++)
+        for(int i = 0; i < 8; i++)
+            StoreBE32(digests[lane] + 4 * i, words[i][lane]);
+}
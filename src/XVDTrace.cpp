@@ -0,0 +1,216 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDTrace.cpp - Implementation of the phase timers     */
+/*                 and counters                           */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDTrace.h"
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+/******************************************************************************************\
+                                TRACE THEORY OF OPERATION
+
+Probes sit in the few places where the work actually happens (header read, layout, BAT
+scan, SHA256 of pages, AES-XTS of pages, writes, and the syscalls of XvdFile and the async
+reader), not in the operations built on top of them, so every operation is covered without
+each one having to time itself.
+
+- Off (the default), a probe is a relaxed load of gXvdTraceMode and a branch that is
+  always predicted right. Compiled with XVD_TRACE=0, not even that.
+- Summary: each phase adds its duration and bytes to a few atomics when it ends, counters
+  are atomics too. No locks, worker threads don't wait for each other.
+- Events: on top of that, every phase is kept (thread, start, duration) for the Chrome
+  trace. That's a mutex per phase, but phases are big (a group of 170 pages at least), and
+  after XVD_TRACE_MAX_EVENTS they are only counted.
+
+Phase times are summed over threads, so with 8 workers hashing for 1 second the HASH phase
+shows about 8 seconds. That's on purpose: it's the CPU time of the phase, and the ratio with
+the wall time tells how well it was spread.
+
+\*******************************************************************************************/
+
+//////////////////////////////////////////
+// STATE                                //
+//////////////////////////////////////////
+std::atomic<uint32_t> gXvdTraceMode{XVD_TRACE_OFF};
+std::atomic<uint64_t> gXvdTraceCounters[XVD_COUNTER_COUNT];
+
+struct XvdTracePhaseTotals
+{
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> ns{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+struct XvdTraceEvent
+{
+    XvdTracePhase phase;
+    uint32_t      thread;
+    uint64_t      start_ns;
+    uint64_t      duration_ns;
+    uint64_t      bytes;
+};
+
+static XvdTracePhaseTotals        sPhaseTotals[XVD_PHASE_COUNT];
+static std::mutex                 sEventsMutex;
+static std::vector<XvdTraceEvent> sEvents;
+static uint64_t                   sDroppedEvents = 0;
+static uint64_t                   sEnabledAtNs   = 0;
+static std::atomic<uint32_t>      sNextThread{0};
+
+static const char* PhaseName(XvdTracePhase phase)
+{
+    switch(phase)
+    {
+        case XVD_PHASE_HEADER_READ: return "header_read";
+        case XVD_PHASE_LAYOUT:      return "layout";
+        case XVD_PHASE_BAT_SCAN:    return "bat_scan";
+        case XVD_PHASE_HASH:        return "hash";
+        case XVD_PHASE_DECRYPT:     return "decrypt";
+        case XVD_PHASE_WRITE:       return "write";
+        default:                    return "unknown";
+    }
+}
+
+static const char* CounterName(XvdTraceCounter counter)
+{
+    switch(counter)
+    {
+        case XVD_COUNTER_BYTES_READ:    return "bytes_read";
+        case XVD_COUNTER_BYTES_WRITTEN: return "bytes_written";
+        case XVD_COUNTER_SYSCALLS:      return "syscalls";
+        case XVD_COUNTER_CACHE_HITS:    return "cache_hits";
+        case XVD_COUNTER_BUFFER_ALLOCS: return "buffer_allocs";
+        default:                        return "unknown";
+    }
+}
+
+static uint64_t NowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Small numbers are easier to read in the trace viewer than std::thread::id hashes
+static uint32_t ThisThread()
+{
+    thread_local uint32_t thread = sNextThread++;
+    return thread;
+}
+
+//////////////////////////////////////////
+// TRACE METHODS                        //
+//////////////////////////////////////////
+void XvdTraceEnable(uint32_t mode)
+{
+    {
+        std::lock_guard<std::mutex> lock(sEventsMutex);
+        sEvents.clear();
+        sDroppedEvents = 0;
+        sEnabledAtNs   = NowNs();
+    }
+    for(auto& totals : sPhaseTotals)
+    {
+        totals.calls = 0;
+        totals.ns    = 0;
+        totals.bytes = 0;
+    }
+    for(auto& counter : gXvdTraceCounters)
+        counter = 0;
+
+    gXvdTraceMode = mode;
+}
+
+void XvdTraceScope::Begin(XvdTracePhase phase, uint64_t bytes)
+{
+    mPhase   = phase;
+    mBytes   = bytes;
+    mStartNs = NowNs();
+}
+
+void XvdTraceScope::End()
+{
+    uint64_t duration = NowNs() - mStartNs;
+    auto&    totals   = sPhaseTotals[mPhase];
+    totals.calls.fetch_add(1, std::memory_order_relaxed);
+    totals.ns.fetch_add(duration, std::memory_order_relaxed);
+    totals.bytes.fetch_add(mBytes, std::memory_order_relaxed);
+
+    if(gXvdTraceMode.load(std::memory_order_relaxed) & XVD_TRACE_EVENTS)
+    {
+        XvdTraceEvent event{ mPhase, ThisThread(), mStartNs, duration, mBytes };
+        std::lock_guard<std::mutex> lock(sEventsMutex);
+        if(sEvents.size() < XVD_TRACE_MAX_EVENTS)
+            sEvents.push_back(event);
+        else
+            sDroppedEvents++;
+    }
+}
+
+void XvdTracePrintSummary(FILE* out)
+{
+    fprintf(out, "Phase          calls      time (ms)          MB       MB/s   (time summed over threads)\n");
+    for(uint32_t p = 0; p < XVD_PHASE_COUNT; p++)
+    {
+        const auto& totals = sPhaseTotals[p];
+        uint64_t    calls  = totals.calls;
+        if(calls == 0)
+            continue;
+
+        double ms = totals.ns / 1e6;
+        double mb = totals.bytes / 1e6;
+        if(totals.bytes > 0 && ms > 0)
+            fprintf(out, "%-12s %8llu %14.3f %11.2f %10.1f\n", PhaseName((XvdTracePhase)p),
+                    (unsigned long long)calls, ms, mb, mb / (ms / 1e3));
+        else
+            fprintf(out, "%-12s %8llu %14.3f %11s %10s\n", PhaseName((XvdTracePhase)p),
+                    (unsigned long long)calls, ms, "-", "-");
+    }
+
+    fprintf(out, "\nCounter                     value\n");
+    for(uint32_t c = 0; c < XVD_COUNTER_COUNT; c++)
+        fprintf(out, "%-16s %16llu\n", CounterName((XvdTraceCounter)c), (unsigned long long)gXvdTraceCounters[c].load());
+}
+
+bool XvdTraceWriteChrome(const char* filename)
+{
+    FILE* f = fopen(filename, "w");
+    if(!f)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", filename);
+        return false;
+    }
+
+    // "X" (complete) events, timestamps in microseconds since tracing was enabled. The
+    // counters go at the end as a single "C" event, the viewer shows them as a track.
+    std::lock_guard<std::mutex> lock(sEventsMutex);
+    fprintf(f, "{\"traceEvents\":[\n");
+    for(const XvdTraceEvent& event : sEvents)
+    {
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"xvd\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"args\":{\"bytes\":%llu}},\n",
+                PhaseName(event.phase), event.thread, (event.start_ns - sEnabledAtNs) / 1e3,
+                event.duration_ns / 1e3, (unsigned long long)event.bytes);
+    }
+
+    fprintf(f, "{\"name\":\"counters\",\"cat\":\"xvd\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"args\":{",
+            (NowNs() - sEnabledAtNs) / 1e3);
+    for(uint32_t c = 0; c < XVD_COUNTER_COUNT; c++)
+        fprintf(f, "%s\"%s\":%llu", c ? "," : "", CounterName((XvdTraceCounter)c),
+                (unsigned long long)gXvdTraceCounters[c].load());
+    fprintf(f, "}}\n],\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)sDroppedEvents);
+
+    return fclose(f) == 0;
+}
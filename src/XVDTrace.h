@@ -0,0 +1,126 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDTrace.h - Phase timers and I/O counters, dumped    */
+/*               as a table or as a Chrome trace          */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+#include <stdio.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <atomic>
+
+// Build with -DXVD_TRACE=0 and every probe below compiles to nothing. With the default (1)
+// a probe that is not enabled at runtime costs one relaxed atomic load.
+#ifndef XVD_TRACE
+#define XVD_TRACE 1
+#endif
+
+///////////////////////////////////////
+// Types
+///////////////////////////////////////
+
+// Where the time goes. Phases can nest (the BAT scan happens while computing the layout)
+enum XvdTracePhase : uint32_t
+{
+    XVD_PHASE_HEADER_READ = 0,
+    XVD_PHASE_LAYOUT      = 1,
+    XVD_PHASE_BAT_SCAN    = 2,
+    XVD_PHASE_HASH        = 3,
+    XVD_PHASE_DECRYPT     = 4,
+    XVD_PHASE_WRITE       = 5,
+    XVD_PHASE_COUNT
+};
+
+enum XvdTraceCounter : uint32_t
+{
+    XVD_COUNTER_BYTES_READ    = 0, // Read with a syscall (pread(), io_uring)
+    XVD_COUNTER_BYTES_WRITTEN = 1, // Written with a syscall (pwrite(), or by the kernel: copy_file_range(), sendfile())
+    XVD_COUNTER_SYSCALLS      = 2, // Read/write/copy syscalls issued (one io_uring_enter() counts once)
+    XVD_COUNTER_CACHE_HITS    = 3, // Reads served straight from the mapping, no syscall and no copy
+    XVD_COUNTER_BUFFER_ALLOCS = 4, // I/O buffers the pool had to allocate (see XVDBufferPool.h). ~0 in steady state
+    XVD_COUNTER_COUNT
+};
+
+// What gets recorded. The summary is a handful of atomics, events also keep every phase
+// with its thread and timestamps for the Chrome trace (bounded, see XVD_TRACE_MAX_EVENTS).
+enum XvdTraceMode : uint32_t
+{
+    XVD_TRACE_OFF     = 0,
+    XVD_TRACE_SUMMARY = 1,
+    XVD_TRACE_EVENTS  = 2,
+};
+
+#define XVD_TRACE_MAX_EVENTS  (1u << 20)   // ~32Mb of events, the rest is only counted
+
+extern std::atomic<uint32_t> gXvdTraceMode;
+extern std::atomic<uint64_t> gXvdTraceCounters[XVD_COUNTER_COUNT];
+
+//////////////////////////////////////////
+// TRACE METHODS                        //
+//////////////////////////////////////////
+
+// 'mode' is a combination of XvdTraceMode flags. Also resets everything recorded so far.
+void XvdTraceEnable(uint32_t mode);
+
+// Table with time, calls and throughput of every phase, plus the counters
+void XvdTracePrintSummary(FILE* out);
+
+// Chrome trace_event JSON (load it in chrome://tracing or ui.perfetto.dev). Needs XVD_TRACE_EVENTS.
+bool XvdTraceWriteChrome(const char* filename);
+
+// Times a phase from its construction to its destruction. Use XVD_TRACE_SCOPE() instead.
+class XvdTraceScope
+{
+public:
+    XvdTraceScope(XvdTracePhase phase, uint64_t bytes)
+    {
+        if(gXvdTraceMode.load(std::memory_order_relaxed) != XVD_TRACE_OFF)
+            Begin(phase, bytes);
+    }
+    ~XvdTraceScope()
+    {
+        if(mStartNs != 0)
+            End();
+    }
+
+    XvdTraceScope(const XvdTraceScope&)            = delete;
+    XvdTraceScope& operator=(const XvdTraceScope&) = delete;
+
+private:
+    void Begin(XvdTracePhase phase, uint64_t bytes);
+    void End();
+
+    XvdTracePhase mPhase   = XVD_PHASE_COUNT;
+    uint64_t      mBytes   = 0;
+    uint64_t      mStartNs = 0;
+};
+
+static inline void XvdTraceCount(XvdTraceCounter counter, uint64_t value)
+{
+    if(gXvdTraceMode.load(std::memory_order_relaxed) != XVD_TRACE_OFF)
+        gXvdTraceCounters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+#define XVD_TRACE_CONCAT_(a, b) a##b
+#define XVD_TRACE_CONCAT(a, b)  XVD_TRACE_CONCAT_(a, b)
+
+#if XVD_TRACE
+// XVD_TRACE_SCOPE(phase, bytes): times the rest of the enclosing block. 'bytes' is what the
+// phase processes, for the throughput column (0 if it doesn't apply).
+#define XVD_TRACE_SCOPE(phase, bytes) XvdTraceScope XVD_TRACE_CONCAT(xvd_trace_scope_, __LINE__)((phase), (bytes))
+#define XVD_TRACE_COUNT(counter, value) XvdTraceCount((counter), (value))
+#else
+#define XVD_TRACE_SCOPE(phase, bytes)   do {} while(0)
+#define XVD_TRACE_COUNT(counter, value) do {} while(0)
+#endif
@@ -105,8 +105,49 @@ std::string FiletimeToString(uint64_t filetime)
 
     // Convert to human-readable format
     std::tm* gmt_time = std::gmtime(&time);
+    if(gmt_time == nullptr) // Garbage in the header, e.g. 0
+        return "INVALID";
     char buffer[80];
     std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S UTC", gmt_time);
 
     return std::string(buffer);
+}
+
+bool MsGUIDFromString(const char* str, MS_GUID& guid)
+{
+    unsigned int data1, data2, data3, data4[8];
+    int consumed = 0;
+    if(sscanf(str, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x%n", &data1, &data2, &data3,
+              &data4[0], &data4[1], &data4[2], &data4[3], &data4[4], &data4[5], &data4[6], &data4[7],
+              &consumed) != 11 || str[consumed] != '\0')
+        return false;
+
+    guid.Data1 = data1;
+    guid.Data2 = (uint16_t)data2;
+    guid.Data3 = (uint16_t)data3;
+    for(int i = 0; i < 8; i++)
+        guid.Data4[i] = (uint8_t)data4[i];
+    return true;
+}
+
+bool FiletimeFromString(const char* str, uint64_t& filetime)
+{
+    // Same constants as FiletimeToString()
+    const uint64_t EPOCH_DIFFERENCE_SECONDS = 11644473600ULL;
+    const uint64_t HUNDRED_NANOSECONDS_PER_SECOND = 10000000ULL;
+
+    std::tm tm{};
+    int fields = sscanf(str, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                        &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    if(fields != 3 && fields != 6)
+        return false;
+    tm.tm_year -= 1900;
+    tm.tm_mon  -= 1;
+
+    std::time_t unix_timestamp = timegm(&tm);
+    if(unix_timestamp == (std::time_t)-1 || unix_timestamp < -(std::time_t)EPOCH_DIFFERENCE_SECONDS)
+        return false;
+
+    filetime = ((uint64_t)unix_timestamp + EPOCH_DIFFERENCE_SECONDS) * HUNDRED_NANOSECONDS_PER_SECOND;
+    return true;
 }
\ No newline at end of file
@@ -42,7 +42,10 @@ const char MAGIC[] = "msft-xvd";
 
 // HashTree Defines
 #define HASH_LENGTH                24
+#define HASH_LENGTH_ENCRYPTED      20           // Data hashes of encrypted XVDs, last 4 bytes hold the XTS data unit
 #define ROOT_HASH_LENGTH           32
+#define HASHES_PER_HASH_PAGE       170          // 0xAA hashes of 24 bytes fit in a 4K page
+#define HASH_TREE_MAX_LEVELS       4
 
 // Drive Defines
 #define SECTOR_SIZE_LEGACY         0x0200
@@ -319,6 +322,16 @@ struct XvdHeader
 
 } __attribute__ ((gcc_struct, __packed__));
 
+// Shape of a HashTree, computed from the number of data pages it protects.
+// See HashTreeSizeFromPageNum() in XanaduXVD.cpp for the theory of operation.
+struct XvdHashTreeShape
+{
+    uint64_t hashed_pages = 0;                              // Data pages covered by level 0
+    uint32_t num_levels   = 0;                              // 1 to 4, the top one is a single page
+    uint64_t pages_of_level[HASH_TREE_MAX_LEVELS]   = {};   // Hash pages of each level (0 = leaves)
+    uint64_t level_start_page[HASH_TREE_MAX_LEVELS] = {};   // First page of each level, relative to the HashTree start
+};
+
 struct MS_GUID 
 {          
     uint32_t Data1;
@@ -342,4 +355,6 @@ uint64_t AlignSizeToPageBoundary(uint64_t size_bytes);
 // Microsoft formats conversion methods
 std::string MsGUIDToString(MS_GUID guid);
 std::string MsVersionToString(uint64_t version, bool extended);
-std::string FiletimeToString(uint64_t filetime);
\ No newline at end of file
+std::string FiletimeToString(uint64_t filetime);
+bool        MsGUIDFromString(const char* str, MS_GUID& guid);          // Inverse of MsGUIDToString()
+bool        FiletimeFromString(const char* str, uint64_t& filetime);   // "YYYY-MM-DD[ HH:MM:SS]", UTC
\ No newline at end of file
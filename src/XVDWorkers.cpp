@@ -0,0 +1,55 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDWorkers.cpp - Implementation of the worker helpers */
+/*                                                        */
+/**********************************************************/
+
+///////////////////////////////////////
+// Project includes
+///////////////////////////////////////
+#include "XVDWorkers.h"
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//////////////////////////////////////////
+// WORKER METHODS                       //
+//////////////////////////////////////////
+unsigned DefaultWorkerCount()
+{
+    // hardware_concurrency() is allowed to return 0 if it can't tell
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores == 0 ? 1 : cores;
+}
+
+void ParallelFor(uint64_t num_items, unsigned num_workers, const std::function<void(uint64_t item)>& fn)
+{
+    if(num_workers == 0)
+        num_workers = DefaultWorkerCount();
+
+    // No point in having more threads than things to do
+    if(num_workers > num_items)
+        num_workers = (unsigned)num_items;
+
+    std::atomic<uint64_t> next_item{0};
+    auto worker = [&]()
+    {
+        for(uint64_t item = next_item++; item < num_items; item = next_item++)
+            fn(item);
+    };
+
+    // The calling thread works too, so N workers means N-1 extra threads
+    std::vector<std::thread> threads;
+    for(unsigned i = 1; i < num_workers; i++)
+        threads.emplace_back(worker);
+    worker();
+
+    for(auto& t : threads)
+        t.join();
+}
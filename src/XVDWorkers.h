@@ -0,0 +1,33 @@
+/**********************************************************/
+/* XanaduXVD: Monolithic XVD Parser / playground tool     */
+/*                    2024 (c) TorusHyperV                */
+/*                                                        */
+/*  XVDWorkers.h - Tiny helpers to spread independent     */
+/*                 work items across CPU cores.           */
+/*                                                        */
+/**********************************************************/
+
+#pragma once
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <functional>
+
+//////////////////////////////////////////
+// WORKER METHODS                       //
+//////////////////////////////////////////
+
+// Number of workers to use when the caller does not specify one (0). One per core.
+unsigned DefaultWorkerCount();
+
+// Calls fn(item) for every item in [0, num_items), spreading them across 'num_workers'
+// threads (0 = DefaultWorkerCount()). Items are handed out dynamically through a shared
+// atomic counter, so a slow item (e.g. a read that misses the page cache) doesn't stall
+// a statically assigned slice. Returns once every item has been processed.
+void ParallelFor(uint64_t num_items, unsigned num_workers, const std::function<void(uint64_t item)>& fn);
@@ -13,6 +13,29 @@
 // Project includes
 ///////////////////////////////////////
 #include "XanaduXVD.h"
+#include "XVDLog.h"
+#include "XVDTrace.h"
+#include "XVDBufferPool.h"
+
+///////////////////////////////////////
+// C includes
+///////////////////////////////////////
+#include <unistd.h> // pread, pwrite
+#include <limits.h> // IOV_MAX
+#include <sys/uio.h> // preadv
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h> // offsetof
+#include <sys/stat.h> // fstat
+
+///////////////////////////////////////
+// C++ includes
+///////////////////////////////////////
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 ///////////////////////////////////////
 // Windows includes (replace with wine later)
@@ -83,25 +106,62 @@
 XanaduXVD::XanaduXVD(const char* filename) : mFilename(filename)
 {}
 
-int XanaduXVD::Start(bool unsafe_mode, bool debug_mode)
+XanaduXVD::XanaduXVD(XanaduXVD&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+XanaduXVD& XanaduXVD::operator=(XanaduXVD&& other) noexcept
+{
+    if(this == &other)
+        return *this;
+
+    mFile         = std::move(other.mFile);
+    mIoQueueDepth = other.mIoQueueDepth;
+    mProgress     = other.mProgress;
+    mFilesize     = other.mFilesize;
+    mFilename     = other.mFilename;
+    mUnsafeMode   = other.mUnsafeMode;
+    mDebugMode    = other.mDebugMode;
+    mUseMmap      = other.mUseMmap;
+    mDirectIo     = other.mDirectIo;
+    mIsStarted    = other.mIsStarted;
+    mHeader       = other.mHeader;
+    mLayout       = std::move(other.mLayout);
+    mSectorSize   = other.mSectorSize;
+
+    // The file went with the move, the old object keeps its filename so it can be Start()ed again
+    other.mIsStarted = false;
+    other.mFilesize  = 0;
+    other.mProgress  = nullptr;
+    return *this;
+}
+
+int XanaduXVD::Start(bool unsafe_mode, bool debug_mode, bool use_mmap)
 {
     // Config object attributes
     mDebugMode  = debug_mode;
     mUnsafeMode = unsafe_mode;
+    mUseMmap    = use_mmap;
 
-    // 1. Open XVD File
-    FILE* f = fopen(mFilename.c_str(), "rb");
-    if (f == NULL) {
+    // 1. Open XVD File. It gets memory mapped read-only if possible, so that the header,
+    //    the BAT and the pages being hashed are read straight from the page cache.
+    //    In direct mode it's read with O_DIRECT instead, see XvdFile.
+    if (!mFile.Open(mFilename.c_str(), use_mmap, mDirectIo)) {
         fprintf(stderr, "ERR: Failed to open file '%s'!\n", mFilename.c_str());
         return 2;
     }
-    fprintf(stdout, "INFO: XVD opened in %s mode\n", mUnsafeMode ? "unsafe" : "safe");
-
-    // Save file descriptor
-    mFD = f;
+    if(mDebugMode)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: XVD opened in %s mode\n", mUnsafeMode ? "unsafe" : "safe");
+        XVD_LOG(XVD_LOG_DBG, "DBG: XVD is %s\n", mFile.IsMapped() ? "memory mapped" :
+                                                  mFile.IsDirect() ? "read with O_DIRECT" : "read with pread()");
+    }
+    if(mDirectIo && !mFile.IsDirect())
+        XVD_LOG(XVD_LOG_INFO, "INFO: O_DIRECT is not supported for '%s', reading through the page cache\n", mFilename.c_str());
 
-    // Get file size from filesystem directly
-    mFilesize = std::filesystem::file_size(mFilename.c_str());
+    // Get file size from the opened file directly
+    mFilesize = mFile.Size();
 
     // Check if the file_size makes sense
     if (mFilesize < XVD_HEADER_INCL_SIGNATURE) {
@@ -110,47 +170,61 @@ int XanaduXVD::Start(bool unsafe_mode, bool debug_mode)
         return 3;
     }
 
-    // Allocate a buffer to read the header into memory
-    char* buffer = (char*)calloc(1, XVD_HEADER_INCL_SIGNATURE);
-
-    // Read the header from file
-    fread(buffer, 1, XVD_HEADER_INCL_SIGNATURE, mFD);
+    // Get the header from the file (a view of the mapping, or read into a buffer otherwise)
+    {
+        XVD_TRACE_SCOPE(XVD_PHASE_HEADER_READ, XVD_HEADER_INCL_SIGNATURE);
+        XvdPoolChunk scratch;
+        auto header_view = mFile.ViewOrRead(0, XVD_HEADER_INCL_SIGNATURE, scratch);
+        if (header_view.empty()) {
+            fprintf(stderr, "ERR: Failed to read the header of '%s'!\n", mFilename.c_str());
+            return 3;
+        }
 
-    // Cast the buffer to the header struct
-    XvdHeader* xvd = (struct XvdHeader*)buffer;
+        // Copy into our object's memory. It has to be a copy since it may get its endianess fixed
+        memcpy(&mHeader, header_view.data(), sizeof(XvdHeader));
+    }
 
     // NOTE: Direct de-serialization works on big endian machines only. To support modern Windows ARM PCs,
     // other ARM devices, and M1/M2/M3/M4 Macs, detect if the endianess of the system
     // is little, and call an auxiliary method to fix the memory representation:
     if constexpr(std::endian::native == std::endian::little)
     {
-        FixHeaderEndianess(xvd);
+        FixHeaderEndianess(&mHeader);
     } // else TODO: should we check for std::endian::mixed instead of assuming big just in case?
 
-    // Copy into our object's memory
-    mHeader = *xvd;
-    free(buffer);
+    // 2. Basic format verification (magic, version, type, block size). The layout is computed
+    //    from the sizes in the header and reads the BAT, so a header that fails these isn't
+    //    used for it, unless in unsafe mode.
+    bool valid = IsValidHeaderFormat();
+    if(valid || mUnsafeMode)
+    {
+        // Figure out where every region is. Done once here, everything else just looks it up.
+        ComputeLayout();
 
-    // 2. Basic format verification (magic verification, sizes, etc)
-    if(!IsValidHeader())
+        // 3. The sizes in the header have to add up to the file
+        valid = IsValidHeader() && valid;
+    }
+    if(!valid)
     {
         fprintf(stderr, "ERR: File '%s' -> Header verification failed\n", mFilename.c_str());
         if(!mUnsafeMode)
             return 4;
         else
-        fprintf(stdout, "INFO: Ignoring errors in unsafe mode. Moving on...\n");
+        XVD_LOG(XVD_LOG_INFO, "INFO: Ignoring errors in unsafe mode. Moving on...\n");
     }
 
     // If we have verified the header, we can do some parsing
     // ParseHeader()
 
+    mIsStarted = true;
     return 0;
 }
 
 int XanaduXVD::Stop()
 {
-    // Close XVD File
-    fclose(mFD);
+    // Close XVD File (and drop the mapping)
+    mFile.Close();
+    mIsStarted = false;
 
     // free(buffer)s
     return 0;
@@ -209,41 +283,80 @@ void XanaduXVD::FixHeaderEndianess(XvdHeader* xvd_header)
     */
 }
 
-bool XanaduXVD::IsValidHeader()
+bool XanaduXVD::ReadAt(void* dst, uint64_t length, uint64_t offset) const
+{
+    // Copy out of the mapping, or pread(). Either way no cursor is involved, so several
+    // worker threads can read different parts of the XVD at the same time.
+    return mFile.Read(dst, length, offset);
+}
+
+uint64_t XanaduXVD::DataPagesInFile() const
+{
+    // Whole pages from the start of the UserData (the first hashed page) to the end of the file
+    uint64_t data_offset = mLayout.Offset(XVD_REGION_USERDATA);
+    return (mFilesize > data_offset) ? (mFilesize - data_offset) / XVD_PAGE_SIZE : 0;
+}
+
+bool XanaduXVD::WriteAt(int fd, const void* src, uint64_t length, uint64_t offset)
+{
+    XVD_TRACE_SCOPE(XVD_PHASE_WRITE, length);
+    const uint8_t* in = (const uint8_t*)src;
+    while(length > 0)
+    {
+        ssize_t done = pwrite(fd, in, length, offset);
+        XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+        if(done <= 0)
+        {
+            if(done < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        XVD_TRACE_COUNT(XVD_COUNTER_BYTES_WRITTEN, done);
+        in     += done;
+        offset += done;
+        length -= done;
+    }
+    return true;
+}
+
+bool XanaduXVD::IsValidHeaderFormat()
 {
     // Check MAGIC
     if (memcmp(mHeader.magic, MAGIC, 8)) {
-        fprintf(stderr, "ERR: File '%s' -> Invalid magic, not msft-xvd, got: %s!\n",
-                mFilename.c_str(), mHeader.magic);
-        return 4;
+        fprintf(stderr, "ERR: File '%s' -> Invalid magic, not msft-xvd, got: %.8s!\n",
+                mFilename.c_str(), (const char*)mHeader.magic);
+        return false;
     }
 
     // Print flags about the XVD
-    fprintf(stdout, "DBG: Xvd Type:                       %s\n\n", mHeader.xvd_type == XvdType::FIXED ? "Fixed" : "Dynamic");
-    fprintf(stdout, "DBG: Content Type:                   %s\n\n", ContentTypeStr(mHeader.content_type));
-    fprintf(stdout, "DBG: ReadOnly:                       %s\n", (mHeader.flags.ReadOnly == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: ResiliencyEnabled:              %s\n", (mHeader.flags.ResiliencyEnabled == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: DataIntegrityDisabled:          %s\n", (mHeader.flags.DataIntegrityDisabled == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: EncryptionDisabled:             %s\n", (mHeader.flags.EncryptionDisabled == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: LegacySectorSize:               %s\n", (mHeader.flags.LegacySectorSize == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: SraReadOnly:                    %s\n", (mHeader.flags.SraReadOnly == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: TrimSupported:                  %s\n", (mHeader.flags.TrimSupported == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: StreamingRoamable:              %s\n", (mHeader.flags.StreamingRoamable == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: RoamingEnabled:                 %s\n", (mHeader.flags.RoamingEnabled == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: TitleSpecific:                  %s\n", (mHeader.flags.TitleSpecific == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: DiffusiveDisabled:              %s\n", (mHeader.flags.DiffusiveDisabled == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: PointerXvd:                     %s\n", (mHeader.flags.PointerXvd == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: RegionIdInXts:                  %s\n", (mHeader.flags.RegionIdInXts == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: SpoofedDuid:                    %s\n", (mHeader.flags.SpoofedDuid == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: Reserved0 (prev TrimSupported): %s\n", (mHeader.flags.Reserved0 == 1) ? "Yes" : "No");
-    fprintf(stdout, "DBG: Reserved Area:                  0x%8x\n", mHeader.flags.Reserved);
-    printf("\n");
+    if(mDebugMode)
+    {
+        XVD_LOG(XVD_LOG_DBG, "DBG: Xvd Type:                       %s\n\n", mHeader.xvd_type == XvdType::FIXED ? "Fixed" : "Dynamic");
+        XVD_LOG(XVD_LOG_DBG, "DBG: Content Type:                   %s\n\n", ContentTypeStr(mHeader.content_type));
+        XVD_LOG(XVD_LOG_DBG, "DBG: ReadOnly:                       %s\n", (mHeader.flags.ReadOnly == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: ResiliencyEnabled:              %s\n", (mHeader.flags.ResiliencyEnabled == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: DataIntegrityDisabled:          %s\n", (mHeader.flags.DataIntegrityDisabled == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: EncryptionDisabled:             %s\n", (mHeader.flags.EncryptionDisabled == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: LegacySectorSize:               %s\n", (mHeader.flags.LegacySectorSize == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: SraReadOnly:                    %s\n", (mHeader.flags.SraReadOnly == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: TrimSupported:                  %s\n", (mHeader.flags.TrimSupported == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: StreamingRoamable:              %s\n", (mHeader.flags.StreamingRoamable == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: RoamingEnabled:                 %s\n", (mHeader.flags.RoamingEnabled == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: TitleSpecific:                  %s\n", (mHeader.flags.TitleSpecific == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: DiffusiveDisabled:              %s\n", (mHeader.flags.DiffusiveDisabled == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: PointerXvd:                     %s\n", (mHeader.flags.PointerXvd == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: RegionIdInXts:                  %s\n", (mHeader.flags.RegionIdInXts == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: SpoofedDuid:                    %s\n", (mHeader.flags.SpoofedDuid == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: Reserved0 (prev TrimSupported): %s\n", (mHeader.flags.Reserved0 == 1) ? "Yes" : "No");
+        XVD_LOG(XVD_LOG_DBG, "DBG: Reserved Area:                  0x%8x\n", mHeader.flags.Reserved);
+        XVD_LOG(XVD_LOG_DBG, "\n");
+    }
 
     // Check XVD format version
     // At the moment, XanaduXVD only supports v2 and v3, other versions have not been found in the wild
     if(mHeader.format_version != 3)
     {
-        printf("Rare XVD Format Version found: v %d\n", mHeader.format_version);
+        XVD_LOG(XVD_LOG_INFO, "Rare XVD Format Version found: v %d\n", mHeader.format_version);
         if(mHeader.format_version != 2)
             return false;
     }
@@ -263,64 +376,28 @@ bool XanaduXVD::IsValidHeader()
     }
 
     // TODO Add some more checks in the future? Think of more checks
+    return true;
+}
 
+bool XanaduXVD::IsValidHeader()
+{
     // Consider the size check as a validity check. Add extra override to disabled this
-    uint64_t computed_filesize = 0;
-    if(mHeader.xvd_type == XvdType::FIXED)
-    {
-        computed_filesize = 
-        (
-            XVD_HEADER_INCL_SIGNATURE    +  // Header + Sig
-            FindEmbeddedXVDSize()        +  // Size of the embedded XVD
-            FindMDUSize()                +  // Size of mutable XVC info
-            FindHashTreeSize()           +  // Size of the HashTree
-            FindUserDataSize()           +  // Size of user data region
-            FindXVCSize()                +  // Size of XVC Region
-            FindDynHeaderSize()          +  // This will be 0 anyways since it's a fixed XVD...
-            FindDriveSize()                 // Size of the static Drive
-        );
-    }
-    else
-    {
-        computed_filesize = 
-        (
-            XVD_HEADER_INCL_SIGNATURE     +  // Header + Sig
-            FindEmbeddedXVDSize()         +  // Size of the embedded XVD
-            FindMDUSize()                 +  // Size of mutable XVC info
-            FindHashTreeSize()               // Size of the HashTree (in this case it'll be computed differently)
-        );
-
-        // On Dynamic XVDs, data can be added or deleted, thus changing the container size.
-        // This affects the UserData, XVC and Drive regions, but also the BAT/DynamicHeader,
-        // which keeps tracks of the mappings for the previously mentioned regions, thus it
-        // also changes.
-        computed_filesize += FindDynamicOccupancy();
-    }
+    // (the expected size was already computed together with the layout, see ComputeLayout())
+    uint64_t computed_filesize = mLayout.ComputedFileSize();
 
     // Some extra debug prints
     if(mDebugMode)
     {
         // Print all the individual sizes to take into account for debugging purposes
-        fprintf(stdout, "\n");
-        fprintf(stdout, "DBG: XvdHeader_W_SIGNATURE: 0x%16x\n",  XVD_HEADER_INCL_SIGNATURE);
-        fprintf(stdout, "DBG: embedded_xvd_length:    0x%16x\n", FindEmbeddedXVDSize());
-        fprintf(stdout, "DBG: mutable_data_length:    0x%16x\n", FindMDUSize());
-        fprintf(stdout, "DBG: hash_tree_length:       0x%16x\n", FindHashTreeSize());
-        
-        if(mHeader.xvd_type == XvdType::FIXED)
-        {
-            fprintf(stdout, "DBG: user_data_length:       0x%16x\n", FindUserDataSize());
-            fprintf(stdout, "DBG: xvc_info_length:        0x%16x\n", FindXVCSize());
-            fprintf(stdout, "DBG: dynamic_header_length:  0x%16x\n", FindDynHeaderSize());
-            fprintf(stdout, "DBG: drive_size:             0x%16llx\n\n", FindDriveSize());
-        }
-        else
-        {
-            fprintf(stdout, "DBG: user_data_length:       0x%16x\n", FindUserDataSize());
-            fprintf(stdout, "DBG: xvc_info_length:        0x%16x\n", FindXVCSize());
-            fprintf(stdout, "DBG: dynamic_header_length:  0x%16x\n", FindDynHeaderSize());
-            fprintf(stdout, "DBG: drive_size:             0x%16llx\n\n", FindDriveSize());
-        }
+        XVD_LOG(XVD_LOG_DBG, "\n");
+        XVD_LOG(XVD_LOG_DBG, "DBG: XvdHeader_W_SIGNATURE: 0x%16x\n",  XVD_HEADER_INCL_SIGNATURE);
+        XVD_LOG(XVD_LOG_DBG, "DBG: embedded_xvd_length:    0x%16llx\n", (unsigned long long)mLayout.Length(XVD_REGION_EXVD));
+        XVD_LOG(XVD_LOG_DBG, "DBG: mutable_data_length:    0x%16llx\n", (unsigned long long)mLayout.Length(XVD_REGION_MDU));
+        XVD_LOG(XVD_LOG_DBG, "DBG: hash_tree_length:       0x%16llx\n", (unsigned long long)mLayout.Length(XVD_REGION_HASHTREE));
+        XVD_LOG(XVD_LOG_DBG, "DBG: user_data_length:       0x%16llx\n", (unsigned long long)mLayout.Length(XVD_REGION_USERDATA));
+        XVD_LOG(XVD_LOG_DBG, "DBG: xvc_info_length:        0x%16llx\n", (unsigned long long)mLayout.Length(XVD_REGION_XVC));
+        XVD_LOG(XVD_LOG_DBG, "DBG: dynamic_header_length:  0x%16llx\n", (unsigned long long)mLayout.Length(XVD_REGION_DYNHEADER));
+        XVD_LOG(XVD_LOG_DBG, "DBG: drive_size:             0x%16llx\n\n", (unsigned long long)mLayout.Length(XVD_REGION_DRIVE));
     }
 
     if (mFilesize != computed_filesize)
@@ -334,14 +411,14 @@ bool XanaduXVD::IsValidHeader()
         return false;
     }
     else if(mDebugMode)
-        fprintf(stdout, "OUT: File '%s' -> Size matches. real: 0x%llx, calculated: 0x%llx!\n", mFilename.c_str(), mFilesize, computed_filesize);
+        XVD_LOG(XVD_LOG_DBG, "OUT: File '%s' -> Size matches. real: 0x%llx, calculated: 0x%llx!\n", mFilename.c_str(), mFilesize, computed_filesize);
 
     // TODO: Add print about the XVD Having unusual flags set
 
     // PLS Check (debug for now)
     if(mDebugMode && (mHeader.pls_size != 0))
     {
-        printf("XVD Has PLS Size: %d\n", mHeader.pls_size);
+        XVD_LOG(XVD_LOG_DBG, "XVD Has PLS Size: %d\n", mHeader.pls_size);
     }
 
     return true;
@@ -356,22 +433,95 @@ void XanaduXVD::ParseHeader()
         mSectorSize = SECTOR_SIZE_MODERN;
 }
 
+//////////////////////////////////////////
+// Layout                               //
+//////////////////////////////////////////
+void XanaduXVD::ComputeLayout()
+{
+    // Computes the offset and size of every region ONCE, when opening the XVD. Before this
+    // existed, every Find*Position() called the previous region's position and size, so the
+    // cost compounded down the chain, and for dynamic XVDs every FindDriveSize() re-read the
+    // whole BAT from disk. Now the Find*Size() methods are only called from here, and the
+    // Find*Position() methods (and everyone else) just look up the result in mLayout.
+    XVD_TRACE_SCOPE(XVD_PHASE_LAYOUT, 0);
+    mLayout = XvdLayout{};
+    XvdRegion* regions = mLayout.mRegions;
+
+    // Header (+ signature) has a fixed max size of 0x3000
+    regions[XVD_REGION_HEADER]    = { 0, XVD_HEADER_INCL_SIGNATURE, XVD_PAGE_SIZE };
+
+    // Embedded XVD, if existing, is always the first thing after the header. So
+    // it will always be at 0x3000 (if it is present)
+    regions[XVD_REGION_EXVD]      = { regions[XVD_REGION_HEADER].End(), FindEmbeddedXVDSize(), XVD_PAGE_SIZE };
+
+    // Mutable Data always comes after EmbeddedXVD. Thus It will be found immediately after the EmbeddedXVD
+    regions[XVD_REGION_MDU]       = { regions[XVD_REGION_EXVD].End(), FindMDUSize(), XVD_PAGE_SIZE };
+
+    // HashTree always comes after MDU. Thus it will be found immediately after the mutable data region.
+    regions[XVD_REGION_HASHTREE]  = { regions[XVD_REGION_MDU].End(), FindHashTreeSize(), XVD_PAGE_SIZE };
+    regions[XVD_REGION_USERDATA]  = { regions[XVD_REGION_HASHTREE].End(), FindUserDataSize(), XVD_PAGE_SIZE };
+    regions[XVD_REGION_XVC]       = { regions[XVD_REGION_USERDATA].End(), FindXVCSize(), XVD_PAGE_SIZE };
+    regions[XVD_REGION_DYNHEADER] = { regions[XVD_REGION_XVC].End(), FindDynHeaderSize(), BAT_ENTRY_SIZE }; // NO Alignment
+
+    mLayout.mHashTreeShape = HashTreeShapeFromPageNum(FindHashedPageNum());
+
+    // The BAT is needed to know how much of the Drive of a dynamic XVD is actually in the file.
+    // This is the one and only place where it is read.
+    if(mHeader.xvd_type == XvdType::DYNAMIC)
+        mLayout.mDynamicOccupancy = FindDynamicOccupancy();
+
+    // If dynamic XVD, the drive will be after the DynHeader. If static XVD, the drive will be after the XVC_REGION
+    uint64_t drive_offset = (mHeader.xvd_type == XvdType::DYNAMIC) ? regions[XVD_REGION_DYNHEADER].End()
+                                                                    : regions[XVD_REGION_XVC].End();
+    uint64_t drive_size   = FindDriveSize();
+    regions[XVD_REGION_DRIVE] = { drive_offset, drive_size,
+                                  (AlignSizeToPageBoundary(drive_size) == drive_size) ? (uint64_t)XVD_PAGE_SIZE : 1ull };
+
+    // And what all of that adds up to, for IsValidHeader()
+    if(mHeader.xvd_type == XvdType::FIXED)
+    {
+        mLayout.mComputedFileSize =
+        (
+            XVD_HEADER_INCL_SIGNATURE                  +  // Header + Sig
+            regions[XVD_REGION_EXVD].length            +  // Size of the embedded XVD
+            regions[XVD_REGION_MDU].length             +  // Size of mutable XVC info
+            regions[XVD_REGION_HASHTREE].length        +  // Size of the HashTree
+            regions[XVD_REGION_USERDATA].length        +  // Size of user data region
+            regions[XVD_REGION_XVC].length             +  // Size of XVC Region
+            regions[XVD_REGION_DYNHEADER].length       +  // This will be 0 anyways since it's a fixed XVD...
+            regions[XVD_REGION_DRIVE].length              // Size of the static Drive
+        );
+    }
+    else
+    {
+        // On Dynamic XVDs, data can be added or deleted, thus changing the container size.
+        // This affects the UserData, XVC and Drive regions, but also the BAT/DynamicHeader,
+        // which keeps tracks of the mappings for the previously mentioned regions, thus it
+        // also changes.
+        mLayout.mComputedFileSize =
+        (
+            XVD_HEADER_INCL_SIGNATURE                  +  // Header + Sig
+            regions[XVD_REGION_EXVD].length            +  // Size of the embedded XVD
+            regions[XVD_REGION_MDU].length             +  // Size of mutable XVC info
+            regions[XVD_REGION_HASHTREE].length        +  // Size of the HashTree (in this case it'll be computed differently)
+            mLayout.mDynamicOccupancy
+        );
+    }
+}
+
 //////////////////////////////////////////
 // eXVD                                 //
 //////////////////////////////////////////
 uint64_t XanaduXVD::FindEmbeddedXVDPosition()
 {
-    // Embedded XVD, if existing, is always the first thing after
-    // the header. Header is a fixed max size of 0x3000, so the eXVD
-    // will always be at that offset. (if it is present)
-    return 0x3000;
+    return mLayout.Offset(XVD_REGION_EXVD); // See ComputeLayout()
 }
 
 uint64_t XanaduXVD::FindEmbeddedXVDSize()
 {
-    if(AlignSizeToPageBoundary(mHeader.embedded_xvd_length) != mHeader.embedded_xvd_length)
+    if(mDebugMode && AlignSizeToPageBoundary(mHeader.embedded_xvd_length) != mHeader.embedded_xvd_length)
     {
-        printf("INFO: embedded_xvd_length alignment problem - should probably not use alignment\n");
+        XVD_LOG(XVD_LOG_INFO, "INFO: embedded_xvd_length alignment problem - should probably not use alignment\n");
     }
 
     // If the header says eXVD length is 0, it means the XVD does
@@ -384,11 +534,7 @@ uint64_t XanaduXVD::FindEmbeddedXVDSize()
 //////////////////////////////////////////
 uint64_t XanaduXVD::FindMDUPosition()
 {
-    // Mutable Data always comes after EmbeddedXVD. Thus
-    // It will be found immediately after the EmbeddedXVD
-
-    // Otherwise, mutable starts at the end of EmbeddedXVD
-    return FindEmbeddedXVDPosition() + FindEmbeddedXVDSize();
+    return mLayout.Offset(XVD_REGION_MDU);
 }
 
 uint64_t XanaduXVD::FindMDUSize()
@@ -403,9 +549,7 @@ uint64_t XanaduXVD::FindMDUSize()
 //////////////////////////////////////////
 uint64_t XanaduXVD::FindHashTreePosition()
 {
-    // HashTree always comes after MDU. Thus it will be found
-    // immediately after the mutable data region.
-    return FindMDUPosition() + FindMDUSize();
+    return mLayout.Offset(XVD_REGION_HASHTREE);
 }
 
 uint64_t XanaduXVD::FindHashTreeSize()
@@ -421,7 +565,12 @@ uint64_t XanaduXVD::FindHashTreeSize()
     // The size of the HashTree depends pretty much on the size of
     // the data that it hashes. In other words, the more data pages
     // that need to be hashed, the bigger the HashTree would be.
+    // Compute the size that the HashTree will have
+    return HashTreeSizeFromPageNum(FindHashedPageNum(), has_resiliency_en);
+}
 
+uint64_t XanaduXVD::FindHashedPageNum()
+{
     // Most specifically, the following regions seem to be being hashed:
     // - Drive
     // - UserData
@@ -434,14 +583,11 @@ uint64_t XanaduXVD::FindHashTreeSize()
     // that would be obtained from hashing all of those data pages.
     if(mHeader.xvd_type == XvdType::FIXED)
     {
-        auto hashed_pages = BytesToPages(
-                                FindDriveSize()    
-                                + FindUserDataSize()
-                                + FindXVCSize()
-                                + FindDynHeaderSize());
-
-        // Compute the size that the HashTree will have
-        return HashTreeSizeFromPageNum(hashed_pages, has_resiliency_en);
+        return BytesToPages(
+                    FindDriveSize()    
+                    + FindUserDataSize()
+                    + FindXVCSize()
+                    + FindDynHeaderSize());
     }
     else
     {
@@ -477,13 +623,13 @@ uint64_t XanaduXVD::FindHashTreeSize()
                          AlignSizeToPageBoundary(mHeader.dynamic_header_length) +
                          AlignSizeToPageBoundary(mHeader.xvc_data_length);
 
-        printf("head_size:          %d\n", head_size);
-        printf("bat_computed_size:  %d\n", size_bytes);
+        XVD_LOG(XVD_LOG_DBG, "head_size:          %d\n", head_size);
+        XVD_LOG(XVD_LOG_DBG, "bat_computed_size:  %d\n", size_bytes);
         */
 
         auto exact_division = (size_bytes % XVD_PAGE_SIZE) == 0;
         auto size_in_pages = (size_bytes) / XVD_PAGE_SIZE + (exact_division ? 0 : 1);
-        return HashTreeSizeFromPageNum(size_in_pages, has_resiliency_en);
+        return size_in_pages;
     }
 }
 
@@ -741,12 +887,42 @@ done:
     return total_hashtree_pages * XVD_PAGE_SIZE;
 }
 
+XvdHashTreeShape XanaduXVD::HashTreeShapeFromPageNum(uint64_t num_pages_to_hash)
+{
+    // Same math as HashTreeSizeFromPageNum() above (go read the theory of operation there),
+    // but keeping the page count of every level and where each level starts inside the
+    // HashTree region, which is what's needed to actually walk the tree.
+    XvdHashTreeShape shape{};
+    shape.hashed_pages = num_pages_to_hash;
+
+    // Level 0 always exists. Each extra level is 170 times smaller than the one below,
+    // and we stop as soon as a level fits in a single page (that's the top of the tree).
+    uint64_t children = num_pages_to_hash;
+    do
+    {
+        shape.pages_of_level[shape.num_levels] = (children + HASHES_PER_HASH_PAGE - 1) / HASHES_PER_HASH_PAGE;
+        children = shape.pages_of_level[shape.num_levels];
+        shape.num_levels++;
+    } while(children > 1 && shape.num_levels < HASH_TREE_MAX_LEVELS);
+
+    // Levels are stored top first (LEVEL_3, LEVEL_2, LEVEL_1, LEVEL_0), so
+    // the top level starts at page 0 and level 0 comes last.
+    uint64_t page = 0;
+    for(int level = shape.num_levels - 1; level >= 0; level--)
+    {
+        shape.level_start_page[level] = page;
+        page += shape.pages_of_level[level];
+    }
+
+    return shape;
+}
+
 //////////////////////////////////////////
 // UserData                             //
 //////////////////////////////////////////
 uint64_t XanaduXVD::FindUserDataPosition()
 {
-    return FindHashTreePosition() + FindHashTreeSize();
+    return mLayout.Offset(XVD_REGION_USERDATA);
 }
 
 uint64_t XanaduXVD::FindUserDataSize()
@@ -759,15 +935,15 @@ uint64_t XanaduXVD::FindUserDataSize()
 //////////////////////////////////////////
 uint64_t XanaduXVD::FindXVCPosition()
 {
-    return FindUserDataPosition() + FindUserDataSize();
+    return mLayout.Offset(XVD_REGION_XVC);
 }
 
 uint64_t XanaduXVD::FindXVCSize()
 {
 
-    if(AlignSizeToPageBoundary(mHeader.xvc_data_length) != mHeader.xvc_data_length)
+    if(mDebugMode && AlignSizeToPageBoundary(mHeader.xvc_data_length) != mHeader.xvc_data_length)
     {
-        printf("INFO: xvc_data_length alignment problem - should probably not use alignment\n");
+        XVD_LOG(XVD_LOG_INFO, "INFO: xvc_data_length alignment problem - should probably not use alignment\n");
     }
 
     return AlignSizeToPageBoundary(mHeader.xvc_data_length); // Alignment here might or might not be needed, but adding it just in case
@@ -781,7 +957,7 @@ uint64_t XanaduXVD::FindXVCSize()
 //////////////////////////////////////////
 uint64_t XanaduXVD::FindDynHeaderPosition()
 {
-    return FindXVCPosition() + FindXVCSize();
+    return mLayout.Offset(XVD_REGION_DYNHEADER);
 }
 
 uint64_t XanaduXVD::FindDynHeaderSize()
@@ -794,12 +970,7 @@ uint64_t XanaduXVD::FindDynHeaderSize()
 //////////////////////////////////////////
 uint64_t XanaduXVD::FindDrivePosition()
 {
-    // If dynamic XVD, the drive will be after the DynHeader
-    if(mHeader.xvd_type == XvdType::DYNAMIC)
-        return FindDynHeaderPosition() + FindDynHeaderSize();
-
-    // If static XVD, the drive will be after the XVC_REGION
-    return FindXVCPosition() + FindXVCSize();
+    return mLayout.Offset(XVD_REGION_DRIVE);
 }
 
 uint64_t XanaduXVD::FindDriveSize()
@@ -807,7 +978,8 @@ uint64_t XanaduXVD::FindDriveSize()
     // Test stuff
     if(AlignSizeToPageBoundary(mHeader.drive_size) != mHeader.drive_size)
     {
-        printf("found alignment problem - working w/o alignment\n");
+        if(mDebugMode)
+            XVD_LOG(XVD_LOG_DBG, "found alignment problem - working w/o alignment\n");
         return mHeader.drive_size;
     }
 
@@ -821,7 +993,8 @@ uint64_t XanaduXVD::FindDriveSize()
 
 uint64_t XanaduXVD::ComputeUsedDriveSizeInDynamicXVD()
 {
-    uint64_t ocupancy = FindDynamicOccupancy();
+    // Already computed from the BAT by ComputeLayout()
+    uint64_t ocupancy = mLayout.DynamicOccupancy();
 
     // This might seem like a random computation, but if you draw it it's very easy.
     // It all comes together once you remember that the mHeader.drive_size is not the actual occupancy of the disk,
@@ -870,59 +1043,70 @@ uint64_t XanaduXVD::FindDynamicOccupancy()
 
     // 1. Find the BAT offset. This is now possible since we know the sizes of all previous regions (especially the HashTree)
     //     HashTree comes always after MDU and then we have user data, XVC, and finally we'd reach the BAT start offset.
-    auto bat_start = FindHashTreePosition() + FindHashTreeSize() + 
-                    + mHeader.user_data_length 
-                    + mHeader.xvc_data_length;
-
+    auto bat_start = mLayout.Offset(XVD_REGION_DYNHEADER);
     auto bat_size  = mHeader.dynamic_header_length;
 
     //printf("bat_start: 0x%16x\n", bat_start);
     //printf("bat_size:  0x%16x\n", bat_size);
 
+    // A corrupted header could point us to a huge BAT out of the file, don't even try
+    if(bat_start + bat_size > mFilesize)
+    {
+        fprintf(stderr, "ERR: File '%s' -> BAT (0x%llx bytes at 0x%llx) is out of the file!\n",
+                mFilename.c_str(), (unsigned long long)bat_size, (unsigned long long)bat_start);
+        return 0;
+    }
+
     // 2. Iterate through the BAT entries and find how many entries are valid
-    // Allocate a buffer to read the BAT
-    char* bat_data = (char *)calloc(1, bat_size);
-    fseek(mFD, bat_start, SEEK_SET);
-    fread(bat_data, 1, bat_size, mFD);
-
-    // Each block is mapped by one entry. There are as many entries as blocks
-    uint32_t max_entry = 0;
-    size_t   unallocated_entries = 0;
-    size_t   allocated_entries   = 0;
-    int      curr_entry = 0;
-    auto     bat_entries = bat_size / 4;
-    for(curr_entry; curr_entry < bat_entries; curr_entry++)
-    {
-        // Invalid entry found. Count it and ignore it
-        auto entry = ((uint32_t*)bat_data)[curr_entry];
-        if(entry == (uint32_t)XVD_INVALID_BLOCK)
-        {
-            unallocated_entries++;
-            continue;
-        }
-        
-        // Save the latest found valid entry that is a bigger offset than what previously found
-        allocated_entries++;
-        if(max_entry < entry)
-            max_entry = entry;        
+    // When the XVD is mapped, the BAT is scanned straight from the page cache.
+    std::vector<uint8_t> scratch;
+    auto bat_view = mFile.ViewOrRead(bat_start, bat_size, scratch);
+    if(bat_view.size() != bat_size)
+    {
+        fprintf(stderr, "ERR: File '%s' -> Failed to read the BAT!\n", mFilename.c_str());
+        return 0;
     }
-    /*
-    printf("latest valid bat_index: %d / max entry value: 0x%x\n", curr_entry, max_entry);
-    printf("ALLOCATED ENTRIES | ENTRIES\n");
-    printf("%d | %d", allocated_entries, bat_entries);
-    */
 
-    free(bat_data);
-    
-    // I have not figured exactly why I have to add +1 to the number of BAT entries unfortunately. 
-    // The count of allocated entries is correct, so the +1 shouldn't be needed, but it is.
-    return (allocated_entries+1) * XVD_BLOCK_SIZE;
+    // 3. As Remark 1 says, the first entries map the blocks of UserData, XVC and the BAT itself,
+    //    the Drive comes after them: BAT index = (metadata + virtual offset) / block size.
+    size_t   bat_entries    = bat_size / BAT_ENTRY_SIZE;
+    uint64_t metadata_bytes = mLayout.Region(XVD_REGION_DYNHEADER).End() - mLayout.Offset(XVD_REGION_USERDATA);
+    size_t   metadata       = std::min<uint64_t>(bat_entries, (metadata_bytes + XVD_BLOCK_SIZE - 1) / XVD_BLOCK_SIZE);
+    uint64_t allocated_metadata = 0;
+    for(size_t entry = 0; entry < metadata; entry++)
+    {
+        uint32_t value;
+        memcpy(&value, bat_view.data() + entry * BAT_ENTRY_SIZE, BAT_ENTRY_SIZE);
+        allocated_metadata += (value != (uint32_t)XVD_INVALID_BLOCK);
+    }
+    mLayout.mMetadataBlocks = metadata;
+
+    // Each Drive block is mapped by one entry. The scanner counts the valid ones and finds the
+    // max entry as before, but in the same (SIMD) pass it also builds the allocation bitmap and
+    // the extents (in Drive blocks), so nobody has to walk the BAT again.
+    size_t drive_entries = bat_entries - metadata;
+    ScanBat(bat_view.data() + metadata * BAT_ENTRY_SIZE, drive_entries, mLayout.mBatScan);
+    uint64_t allocated_entries = mLayout.mBatScan.allocated_blocks;
+
+    if(mDebugMode)
+        XVD_LOG(XVD_LOG_DBG, "DBG: BAT: %llu metadata blocks, %llu of %llu Drive blocks allocated in %llu extents, max entry 0x%x, %.2f%% fragmented\n",
+               (unsigned long long)metadata, (unsigned long long)allocated_entries, (unsigned long long)drive_entries,
+               (unsigned long long)mLayout.mBatScan.extents.size(), mLayout.mBatScan.max_entry,
+               mLayout.mBatScan.Fragmentation().percent);
+
+    // Keep a copy of the Drive part of the table in the layout for the block translation code
+    mLayout.mBat.resize(drive_entries);
+    memcpy(mLayout.mBat.data(), bat_view.data() + metadata * BAT_ENTRY_SIZE, drive_entries * BAT_ENTRY_SIZE);
+
+    // The metadata blocks are in the file too, before the Drive blocks. That's the +1 that
+    // used to be added here: block 0 wasn't counted when only the Drive entries were.
+    return (allocated_metadata + allocated_entries) * XVD_BLOCK_SIZE;
 }
 
 //////////////////////////////////////////
 // PUBLIC / USER FACING METHODS         //
 //////////////////////////////////////////
-int XanaduXVD::InfoDump()
+int XanaduXVD::InfoDump() const
 {
     // Internally keep track of all the relevant values in a serialized form
     // Could probably be a vector of pairs of strs for faster access but idc
@@ -956,90 +1140,2502 @@ int XanaduXVD::InfoDump()
     return 0;    
 }
 
-int XanaduXVD::ExtractEmbeddedXVD(const char* output_filename)
+int XanaduXVD::ExtractRegion(XvdRegionId region, const char* output_filename) const
+{
+    // Extracting is just copying a range of the XVD into a new file. XvdFile::CopyTo() lets
+    // the kernel do that (copy_file_range / sendfile), and only falls back to a read/write
+    // loop with two small buffers if it has to. So extracting a multi-GB region uses constant
+    // memory and goes about as fast as a 'cp' would.
+    auto size = mLayout.Length(region);
+    auto pos  = mLayout.Offset(region);
+
+    int fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", output_filename);
+        return 2;
+    }
+
+    int ret = CopyOut(fd, pos, size, 0);
+    if (close(fd) != 0 && ret == 0)
+        ret = IO_ERROR;
+
+    if (ret == CANCELLED) {
+        XVD_LOG(XVD_LOG_INFO, " [CANCELLED]\n");
+        remove(output_filename);
+        return ret;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "ERR: Failed to copy %s (0x%llx bytes at 0x%llx) into '%s'!\n", RegionIdStr(region),
+                (unsigned long long)size, (unsigned long long)pos, output_filename);
+        return IO_ERROR;
+    }
+
+    return 0;
+}
+
+int XanaduXVD::ExtractEmbeddedXVD(const char* output_filename) const
 {
     // Get the eXVD region size
-    auto exvd_size = FindEmbeddedXVDSize();
-    auto exvd_pos  = FindEmbeddedXVDPosition();
-    if(exvd_size == 0)
+    if(mLayout.Length(XVD_REGION_EXVD) == 0)
     {
         fprintf(stderr, "ERR: XVD does not contain an eXVD.\n");
         return 1;
     }
 
-    printf("Extracting Embedded XVD...");
-
-    // Allocate a buffer to read the eXVD into memory
-    char* buffer = (char *)calloc(1, exvd_size);
-    fseek(mFD, exvd_pos, SEEK_SET);
-    fread(buffer, 1, exvd_size, mFD);
-
-    // Future optimization: eXVD potentially a large file
-    // to read chunk by chunk
+    XVD_LOG(XVD_LOG_INFO, "Extracting Embedded XVD...");
 
-    // Write to output file
-    FILE* f = fopen(output_filename, "wb");
-    if (f == NULL) {
-        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", output_filename);
-        return 2;
-    }
-    fwrite(buffer, 1, exvd_size, f);
-    fclose(f);
-    free(buffer);
+    if(auto ret = ExtractRegion(XVD_REGION_EXVD, output_filename); ret)
+        return ret;
 
     // IMPROVEMENT: Open the extracted eXVD and check its ID matches
     // against the parent XVD header
 
-    printf(" [DONE]\n");
+    XVD_LOG(XVD_LOG_INFO, " [DONE]\n");
     return 0;
 }
 
-int XanaduXVD::ExtractUserData(const char* output_filename)
+int XanaduXVD::ExtractUserData(const char* output_filename) const
 {
-    // Get the eXVD region size
-    auto userdata_size = FindUserDataSize();
-    auto userdata_pos  = FindUserDataPosition();
-    if(userdata_size == 0)
+    // Get the UserData region size
+    if(mLayout.Length(XVD_REGION_USERDATA) == 0)
     {
         fprintf(stderr, "ERR: XVD does not contain UserData.\n");
         return 1;
     }
 
-    printf("Extracting UserData...");
+    XVD_LOG(XVD_LOG_INFO, "Extracting UserData...");
+
+    if(auto ret = ExtractRegion(XVD_REGION_USERDATA, output_filename); ret)
+        return ret;
+
+    XVD_LOG(XVD_LOG_INFO, " [DONE]\n");
+    return 0;
+}
+
+int XanaduXVD::CopyOut(int out_fd, uint64_t offset, uint64_t length, uint64_t out_offset) const
+{
+    // XvdFile::CopyTo() in pieces of XVD_PROGRESS_COPY_CHUNK, so a multi-GB copy can report
+    // progress and be cancelled (the kernel can't be interrupted in the middle of a call)
+    for(uint64_t done = 0; done < length; )
+    {
+        if(XvdCancelled(mProgress))
+            return CANCELLED;
+
+        uint64_t chunk = std::min<uint64_t>(XVD_PROGRESS_COPY_CHUNK, length - done);
+        if(!mFile.CopyTo(out_fd, offset + done, chunk, out_offset + done))
+            return IO_ERROR;
+        XvdProgressAdvance(mProgress, chunk);
+        done += chunk;
+    }
+    return 0;
+}
+
+int XanaduXVD::ExtractDrive(const char* output_filename) const
+{
+    // Fixed XVDs have the whole Drive in one piece, it's just another region
+    if(mHeader.xvd_type == XvdType::FIXED)
+    {
+        XvdProgressOperation progress(mProgress, XVD_PROGRESS_EXTRACT, mLayout.Length(XVD_REGION_DRIVE));
+        XVD_LOG(XVD_LOG_INFO, "Extracting Drive...");
+        if(auto ret = ExtractRegion(XVD_REGION_DRIVE, output_filename); ret)
+            return ret;
+        XVD_LOG(XVD_LOG_INFO, " [DONE]\n");
+        return 0;
+    }
+
+    /******************************************************************************************\
+                                  SPARSE DRIVE EXPORT (DYNAMIC XVDs)
+
+    The output is a raw image of the virtual Drive, drive_size bytes long. Most dynamic XVDs
+    are mostly empty: every BAT entry that is XVD_INVALID_BLOCK is a 0xAA000 block that reads
+    as zeros and is not in the XVD at all. So the output file is first ftruncate()'d to its
+    final size, which makes it one big hole, and then only the allocated blocks are copied in.
+    Unallocated blocks are never read or written and stay holes, both in time and disk space.
 
-    // Allocate a buffer to read the eXVD into memory
-    char* buffer = (char*)calloc(1, userdata_size);
-    fseek(mFD, userdata_pos, SEEK_SET);
-    fread(buffer, 1, userdata_size, mFD);
+    The BAT scanner already grouped the allocated blocks into extents (blocks consecutive both
+    in the Drive and in the XVD), and each extent is copied with a single CopyTo()
+    (copy_file_range), so a mostly-contiguous XVD is only a handful of calls.
 
-    // Future optimization: UserData potentially a large file
-    // to read chunk by chunk
+    \*******************************************************************************************/
+    uint64_t drive_size   = mHeader.drive_size;
+    uint64_t drive_blocks = (drive_size + XVD_BLOCK_SIZE - 1) / XVD_BLOCK_SIZE;
+    uint64_t num_blocks   = std::min<uint64_t>(drive_blocks, mLayout.BAT().size());
+
+    XVD_LOG(XVD_LOG_INFO, "Extracting Drive (dynamic, %llu of %llu blocks allocated)...",
+           (unsigned long long)mLayout.AllocatedBlocks(), (unsigned long long)drive_blocks);
+    XvdProgressOperation progress(mProgress, XVD_PROGRESS_EXTRACT, BlocksToBytes(mLayout.AllocatedBlocks()));
 
-    // Write to output file
-    FILE* f = fopen(output_filename, "wb");
-    if (f == NULL) {
+    int fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
         fprintf(stderr, "ERR: Failed to open output file '%s'!\n", output_filename);
         return 2;
     }
-    fwrite(buffer, 1, userdata_size, f);
-    fclose(f);
-    free(buffer);
 
-    printf(" [DONE]\n");
+    if (ftruncate(fd, (off_t)drive_size) != 0) {
+        fprintf(stderr, "ERR: Failed to size output file '%s'!\n", output_filename);
+        close(fd);
+        return IO_ERROR;
+    }
+
+    int      ret           = 0;
+    uint64_t bytes_written = 0;
+    for(const XvdBatExtent& extent : mLayout.BatScan().extents)
+    {
+        if(extent.first_block >= num_blocks)
+            break;
+
+        uint64_t file_offset = 0;
+        mLayout.DriveBlockOffset(extent.first_block, file_offset);
+
+        uint64_t out_offset = BlocksToBytes(extent.first_block);
+        uint64_t length     = std::min<uint64_t>(BlocksToBytes(extent.num_blocks), drive_size - out_offset);
+        if(file_offset + length > mFilesize)
+        {
+            fprintf(stderr, "\nERR: Drive block 0x%llx points out of the XVD file!\n", (unsigned long long)extent.first_block);
+            ret = IO_ERROR;
+            break;
+        }
+
+        if((ret = CopyOut(fd, file_offset, length, out_offset)) != 0)
+            break;
+        bytes_written += length;
+    }
+
+    if (close(fd) != 0 && ret == 0)
+        ret = IO_ERROR;
+
+    if (ret == CANCELLED) {
+        XVD_LOG(XVD_LOG_INFO, " [CANCELLED]\n");
+        remove(output_filename);
+        return ret;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "ERR: Failed to extract the Drive into '%s'!\n", output_filename);
+        return IO_ERROR;
+    }
+
+    XVD_LOG(XVD_LOG_INFO, " [DONE] (%llu of %llu bytes written, the rest are holes)\n",
+           (unsigned long long)bytes_written, (unsigned long long)drive_size);
     return 0;
 }
 
-int XanaduXVD::VerifyHashTree()
+int XanaduXVD::ExtractDriveVerified(const char* output_filename, const char* cik_filename, unsigned num_threads) const
 {
+    /******************************************************************************************\
+                            SINGLE PASS DRIVE EXTRACTION PIPELINE
+
+    Verifying, decrypting and extracting one after the other reads the whole XVD three times.
+    This does all of it in one pass, with every stage running at the same time:
+
+        readers --> [to_verify] --> hashers --> [to_decrypt] --> decryptors --> [to_write] --> writer
+           ^                                                                                    |
+           +----------------------------------- [free_slots] -----------------------------------+
+
+    The Drive is cut in chunks that never cross a group of 170 pages of the HashTree, so a
+    single level 0 hash page (the "parent") has the hashes and XTS data units of a whole
+    chunk. A chunk travels through the stages in a "slot": a buffer of 170 pages plus what
+    the stages need to know about it. Only slot numbers go through the queues, the data is
+    never copied from one stage to the next:
+
+    - Readers pread() the pages of a chunk into the slot buffer, or when the XVD is mapped,
+      just take a view of them (which the hashers then fault in from the page cache).
+    - Hashers check the pages against their level 0 entries, exactly like VerifyHashTree()
+      does. Skipped if the XVD has no HashTree. Bad pages are reported, but still extracted.
+    - Decryptors decrypt the pages into the slot buffer (see Decrypt()). Skipped if the XVD
+      is not encrypted.
+    - The writer (the calling thread) pwrite()s the pages where they go in the Drive and
+      gives the slot back. Like ExtractDrive(), the output starts as one big hole, so the
+      unallocated blocks of a dynamic XVD are never touched.
+
+    The queues are bounded and lock-free (see XVDQueue.h), and there are only so many slots:
+    that's what keeps a fast stage from running ahead of a slow one and hoarding memory.
+    Every stage knows when it's done because the stage before it sends one "end" marker per
+    thread when its last thread finishes.
+
+    Only the data pages are read once. The hash pages are read by both the hashers and the
+    decryptors, but that's 1 page every 170, and it's hot in the page cache anyway.
+
+    \*******************************************************************************************/
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    bool verify  = !mHeader.flags.DataIntegrityDisabled;
+    bool decrypt = !mHeader.flags.EncryptionDisabled;
+
+    if(verify && mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: HashTree verification of resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    AesXtsKey key;
+    if(decrypt)
+    {
+        if(mHeader.xvc_data_length != 0)
+        {
+            fprintf(stderr, "ERR: Decryption of XVC packages is not supported yet\n");
+            return UNSUPPORTED;
+        }
+        if(cik_filename == nullptr)
+        {
+            fprintf(stderr, "ERR: XVD is encrypted, a CIK is needed to extract its Drive\n");
+            return UNSUPPORTED;
+        }
+
+        uint8_t cik[XVD_CIK_LENGTH_BYTES];
+        if(!LoadCik(cik_filename, cik))
+            return FILE_NOT_FOUND;
+        AesXtsInit(key, cik);
+    }
+
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    uint64_t tree_offset   = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset   = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t pages_in_file = (mFilesize > data_offset) ? (mFilesize - data_offset) / XVD_PAGE_SIZE : 0;
+    uint64_t drive_size    = mHeader.drive_size;
+
+    // 1. Cut the Drive in chunks. 'first_page' counts from the UserData, like the HashTree does.
+    struct Chunk
+    {
+        uint64_t first_page;
+        uint64_t num_pages;
+        uint64_t out_offset; // In the Drive
+    };
+    std::vector<Chunk> chunks;
+
+    if(mHeader.xvd_type == XvdType::FIXED)
+    {
+        uint64_t drive_first = (mLayout.Offset(XVD_REGION_DRIVE) - data_offset) / XVD_PAGE_SIZE;
+        uint64_t drive_end   = std::min<uint64_t>(drive_first + AlignSizeToPageBoundary(drive_size) / XVD_PAGE_SIZE,
+                                                  pages_in_file);
+        for(uint64_t page = drive_first; page < drive_end; )
+        {
+            uint64_t end = std::min<uint64_t>((page / HASHES_PER_HASH_PAGE + 1) * HASHES_PER_HASH_PAGE, drive_end);
+            chunks.push_back({ page, end - page, PagesToBytes(page - drive_first) });
+            page = end;
+        }
+    }
+    else
+    {
+        // One chunk per allocated block: blocks are 170 pages, and aligned to the groups
+        uint64_t drive_blocks = (drive_size + XVD_BLOCK_SIZE - 1) / XVD_BLOCK_SIZE;
+        for(const XvdBatExtent& extent : mLayout.BatScan().extents)
+        {
+            for(uint64_t block = extent.first_block; block < extent.first_block + extent.num_blocks; block++)
+            {
+                uint64_t file_offset = 0;
+                if(block >= drive_blocks || !mLayout.DriveBlockOffset(block, file_offset))
+                    break;
+
+                uint64_t first_page = (file_offset - data_offset) / XVD_PAGE_SIZE;
+                if(first_page >= pages_in_file)
+                {
+                    fprintf(stderr, "ERR: Drive block 0x%llx points out of the XVD file!\n", (unsigned long long)block);
+                    return IO_ERROR;
+                }
+                uint64_t num_pages = std::min<uint64_t>(HASHES_PER_HASH_PAGE, pages_in_file - first_page);
+                chunks.push_back({ first_page, num_pages, BlocksToBytes(block) });
+            }
+        }
+    }
+
+    // A page the HashTree doesn't cover can't be verified, so a verified extraction can't have it
+    if(verify)
+    {
+        uint64_t uncovered = 0;
+        for(const Chunk& chunk : chunks)
+            if(chunk.first_page + chunk.num_pages > shape.hashed_pages)
+                uncovered += chunk.first_page + chunk.num_pages - std::max(chunk.first_page, shape.hashed_pages);
+        if(uncovered != 0)
+        {
+            fprintf(stderr, "ERR: %llu Drive pages are not covered by the HashTree, they can't be verified\n",
+                    (unsigned long long)uncovered);
+            return HASHTREE_INVALID;
+        }
+    }
+
+    int fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", output_filename);
+        return PERMISION_DENIED;
+    }
+    if(ftruncate(fd, (off_t)drive_size) != 0)
+    {
+        fprintf(stderr, "ERR: Failed to size output file '%s'!\n", output_filename);
+        close(fd);
+        return IO_ERROR;
+    }
+
+    // 2. Slots and queues
+    unsigned workers    = num_threads ? num_threads : DefaultWorkerCount();
+    unsigned readers    = mFile.IsMapped() ? 1 : std::clamp(mIoQueueDepth, 1u, 8u);
+    unsigned hashers    = verify  ? workers : 0;
+    unsigned decryptors = decrypt ? workers : 0;
+    unsigned num_slots  = mIoQueueDepth + 2 * workers;
+
+    struct Slot
+    {
+        uint64_t                 chunk;
+        std::span<const uint8_t> data;    // The pages, in 'buffer' or a view of the mapping
+        std::span<const uint8_t> parent;  // Level 0 entries of the pages (empty if none)
+        XvdPoolChunk             buffer;
+        XvdPoolChunk             parent_buffer;
+    };
+    std::vector<Slot> slots(num_slots);
+
+    const uint32_t END = UINT32_MAX;
+    XvdBoundedQueue<uint32_t> free_slots(num_slots);
+    XvdBoundedQueue<uint32_t> to_verify(num_slots);
+    XvdBoundedQueue<uint32_t> to_decrypt(num_slots);
+    XvdBoundedQueue<uint32_t> to_write(num_slots);
+    for(uint32_t i = 0; i < num_slots; i++)
+    {
+        if(!slots[i].buffer.Acquire())
+        {
+            close(fd);
+            return IO_ERROR;
+        }
+        free_slots.Push(i);
+    }
+
+    // Where a slot goes after each stage, and how many threads read each queue
+    XvdBoundedQueue<uint32_t>* after_read   = verify ? &to_verify : decrypt ? &to_decrypt : &to_write;
+    XvdBoundedQueue<uint32_t>* after_verify = decrypt ? &to_decrypt : &to_write;
+    auto consumers_of = [&](XvdBoundedQueue<uint32_t>* queue) -> unsigned
+    {
+        return queue == &to_verify ? hashers : queue == &to_decrypt ? decryptors : 1;
+    };
+
+    // The last thread of a stage to finish tells every thread of the next stage
+    auto finish_stage = [&](std::atomic<unsigned>& running, XvdBoundedQueue<uint32_t>* next)
+    {
+        if(--running == 0)
+            for(unsigned i = 0, n = consumers_of(next); i < n; i++)
+                next->Push(END);
+    };
+
+    std::atomic<bool>     failed{false};
+    std::atomic<uint64_t> bad_hashes{0};
+    std::atomic<uint64_t> next_chunk{0};
+
+    auto load_parent = [&](Slot& slot) -> bool
+    {
+        const Chunk& chunk = chunks[slot.chunk];
+        if(!verify || !slot.parent.empty() || chunk.first_page >= shape.hashed_pages)
+            return true;
+
+        uint64_t group = chunk.first_page / HASHES_PER_HASH_PAGE;
+        auto page = mFile.ViewOrRead(tree_offset + PagesToBytes(shape.level_start_page[0] + group),
+                                     XVD_PAGE_SIZE, slot.parent_buffer);
+        if(page.empty())
+            return false;
+        slot.parent = page.subspan((chunk.first_page % HASHES_PER_HASH_PAGE) * HASH_LENGTH);
+        return true;
+    };
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Extracting Drive in one pass (%zu chunks: read%s%s, write)...\n", chunks.size(),
+           verify ? ", verify" : "", decrypt ? ", decrypt" : "");
+    if(mDebugMode)
+        XVD_LOG(XVD_LOG_DBG, "DBG: %u readers, %u hashers, %u decryptors, %u slots\n", readers, hashers, decryptors, num_slots);
+    auto start_time = std::chrono::steady_clock::now();
+
+    uint64_t chunk_bytes = 0;
+    for(const Chunk& chunk : chunks)
+        chunk_bytes += PagesToBytes(chunk.num_pages);
+    XvdProgressOperation progress(mProgress, XVD_PROGRESS_EXTRACT, chunk_bytes);
+
+    if(mFile.IsMapped())
+        mFile.AdviseSequential(data_offset, PagesToBytes(pages_in_file));
+
+    // 3. Stages. A cancel only stops the readers: what is already in the pipeline drains
+    //    through the other stages as usual, and they all finish on their own.
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> readers_running{readers};
+    for(unsigned t = 0; t < readers; t++)
+        threads.emplace_back([&]()
+        {
+            for(uint64_t index; !XvdCancelled(mProgress) && (index = next_chunk++) < chunks.size(); )
+            {
+                uint32_t     id     = free_slots.Pop();
+                Slot&        slot   = slots[id];
+                const Chunk& chunk  = chunks[index];
+                uint64_t     offset = data_offset + PagesToBytes(chunk.first_page);
+                uint64_t     length = PagesToBytes(chunk.num_pages);
+
+                slot.chunk  = index;
+                slot.parent = {};
+                slot.data   = mFile.View(offset, length);
+                if(slot.data.empty() && !failed)
+                {
+                    if(ReadAt(slot.buffer.data(), length, offset))
+                        slot.data = { slot.buffer.data(), length };
+                    else
+                        failed = true;
+                }
+                after_read->Push(id);
+            }
+            finish_stage(readers_running, after_read);
+        });
+
+    std::atomic<unsigned> hashers_running{hashers};
+    for(unsigned t = 0; t < hashers; t++)
+        threads.emplace_back([&]()
+        {
+            for(uint32_t id; (id = to_verify.Pop()) != END; )
+            {
+                Slot& slot = slots[id];
+                if(!failed && !slot.data.empty())
+                {
+                    const Chunk& chunk = chunks[slot.chunk];
+                    if(!load_parent(slot))
+                        failed = true;
+                    else
+                        bad_hashes += CheckHashTreeGroup(0, chunk.first_page, slot.parent, slot.data);
+                }
+                after_verify->Push(id);
+            }
+            finish_stage(hashers_running, after_verify);
+        });
+
+    std::atomic<unsigned> decryptors_running{decryptors};
+    for(unsigned t = 0; t < decryptors; t++)
+        threads.emplace_back([&]()
+        {
+            uint8_t tweaks[HASHES_PER_HASH_PAGE][AES_BLOCK_LENGTH_BYTES];
+            for(uint32_t id; (id = to_decrypt.Pop()) != END; )
+            {
+                Slot& slot = slots[id];
+                if(!failed && !slot.data.empty())
+                {
+                    const Chunk& chunk = chunks[slot.chunk];
+                    if(!load_parent(slot))
+                        failed = true;
+                    else
+                    {
+                        BuildXtsTweaks(slot.parent, chunk.first_page, chunk.num_pages, tweaks);
+                        AesXtsDecryptPages(key, slot.data.data(), slot.buffer.data(), chunk.num_pages, tweaks);
+                        slot.data = { slot.buffer.data(), slot.data.size() };
+                    }
+                }
+                to_write.Push(id);
+            }
+            finish_stage(decryptors_running, &to_write);
+        });
+
+    // The writer is this thread. In direct mode what it wrote doesn't stay in the page cache.
+    uint64_t       bytes_written = 0;
+    XvdWriteBehind write_behind(mFile.IsDirect() ? fd : -1);
+    for(uint32_t id; (id = to_write.Pop()) != END; )
+    {
+        Slot& slot = slots[id];
+        if(!failed && !slot.data.empty())
+        {
+            const Chunk& chunk  = chunks[slot.chunk];
+            uint64_t     length = std::min<uint64_t>(slot.data.size(), drive_size - chunk.out_offset);
+            if(WriteAt(fd, slot.data.data(), length, chunk.out_offset))
+            {
+                bytes_written += length;
+                write_behind.Written(chunk.out_offset, length);
+            }
+            else
+                failed = true;
+            XvdProgressAdvance(mProgress, PagesToBytes(chunk.num_pages));
+        }
+        free_slots.Push(id);
+    }
+
+    for(auto& thread : threads)
+        thread.join();
+
+    write_behind.Flush();
+    if(close(fd) != 0)
+        failed = true;
+    if(XvdCancelled(mProgress) && !failed)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: Drive extraction cancelled\n");
+        remove(output_filename);
+        return CANCELLED;
+    }
+    if(failed)
+    {
+        fprintf(stderr, "ERR: Failed to extract the Drive into '%s'!\n", output_filename);
+        return IO_ERROR;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    double gbytes = (double)bytes_written / 1e9;
+    XVD_LOG(XVD_LOG_INFO, "INFO: Extracted %.2f GB in %.2f s (%.2f GB/s)\n", gbytes, elapsed.count(),
+           elapsed.count() > 0 ? gbytes / elapsed.count() : 0.0);
+
+    if(bad_hashes != 0)
+    {
+        fprintf(stderr, "ERR: %llu Drive pages do not match their hash, the Drive is corrupted\n",
+                (unsigned long long)bad_hashes.load());
+        return HASHTREE_INVALID;
+    }
     return 0;
 }
 
-int XanaduXVD::RebuildHashTree()
+int XanaduXVD::ReadDrive(uint64_t offset, uint64_t length, void* dst) const
+{
+    XvdDriveIo io{ offset, length, dst };
+    return ReadDriveV({ &io, 1 });
+}
+
+int XanaduXVD::ReadDriveV(std::span<const XvdDriveIo> ios) const
 {
+    /******************************************************************************************\
+                                    VIRTUAL DRIVE READS
+
+    The Drive is what a guest OS sees as a disk: drive_size bytes, addressed from 0. On a
+    fixed XVD it's just the Drive region of the file. On a dynamic XVD it's cut in 0xAA000
+    blocks, and each one is wherever the BAT says (see XvdLayout::DriveBlockOffset()), or
+    nowhere at all if it was never written, in which case it reads as zeros.
+
+    1. Every requested range is cut at block boundaries and translated. Unallocated pieces
+       are zero-filled right away, the rest become (file offset, length, destination).
+    2. The pieces are sorted by file offset, and pieces that are adjacent in the file are
+       merged into one run, even if their destinations aren't adjacent: a run is a single
+       preadv() with one iovec per piece. So a sequential read over a contiguous dynamic XVD
+       is one big read, and random 4K reads are one read each, as they should be.
+    3. When the XVD is memory mapped, runs are just copied out of the mapping instead.
+
+    Nothing here touches shared state, so it can be called from several threads at once.
+
+    \*******************************************************************************************/
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    struct Piece
+    {
+        uint64_t file_offset;
+        uint64_t length;
+        uint8_t* dst;
+    };
+    thread_local std::vector<Piece> pieces;
+    pieces.clear();
+
+    bool     dynamic    = (mHeader.xvd_type == XvdType::DYNAMIC);
+    uint64_t drive_size = dynamic ? mHeader.drive_size : mLayout.Length(XVD_REGION_DRIVE);
+    uint64_t drive_pos  = mLayout.Offset(XVD_REGION_DRIVE);
+
+    // 1. Translate
+    for(const XvdDriveIo& io : ios)
+    {
+        if(io.offset > drive_size || io.length > drive_size - io.offset)
+        {
+            fprintf(stderr, "ERR: Drive read of 0x%llx bytes at 0x%llx is out of the Drive (0x%llx bytes)\n",
+                    (unsigned long long)io.length, (unsigned long long)io.offset, (unsigned long long)drive_size);
+            return OUT_OF_RANGE;
+        }
+
+        if(!dynamic)
+        {
+            if(io.length)
+                pieces.push_back({ drive_pos + io.offset, io.length, (uint8_t*)io.dst });
+            continue;
+        }
+
+        uint8_t* dst    = (uint8_t*)io.dst;
+        uint64_t offset = io.offset;
+        uint64_t left   = io.length;
+        while(left > 0)
+        {
+            uint64_t block    = offset / XVD_BLOCK_SIZE;
+            uint64_t in_block = offset % XVD_BLOCK_SIZE;
+            uint64_t length   = std::min<uint64_t>(left, XVD_BLOCK_SIZE - in_block);
+
+            uint64_t block_offset;
+            if(mLayout.DriveBlockOffset(block, block_offset))
+                pieces.push_back({ block_offset + in_block, length, dst });
+            else
+                memset(dst, 0, length); // Never written, reads as zeros
+
+            dst    += length;
+            offset += length;
+            left   -= length;
+        }
+    }
+
+    // 2. Sort and merge. Already sorted in the (very common) sequential case, no need to sort then.
+    auto by_file_offset = [](const Piece& a, const Piece& b) { return a.file_offset < b.file_offset; };
+    if(!std::is_sorted(pieces.begin(), pieces.end(), by_file_offset))
+        std::sort(pieces.begin(), pieces.end(), by_file_offset);
+
+    thread_local std::vector<iovec> iov;
+    for(size_t first = 0; first < pieces.size(); )
+    {
+        // Find the end of the run
+        size_t   last     = first;
+        uint64_t run_end  = pieces[first].file_offset + pieces[first].length;
+        while(last + 1 < pieces.size() && last + 1 - first < IOV_MAX && pieces[last + 1].file_offset == run_end)
+        {
+            last++;
+            run_end += pieces[last].length;
+        }
+
+        uint64_t run_start = pieces[first].file_offset;
+        if(run_end > mFilesize)
+        {
+            fprintf(stderr, "ERR: Drive data at 0x%llx is out of the XVD file!\n", (unsigned long long)run_start);
+            return IO_ERROR;
+        }
+
+        // 3. Read the run
+        if(mFile.IsMapped())
+        {
+            auto view = mFile.View(run_start, run_end - run_start);
+            for(size_t i = first; i <= last; i++)
+                memcpy(pieces[i].dst, view.data() + (pieces[i].file_offset - run_start), pieces[i].length);
+        }
+        else
+        {
+            iov.clear();
+            for(size_t i = first; i <= last; i++)
+                iov.push_back({ pieces[i].dst, pieces[i].length });
+
+            ssize_t done = preadv(mFile.Fd(), iov.data(), (int)iov.size(), (off_t)run_start);
+            XVD_TRACE_COUNT(XVD_COUNTER_SYSCALLS, 1);
+            if(done > 0)
+                XVD_TRACE_COUNT(XVD_COUNTER_BYTES_READ, done);
+            if(done < 0 || (uint64_t)done != run_end - run_start)
+            {
+                // Short read or interrupted: finish the run piece by piece, the slow and sure way
+                for(size_t i = first; i <= last; i++)
+                    if(!mFile.Read(pieces[i].dst, pieces[i].length, pieces[i].file_offset))
+                        return IO_ERROR;
+            }
+        }
+
+        first = last + 1;
+    }
+
+    return 0;
+}
+
+bool XanaduXVD::ForEachPageGroup(uint64_t offset, uint64_t num_pages, unsigned num_threads, const XvdReadConsumer& fn) const
+{
+    // Hands 'fn' the pages at 'offset' in groups of (up to) 170 pages, the same groups the
+    // HashTree uses, so group N is exactly the pages hashed by entry N of level 0. Groups
+    // arrive in any order, from 'num_threads' threads at the same time.
+    uint64_t num_groups = (num_pages + HASHES_PER_HASH_PAGE - 1) / HASHES_PER_HASH_PAGE;
+    auto group_request  = [&](uint64_t group) -> XvdReadRequest
+    {
+        uint64_t first_page = group * HASHES_PER_HASH_PAGE;
+        uint64_t count      = std::min<uint64_t>(HASHES_PER_HASH_PAGE, num_pages - first_page);
+        return { offset + PagesToBytes(first_page), PagesToBytes(count) };
+    };
+
+    mFile.AdviseSequential(offset, PagesToBytes(num_pages));
+
+    if(!mFile.IsMapped())
+    {
+        // Not mapped: the async reader keeps a deep queue of reads in flight while the
+        // workers chew on whatever already arrived
+        std::vector<XvdReadRequest> requests(num_groups);
+        for(uint64_t group = 0; group < num_groups; group++)
+            requests[group] = group_request(group);
+
+        XvdAsyncReader reader(mFile.BulkFd(), PagesToBytes(HASHES_PER_HASH_PAGE), mIoQueueDepth);
+        if(mDebugMode)
+            XVD_LOG(XVD_LOG_DBG, "DBG: Reading pages with %s, queue depth %u\n", reader.EngineName(), mIoQueueDepth);
+        return reader.Run(requests, num_threads ? num_threads : DefaultWorkerCount(), fn);
+    }
+
+    // Mapped: every worker works straight on views of the page cache
+    std::atomic<bool> ok{true};
+    ParallelFor(num_groups, num_threads, [&](uint64_t group)
+    {
+        if(!ok)
+            return;
+        thread_local std::vector<uint8_t> scratch;
+        XvdReadRequest request = group_request(group);
+        auto data = mFile.ViewOrRead(request.offset, request.length, scratch);
+        if(data.empty() || !fn(group, data))
+            ok = false;
+    });
+    return ok;
+}
+
+bool XanaduXVD::LoadCik(const char* cik_filename, uint8_t cik[XVD_CIK_LENGTH_BYTES]) const
+{
+    // A CIK file is either just the 32 bytes of the key (tweak key + data key), or the
+    // 16 byte GUID of the key followed by the key (the .cik files xvdtool uses)
+    uint8_t buffer[sizeof(MS_GUID) + XVD_CIK_LENGTH_BYTES];
+    FILE* f = fopen(cik_filename, "rb");
+    if(!f)
+    {
+        fprintf(stderr, "ERR: Failed to open CIK file '%s'!\n", cik_filename);
+        return false;
+    }
+    size_t length = fread(buffer, 1, sizeof(buffer), f);
+    bool   longer = fgetc(f) != EOF;
+    fclose(f);
+
+    if(length == XVD_CIK_LENGTH_BYTES && !longer)
+        memcpy(cik, buffer, XVD_CIK_LENGTH_BYTES);
+    else if(length == sizeof(buffer) && !longer)
+    {
+        memcpy(cik, buffer + sizeof(MS_GUID), XVD_CIK_LENGTH_BYTES);
+        XVD_LOG(XVD_LOG_INFO, "INFO: Using CIK %s\n", MsGUIDToString(*(MS_GUID*)buffer).c_str());
+    }
+    else
+    {
+        fprintf(stderr, "ERR: CIK file '%s' must be %u or %zu bytes long\n", cik_filename,
+                XVD_CIK_LENGTH_BYTES, sizeof(buffer));
+        return false;
+    }
+    return true;
+}
+
+void XanaduXVD::BuildXtsTweaks(std::span<const uint8_t> entries, uint64_t first_page, uint64_t count,
+                               uint8_t tweaks[][AES_BLOCK_LENGTH_BYTES]) const
+{
+    // 'entries' are the level 0 hash entries of the pages, which hold their data units. Without
+    // them (no HashTree, or past the end of it) the page number is used as the data unit.
+    const uint32_t header_id = 1; // Plain XVDs. XVC regions have their own, see Decrypt()
+    for(uint64_t i = 0; i < count; i++)
+    {
+        uint32_t data_unit = (uint32_t)(first_page + i);
+        if(!entries.empty())
+            memcpy(&data_unit, entries.data() + i * HASH_LENGTH + HASH_LENGTH_ENCRYPTED, sizeof(data_unit));
+
+        memcpy(tweaks[i],     &data_unit, sizeof(data_unit));
+        memcpy(tweaks[i] + 4, &header_id, sizeof(header_id));
+        memcpy(tweaks[i] + 8, mHeader.content_id_guid, 8);
+    }
+}
+
+int XanaduXVD::Decrypt(const char* cik_filename, const char* output_filename, unsigned num_threads) const
+{
+    /******************************************************************************************\
+                                    PACKAGE DECRYPTION
+
+    Everything from the UserData onwards (UserData, XVC info, BAT, Drive...) is encrypted
+    with AES-128-XTS using the CIK (see XVDAes.cpp), one 4K page per XTS data unit. The
+    tweak of a page is 16 bytes:
+
+        [0..3]  data unit (LE). Stored in the last 4 bytes of the level 0 hash of the page
+        [4..7]  header id (LE). 1 for plain XVDs, XVCs use the id of each XVC region
+        [8..15] first half of the content id (the VDUID)
+
+    The output is a copy of the XVD: header, eXVD, MDU and HashTree copied as they are (by
+    the kernel, see XvdFile::CopyTo()), and the decrypted pages written at the same offsets.
+    Pages are taken in the groups of 170 of the HashTree, so the parent hash page of a group
+    has the data units of all its pages. Groups are spread across all the cores, each worker
+    decrypts its group into its own buffer and writes it out with pwrite().
+
+    Then the header is flagged as EncryptionDisabled and, since the hashes were computed
+    over the encrypted pages, the HashTree of the copy is rebuilt. Which of course means the
+    header signature isn't valid anymore.
+
+    \*******************************************************************************************/
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    if(mHeader.flags.EncryptionDisabled)
+    {
+        fprintf(stderr, "ERR: XVD is not encrypted\n");
+        return UNSUPPORTED;
+    }
+
+    // XVCs encrypt every region with its own header id (and sometimes key), which requires
+    // parsing the XVC info. Not there yet.
+    if(mHeader.xvc_data_length != 0)
+    {
+        fprintf(stderr, "ERR: Decryption of XVC packages is not supported yet\n");
+        return UNSUPPORTED;
+    }
+
+    uint8_t cik[XVD_CIK_LENGTH_BYTES];
+    if(!LoadCik(cik_filename, cik))
+        return FILE_NOT_FOUND;
+
+    AesXtsKey key;
+    AesXtsInit(key, cik);
+
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    bool     has_data_units = !mHeader.flags.DataIntegrityDisabled;
+    uint64_t tree_offset    = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset    = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t num_pages      = (mFilesize > data_offset) ? (mFilesize - data_offset) / XVD_PAGE_SIZE : 0;
+    uint64_t tail_offset    = data_offset + PagesToBytes(num_pages);
+
+    int fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        fprintf(stderr, "ERR: Failed to open output file '%s'!\n", output_filename);
+        return PERMISION_DENIED;
+    }
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Decrypting %llu pages (%s)...\n", (unsigned long long)num_pages,
+           AesXtsKernelName(AesXtsBestKernel()));
+    auto start_time = std::chrono::steady_clock::now();
+    XvdProgressBegin(mProgress, XVD_PROGRESS_DECRYPT, PagesToBytes(num_pages));
+
+    // Everything before the UserData is not encrypted. Neither is a trailing partial page, if any.
+    bool ok = ftruncate(fd, (off_t)mFilesize) == 0 &&
+              mFile.CopyTo(fd, 0, data_offset, 0) &&
+              mFile.CopyTo(fd, tail_offset, mFilesize - tail_offset, tail_offset);
+
+    ok = ok && ForEachPageGroup(data_offset, num_pages, num_threads,
+                                [&](uint64_t group, std::span<const uint8_t> data)
+    {
+        if(XvdCancelled(mProgress))
+            return false;
+
+        XvdPoolChunk plain = XvdBorrowChunk();
+        XvdPoolChunk parent_scratch;
+        if(!plain)
+            return false;
+        uint8_t  tweaks[HASHES_PER_HASH_PAGE][AES_BLOCK_LENGTH_BYTES];
+        uint64_t first_page = group * HASHES_PER_HASH_PAGE;
+        uint64_t count      = data.size() / XVD_PAGE_SIZE;
+
+        // The data units live in the level 0 hash page of the group
+        std::span<const uint8_t> parent;
+        if(has_data_units && first_page < shape.hashed_pages)
+        {
+            parent = mFile.ViewOrRead(tree_offset + PagesToBytes(shape.level_start_page[0] + group),
+                                      XVD_PAGE_SIZE, parent_scratch);
+            if(parent.empty())
+                return false;
+        }
+        BuildXtsTweaks(parent, first_page, count, tweaks);
+
+        AesXtsDecryptPages(key, data.data(), plain.data(), count, tweaks);
+        XvdProgressAdvance(mProgress, data.size());
+        return WriteAt(fd, plain.data(), data.size(), data_offset + PagesToBytes(first_page));
+    });
+    XvdProgressEnd(mProgress);
+
+    // Flag the copy as not encrypted, so its pages are taken as they are from now on
+    XvdFlags flags = mHeader.flags;
+    flags.EncryptionDisabled = 1;
+    ok = ok && WriteAt(fd, &flags, sizeof(flags), offsetof(XvdHeader, flags));
+
+    if(close(fd) != 0)
+        ok = false;
+    if(XvdCancelled(mProgress))
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: Decryption cancelled\n");
+        remove(output_filename);
+        return CANCELLED;
+    }
+    if(!ok)
+    {
+        fprintf(stderr, "ERR: Failed to decrypt '%s' into '%s'\n", mFilename.c_str(), output_filename);
+        remove(output_filename);
+        return IO_ERROR;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    double gbytes = (double)PagesToBytes(num_pages) / 1e9;
+    XVD_LOG(XVD_LOG_INFO, "INFO: Decrypted %.2f GB in %.2f s (%.2f GB/s)\n", gbytes, elapsed.count(),
+           elapsed.count() > 0 ? gbytes / elapsed.count() : 0.0);
+
+    // The hashes were computed over the encrypted pages
+    if(has_data_units)
+    {
+        XanaduXVD decrypted(output_filename);
+        decrypted.SetProgress(mProgress);
+        int ret = decrypted.Start(true, mDebugMode);
+        if(ret == 0)
+            ret = decrypted.RebuildHashTree(num_threads);
+        if(ret)
+        {
+            // A copy whose HashTree doesn't match its pages is of no use to anyone
+            remove(output_filename);
+            return ret;
+        }
+    }
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Decrypted XVD written to '%s'. Its header signature is no longer valid\n", output_filename);
+    return 0;
+}
+
+int XanaduXVD::VerifyHashTree(unsigned num_threads) const
+{
+    /******************************************************************************************\
+                                HASHTREE VERIFICATION ENGINE
+
+    Check the theory of operation in HashTreeSizeFromPageNum() first. Verification is done
+    in "groups": a group is one hash page of a level plus the (up to) 170 pages it contains
+    hashes for. For level 0 those are data pages, for any other level they are the hash pages
+    of the level right below. Every group is independent from the others, so the groups of a
+    level are spread across all the cores (see ParallelFor()), and each worker reads its own
+    group with pread(), which means both the hashing and the disk queue scale with the cores.
+
+    Levels are checked bottom-up, one after the other: level 0 (by far the biggest one, it
+    covers all the data), then level 1, 2, 3 and finally the root hash in the header, which
+    is the full (non truncated) SHA256 of the single page of the top level.
+
+    \*******************************************************************************************/
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    if(mHeader.flags.DataIntegrityDisabled)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: XVD has data integrity disabled, there is no HashTree to verify\n");
+        return 0;
+    }
+
+    // Resilient XVDs have two copies of the tree. None has been found in the wild (yet).
+    if(mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: HashTree verification of resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    uint64_t tree_offset   = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset   = mLayout.Offset(XVD_REGION_USERDATA);
+
+    // Dynamic XVDs have a tree sized for the maximum size of the drive, but only the
+    // allocated blocks exist in the file. Data pages that aren't there can't be checked.
+    uint64_t pages_in_file = (mFilesize > data_offset) ? (mFilesize - data_offset) / XVD_PAGE_SIZE : 0;
+    uint64_t data_pages    = std::min<uint64_t>(shape.hashed_pages, pages_in_file);
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Verifying HashTree (%u levels, %llu data pages)...\n",
+           shape.num_levels, (unsigned long long)data_pages);
+
+    // Progress counts every page that gets hashed: the data pages and every level but the top
+    uint64_t pages_to_check = data_pages;
+    for(uint32_t level = 0; level + 1 < shape.num_levels; level++)
+        pages_to_check += shape.pages_of_level[level];
+    XvdProgressOperation progress(mProgress, XVD_PROGRESS_VERIFY, PagesToBytes(pages_to_check));
+
+    if(mDebugMode)
+        XVD_LOG(XVD_LOG_DBG, "DBG: SHA256 kernel: %s, workers: %u\n", Sha256KernelName(Sha256BestKernel()),
+               num_threads ? num_threads : DefaultWorkerCount());
+    auto start_time = std::chrono::steady_clock::now();
+
+    // The data pages are going to be read front to back, let the kernel read ahead
+    mFile.AdviseSequential(data_offset, PagesToBytes(data_pages));
+
+    bool valid = true;
+    for(uint32_t level = 0; level < shape.num_levels; level++)
+    {
+        uint64_t num_children = (level == 0) ? data_pages : shape.pages_of_level[level - 1];
+        uint64_t num_groups   = (num_children + HASHES_PER_HASH_PAGE - 1) / HASHES_PER_HASH_PAGE;
+
+        std::atomic<uint64_t> bad_entries{0};
+        std::atomic<bool>     io_error{false};
+        auto account = [&](int64_t bad)
+        {
+            if(bad < 0)
+                io_error = true;
+            else
+                bad_entries += bad;
+        };
+
+        if(level == 0 && !mFile.IsMapped())
+        {
+            // Not mapped: the data pages (the bulk of the work) go through the async reader,
+            // which keeps a deep queue of reads in flight while the workers hash what arrived.
+            std::vector<XvdReadRequest> requests(num_groups);
+            for(uint64_t group = 0; group < num_groups; group++)
+            {
+                uint64_t first_child = group * HASHES_PER_HASH_PAGE;
+                uint64_t count       = std::min<uint64_t>(HASHES_PER_HASH_PAGE, num_children - first_child);
+                requests[group]      = { data_offset + PagesToBytes(first_child), PagesToBytes(count) };
+            }
+
+            XvdAsyncReader reader(mFile.BulkFd(), PagesToBytes(HASHES_PER_HASH_PAGE), mIoQueueDepth);
+            if(mDebugMode)
+                XVD_LOG(XVD_LOG_DBG, "DBG: Reading data pages with %s, queue depth %u\n", reader.EngineName(), mIoQueueDepth);
+
+            bool read_ok = reader.Run(requests, num_threads ? num_threads : DefaultWorkerCount(),
+                                      [&](uint64_t group, std::span<const uint8_t> data)
+            {
+                if(XvdCancelled(mProgress))
+                    return false;
+                XvdPoolChunk parent_scratch;
+                auto parent = mFile.ViewOrRead(tree_offset + PagesToBytes(shape.level_start_page[0] + group),
+                                               XVD_PAGE_SIZE, parent_scratch);
+                account(parent.empty() ? -1 : CheckHashTreeGroup(0, group * HASHES_PER_HASH_PAGE, parent, data));
+                XvdProgressAdvance(mProgress, data.size());
+                return true;
+            });
+            if(!read_ok && !XvdCancelled(mProgress))
+                io_error = true;
+        }
+        else
+        {
+            ParallelFor(num_groups, num_threads, [&](uint64_t group)
+            {
+                if(XvdCancelled(mProgress))
+                    return;
+                account(VerifyHashTreeGroup(shape, level, group, tree_offset, data_offset, num_children));
+                XvdProgressAdvance(mProgress, PagesToBytes(std::min<uint64_t>(HASHES_PER_HASH_PAGE,
+                                                                              num_children - group * HASHES_PER_HASH_PAGE)));
+            });
+        }
+
+        if(XvdCancelled(mProgress))
+        {
+            XVD_LOG(XVD_LOG_INFO, "INFO: HashTree verification cancelled\n");
+            return CANCELLED;
+        }
+
+        if(io_error)
+        {
+            fprintf(stderr, "ERR: Failed to read HashTree level %u from '%s'\n", level, mFilename.c_str());
+            return IO_ERROR;
+        }
+
+        if(bad_entries != 0)
+        {
+            fprintf(stderr, "ERR: HashTree level %u: %llu invalid hashes\n",
+                    level, (unsigned long long)bad_entries.load());
+            valid = false;
+        }
+        else if(mDebugMode)
+            XVD_LOG(XVD_LOG_DBG, "DBG: HashTree level %u OK (%llu pages checked)\n", level, (unsigned long long)num_children);
+    }
+
+    // Data pages past what the tree covers can't have been checked, so they can't be VALID
+    if(pages_in_file > data_pages)
+    {
+        fprintf(stderr, "ERR: %llu data pages at the end of the file are not covered by the HashTree\n",
+                (unsigned long long)(pages_in_file - data_pages));
+        valid = false;
+    }
+
+    // And finally the top of the tree against the root hash in the header
+    uint8_t top_page[XVD_PAGE_SIZE];
+    uint8_t root_hash[SHA256_DIGEST_LENGTH_BYTES];
+    uint64_t top_offset = tree_offset + PagesToBytes(shape.level_start_page[shape.num_levels - 1]);
+    if(!ReadAt(top_page, XVD_PAGE_SIZE, top_offset))
+    {
+        fprintf(stderr, "ERR: Failed to read HashTree top page from '%s'\n", mFilename.c_str());
+        return IO_ERROR;
+    }
+    Sha256(top_page, XVD_PAGE_SIZE, root_hash);
+    if(memcmp(root_hash, mHeader.root_hash, ROOT_HASH_LENGTH) != 0)
+    {
+        fprintf(stderr, "ERR: HashTree root hash does not match the header\n");
+        valid = false;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    double gbytes = (double)PagesToBytes(data_pages) / 1e9;
+    XVD_LOG(XVD_LOG_INFO, "INFO: HashTree %s. Verified %.2f GB in %.2f s (%.2f GB/s)\n",
+           valid ? "is VALID" : "is INVALID", gbytes, elapsed.count(),
+           elapsed.count() > 0 ? gbytes / elapsed.count() : 0.0);
+
+    return valid ? 0 : HASHTREE_INVALID;
+}
+
+int64_t XanaduXVD::VerifyHashTreeGroup(const XvdHashTreeShape& shape, uint32_t level, uint64_t group,
+                                       uint64_t tree_offset, uint64_t data_offset, uint64_t num_children) const
+{
+    // When the XVD is mapped, pages are hashed straight from the page cache. Otherwise they
+    // are read into chunks of the buffer pool, one group is 170 pages (680Kb), one chunk
+    XvdPoolChunk children_scratch;
+    XvdPoolChunk parent_scratch;
+
+    uint64_t first_child = group * HASHES_PER_HASH_PAGE;
+    uint64_t count       = std::min<uint64_t>(HASHES_PER_HASH_PAGE, num_children - first_child);
+
+    // Children are data pages for level 0, and pages of the level below otherwise
+    uint64_t parent_offset   = tree_offset + PagesToBytes(shape.level_start_page[level] + group);
+    uint64_t children_offset = (level == 0)
+                             ? data_offset + PagesToBytes(first_child)
+                             : tree_offset + PagesToBytes(shape.level_start_page[level - 1] + first_child);
+
+    auto parent   = mFile.ViewOrRead(parent_offset, XVD_PAGE_SIZE, parent_scratch);
+    auto children = mFile.ViewOrRead(children_offset, PagesToBytes(count), children_scratch);
+    if(parent.empty() || children.empty())
+        return -1;
+
+    return CheckHashTreeGroup(level, first_child, parent, children);
+}
+
+int64_t XanaduXVD::CheckHashTreeGroup(uint32_t level, uint64_t first_child,
+                                      std::span<const uint8_t> parent, std::span<const uint8_t> children) const
+{
+    // Hashes the children pages and compares them against the entries of their parent page
+    uint8_t  digests[HASHES_PER_HASH_PAGE][SHA256_DIGEST_LENGTH_BYTES];
+    uint64_t count = children.size() / XVD_PAGE_SIZE;
+    Sha256Pages(children.data(), count, digests);
+
+    uint32_t compare_length = HashEntryLength(level);
+
+    int64_t bad = 0;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        if(memcmp(digests[i], parent.data() + i * HASH_LENGTH, compare_length) != 0)
+        {
+            bad++;
+            if(mDebugMode)
+                fprintf(stderr, "DBG: HashTree level %u: bad hash for %s page 0x%llx\n", level,
+                        level == 0 ? "data" : "hash", (unsigned long long)(first_child + i));
+        }
+    }
+
+    return bad;
+}
+
+uint32_t XanaduXVD::HashEntryLength(uint32_t level) const
+{
+    // On encrypted XVDs the last 4 bytes of a data (level 0) hash entry are not part of
+    // the hash: they hold the XTS data unit of the page, and must never be overwritten.
+    return (level == 0 && !mHeader.flags.EncryptionDisabled) ? HASH_LENGTH_ENCRYPTED : HASH_LENGTH;
+}
+
+bool XanaduXVD::WriteRootHash(int fd, const uint8_t top_page[XVD_PAGE_SIZE])
+{
+    // The root hash is the only non-truncated hash of the tree, and it lives in the header.
+    // NOTE: This obviously invalidates the header RSA signature.
+    uint8_t root_hash[SHA256_DIGEST_LENGTH_BYTES];
+    Sha256(top_page, XVD_PAGE_SIZE, root_hash);
+    if(!WriteAt(fd, root_hash, ROOT_HASH_LENGTH, offsetof(XvdHeader, root_hash)))
+        return false;
+
+    memcpy(mHeader.root_hash, root_hash, ROOT_HASH_LENGTH);
+    return true;
+}
+
+int XanaduXVD::RehashGroupInPlace(int fd, const XvdHashTreeShape& shape, uint32_t level, uint64_t group,
+                                  uint64_t tree_offset, uint64_t data_offset, uint64_t num_children)
+{
+    // Same idea as VerifyHashTreeGroup(), but instead of comparing, the fresh hashes
+    // are stored in the parent page, which is then written back to the file.
+    XvdPoolChunk children = XvdBorrowChunk();
+    XvdPoolChunk parent   = XvdBorrowChunk();
+    if(!children || !parent)
+        return IO_ERROR;
+    uint8_t digests[HASHES_PER_HASH_PAGE][SHA256_DIGEST_LENGTH_BYTES];
+
+    uint64_t first_child = group * HASHES_PER_HASH_PAGE;
+    uint64_t count       = std::min<uint64_t>(HASHES_PER_HASH_PAGE, num_children - first_child);
+
+    uint64_t parent_offset   = tree_offset + PagesToBytes(shape.level_start_page[level] + group);
+    uint64_t children_offset = (level == 0)
+                             ? data_offset + PagesToBytes(first_child)
+                             : tree_offset + PagesToBytes(shape.level_start_page[level - 1] + first_child);
+
+    // The parent is read first (and not just zeroed) to keep the XTS data units of encrypted XVDs
+    if(!ReadAt(parent.data(), XVD_PAGE_SIZE, parent_offset) ||
+       !ReadAt(children.data(), PagesToBytes(count), children_offset))
+        return IO_ERROR;
+
+    Sha256Pages(children.data(), count, digests);
+    for(uint64_t i = 0; i < count; i++)
+        memcpy(parent.data() + i * HASH_LENGTH, digests[i], HashEntryLength(level));
+
+    return WriteAt(fd, parent.data(), XVD_PAGE_SIZE, parent_offset) ? 0 : IO_ERROR;
+}
+
+int XanaduXVD::RebuildHashTree(unsigned num_threads)
+{
+    // Full rebuild: every level is recomputed bottom-up, in place (see RehashLevels())
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    if(mHeader.flags.DataIntegrityDisabled)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: XVD has data integrity disabled, there is no HashTree to rebuild\n");
+        return 0;
+    }
+
+    if(mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: HashTree rebuilding of resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    int fd = open(mFilename.c_str(), O_RDWR);
+    if(fd < 0)
+    {
+        fprintf(stderr, "ERR: Failed to open file '%s' for writing!\n", mFilename.c_str());
+        return PERMISION_DENIED;
+    }
+
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    uint64_t data_pages = std::min<uint64_t>(shape.hashed_pages, DataPagesInFile());
+    XVD_LOG(XVD_LOG_INFO, "Rebuilding HashTree (%u levels, %llu data pages)...", shape.num_levels,
+           (unsigned long long)data_pages);
+    fflush(stdout);
+
+    uint64_t pages_to_hash = data_pages;
+    for(uint32_t level = 0; level + 1 < shape.num_levels; level++)
+        pages_to_hash += shape.pages_of_level[level];
+    XvdProgressOperation progress(mProgress, XVD_PROGRESS_REBUILD, PagesToBytes(pages_to_hash));
+
+    int ret = RehashLevels(fd, 0, num_threads, true);
+    close(fd);
+
+    if(ret == CANCELLED)
+    {
+        XVD_LOG(XVD_LOG_INFO, " [CANCELLED] (the HashTree is only partially rebuilt)\n");
+        return ret;
+    }
+    if(ret != 0)
+    {
+        fprintf(stderr, "\nERR: Failed to rebuild the HashTree of '%s'\n", mFilename.c_str());
+        return ret;
+    }
+
+    XVD_LOG(XVD_LOG_INFO, " [DONE]\n");
+    return 0;
+}
+
+int XanaduXVD::RehashLevels(int fd, uint32_t first_level, unsigned num_threads, bool cancellable)
+{
+    // Recomputes levels first_level and up, bottom-up, and then the root hash. A level can
+    // only be computed once the one below is final, but within a level every hash page is
+    // independent, so (just like VerifyHashTree()) the pages of a level are spread across
+    // all the cores. Nothing is kept in memory between levels, the level just written is
+    // read back as the children of the next one. Only a full rebuild is 'cancellable': the
+    // in place operations (trimming...) rely on this to leave a valid tree behind.
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    uint64_t tree_offset = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t data_pages  = std::min<uint64_t>(shape.hashed_pages, DataPagesInFile());
+
+    int ret = 0;
+    for(uint32_t level = first_level; level < shape.num_levels && ret == 0; level++)
+    {
+        uint64_t num_children = (level == 0) ? data_pages : shape.pages_of_level[level - 1];
+        uint64_t num_groups   = (num_children + HASHES_PER_HASH_PAGE - 1) / HASHES_PER_HASH_PAGE;
+
+        std::atomic<int> level_ret{0};
+        ParallelFor(num_groups, num_threads, [&](uint64_t group)
+        {
+            if(cancellable && XvdCancelled(mProgress))
+            {
+                level_ret = CANCELLED;
+                return;
+            }
+            if(int err = RehashGroupInPlace(fd, shape, level, group, tree_offset, data_offset, num_children); err)
+                level_ret = err;
+            XvdProgressAdvance(mProgress, PagesToBytes(std::min<uint64_t>(HASHES_PER_HASH_PAGE,
+                                                                          num_children - group * HASHES_PER_HASH_PAGE)));
+        });
+        ret = level_ret;
+    }
+
+    uint8_t top_page[XVD_PAGE_SIZE];
+    if(ret == 0)
+    {
+        uint64_t top_offset = tree_offset + PagesToBytes(shape.level_start_page[shape.num_levels - 1]);
+        if(!ReadAt(top_page, XVD_PAGE_SIZE, top_offset) || !WriteRootHash(fd, top_page))
+            ret = IO_ERROR;
+    }
+    return ret;
+}
+
+int XanaduXVD::RebuildHashTree(const std::vector<uint64_t>& dirty_pages, unsigned num_threads)
+{
+    return RehashDirtyPages(dirty_pages, num_threads, UINT32_MAX);
+}
+
+int XanaduXVD::RehashDirtyPages(const std::vector<uint64_t>& dirty_pages, unsigned num_threads, uint32_t num_levels)
+{
+    /******************************************************************************************\
+                                INCREMENTAL HASHTREE REBUILD
+
+    When only a few data pages of the XVD changed (e.g. patching the UserData/VBI, or some
+    pages of the Drive), there's no need to rehash gigabytes of data. 'dirty_pages' are the
+    data page numbers (counting from the start of the UserData region, like level 0 does)
+    that were modified. Then:
+
+    - Level 0: only the hash entries of the dirty data pages are recomputed, which means
+      reading just those data pages plus the hash pages that contain their entries.
+    - Level N: the hash pages of level N-1 that were just modified are the "dirty pages"
+      of level N. We already have their new contents in memory, so no need to read them.
+    - Root: the top level is a single page, and it is always dirty if anything was.
+
+    Only the lowest 'num_levels' levels are updated (the root hash only if that's all of
+    them). The in place rewrites use 1: they fix a few level 0 entries, and then rehash all
+    the upper levels anyway because whole level 0 pages moved (see ReopenAfterRewrite()).
+
+    Every modified hash page is written exactly once, and then the root hash in the header.
+    So the cost is (number of dirty pages) + (at most 4 hash pages for each of them), no
+    matter how big the XVD is.
+
+    \*******************************************************************************************/
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    if(mHeader.flags.DataIntegrityDisabled)
+        return 0;
+
+    if(mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: HashTree rebuilding of resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    uint64_t tree_offset   = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset   = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t pages_in_file = (mFilesize > data_offset) ? (mFilesize - data_offset) / XVD_PAGE_SIZE : 0;
+    uint64_t data_pages    = std::min<uint64_t>(shape.hashed_pages, pages_in_file);
+
+    // Sorted and without duplicates, so the pages that share a hash page end up together
+    std::vector<uint64_t> dirty(dirty_pages);
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+    while(!dirty.empty() && dirty.back() >= data_pages)
+    {
+        fprintf(stderr, "ERR: Dirty page 0x%llx is not covered by the HashTree, ignoring it\n",
+                (unsigned long long)dirty.back());
+        dirty.pop_back();
+    }
+    if(dirty.empty())
+        return 0;
+
+    int fd = open(mFilename.c_str(), O_RDWR);
+    if(fd < 0)
+    {
+        fprintf(stderr, "ERR: Failed to open file '%s' for writing!\n", mFilename.c_str());
+        return PERMISION_DENIED;
+    }
+
+    if(mDebugMode)
+        XVD_LOG(XVD_LOG_DBG, "DBG: Incremental HashTree rebuild of %zu dirty pages\n", dirty.size());
+
+    // Contents of the dirty pages of the level below (empty for level 0, those are read from disk)
+    std::vector<std::vector<uint8_t>> dirty_contents;
+
+    int      ret        = 0;
+    uint32_t last_level = std::min(shape.num_levels, num_levels);
+    for(uint32_t level = 0; level < last_level && ret == 0; level++)
+    {
+        // Group the dirty children by the hash page (parent) that holds their entries
+        struct Group { uint64_t parent; size_t first; size_t last; };
+        std::vector<Group> groups;
+        for(size_t i = 0; i < dirty.size(); i++)
+        {
+            uint64_t parent = dirty[i] / HASHES_PER_HASH_PAGE;
+            if(groups.empty() || groups.back().parent != parent)
+                groups.push_back({parent, i, i});
+            groups.back().last = i;
+        }
+
+        std::vector<std::vector<uint8_t>> parents(groups.size());
+        std::atomic<int> level_ret{0};
+        ParallelFor(groups.size(), num_threads, [&](uint64_t g)
+        {
+            const Group& group = groups[g];
+            std::vector<uint8_t>& parent = parents[g];
+            parent.resize(XVD_PAGE_SIZE);
+
+            uint64_t parent_offset = tree_offset + PagesToBytes(shape.level_start_page[level] + group.parent);
+            if(!ReadAt(parent.data(), XVD_PAGE_SIZE, parent_offset))
+            {
+                level_ret = IO_ERROR;
+                return;
+            }
+
+            uint8_t digests[HASHES_PER_HASH_PAGE][SHA256_DIGEST_LENGTH_BYTES];
+            if(level == 0)
+            {
+                // Data pages come from disk. Consecutive dirty pages are read in one go.
+                std::vector<uint8_t> pages;
+                for(size_t run_start = group.first; run_start <= group.last; )
+                {
+                    size_t run_end = run_start;
+                    while(run_end < group.last && dirty[run_end + 1] == dirty[run_end] + 1)
+                        run_end++;
+
+                    size_t run_len = run_end - run_start + 1;
+                    pages.resize(PagesToBytes(run_len));
+                    if(!ReadAt(pages.data(), pages.size(), data_offset + PagesToBytes(dirty[run_start])))
+                    {
+                        level_ret = IO_ERROR;
+                        return;
+                    }
+                    Sha256Pages(pages.data(), run_len, digests + (run_start - group.first));
+                    run_start = run_end + 1;
+                }
+            }
+            else
+            {
+                // Hash pages of the level below, which we just rebuilt and still have around
+                for(size_t i = group.first; i <= group.last; i++)
+                    Sha256Pages(dirty_contents[i].data(), 1, digests + (i - group.first));
+            }
+
+            for(size_t i = group.first; i <= group.last; i++)
+                memcpy(parent.data() + (dirty[i] % HASHES_PER_HASH_PAGE) * HASH_LENGTH,
+                       digests[i - group.first], HashEntryLength(level));
+
+            if(!WriteAt(fd, parent.data(), XVD_PAGE_SIZE, parent_offset))
+                level_ret = IO_ERROR;
+        });
+        ret = level_ret;
+
+        // The hash pages just modified are the dirty children of the next level
+        dirty.clear();
+        for(const auto& group : groups)
+            dirty.push_back(group.parent);
+        dirty_contents = std::move(parents);
+    }
+
+    // After the top level, there's a single dirty page left: the top of the tree
+    if(ret == 0 && last_level == shape.num_levels && !WriteRootHash(fd, dirty_contents.front().data()))
+        ret = IO_ERROR;
+    close(fd);
+
+    if(ret != 0)
+        fprintf(stderr, "ERR: Failed to rebuild the HashTree of '%s'\n", mFilename.c_str());
+
+    return ret;
+}
+
+//////////////////////////////////////////
+// TRIMMING                             //
+//////////////////////////////////////////
+
+/******************************************************************************************\
+                                TRIMMING THEORY OF OPERATION
+
+Trimming takes things out of an XVD in place, without writing a new copy of it:
+
+- The eXVD: nothing refers to it by offset. The HashTree doesn't cover it and the BAT counts
+  from the UserData, so everything after it just moves back and the header forgets it.
+- The UserData of a fixed XVD: the data pages after it move back, which renumbers them, so
+  the level 0 hash entries move back by as many entries (the XTS data units of encrypted XVDs
+  are in those entries, so they move along with their pages). The tree may get smaller too.
+  No data page needs to be read or rehashed, only the upper levels.
+- The UserData of a dynamic XVD: it lives in block 0 together with the XVC and the BAT, and
+  blocks have a fixed size, so the XVC and BAT move back inside block 0 and the rest of the
+  block is zeroed. The file keeps its size, only block 0 is rehashed.
+- Unused blocks of a dynamic XVD: allocated blocks that are all zeros (e.g. files deleted by
+  the guest) read the same when unmapped. Their level 0 hash entries are all the hash of a
+  zero page, so they are found without reading any data. They get unmapped in the BAT and the
+  space they used is reclaimed, moving the blocks after them. A block is exactly one level 0
+  hash page (170 pages), so the hash pages just move along with their blocks.
+
+Moving "everything after" back is done with fallocate(FALLOC_FL_COLLAPSE_RANGE) when the
+filesystem supports it (ext4, XFS...): the filesystem just shifts its extents, no data is
+read or written no matter how big the file is. When it doesn't, the data is moved by the
+kernel (XvdFile::CopyTo()) in pieces that never overlap. Unused blocks are first collapsed
+out the same way, and if that's not possible the last blocks of the file are moved into
+their place instead (the file is then truncated).
+
+While the XVD is being shuffled, the header trim state says so (phase shuffle, then bat while
+the BAT is rewritten), so a trim that didn't finish can be recognized. Any trim changes the
+header, so its signature is no longer valid.
+
+\*******************************************************************************************/
+
+int XanaduXVD::OpenForRewrite()
+{
+    // From here on the file changes size and shape: the mapping must go before that happens
+    Stop();
+    mIsStarted = false;
+
+    int fd = open(mFilename.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+        fprintf(stderr, "ERR: Failed to open file '%s' for writing!\n", mFilename.c_str());
+    return fd;
+}
+
+int XanaduXVD::ReopenAfterRewrite(bool rehash_upper_levels, unsigned num_threads, const std::vector<uint64_t>& dirty_pages)
+{
+    // The level 0 entries of 'dirty_pages' first, then every level above (and the root) once
+    if(int ret = Start(mUnsafeMode, mDebugMode, mUseMmap); ret)
+        return ret;
+    if(!rehash_upper_levels || mHeader.flags.DataIntegrityDisabled)
+        return 0;
+    if(!dirty_pages.empty())
+        if(int ret = RehashDirtyPages(dirty_pages, num_threads, 1); ret)
+            return ret;
+
+    int fd = open(mFilename.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+        return PERMISION_DENIED;
+    int ret = RehashLevels(fd, 1, num_threads);
+    close(fd);
+    return ret;
+}
+
+bool XanaduXVD::WriteTrimState(int fd, XvdTrimPhase phase, uint64_t blob_size)
+{
+    // FILETIME: 100ns intervals since 1601
+    XvdTrimState state{};
+    state.phase     = phase;
+    state.timestamp = ((int64_t)time(nullptr) + 11644473600ll) * 10000000ll;
+    state.blob_size = blob_size;
+    mHeader.trim_state = state;
+    return WriteAt(fd, &state, sizeof(state), offsetof(XvdHeader, trim_state));
+}
+
+bool XanaduXVD::CollapseRange(int fd, uint64_t offset, uint64_t length, bool& in_kernel)
+{
+    // Takes [offset, offset + length) out of the file, everything after it moves back
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        return false;
+    uint64_t file_size = (uint64_t)st.st_size;
+    if(offset + length >= file_size)
+        return ftruncate(fd, (off_t)offset) == 0;
+
+    if(fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, (off_t)offset, (off_t)length) == 0)
+    {
+        in_kernel = true;
+        return true;
+    }
+    if(errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS)
+        return false;
+
+    // No support (or not aligned to the blocks of the filesystem): move it back piece by piece.
+    // A piece is never longer than the distance it moves, so source and destination never overlap.
+    XvdFile source;
+    if(!source.Open(mFilename.c_str(), false))
+        return false;
+    for(uint64_t from = offset + length; from < file_size; )
+    {
+        uint64_t chunk = std::min<uint64_t>({ length, file_size - from, 1ull << 30 });
+        if(!source.CopyTo(fd, from, chunk, from - length))
+            return false;
+        from += chunk;
+    }
+    return ftruncate(fd, (off_t)(file_size - length)) == 0;
+}
+
+std::vector<uint64_t> XanaduXVD::DirtyPagesAfterBlockMoves(const std::vector<uint64_t>& slots, uint64_t data_pages) const
+{
+    // The block now at slot 'pos' was at slot 'slots[pos]'. Level 0 hash pages moved along with
+    // their blocks, so only two kinds of data pages need new entries: the BAT (it's in block 0),
+    // and blocks that came from past the pages the HashTree covered ('data_pages' before moving).
+    const XvdRegion& bat         = mLayout.Region(XVD_REGION_DYNHEADER);
+    uint64_t         data_offset = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t         hashed      = mLayout.HashTreeShape().hashed_pages;
+
+    std::vector<uint64_t> dirty;
+    for(uint64_t page = (bat.offset - data_offset) / XVD_PAGE_SIZE; page < BytesToPages(bat.End() - data_offset); page++)
+        dirty.push_back(page);
+    for(uint64_t pos = 1; pos < slots.size(); pos++)
+        if((slots[pos] + 1) * HASHES_PER_HASH_PAGE > data_pages)
+            for(uint64_t page = pos * HASHES_PER_HASH_PAGE; page < std::min<uint64_t>((pos + 1) * HASHES_PER_HASH_PAGE, hashed); page++)
+                dirty.push_back(page);
+    return dirty;
+}
+
+int XanaduXVD::RemoveEmbeddedXVD()
+{
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    uint64_t offset = mLayout.Offset(XVD_REGION_EXVD);
+    uint64_t length = mLayout.Length(XVD_REGION_EXVD);
+    if(length == 0)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: XVD has no embedded XVD, nothing to remove\n");
+        return 0;
+    }
+
+    int fd = OpenForRewrite();
+    if(fd < 0)
+        return PERMISION_DENIED;
+
+    bool     in_kernel = false;
+    uint32_t zero      = 0;
+    bool ok = WriteTrimState(fd, XvdTrimPhase::shuffle, length) &&
+              CollapseRange(fd, offset, length, in_kernel) &&
+              WriteAt(fd, &zero, sizeof(zero), offsetof(XvdHeader, embedded_xvd_length)) &&
+              WriteTrimState(fd, XvdTrimPhase::none, 0);
+    close(fd);
+
+    if(!ok)
+    {
+        fprintf(stderr, "ERR: Failed to remove the embedded XVD of '%s'\n", mFilename.c_str());
+        return IO_ERROR;
+    }
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Removed the embedded XVD (%.2f MB%s)\n", (double)length / 1e6,
+           in_kernel ? ", collapsed by the filesystem" : "");
+    return ReopenAfterRewrite(false, 0);
+}
+
+int XanaduXVD::RemoveUserData(unsigned num_threads)
+{
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    uint64_t ud_offset = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t ud_length = mLayout.Length(XVD_REGION_USERDATA);
+    if(ud_length == 0)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: XVD has no UserData, nothing to remove\n");
+        return 0;
+    }
+
+    if(mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: Trimming resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    bool     has_tree  = !mHeader.flags.DataIntegrityDisabled;
+    bool     in_kernel = false;
+    uint32_t zero      = 0;
+    bool     ok;
+
+    if(mHeader.xvd_type == XvdType::DYNAMIC)
+    {
+        // The XVC and BAT move to other pages of block 0, which would need new XTS data units
+        if(!mHeader.flags.EncryptionDisabled)
+        {
+            fprintf(stderr, "ERR: Removing the UserData of an encrypted dynamic XVD is not supported\n");
+            return UNSUPPORTED;
+        }
+
+        uint64_t rest_offset = mLayout.Offset(XVD_REGION_XVC);
+        uint64_t rest_length = mLayout.Region(XVD_REGION_DYNHEADER).End() - rest_offset;
+        std::vector<uint8_t> block(XVD_BLOCK_SIZE, 0);
+        if(rest_length > XVD_BLOCK_SIZE - ud_length || !ReadAt(block.data(), rest_length, rest_offset))
+        {
+            fprintf(stderr, "ERR: Failed to read the XVC and BAT of '%s'\n", mFilename.c_str());
+            return IO_ERROR;
+        }
+
+        int fd = OpenForRewrite();
+        if(fd < 0)
+            return PERMISION_DENIED;
+
+        ok = WriteTrimState(fd, XvdTrimPhase::shuffle, ud_length) &&
+             WriteAt(fd, block.data(), XVD_BLOCK_SIZE, ud_offset) &&
+             WriteAt(fd, &zero, sizeof(zero), offsetof(XvdHeader, user_data_length)) &&
+             WriteTrimState(fd, XvdTrimPhase::none, 0);
+        close(fd);
+        if(!ok)
+        {
+            fprintf(stderr, "ERR: Failed to remove the UserData of '%s'\n", mFilename.c_str());
+            return IO_ERROR;
+        }
+
+        // Only block 0 changed
+        if(int ret = ReopenAfterRewrite(false, 0); ret)
+            return ret;
+        std::vector<uint64_t> dirty(HASHES_PER_HASH_PAGE);
+        for(uint64_t page = 0; page < dirty.size(); page++)
+            dirty[page] = page;
+        if(int ret = RebuildHashTree(dirty, num_threads); ret)
+            return ret;
+
+        XVD_LOG(XVD_LOG_INFO, "INFO: Removed the UserData (%.2f MB). Blocks of dynamic XVDs have a fixed size, "
+               "so the file keeps its size\n", (double)ud_length / 1e6);
+        return 0;
+    }
+
+    // Without a HashTree the XTS data unit of a page is its page number, which changes when
+    // the pages move back, so the Drive of an encrypted XVD couldn't be decrypted anymore
+    if(!mHeader.flags.EncryptionDisabled && !has_tree)
+    {
+        fprintf(stderr, "ERR: Removing the UserData of an encrypted XVD without a HashTree is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    // Fixed XVD: the tree covers fewer pages from now on, it may even lose a level
+    const XvdHashTreeShape old_shape   = mLayout.HashTreeShape();
+    uint64_t               tree_offset = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t               old_tree    = mLayout.Length(XVD_REGION_HASHTREE);
+    uint64_t               ud_pages    = ud_length / XVD_PAGE_SIZE;
+    uint64_t               old_entries = std::min<uint64_t>(old_shape.hashed_pages, DataPagesInFile());
+    uint64_t               new_entries = (old_entries > ud_pages) ? old_entries - ud_pages : 0;
+    XvdHashTreeShape       new_shape{};
+    uint64_t               new_tree    = 0;
+    if(has_tree)
+    {
+        new_shape = HashTreeShapeFromPageNum(old_shape.hashed_pages - ud_pages);
+        new_tree  = HashTreeSizeFromPageNum(new_shape.hashed_pages, false);
+    }
+
+    int fd = OpenForRewrite();
+    if(fd < 0)
+        return PERMISION_DENIED;
+    ok = WriteTrimState(fd, XvdTrimPhase::shuffle, ud_length);
+
+    // 1. Level 0 entry N is now entry N + ud_pages. Rewritten front to back in place: the new
+    //    level 0 starts at or before the old one, so a page is always written at or before
+    //    the pages it was built from, and no old page is overwritten before it was read.
+    std::vector<uint8_t> old_pages(2 * XVD_PAGE_SIZE);
+    std::vector<uint8_t> page(XVD_PAGE_SIZE);
+    for(uint64_t p = 0; has_tree && ok && p < new_shape.pages_of_level[0]; p++)
+    {
+        std::fill(page.begin(), page.end(), 0);
+        uint64_t first = p * HASHES_PER_HASH_PAGE;
+        uint64_t count = (first < new_entries) ? std::min<uint64_t>(HASHES_PER_HASH_PAGE, new_entries - first) : 0;
+        if(count > 0)
+        {
+            // 170 consecutive entries are in one or two old pages
+            uint64_t old_first = first + ud_pages;
+            uint64_t old_page  = old_first / HASHES_PER_HASH_PAGE;
+            uint64_t num_old   = (old_first + count - 1) / HASHES_PER_HASH_PAGE - old_page + 1;
+            uint64_t length    = PagesToBytes(num_old);
+            ok = pread(fd, old_pages.data(), length,
+                       tree_offset + PagesToBytes(old_shape.level_start_page[0] + old_page)) == (ssize_t)length;
+            for(uint64_t i = 0; ok && i < count; i++)
+            {
+                uint64_t entry = old_first + i;
+                memcpy(page.data() + i * HASH_LENGTH,
+                       old_pages.data() + PagesToBytes(entry / HASHES_PER_HASH_PAGE - old_page) +
+                       (entry % HASHES_PER_HASH_PAGE) * HASH_LENGTH, HASH_LENGTH);
+            }
+        }
+        ok = ok && WriteAt(fd, page.data(), XVD_PAGE_SIZE, tree_offset + PagesToBytes(new_shape.level_start_page[0] + p));
+    }
+
+    // 2. The UserData, and what the tree doesn't need anymore, out of the file
+    uint64_t removed = (old_tree - new_tree) + ud_length;
+    ok = ok && CollapseRange(fd, tree_offset + new_tree, removed, in_kernel) &&
+         WriteAt(fd, &zero, sizeof(zero), offsetof(XvdHeader, user_data_length)) &&
+         WriteTrimState(fd, XvdTrimPhase::none, 0);
+    close(fd);
+
+    if(!ok)
+    {
+        fprintf(stderr, "ERR: Failed to remove the UserData of '%s'\n", mFilename.c_str());
+        return IO_ERROR;
+    }
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Removed the UserData (%.2f MB smaller%s)\n", (double)removed / 1e6,
+           in_kernel ? ", collapsed by the filesystem" : "");
+
+    // 3. Levels 1 and up, from the moved level 0
+    return ReopenAfterRewrite(true, num_threads);
+}
+
+static bool IsAllZeros(std::span<const uint8_t> data)
+{
+    for(uint8_t byte : data)
+        if(byte != 0)
+            return false;
+    return true;
+}
+
+int XanaduXVD::TrimUnusedBlocks(unsigned num_threads)
+{
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    if(mHeader.xvd_type != XvdType::DYNAMIC)
+    {
+        fprintf(stderr, "ERR: Only dynamic XVDs have blocks that can be unmapped\n");
+        return UNSUPPORTED;
+    }
+
+    // Encrypted zeros don't look like zeros
+    if(!mHeader.flags.EncryptionDisabled)
+    {
+        fprintf(stderr, "ERR: Unused blocks of encrypted XVDs can't be found without decrypting them\n");
+        return UNSUPPORTED;
+    }
+
+    if(mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: Trimming resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    // Slots are moved around assuming block 0 is the only one that isn't in the Drive
+    if(mLayout.MetadataBlocks() != 1)
+    {
+        fprintf(stderr, "ERR: Trimming XVDs whose UserData, XVC and BAT don't fit in block 0 is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    // Only informative: the blocks are found and unmapped by us, not by the console
+    if(mDebugMode && !mHeader.flags.TrimSupported)
+        XVD_LOG(XVD_LOG_DBG, "DBG: XVD doesn't have the TrimSupported flag, trimming it anyway\n");
+
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    bool     has_tree     = !mHeader.flags.DataIntegrityDisabled;
+    uint64_t tree_offset  = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset  = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t data_pages   = std::min<uint64_t>(shape.hashed_pages, DataPagesInFile());
+    uint64_t num_slots    = (mFilesize - data_offset) / XVD_BLOCK_SIZE;  // Block 0 + one per allocated block
+    uint64_t level0_pages = has_tree ? shape.pages_of_level[0] : 0;
+
+    // 1. Find the blocks that are all zeros. With a HashTree, only their hashes are looked at.
+    uint8_t zero_page[XVD_PAGE_SIZE] = {};
+    uint8_t zero_hash[SHA256_DIGEST_LENGTH_BYTES];
+    Sha256(zero_page, XVD_PAGE_SIZE, zero_hash);
+
+    std::vector<uint8_t> unused(num_slots, 0);
+    std::atomic<bool>    io_error{false};
+    ParallelFor(num_slots - 1, num_threads, [&](uint64_t item)
+    {
+        thread_local std::vector<uint8_t> scratch;
+        uint64_t slot = item + 1;  // Block 0 is UserData + XVC + BAT
+        if(has_tree)
+        {
+            uint64_t first_page = slot * HASHES_PER_HASH_PAGE;
+            if(slot >= level0_pages || first_page + HASHES_PER_HASH_PAGE > data_pages)
+                return;
+            auto entries = mFile.ViewOrRead(tree_offset + PagesToBytes(shape.level_start_page[0] + slot),
+                                            XVD_PAGE_SIZE, scratch);
+            if(entries.empty())
+            {
+                io_error = true;
+                return;
+            }
+            for(uint64_t i = 0; i < HASHES_PER_HASH_PAGE; i++)
+                if(memcmp(entries.data() + i * HASH_LENGTH, zero_hash, HASH_LENGTH) != 0)
+                    return;
+            unused[slot] = 1;
+        }
+        else
+        {
+            auto block = mFile.ViewOrRead(data_offset + slot * XVD_BLOCK_SIZE, XVD_BLOCK_SIZE, scratch);
+            if(block.empty())
+                io_error = true;
+            else if(IsAllZeros(block))
+                unused[slot] = 1;
+        }
+    });
+    if(io_error)
+    {
+        fprintf(stderr, "ERR: Failed to read '%s'\n", mFilename.c_str());
+        return IO_ERROR;
+    }
+
+    uint64_t num_unused = std::count(unused.begin(), unused.end(), 1);
+    if(num_unused == 0)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: No unused blocks, nothing to trim\n");
+        return 0;
+    }
+    XVD_LOG(XVD_LOG_INFO, "INFO: %llu of %llu allocated blocks are unused\n", (unsigned long long)num_unused,
+           (unsigned long long)(num_slots - 1));
+
+    std::vector<uint32_t> bat = mLayout.BAT();
+    uint64_t bat_offset = mLayout.BatDriveOffset();
+
+    int fd = OpenForRewrite();
+    if(fd < 0)
+        return PERMISION_DENIED;
+    bool ok = WriteTrimState(fd, XvdTrimPhase::shuffle, num_unused * XVD_BLOCK_SIZE);
+
+    // 2. Collapse the unused blocks out of the file, last first, so the ones still to go
+    //    stay where they were. 'slots' is what's in the file afterwards, in order.
+    bool     in_kernel = false;
+    uint64_t collapsed = 0;
+    uint64_t slot      = num_slots;
+    while(ok && slot-- > 1)
+    {
+        if(!unused[slot])
+            continue;
+        if(slot == num_slots - 1 - collapsed)
+            ok = ftruncate(fd, (off_t)(data_offset + slot * XVD_BLOCK_SIZE)) == 0;  // Nothing after it
+        else if(fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, (off_t)(data_offset + slot * XVD_BLOCK_SIZE), XVD_BLOCK_SIZE) == 0)
+            in_kernel = true;
+        else if(errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS)
+            break;
+        else
+            ok = false;
+        unused[slot] = 2;
+        collapsed++;
+    }
+
+    std::vector<uint64_t> slots;
+    for(uint64_t s = 0; s < num_slots; s++)
+        if(unused[s] != 2)
+            slots.push_back(s);
+
+    // 3. If the filesystem can't collapse, the last blocks of the file fill the holes instead
+    uint64_t end = slots.size();
+    if(ok && collapsed < num_unused)
+    {
+        XvdFile source;
+        ok = source.Open(mFilename.c_str(), false);
+        for(uint64_t pos = 1; ok && pos < end; pos++)
+        {
+            while(end > pos && unused[slots[end - 1]])
+                end--;
+            if(pos >= end || !unused[slots[pos]])
+                continue;
+
+            ok = source.CopyTo(fd, data_offset + (end - 1) * XVD_BLOCK_SIZE, XVD_BLOCK_SIZE,
+                               data_offset + pos * XVD_BLOCK_SIZE);
+            slots[pos] = slots[--end];
+        }
+        slots.resize(end);
+        ok = ok && ftruncate(fd, (off_t)(data_offset + end * XVD_BLOCK_SIZE)) == 0;
+    }
+
+    // 4. Level 0 hash pages follow their blocks. A block only ever moves back, so (like for
+    //    the data) going front to back never overwrites a page that is still to be moved.
+    std::vector<uint8_t> page(XVD_PAGE_SIZE);
+    for(uint64_t pos = 0; has_tree && ok && pos < std::min<uint64_t>(num_slots, level0_pages); pos++)
+    {
+        uint64_t to = tree_offset + PagesToBytes(shape.level_start_page[0] + pos);
+        if(pos < slots.size() && slots[pos] == pos)
+            continue;
+        if(pos < slots.size() && slots[pos] < level0_pages)
+            ok = pread(fd, page.data(), XVD_PAGE_SIZE, tree_offset + PagesToBytes(shape.level_start_page[0] + slots[pos]))
+                 == XVD_PAGE_SIZE;
+        else
+            std::fill(page.begin(), page.end(), 0);  // Past the end of the file now
+        ok = ok && WriteAt(fd, page.data(), XVD_PAGE_SIZE, to);
+    }
+
+    // 5. The BAT: unused blocks are unmapped, the others point to where their block is now
+    std::vector<uint32_t> new_slot(num_slots, (uint32_t)XVD_INVALID_BLOCK);
+    for(uint64_t pos = 0; pos < slots.size(); pos++)
+        new_slot[slots[pos]] = (uint32_t)pos;
+    for(uint32_t& entry : bat)
+        if(entry != (uint32_t)XVD_INVALID_BLOCK)
+            entry = (entry < num_slots) ? new_slot[entry] : entry;
+
+    ok = ok && WriteTrimState(fd, XvdTrimPhase::bat, num_unused * XVD_BLOCK_SIZE) &&
+         WriteAt(fd, bat.data(), bat.size() * BAT_ENTRY_SIZE, bat_offset) &&
+         WriteTrimState(fd, XvdTrimPhase::none, 0);
+    close(fd);
+
+    if(!ok)
+    {
+        fprintf(stderr, "ERR: Failed to trim '%s', it is probably corrupted now\n", mFilename.c_str());
+        return IO_ERROR;
+    }
+
+    // 6. Pages whose hash entries aren't right yet
+    std::vector<uint64_t> dirty;
+    if(has_tree)
+        dirty = DirtyPagesAfterBlockMoves(slots, data_pages);
+
+    XVD_LOG(XVD_LOG_INFO, "INFO: Trimmed %llu unused blocks (%.2f MB smaller, %s)\n", (unsigned long long)num_unused,
+           (double)(num_unused * XVD_BLOCK_SIZE) / 1e6,
+           collapsed == num_unused && in_kernel ? "collapsed by the filesystem" :
+           collapsed == num_unused              ? "truncated" : "blocks moved into the holes");
+
+    // 7. The level 0 entries of the pages from step 6, then levels 1 and up from the moved level 0
+    return ReopenAfterRewrite(true, num_threads, dirty);
+}
+
+//////////////////////////////////////////
+// DEFRAGMENTATION                      //
+//////////////////////////////////////////
+
+/******************************************************************************************\
+                             DEFRAGMENTATION THEORY OF OPERATION
+
+Dynamic XVDs get their blocks appended to the file in the order they were first written,
+so the BAT can map the virtual Drive to the file in any order, and reading the Drive front
+to back seeks all over the file. That's what XvdBatScan::Fragmentation() measures, from the
+BAT extents: how many runs a sequential read of the Drive breaks into.
+
+Defragmenting gives the allocated blocks, in Drive order, the slots 1, 2, 3... of the file
+(block 0 is the UserData/XVC/BAT) and rewrites the BAT to match. That's a permutation of the
+slots, done in place one cycle at a time: the first block of the cycle is kept in memory, then
+every slot gets the block that goes there (a kernel side copy, see XvdFile::CopyTo()) and
+the slot it came from is the next one to fill, until the cycle gets back to its start. Every
+block is read and written exactly once and only one block is ever held in memory.
+
+A block is exactly one level 0 hash page, so the hash pages are permuted together with their
+blocks. Entries keep their XTS data units, which is what encrypted blocks need to be decrypted
+wherever they are. Only the pages of the BAT need new level 0 entries, then levels 1 and up
+are rehashed (a few pages).
+
+The XVD is unusable if this is interrupted, so it's for offline use on a copy that can be
+thrown away (or with a backup).
+
+\*******************************************************************************************/
+
+static void PrintFragmentation(const char* when, const XvdBatFragmentation& frag, uint64_t allocated)
+{
+    XVD_LOG(XVD_LOG_INFO, "INFO: Fragmentation %s: %.2f%% (%llu runs for %llu blocks, %llu backward seeks)\n", when, frag.percent,
+           (unsigned long long)frag.physical_runs, (unsigned long long)allocated,
+           (unsigned long long)frag.backward_seeks);
+}
+
+int XanaduXVD::Defragment(unsigned num_threads)
+{
+    if(!mIsStarted)
+        return INVALID_HEADER;
+
+    if(mHeader.xvd_type != XvdType::DYNAMIC)
+    {
+        fprintf(stderr, "ERR: Only dynamic XVDs can be defragmented\n");
+        return UNSUPPORTED;
+    }
+
+    if(mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: Defragmenting resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    if(mLayout.MetadataBlocks() != 1)
+    {
+        fprintf(stderr, "ERR: Defragmenting XVDs whose UserData, XVC and BAT don't fit in block 0 is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    PrintFragmentation("before", mLayout.BatScan().Fragmentation(), mLayout.AllocatedBlocks());
+
+    const XvdHashTreeShape& shape = mLayout.HashTreeShape();
+    bool     has_tree     = !mHeader.flags.DataIntegrityDisabled;
+    uint64_t tree_offset  = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset  = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t data_pages   = std::min<uint64_t>(shape.hashed_pages, DataPagesInFile());
+    uint64_t num_slots    = (mFilesize - data_offset) / XVD_BLOCK_SIZE;
+    uint64_t level0_pages = has_tree ? shape.pages_of_level[0] : 0;
+
+    // 1. Where everything goes. slots[pos] = the slot whose block ends up at 'pos'.
+    std::vector<uint32_t> bat = mLayout.BAT();
+    std::vector<uint64_t> slots(num_slots, 0);
+    std::vector<uint8_t>  taken(num_slots, 0);
+    uint64_t              next = 1;
+    for(uint32_t& entry : bat)
+    {
+        if(entry == (uint32_t)XVD_INVALID_BLOCK)
+            continue;
+        if(entry == 0 || entry >= num_slots || taken[entry])
+        {
+            fprintf(stderr, "ERR: BAT entry 0x%x is out of the file or used twice, refusing to defragment\n", entry);
+            return INVALID_HEADER;
+        }
+        taken[entry]  = 1;
+        slots[next]   = entry;
+        entry         = (uint32_t)next++;
+    }
+    for(uint64_t slot = 1; slot < num_slots; slot++)  // Slots nothing maps to keep their order, at the end
+        if(!taken[slot])
+            slots[next++] = slot;
+
+    uint64_t to_move = 0;
+    for(uint64_t pos = 1; pos < num_slots; pos++)
+        to_move += (slots[pos] != pos);
+    if(to_move == 0)
+    {
+        XVD_LOG(XVD_LOG_INFO, "INFO: Blocks are already in Drive order, nothing to do\n");
+        return 0;
+    }
+    XVD_LOG(XVD_LOG_INFO, "INFO: Moving %llu of %llu blocks...\n", (unsigned long long)to_move, (unsigned long long)(num_slots - 1));
+    auto start_time = std::chrono::steady_clock::now();
+
+    int fd = OpenForRewrite();
+    if(fd < 0)
+        return PERMISION_DENIED;
+
+    XvdFile source;
+    bool ok = source.Open(mFilename.c_str(), false);
+
+    // 2. One cycle of the permutation at a time
+    std::vector<uint8_t> first_block(XVD_BLOCK_SIZE);
+    std::vector<uint8_t> first_page(XVD_PAGE_SIZE);
+    std::vector<uint8_t> page(XVD_PAGE_SIZE);
+    std::vector<uint8_t> done(num_slots, 0);
+    auto block_offset = [&](uint64_t slot) { return data_offset + slot * XVD_BLOCK_SIZE; };
+    auto page_offset  = [&](uint64_t slot) { return tree_offset + PagesToBytes(shape.level_start_page[0] + slot); };
+
+    for(uint64_t start = 1; ok && start < num_slots; start++)
+    {
+        if(done[start] || slots[start] == start)
+            continue;
+
+        // The block at 'start' is the first one overwritten, keep it aside
+        ok = source.Read(first_block.data(), XVD_BLOCK_SIZE, block_offset(start)) &&
+             (start >= level0_pages || source.Read(first_page.data(), XVD_PAGE_SIZE, page_offset(start)));
+
+        for(uint64_t pos = start; ok; )
+        {
+            done[pos] = 1;
+            uint64_t from = slots[pos];
+            if(from == start)
+            {
+                ok = WriteAt(fd, first_block.data(), XVD_BLOCK_SIZE, block_offset(pos)) &&
+                     (pos >= level0_pages || start >= level0_pages ||
+                      WriteAt(fd, first_page.data(), XVD_PAGE_SIZE, page_offset(pos)));
+                break;
+            }
+
+            ok = source.CopyTo(fd, block_offset(from), XVD_BLOCK_SIZE, block_offset(pos));
+            if(ok && pos < level0_pages && from < level0_pages)
+                ok = source.Read(page.data(), XVD_PAGE_SIZE, page_offset(from)) &&
+                     WriteAt(fd, page.data(), XVD_PAGE_SIZE, page_offset(pos));
+            pos = from;
+        }
+    }
+
+    // 3. The BAT, now in Drive order too
+    ok = ok && WriteAt(fd, bat.data(), bat.size() * BAT_ENTRY_SIZE, mLayout.BatDriveOffset());
+    close(fd);
+
+    if(!ok)
+    {
+        fprintf(stderr, "ERR: Failed to defragment '%s', it is probably corrupted now\n", mFilename.c_str());
+        return IO_ERROR;
+    }
+
+    // 4. The HashTree: the BAT pages (and whatever was not covered before), then levels 1 and up
+    std::vector<uint64_t> dirty;
+    if(has_tree)
+        dirty = DirtyPagesAfterBlockMoves(slots, data_pages);
+    if(int ret = ReopenAfterRewrite(true, num_threads, dirty); ret)
+        return ret;
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    XVD_LOG(XVD_LOG_INFO, "INFO: Moved %.2f MB in %.2f s\n", (double)(to_move * XVD_BLOCK_SIZE) / 1e6, elapsed.count());
+    PrintFragmentation("after", mLayout.BatScan().Fragmentation(), mLayout.AllocatedBlocks());
+    return 0;
+}
+
+int XanaduXVD::Diff(const XanaduXVD& base, XvdDiff& diff, unsigned num_threads) const
+{
+    /******************************************************************************************\
+                                HASHTREE GUIDED DIFF
+
+    Two versions of the same package usually share most of their data, and the HashTree
+    already says which: two data pages with the same hash entry are the same page. And so
+    are the 170 pages (or hash pages) below two equal entries of the level above. So the
+    trees are walked top-down, side by side, and only where they differ:
+
+    - Root: if the root hashes in the headers match, nothing in the data changed. Done.
+    - Top level, down to level 1: the hash pages whose entry in the level above differs
+      are compared entry by entry. The entries that differ are the pages of the level
+      below to look at next.
+    - Level 0: the entries that differ are the data pages that changed.
+
+    For a typical update that only touches a few files of the Drive, that's a few hash
+    pages per changed page, and no data page is ever read. The cost of the whole walk is
+    bounded by the size of level 0 (0.6% of the data), when absolutely everything changed.
+
+    The walk only works if both trees have the same shape (the same number of hashed pages,
+    i.e. the same sizes). If they don't, the upper levels hash different things and are
+    useless, but page N of level 0 is still the hash of data page N in both XVDs, so all of
+    level 0 is compared instead.
+
+    Data pages are numbered from the start of the UserData region in both XVDs (like level 0
+    does), so when the regions before it changed size, an unchanged data page lives at a
+    different offset in each file. Header, eXVD and MDU are not covered by the HashTree, but
+    they are small, so they are compared byte by byte.
+
+    NOTE: This trusts both HashTrees. Verify them first (VerifyHashTree()) if they may be bad.
+
+    \*******************************************************************************************/
+    if(!mIsStarted || !base.mIsStarted)
+        return INVALID_HEADER;
+
+    if(mHeader.flags.DataIntegrityDisabled || base.mHeader.flags.DataIntegrityDisabled)
+    {
+        fprintf(stderr, "ERR: Diffing needs the HashTrees, but an XVD has data integrity disabled\n");
+        return UNSUPPORTED;
+    }
+
+    if(mHeader.flags.ResiliencyEnabled || base.mHeader.flags.ResiliencyEnabled)
+    {
+        fprintf(stderr, "ERR: Diffing resilient XVDs is not supported\n");
+        return UNSUPPORTED;
+    }
+
+    if(memcmp(mHeader.content_id_guid, base.mHeader.content_id_guid, sizeof(mHeader.content_id_guid)) != 0)
+        XVD_LOG(XVD_LOG_INFO, "INFO: The XVDs have different content ids, expect everything to be different\n");
+
+    const XvdHashTreeShape& shape      = mLayout.HashTreeShape();
+    const XvdHashTreeShape& base_shape = base.mLayout.HashTreeShape();
+    uint64_t tree_offset      = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t base_tree_offset = base.mLayout.Offset(XVD_REGION_HASHTREE);
+
+    // Dynamic XVDs have a tree sized for the maximum size of the drive, only the pages in the file count
+    diff = XvdDiff{};
+    diff.data_pages      = std::min<uint64_t>(shape.hashed_pages, DataPagesInFile());
+    diff.base_data_pages = std::min<uint64_t>(base_shape.hashed_pages, base.DataPagesInFile());
+    diff.same_tree_shape = shape.num_levels == base_shape.num_levels && shape.hashed_pages == base_shape.hashed_pages;
+    uint64_t common_pages = std::min(diff.data_pages, diff.base_data_pages);
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Everything is found in file order, so a range only ever grows at the end
+    auto add_range = [&](XvdRegionId region, uint64_t offset, uint64_t length)
+    {
+        XvdDiffRange* last = diff.ranges.empty() ? nullptr : &diff.ranges.back();
+        if(last && last->region == region && last->offset + last->length == offset)
+            last->length += length;
+        else
+            diff.ranges.push_back({ region, offset, length });
+    };
+
+    // 1. What the HashTree doesn't cover
+    for(XvdRegionId region : { XVD_REGION_HEADER, XVD_REGION_EXVD, XVD_REGION_MDU })
+    {
+        const XvdRegion& mine   = mLayout.Region(region);
+        const XvdRegion& theirs = base.mLayout.Region(region);
+        if(mine.length == 0)
+            continue;
+
+        if(mine.offset != theirs.offset || mine.length != theirs.length)
+        {
+            add_range(region, mine.offset, mine.length);
+            continue;
+        }
+
+        // A pool chunk at a time, the MDU can be big and not mapped (--no_mmap, --direct_io)
+        XvdPoolChunk scratch, base_scratch;
+        for(uint64_t piece = 0; piece < mine.length; piece += XVD_POOL_CHUNK_SIZE)
+        {
+            uint64_t piece_length = std::min<uint64_t>(XVD_POOL_CHUNK_SIZE, mine.length - piece);
+            auto     a            = mFile.ViewOrRead(mine.offset + piece, piece_length, scratch);
+            auto     b            = base.mFile.ViewOrRead(theirs.offset + piece, piece_length, base_scratch);
+            if(a.empty() || b.empty())
+            {
+                fprintf(stderr, "ERR: Failed to read the %s region\n", RegionIdStr(region));
+                return IO_ERROR;
+            }
+
+            for(uint64_t offset = 0; offset < piece_length; offset += XVD_PAGE_SIZE)
+            {
+                uint64_t length = std::min<uint64_t>(XVD_PAGE_SIZE, piece_length - offset);
+                if(memcmp(a.data() + offset, b.data() + offset, length) != 0)
+                    add_range(region, mine.offset + piece + offset, length);
+            }
+        }
+    }
+
+    // 2. Walk the trees, top-down. 'frontier' are the hash pages of 'level' to compare.
+    std::vector<uint64_t> frontier;
+    std::vector<uint64_t> changed_data;
+    uint32_t              level = 0;
+    if(!diff.same_tree_shape)
+    {
+        add_range(XVD_REGION_HASHTREE, tree_offset, mLayout.Length(XVD_REGION_HASHTREE));
+        for(uint64_t page = 0; page * HASHES_PER_HASH_PAGE < common_pages; page++)
+            frontier.push_back(page);
+    }
+    else if(memcmp(mHeader.root_hash, base.mHeader.root_hash, ROOT_HASH_LENGTH) != 0)
+    {
+        level = shape.num_levels - 1;
+        frontier.push_back(0);
+    }
+
+    while(!frontier.empty())
+    {
+        // A hash page is only looked at because its entry in the level above differs: it changed
+        if(diff.same_tree_shape)
+            for(uint64_t page : frontier)
+                add_range(XVD_REGION_HASHTREE, tree_offset + PagesToBytes(shape.level_start_page[level] + page),
+                          XVD_PAGE_SIZE);
+        diff.hash_pages_read += 2 * frontier.size();
+
+        // Encrypted data hashes don't include the XTS data unit
+        uint64_t num_children   = (level == 0) ? common_pages : shape.pages_of_level[level - 1];
+        uint32_t compare_length = std::min(HashEntryLength(level), base.HashEntryLength(level));
+
+        // A task is a bunch of hash pages, one page is too little work to hand out
+        constexpr uint64_t pages_per_task = 64;
+        uint64_t num_tasks = (frontier.size() + pages_per_task - 1) / pages_per_task;
+        std::vector<std::vector<uint64_t>> changed(num_tasks);
+        std::atomic<bool> io_error{false};
+        ParallelFor(num_tasks, num_threads, [&](uint64_t task)
+        {
+            thread_local std::vector<uint8_t> scratch, base_scratch;
+            uint64_t last = std::min<uint64_t>((task + 1) * pages_per_task, frontier.size());
+            for(uint64_t i = task * pages_per_task; i < last; i++)
+            {
+                uint64_t page   = frontier[i];
+                auto     mine   = mFile.ViewOrRead(tree_offset + PagesToBytes(shape.level_start_page[level] + page),
+                                                   XVD_PAGE_SIZE, scratch);
+                auto     theirs = base.mFile.ViewOrRead(base_tree_offset +
+                                                        PagesToBytes(base_shape.level_start_page[level] + page),
+                                                        XVD_PAGE_SIZE, base_scratch);
+                if(mine.empty() || theirs.empty())
+                {
+                    io_error = true;
+                    return;
+                }
+
+                uint64_t first_child = page * HASHES_PER_HASH_PAGE;
+                uint64_t end_child   = std::min<uint64_t>(first_child + HASHES_PER_HASH_PAGE, num_children);
+                for(uint64_t child = first_child; child < end_child; child++)
+                {
+                    uint64_t entry = (child - first_child) * HASH_LENGTH;
+                    if(memcmp(mine.data() + entry, theirs.data() + entry, compare_length) != 0)
+                        changed[task].push_back(child);
+                }
+            }
+        });
+
+        if(io_error)
+        {
+            fprintf(stderr, "ERR: Failed to read HashTree level %u\n", level);
+            return IO_ERROR;
+        }
+
+        // Tasks are in order, so the children stay sorted
+        std::vector<uint64_t>& next = (level == 0) ? changed_data : frontier;
+        next.clear();
+        for(auto& children : changed)
+            next.insert(next.end(), children.begin(), children.end());
+
+        if(level == 0)
+            break;
+        level--;
+    }
+
+    // 3. The data pages that changed, plus the ones the base doesn't have at all
+    uint64_t data_offset = mLayout.Offset(XVD_REGION_USERDATA);
+    auto add_data_page = [&](uint64_t page)
+    {
+        // Data regions are one after the other, a page belongs to the last one that starts before it
+        uint64_t    offset = data_offset + PagesToBytes(page);
+        XvdRegionId region = XVD_REGION_USERDATA;
+        for(XvdRegionId next : { XVD_REGION_XVC, XVD_REGION_DYNHEADER, XVD_REGION_DRIVE })
+            if(mLayout.Length(next) != 0 && mLayout.Offset(next) <= offset)
+                region = next;
+        add_range(region, offset, XVD_PAGE_SIZE);
+    };
+
+    for(uint64_t page : changed_data)
+        add_data_page(page);
+    for(uint64_t page = common_pages; page < diff.data_pages; page++)
+        add_data_page(page);
+    diff.changed_pages = changed_data.size() + (diff.data_pages - common_pages);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    XVD_LOG(XVD_LOG_INFO, "INFO: %llu of %llu data pages changed (%zu ranges). Read %llu HashTree pages (%.3f%% of the data) in %.3f s\n",
+           (unsigned long long)diff.changed_pages, (unsigned long long)diff.data_pages, diff.ranges.size(),
+           (unsigned long long)diff.hash_pages_read,
+           diff.data_pages ? 100.0 * diff.hash_pages_read / (diff.data_pages + diff.base_data_pages) : 0.0,
+           elapsed.count());
+    if(!diff.same_tree_shape)
+        XVD_LOG(XVD_LOG_INFO, "INFO: The XVDs have different sizes, the whole level 0 of the HashTree had to be compared\n");
+
+    return 0;
+}
+
+int XanaduXVD::CreateDelta(const XanaduXVD& base, const char* delta_filename, unsigned num_threads) const
+{
+    // See the theory of operation in XVDDelta.cpp. What changed comes from Diff(), and
+    // everything else is copied from the base, from wherever it is in there.
+    XvdDiff diff;
+    if(int ret = Diff(base, diff, num_threads); ret)
+        return ret;
+
+    XvdDeltaWriter writer;
+    if(!writer.Open(delta_filename, base.mFilesize, base.mHeader.root_hash, mFilesize, mHeader.root_hash))
+        return PERMISION_DENIED;
+
+    // Diff() only says a page is unchanged if it's at the same place in both XVDs (Header, eXVD,
+    // MDU), at the same place of the same HashTree, or is the same data page. Regions before
+    // the HashTree or the data can have grown or shrunk, which moves everything after them.
+    uint64_t tree_offset      = mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t data_offset      = mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t base_tree_offset = base.mLayout.Offset(XVD_REGION_HASHTREE);
+    uint64_t base_data_offset = base.mLayout.Offset(XVD_REGION_USERDATA);
+    uint64_t tracked_end      = data_offset + PagesToBytes(std::min(diff.data_pages, diff.base_data_pages));
+
+    auto base_offset_of = [&](uint64_t offset)
+    {
+        if(offset < tree_offset)
+            return offset;
+        if(offset < data_offset)
+            return offset - tree_offset + base_tree_offset;
+        return offset - data_offset + base_data_offset;
+    };
+    auto area_end = [&](uint64_t offset)
+    {
+        return (offset < tree_offset) ? tree_offset : (offset < data_offset) ? data_offset : tracked_end;
+    };
+
+    // New bytes, in bounded pieces whatever the size of the range
+    std::vector<uint8_t> scratch, base_scratch;
+    auto write_data = [&](uint64_t offset, uint64_t length)
+    {
+        while(length > 0)
+        {
+            uint64_t chunk = std::min<uint64_t>(length, XVD_DELTA_BUFFER_SIZE);
+            auto     data  = mFile.ViewOrRead(offset, chunk, scratch);
+            if(data.empty() || !writer.Data(offset, data))
+                return false;
+            offset += chunk;
+            length -= chunk;
+        }
+        return true;
+    };
+
+    // Anything Diff() didn't report, past what it could compare there's nothing to copy from
+    auto copy_unchanged = [&](uint64_t offset, uint64_t end)
+    {
+        while(offset < end)
+        {
+            if(offset >= tracked_end)
+                return write_data(offset, end - offset);
+
+            uint64_t length = std::min(end, area_end(offset)) - offset;
+            if(!writer.Copy(offset, base_offset_of(offset), length))
+                return false;
+            offset += length;
+        }
+        return true;
+    };
+
+    // Header, eXVD and MDU changes are usually a few fields: only the bytes that changed are
+    // stored. An op costs as much as 32 bytes of data, so closer changes go in the same op.
+    // Compared a pool chunk at a time, ops just don't get merged across two chunks.
+    XvdPoolChunk mine_chunk, theirs_chunk;
+    auto write_changed_bytes = [&](uint64_t offset, uint64_t length)
+    {
+        for(uint64_t piece = 0; piece < length; piece += XVD_POOL_CHUNK_SIZE)
+        {
+            uint64_t piece_offset = offset + piece;
+            uint64_t piece_length = std::min<uint64_t>(XVD_POOL_CHUNK_SIZE, length - piece);
+            auto     mine         = mFile.ViewOrRead(piece_offset, piece_length, mine_chunk);
+            auto     theirs       = base.mFile.ViewOrRead(piece_offset, piece_length, theirs_chunk);
+            if(mine.empty() || theirs.empty())
+                return false;
+
+            for(uint64_t i = 0; i < piece_length; )
+            {
+                uint64_t start = i;
+                while(i < piece_length && mine[i] == theirs[i])
+                    i++;
+                if(!writer.Copy(piece_offset + start, piece_offset + start, i - start))
+                    return false;
+
+                start = i;
+                uint64_t same = 0;
+                while(i < piece_length && same < sizeof(XvdDeltaOp))
+                {
+                    same = (mine[i] == theirs[i]) ? same + 1 : 0;
+                    i++;
+                }
+                if(same >= sizeof(XvdDeltaOp))
+                    i -= same;
+                if(!writer.Data(piece_offset + start, mine.subspan(start, i - start)))
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    bool     ok       = true;
+    uint64_t position = 0;
+    for(const XvdDiffRange& range : diff.ranges)
+    {
+        const XvdRegion& mine   = mLayout.Region(range.region);
+        const XvdRegion& theirs = base.mLayout.Region(range.region);
+        bool byte_level = range.region < XVD_REGION_HASHTREE && mine.offset == theirs.offset &&
+                          mine.length == theirs.length;
+
+        ok = ok && copy_unchanged(position, range.offset) &&
+             (byte_level ? write_changed_bytes(range.offset, range.length) : write_data(range.offset, range.length));
+        position = range.offset + range.length;
+    }
+    ok = ok && copy_unchanged(position, mFilesize) && writer.Finish();
+
+    if(!ok)
+    {
+        fprintf(stderr, "ERR: Failed to write delta '%s'\n", delta_filename);
+        remove(delta_filename);
+        return IO_ERROR;
+    }
+
+    const XvdDeltaHeader& header = writer.Header();
+    XVD_LOG(XVD_LOG_INFO, "INFO: Delta written to '%s': %llu ops, %.2f MB of new data for a %.2f MB XVD\n", delta_filename,
+           (unsigned long long)header.num_ops, (double)header.data_length / 1e6, (double)mFilesize / 1e6);
     return 0;
 }
 
-int XanaduXVD::VerifySignature()
+int XanaduXVD::VerifySignature() const
 {
     return 0;
 }
\ No newline at end of file
@@ -11,6 +11,15 @@
 // XanaduXVD includes
 ///////////////////////////////////////
 #include "XVDTypes.h"
+#include "XVDFile.h"
+#include "XVDAsyncReader.h"
+#include "XVDLayout.h"
+#include "XVDSha256.h"
+#include "XVDWorkers.h"
+#include "XVDAes.h"
+#include "XVDQueue.h"
+#include "XVDDelta.h"
+#include "XVDProgress.h"
 
 ///////////////////////////////////////
 // C includes
@@ -27,14 +36,58 @@
 #include <filesystem>
 #include <cmath>
 #include <map>
+#include <vector>
 #include <bit> // for endianess shenanigans
 
+// One piece of a vectored read of the virtual Drive (see XanaduXVD::ReadDriveV())
+struct XvdDriveIo
+{
+    uint64_t offset;  // Offset in the virtual Drive
+    uint64_t length;
+    void*    dst;
+};
+
+// A run of changed pages of an XVD (see XanaduXVD::Diff())
+struct XvdDiffRange
+{
+    XvdRegionId region;
+    uint64_t    offset;  // Absolute offset in the XVD Diff() was called on
+    uint64_t    length;
+};
+
+// What changed between two versions of an XVD
+struct XvdDiff
+{
+    std::vector<XvdDiffRange> ranges;                 // Sorted by offset, page granularity. Anything else is unchanged
+    uint64_t                  data_pages      = 0;    // Data pages (UserData onwards) in the new XVD
+    uint64_t                  base_data_pages = 0;    // Same, in the base XVD
+    uint64_t                  changed_pages   = 0;    // Data pages in 'ranges'
+    uint64_t                  hash_pages_read = 0;    // HashTree pages read (from both XVDs) to find them
+    bool                      same_tree_shape = false; // False: the upper levels were useless, all of level 0 was compared
+};
+
+// One opened XVD. After Start() everything it parsed (header, layout, BAT scan) is only
+// read, and every read of the file is positional (mapping or pread(), see XvdFile), so the
+// const methods can be called from any number of threads at the same time on one shared
+// object: a server can open a package once and serve ReadDrive()/ReadDriveV() ranges,
+// extractions and verifications from a worker pool.
+//
+// What is NOT thread-safe is anything non-const: Start()/Stop(), the setters (configure the
+// object before sharing it), and the operations that rewrite the file in place (trimming,
+// defragmenting, rebuilding the HashTree), which need the object to themselves. Also, a
+// single XvdProgress follows one operation at a time.
 class XanaduXVD
 {
 public:
     XanaduXVD(const char* filename);
-    ~XanaduXVD(){};
-    int Start(bool unsafe_mode, bool debug_mode); // Opens the XVD file descriptor, allocates memory, basic header verification, etc.
+    ~XanaduXVD() = default; // mFile unmaps and closes the file
+
+    // One file, one owner: move it around, share it by reference, never copy it
+    XanaduXVD(const XanaduXVD&)            = delete;
+    XanaduXVD& operator=(const XanaduXVD&) = delete;
+    XanaduXVD(XanaduXVD&& other) noexcept;
+    XanaduXVD& operator=(XanaduXVD&& other) noexcept;
+    int Start(bool unsafe_mode, bool debug_mode, bool use_mmap = true); // Opens (and maps) the XVD file, basic header verification, etc.
     int Stop();                                   // Closes the XVD file descriptor, frees memory, commits changes (if any)
 
 ///////////////////////////////////////
@@ -46,7 +99,12 @@ private:
         FILE_NOT_FOUND   = 1,
         PERMISION_DENIED = 2,
         INVALID_HEADER   = 3,
-        INVALID_SIZE     = 4
+        INVALID_SIZE     = 4,
+        HASHTREE_INVALID = 5,
+        IO_ERROR         = 6,
+        UNSUPPORTED      = 7,
+        OUT_OF_RANGE     = 8,
+        CANCELLED        = 9   // XvdProgress::Cancel() was called, see XVDProgress.h
     };
 
 ///////////////////////////////////////
@@ -54,12 +112,23 @@ private:
 ///////////////////////////////////////
 private:
     void    FixHeaderEndianess(XvdHeader* xvd_header);
+    bool    ReadAt(void* dst, uint64_t length, uint64_t offset) const; // Positional read, safe to call from several threads
+    uint64_t DataPagesInFile() const;                            // Pages from the UserData to the end of the file
+    static bool WriteAt(int fd, const void* src, uint64_t length, uint64_t offset);
+    int     OpenForRewrite();                                    // Drops the mapping, opens the file for writing
+    int     ReopenAfterRewrite(bool rehash_upper_levels, unsigned num_threads,
+                               const std::vector<uint64_t>& dirty_pages = {}); // Start() again, fix the HashTree
+    bool    WriteTrimState(int fd, XvdTrimPhase phase, uint64_t blob_size);
+    bool    CollapseRange(int fd, uint64_t offset, uint64_t length, bool& in_kernel); // Takes a range out of the file
+    std::vector<uint64_t> DirtyPagesAfterBlockMoves(const std::vector<uint64_t>& slots, uint64_t data_pages) const;
 
 ///////////////////////////////////////
 // INTERNAL XVD MANIPULATION METHODS //
 ///////////////////////////////////////
 protected:
-    bool     IsValidHeader();
+    bool     IsValidHeaderFormat();                              // Magic, version, type, block size
+    bool     IsValidHeader();                                    // Sizes, needs the layout
+    void     ComputeLayout();
     void     ParseHeader();
     uint64_t FindEmbeddedXVDPosition();
     uint64_t FindEmbeddedXVDSize();
@@ -77,35 +146,78 @@ protected:
     uint64_t FindDriveSize();
     uint64_t FindDynamicOccupancy();
     uint64_t HashTreeSizeFromPageNum(uint64_t num_pages_to_hash, bool resilient);
+    uint64_t FindHashedPageNum();
+    uint32_t HashEntryLength(uint32_t level) const;
+    bool     WriteRootHash(int fd, const uint8_t top_page[XVD_PAGE_SIZE]);
+    int      RehashLevels(int fd, uint32_t first_level, unsigned num_threads,
+                          bool cancellable = false); // Levels first_level.. + root hash
+    int      RehashDirtyPages(const std::vector<uint64_t>& dirty_pages, unsigned num_threads,
+                              uint32_t num_levels); // Incremental rebuild of the lowest num_levels levels
+    int      RehashGroupInPlace(int fd, const XvdHashTreeShape& shape, uint32_t level, uint64_t group,
+                                uint64_t tree_offset, uint64_t data_offset, uint64_t num_children);
+    int64_t  VerifyHashTreeGroup(const XvdHashTreeShape& shape, uint32_t level, uint64_t group,
+                                 uint64_t tree_offset, uint64_t data_offset, uint64_t num_children) const;
+    int64_t  CheckHashTreeGroup(uint32_t level, uint64_t first_child,
+                                std::span<const uint8_t> parent, std::span<const uint8_t> children) const;
     uint64_t FindOccupiedDriveSizeFromBAT(uint64_t bat_offset, uint64_t bat_size);
     uint64_t ComputeUsedDriveSizeInDynamicXVD();
+    int      ExtractRegion(XvdRegionId region, const char* output_filename) const; // Kernel-side copy of a whole region
+    int      CopyOut(int out_fd, uint64_t offset, uint64_t length, uint64_t out_offset) const; // CopyTo() with progress/cancel
+    bool     ForEachPageGroup(uint64_t offset, uint64_t num_pages, unsigned num_threads,
+                              const XvdReadConsumer& fn) const; // Groups of 170 pages, spread across the cores
+    bool     LoadCik(const char* cik_filename, uint8_t cik[XVD_CIK_LENGTH_BYTES]) const;
+    void     BuildXtsTweaks(std::span<const uint8_t> entries, uint64_t first_page, uint64_t count,
+                            uint8_t tweaks[][AES_BLOCK_LENGTH_BYTES]) const;
 
 ///////////////////////////////////////
 // PUBLIC FUNCTIONALITY / METHODS    //
 ///////////////////////////////////////
 public:
-    int InfoDump();
-    int ExtractEmbeddedXVD(const char* output_filename);
-    int ExtractUserData(const char* output_filename);
-    int VerifyHashTree();
-    int RebuildHashTree();
-    int VerifySignature();
+    const XvdLayout& Layout() const { return mLayout; }
+    static XvdHashTreeShape HashTreeShapeFromPageNum(uint64_t num_pages_to_hash); // Shape of the tree over that many pages
+    void SetIoQueueDepth(unsigned depth) { mIoQueueDepth = depth ? depth : 1; } // Reads in flight for bulk reads
+    void SetProgress(XvdProgress* progress) { mProgress = progress; } // Progress/cancellation of long operations (nullptr = none)
+    void SetDirectIo(bool direct_io) { mDirectIo = direct_io; } // O_DIRECT reads, no page cache (before Start())
+    int InfoDump() const;
+    int ExtractEmbeddedXVD(const char* output_filename) const;
+    int ExtractUserData(const char* output_filename) const;
+    int ExtractDrive(const char* output_filename) const; // Raw image of the Drive (sparse for dynamic XVDs)
+    int ExtractDriveVerified(const char* output_filename, const char* cik_filename = nullptr,
+                             unsigned num_threads = 0) const; // Same, verifying (and decrypting) on the fly, in one pass
+    int ReadDrive(uint64_t offset, uint64_t length, void* dst) const; // Reads the virtual Drive (thread-safe)
+    int ReadDriveV(std::span<const XvdDriveIo> ios) const;            // Same, many pieces at once
+    int Decrypt(const char* cik_filename, const char* output_filename, unsigned num_threads = 0) const; // Decrypted copy of the XVD
+    int VerifyHashTree(unsigned num_threads = 0) const; // 0 threads = one per core
+    int RebuildHashTree(unsigned num_threads = 0);                                           // Rehashes the whole XVD
+    int RebuildHashTree(const std::vector<uint64_t>& dirty_pages, unsigned num_threads = 0); // Only rehashes what changed
+    int Diff(const XanaduXVD& base, XvdDiff& diff, unsigned num_threads = 0) const; // What changed from 'base' to this XVD
+    int CreateDelta(const XanaduXVD& base, const char* delta_filename, unsigned num_threads = 0) const; // Patch from 'base' to this XVD
+    int RemoveEmbeddedXVD();                          // These trim the XVD in place
+    int RemoveUserData(unsigned num_threads = 0);
+    int TrimUnusedBlocks(unsigned num_threads = 0);   // Unmaps the all-zero blocks of a dynamic XVD
+    int Defragment(unsigned num_threads = 0);         // Puts the blocks of a dynamic XVD in Drive order, in place
+    int VerifySignature() const;
 
 ///////////////////////////////////////
 // CLASS ATTRIBUTES                  //
 ///////////////////////////////////////
 private:
     // File related variables
-    FILE*       mFD;
+    XvdFile     mFile;      // mmap'd when possible, pread() otherwise
+    unsigned    mIoQueueDepth = XVD_ASYNC_DEFAULT_QUEUE_DEPTH; // For the async reader (when not mmap'd)
+    XvdProgress* mProgress  = nullptr; // Owned by the caller, polled from another thread
     size_t      mFilesize   = 0;
     std::string mFilename   = "";
 
     // tool related variables
     bool        mUnsafeMode = false; // Allows opening and playing with invalid XVD files (use at your own risk!)
     bool        mDebugMode  = false; // Enables debug stdout prints
+    bool        mUseMmap    = true;  // As asked in Start(), to open the file the same way again after trimming it
+    bool        mDirectIo   = false; // Bypass the page cache (O_DIRECT), see XvdFile
     bool        mIsStarted  = false; // Specifies wether Start() has been called and was successful. This implies several things
 
     // Variables related with the XVD being parsed
     XvdHeader   mHeader{};
-    uint64_t    mSectorSize; // Sector size is used when parsing the GPT in the Drive region (I think)
+    XvdLayout   mLayout{};   // Where every region is. Computed once in Start()
+    uint64_t    mSectorSize = 0; // Sector size is used when parsing the GPT in the Drive region (I think)
 };
\ No newline at end of file